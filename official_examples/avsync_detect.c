@@ -0,0 +1,475 @@
+/**
+ * @file
+ * 测量 muxing_demo -sync_test 生成的（或者经过转码、传输之后的）文件中的音画同步偏差。
+ *
+ * 视频中每个事件是一帧整帧闪白，音频中是一段短音，生成时两者的 pts 完全相同。本程序在一遍解码中
+ * 找出所有闪白帧（平均亮度越过阈值的上升沿）和所有短音的起点（静音至少 SILENCE_GAP 秒之后第一个
+ * 幅度越过阈值的样本），再把每个闪白和离它最近的短音配对，偏差 = 短音时间 - 闪白时间，正数表示声音滞后。
+ * 平均亮度隔行采样，用 SSE2 的 psadbw / NEON 的逐对累加求和；音频只看第一个声道，
+ * 用 SIMD 比较一次检查 4 个样本，静音段几乎不花时间。视频解码关闭环路滤波（不影响平均亮度）并使用多线程，
+ * 耗时基本等于解码本身。
+ * @example avsync_detect.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <libavutil/cpu.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/time.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "sample_convert.h"
+
+#define FLASH_LUMA    200                        /* 平均亮度超过它的帧是闪白（测试图像的平均亮度约为 128，闪白为 235） */
+#define TONE_LEVEL    0.1f                       /* 幅度超过满幅的这个比例的样本属于短音（生成的短音约为 0.3） */
+#define SILENCE_GAP   0.1                        /* 短音之前至少静音这么多秒，才算一个新的起点 */
+
+
+/**
+ * @brief 一个流中检测到的事件时间（秒），按时间顺序追加
+ */
+typedef struct EventList {
+    double *t;
+    int nb;
+    int size;
+} EventList;
+
+/**
+ * @brief 一个要解码的流：解码器、检测到的事件和状态
+ */
+typedef struct SyncStream {
+    int index;
+    AVCodecContext *dec;
+    EventList events;
+    // 视频：上一帧是否为闪白；音频：最后一个响的样本的时间，以及第一个声道转换成的 float 样本
+    int prev_flash;
+    double last_loud;
+    float *samples;
+    int samples_size;
+} SyncStream;
+
+
+
+
+static uint64_t row_sum_c(const uint8_t *src, int width)
+{
+    uint64_t sum = 0;
+    int x;
+
+    for (x = 0; x < width; x++)
+    {
+        sum += src[x];
+    }
+    return sum;
+}
+
+static int find_loud_c(const float *x, int n, float level)
+{
+    int i;
+
+    for (i = 0; i < n && fabsf(x[i]) <= level; i++)
+        ;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief 一行像素求和：psadbw 与 0 求绝对差之和，即每 8 个字节的和
+ */
+__attribute__((target("sse2")))
+static uint64_t row_sum_sse2(const uint8_t *src, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(src + x)), zero));
+    }
+    return (uint64_t)_mm_cvtsi128_si32(acc) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8)) +
+           row_sum_c(src + x, width - x);
+}
+
+/**
+ * @brief 找到第一个幅度超过 level 的样本：清掉符号位后一次比较 4 个样本，全部静音时只需要一条 movmskps
+ */
+__attribute__((target("sse2")))
+static int find_loud_sse2(const float *x, int n, float level)
+{
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 thr = _mm_set1_ps(level);
+    int i, mask;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_and_ps(_mm_loadu_ps(x + i), abs_mask), thr));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_loud_c(x + i, n - i, level);
+}
+#elif defined(__aarch64__)
+static uint64_t row_sum_neon(const uint8_t *src, int width)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+    {
+        acc = vpadalq_u16(acc, vpaddlq_u8(vld1q_u8(src + x)));
+    }
+    return vaddlvq_u32(acc) + row_sum_c(src + x, width - x);
+}
+
+static int find_loud_neon(const float *x, int n, float level)
+{
+    const float32x4_t thr = vdupq_n_f32(level);
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        if (vmaxvq_u32(vcagtq_f32(vld1q_f32(x + i), thr)))
+        {
+            break;
+        }
+    }
+    return i + find_loud_c(x + i, n - i, level);
+}
+#endif
+
+/* 当前 CPU 上最快的实现，由 main 选择 */
+static uint64_t (*row_sum)(const uint8_t *src, int width) = row_sum_c;
+static int (*find_loud)(const float *x, int n, float level) = find_loud_c;
+
+
+
+
+static int add_event(EventList *list, double t)
+{
+    double *tmp;
+
+    if (list->nb == list->size)
+    {
+        list->size = FFMAX(2 * list->size, 64);
+        tmp = av_realloc_array(list->t, list->size, sizeof(*tmp));
+        if (!tmp)
+        {
+            return AVERROR(ENOMEM);
+        }
+        list->t = tmp;
+    }
+    list->t[list->nb++] = t;
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 视频帧：隔 4 行求一次平均亮度，越过 FLASH_LUMA 的上升沿是一个闪白事件
+ */
+static int analyze_video(SyncStream *s, const AVFrame *frame, double t)
+{
+    uint64_t sum = 0;
+    int y, rows = 0, flash;
+
+    for (y = 0; y < frame->height; y += 4)
+    {
+        sum += row_sum(frame->data[0] + y * frame->linesize[0], frame->width);
+        rows++;
+    }
+    flash = sum > (uint64_t)FLASH_LUMA * rows * frame->width;
+    if (flash && !s->prev_flash && add_event(&s->events, t) < 0)
+    {
+        return AVERROR(ENOMEM);
+    }
+    s->prev_flash = flash;
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 音频帧：把第一个声道转换成 float，静音 SILENCE_GAP 秒之后第一个响的样本是一个短音的起点
+ */
+static int analyze_audio(SyncStream *s, const AVFrame *frame, double t)
+{
+    enum AVSampleFormat fmt = frame->format;
+    enum AVSampleFormat packed = av_get_packed_sample_fmt(fmt);
+    int planar = av_sample_fmt_is_planar(fmt);
+    int stride = planar ? 1 : frame->channels;
+    const uint8_t *src = frame->data[0];
+    double sample_time;
+    float *tmp;
+    int i, n = frame->nb_samples;
+
+    if (s->samples_size < n)
+    {
+        tmp = av_realloc_array(s->samples, n, sizeof(*tmp));
+        if (!tmp)
+        {
+            return AVERROR(ENOMEM);
+        }
+        s->samples      = tmp;
+        s->samples_size = n;
+    }
+    if (!sample_fmt_to_float_supported(fmt))
+    {
+        fprintf(stderr, "Unsupported sample format %s\n", av_get_sample_fmt_name(fmt));
+        return AVERROR(EINVAL);
+    }
+    for (i = 0; i < n; i++)
+    {
+        s->samples[i] = sample_to_float(src, packed, i * stride);
+    }
+
+    // 每次从上一个响的样本之后继续找，短音之间的静音段只做 SIMD 比较
+    i = find_loud(s->samples, n, TONE_LEVEL);
+    while (i < n)
+    {
+        sample_time = t + (double)i / frame->sample_rate;
+        if (sample_time - s->last_loud > SILENCE_GAP && add_event(&s->events, sample_time) < 0)
+        {
+            return AVERROR(ENOMEM);
+        }
+        s->last_loud = sample_time;
+        i += 1 + find_loud(s->samples + i + 1, n - i - 1, TONE_LEVEL);
+    }
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 把解码出的帧交给对应的检测函数
+ */
+static int receive_frames(AVFormatContext *fmt_ctx, SyncStream *s, AVFrame *frame)
+{
+    AVStream *st = fmt_ctx->streams[s->index];
+    double t;
+    int ret;
+
+    while ((ret = avcodec_receive_frame(s->dec, frame)) >= 0)
+    {
+        if (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+        {
+            t   = frame->best_effort_timestamp * av_q2d(st->time_base);
+            ret = s->dec->codec_type == AVMEDIA_TYPE_VIDEO ? analyze_video(s, frame, t) : analyze_audio(s, frame, t);
+        }
+        av_frame_unref(frame);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+
+
+
+static int open_stream(AVFormatContext *fmt_ctx, enum AVMediaType type, SyncStream *s)
+{
+    const AVCodec *codec;
+    int ret;
+
+    if ((ret = av_find_best_stream(fmt_ctx, type, -1, -1, &codec, 0)) < 0)
+    {
+        fprintf(stderr, "No %s stream\n", av_get_media_type_string(type));
+        return ret;
+    }
+    s->index     = ret;
+    s->last_loud = -INFINITY;
+    s->dec       = avcodec_alloc_context3(codec);
+    if (!s->dec)
+    {
+        return AVERROR(ENOMEM);
+    }
+    avcodec_parameters_to_context(s->dec, fmt_ctx->streams[s->index]->codecpar);
+    s->dec->pkt_timebase = fmt_ctx->streams[s->index]->time_base;
+    if (type == AVMEDIA_TYPE_VIDEO)
+    {
+        // 平均亮度不受环路滤波影响
+        s->dec->thread_count     = 0;
+        s->dec->skip_loop_filter = AVDISCARD_ALL;
+        s->dec->flags2          |= AV_CODEC_FLAG2_FAST;
+    }
+    if ((ret = avcodec_open2(s->dec, codec, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open the %s decoder: %s\n", av_get_media_type_string(type), av_err2str(ret));
+    }
+    return ret;
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    SyncStream video = { 0 }, audio = { 0 }, *s;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    int64_t t_start, elapsed;
+    double window = 0.5, d, best, sum = 0, sum2 = 0, min = INFINITY, max = -INFINITY, duration;
+    int i, j, ret, print = 0, nb_matched = 0;
+
+    if (argc < 2)
+    {
+        printf("usage: %s input [-window seconds] [-print 0|1]\n"
+               "measure the A/V offset of every flash/tone-burst event written by 'muxing_demo -sync_test'.\n"
+               "each white flash is paired with the nearest tone onset within -window seconds (default 0.5);\n"
+               "offset = audio - video, positive means the audio is late. -print 1 prints every event.\n"
+               "\n", argv[0]);
+        return 1;
+    }
+    for (i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-window"))
+        {
+            window = atof(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-print"))
+        {
+            print = atoi(argv[i + 1]);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    {
+        row_sum   = row_sum_sse2;
+        find_loud = find_loud_sse2;
+    }
+#elif defined(__aarch64__)
+    row_sum   = row_sum_neon;
+    find_loud = find_loud_neon;
+#endif
+
+    if ((ret = avformat_open_input(&fmt_ctx, argv[1], NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", argv[1], av_err2str(ret));
+        goto end;
+    }
+    if ((ret = open_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, &video)) < 0 ||
+        (ret = open_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, &audio)) < 0)
+    {
+        goto end;
+    }
+    for (i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        if (i != video.index && i != audio.index)
+        {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    pkt   = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    t_start = av_gettime_relative();
+    while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0)
+    {
+        s = pkt->stream_index == video.index ? &video : pkt->stream_index == audio.index ? &audio : NULL;
+        if (s)
+        {
+            ret = avcodec_send_packet(s->dec, pkt);
+            if (ret >= 0)
+            {
+                ret = receive_frames(fmt_ctx, s, frame);
+            }
+        }
+        av_packet_unref(pkt);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Error decoding: %s\n", av_err2str(ret));
+            goto end;
+        }
+    }
+    if (ret != AVERROR_EOF)
+    {
+        fprintf(stderr, "Error reading '%s': %s\n", argv[1], av_err2str(ret));
+        goto end;
+    }
+    // 冲刷两个解码器
+    avcodec_send_packet(video.dec, NULL);
+    avcodec_send_packet(audio.dec, NULL);
+    if ((ret = receive_frames(fmt_ctx, &video, frame)) < 0 || (ret = receive_frames(fmt_ctx, &audio, frame)) < 0)
+    {
+        goto end;
+    }
+    elapsed = FFMAX(av_gettime_relative() - t_start, 1);
+
+    // 两个事件列表都按时间排序，双指针为每个闪白找到最近的短音
+    for (i = j = 0; i < video.events.nb; i++)
+    {
+        while (j + 1 < audio.events.nb &&
+               fabs(audio.events.t[j + 1] - video.events.t[i]) <= fabs(audio.events.t[j] - video.events.t[i]))
+        {
+            j++;
+        }
+        best = audio.events.nb ? audio.events.t[j] - video.events.t[i] : INFINITY;
+        if (fabs(best) > window)
+        {
+            if (print)
+            {
+                printf("%d\t%.6f\t-\t-\n", i, video.events.t[i]);
+            }
+            continue;
+        }
+        d     = best * 1000;
+        sum  += d;
+        sum2 += d * d;
+        min   = FFMIN(min, d);
+        max   = FFMAX(max, d);
+        nb_matched++;
+        if (print)
+        {
+            printf("%d\t%.6f\t%.6f\t%+.3f\n", i, video.events.t[i], audio.events.t[j], d);
+        }
+    }
+
+    duration = fmt_ctx->duration != AV_NOPTS_VALUE ? fmt_ctx->duration / (double)AV_TIME_BASE : 0;
+    fprintf(stderr, "avsync: %d flashes, %d tone bursts, %d matched; %.1f s analyzed in %.3f s (%.0fx realtime)\n",
+            video.events.nb, audio.events.nb, nb_matched, duration, elapsed / 1000000.0,
+            duration * 1000000.0 / elapsed);
+    if (nb_matched)
+    {
+        d = sum / nb_matched;
+        fprintf(stderr, "avsync: offset (audio - video) mean %+.3f ms, min %+.3f ms, max %+.3f ms, stddev %.3f ms\n",
+                d, min, max, sqrt(FFMAX(sum2 / nb_matched - d * d, 0)));
+    }
+    ret = nb_matched ? 0 : AVERROR_INVALIDDATA;
+
+end:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&video.dec);
+    avcodec_free_context(&audio.dec);
+    av_free(video.events.t);
+    av_free(audio.events.t);
+    av_free(audio.samples);
+    avformat_close_input(&fmt_ctx);
+    return ret < 0;
+}
@@ -0,0 +1,454 @@
+/**
+ * @file
+ * 读出 muxing_demo -barcode 1 打在每帧左上角的亮度条码，统计端到端延迟和丢帧。
+ *
+ * 条码共 BARCODE_ROWS 行、每行 BARCODE_COLS 位，每一位是一个 cell x cell 的黑白块（默认 8x8），
+ * 内容依次是 16 位标记、32 位帧号（next_pts）、64 位发送时间（微秒）和 16 位 CRC，布局与 muxing.c 的
+ * stamp_barcode 一致。读条码时只对每个块中间的一半行求和，8x8 的块用 SSE2 的 psadbw（或 NEON 的逐对累加）
+ * 一次求出两个块的和，每帧只读 2KB 左右的亮度数据，耗时几乎全部是解码。
+ * 收到帧的时刻减去条码中的发送时间就是端到端延迟（读实时流时有意义，两端的时钟需要同步）；
+ * 帧号不连续说明丢帧，相同说明重复，变小说明乱序。
+ * @example barcode_detect.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <libavutil/cpu.h>
+#include <libavutil/crc.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+/* 与 muxing.c 中的条码布局一致 */
+#define BARCODE_COLS 32
+#define BARCODE_ROWS 4
+#define BARCODE_MAGIC 0xB4C0
+
+/* 统计重复和乱序时记住的帧号个数：比已读到的最大帧号小这么多以上的帧只能算作乱序 */
+#define BARCODE_WINDOW 65536
+
+
+/**
+ * @brief 对一行条码中每个块的 rows 行像素求和，块宽为 cell，结果写入 sums[0..nb_cells)
+ */
+static void cell_sums_c(const uint8_t *src, int linesize, int rows, int cell, int nb_cells, uint32_t *sums)
+{
+    int i, x, y;
+
+    for (i = 0; i < nb_cells; i++)
+    {
+        sums[i] = 0;
+        for (y = 0; y < rows; y++)
+        {
+            for (x = 0; x < cell; x++)
+            {
+                sums[i] += src[y * linesize + i * cell + x];
+            }
+        }
+    }
+}
+
+/**
+ * @brief cell 为 8 时的 C 实现，没有 SIMD 时使用
+ */
+static void cell_sums_8_c(const uint8_t *src, int linesize, int rows, int nb_cells, uint32_t *sums)
+{
+    cell_sums_c(src, linesize, rows, 8, nb_cells, sums);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief cell 为 8 时的 SSE2 实现：psadbw 对 16 个字节中的前后 8 个分别求和，正好是两个块
+ */
+__attribute__((target("sse2")))
+static void cell_sums_sse2(const uint8_t *src, int linesize, int rows, int nb_cells, uint32_t *sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+    int i, y;
+
+    for (i = 0; i + 1 < nb_cells; i += 2)
+    {
+        acc = zero;
+        for (y = 0; y < rows; y++)
+        {
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(src + y * linesize + i * 8)), zero));
+        }
+        sums[i]     = _mm_cvtsi128_si32(acc);
+        sums[i + 1] = _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    }
+    if (i < nb_cells)
+    {
+        cell_sums_c(src + i * 8, linesize, rows, 8, 1, sums + i);
+    }
+}
+#elif defined(__aarch64__)
+/**
+ * @brief cell 为 8 时的 NEON 实现：逐对累加到 16 位，再两次逐对相加得到前后 8 个字节各自的和
+ */
+static void cell_sums_neon(const uint8_t *src, int linesize, int rows, int nb_cells, uint32_t *sums)
+{
+    uint16x8_t acc;
+    uint64x2_t sum;
+    int i, y;
+
+    for (i = 0; i + 1 < nb_cells; i += 2)
+    {
+        acc = vdupq_n_u16(0);
+        for (y = 0; y < rows; y++)
+        {
+            acc = vpadalq_u8(acc, vld1q_u8(src + y * linesize + i * 8));
+        }
+        sum         = vpaddlq_u32(vpaddlq_u16(acc));
+        sums[i]     = (uint32_t)vgetq_lane_u64(sum, 0);
+        sums[i + 1] = (uint32_t)vgetq_lane_u64(sum, 1);
+    }
+    if (i < nb_cells)
+    {
+        cell_sums_c(src + i * 8, linesize, rows, 8, 1, sums + i);
+    }
+}
+#endif
+
+/* cell 为 8 时使用的实现，由 main 根据 CPU 能力选择 */
+static void (*cell_sums_8)(const uint8_t *src, int linesize, int rows, int nb_cells, uint32_t *sums) = cell_sums_8_c;
+
+
+
+
+/**
+ * @brief 从亮度平面读出条码
+ * @param luma 亮度平面
+ * @param linesize 亮度平面的行字节数
+ * @param width 图像宽度
+ * @param height 图像高度
+ * @param cell 条码每一位的块大小（像素）
+ * @param pts 读出的帧号
+ * @param send_time 读出的发送时间（微秒）
+ * @return 0 表示成功，负数表示图像太小、没有条码或者校验失败
+ */
+static int read_barcode(const uint8_t *luma, int linesize, int width, int height, int cell,
+                        uint32_t *pts, int64_t *send_time)
+{
+    uint8_t payload[BARCODE_COLS * BARCODE_ROWS / 8] = { 0 };
+    uint32_t sums[BARCODE_COLS];
+    // 只读每个块中间的一半行，避开压缩后块边缘的振铃
+    int rows = FFMAX(cell / 2, 1), threshold;
+    int r, i, bit;
+
+    if (width < BARCODE_COLS * cell || height < BARCODE_ROWS * cell)
+    {
+        return -1;
+    }
+    // 黑块 16、白块 235，阈值取中间
+    threshold = (16 + 235) * rows * cell / 2;
+
+    for (r = 0; r < BARCODE_ROWS; r++)
+    {
+        const uint8_t *src = luma + (r * cell + cell / 4) * linesize;
+        if (cell == 8)
+        {
+            cell_sums_8(src, linesize, rows, BARCODE_COLS, sums);
+        }
+        else
+        {
+            cell_sums_c(src, linesize, rows, cell, BARCODE_COLS, sums);
+        }
+        for (i = 0; i < BARCODE_COLS; i++)
+        {
+            bit = r * BARCODE_COLS + i;
+            if (sums[i] > threshold)
+            {
+                payload[bit >> 3] |= 0x80 >> (bit & 7);
+            }
+        }
+    }
+
+    if (AV_RB16(payload) != BARCODE_MAGIC ||
+        AV_RB16(payload + 14) != av_crc(av_crc_get_table(AV_CRC_16_ANSI), 0, payload, 14))
+    {
+        return -1;
+    }
+    *pts       = AV_RB32(payload + 2);
+    *send_time = AV_RB64(payload + 6);
+    return 0;
+}
+
+
+
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *dec = NULL;
+    const AVCodec *codec;
+    struct SwsContext *sws = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL, *gray = NULL;
+    int64_t *latency = NULL, *tmp, t_start, elapsed, send_time, now;
+    int64_t nb_frames = 0, nb_read = 0, nb_unreadable = 0, nb_lost = 0, nb_dup = 0, nb_reorder = 0;
+    int64_t max_pts = -1, first_pts = -1, k;
+    // 最近 BARCODE_WINDOW 个帧号是否已经读到过，按帧号对 BARCODE_WINDOW 取模存放
+    uint8_t seen[BARCODE_WINDOW / 8] = { 0 };
+    uint32_t pts;
+    int video_index, i, ret, cell = 8, print = 0, latency_size = 0;
+    const uint8_t *luma;
+    int linesize;
+
+    if (argc < 2)
+    {
+        printf("usage: %s input [-cell pixels] [-print 0|1]\n"
+               "read the luma barcode stamped by 'muxing_demo -barcode 1' from every decoded frame and\n"
+               "report end-to-end latency (receive time - send time) and lost, duplicated or reordered frames.\n"
+               "-cell is the size of one barcode bit (8 unless the video was scaled), -print 1 prints one line per frame.\n"
+               "\n", argv[0]);
+        return 1;
+    }
+    for (i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-cell"))
+        {
+            cell = FFMAX(atoi(argv[i + 1]), 1);
+        }
+        else if (!strcmp(argv[i], "-print"))
+        {
+            print = atoi(argv[i + 1]);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    {
+        cell_sums_8 = cell_sums_sse2;
+    }
+#elif defined(__aarch64__)
+    cell_sums_8 = cell_sums_neon;
+#endif
+
+    if ((ret = avformat_open_input(&fmt_ctx, argv[1], NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", argv[1], av_err2str(ret));
+        goto end;
+    }
+    if ((ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
+    {
+        fprintf(stderr, "No video stream in '%s'\n", argv[1]);
+        goto end;
+    }
+    video_index = ret;
+    for (i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        if (i != video_index)
+        {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    dec = avcodec_alloc_context3(codec);
+    if (!dec)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    avcodec_parameters_to_context(dec, fmt_ctx->streams[video_index]->codecpar);
+    dec->thread_count = 0;
+    if ((ret = avcodec_open2(dec, codec, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open the decoder: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    pkt   = av_packet_alloc();
+    frame = av_frame_alloc();
+    gray  = av_frame_alloc();
+    if (!pkt || !frame || !gray)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    t_start = av_gettime_relative();
+    for (;;)
+    {
+        ret = av_read_frame(fmt_ctx, pkt);
+        if (ret < 0 && ret != AVERROR_EOF)
+        {
+            fprintf(stderr, "Error reading '%s': %s\n", argv[1], av_err2str(ret));
+            goto end;
+        }
+        if (ret >= 0 && pkt->stream_index != video_index)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        // 读到文件结尾时发送 NULL 冲刷解码器
+        ret = avcodec_send_packet(dec, ret >= 0 ? pkt : NULL);
+        av_packet_unref(pkt);
+        if (ret < 0 && ret != AVERROR_EOF)
+        {
+            fprintf(stderr, "Error decoding: %s\n", av_err2str(ret));
+            goto end;
+        }
+
+        while ((ret = avcodec_receive_frame(dec, frame)) >= 0)
+        {
+            now = av_gettime();
+            nb_frames++;
+
+            // 大多数解码器输出的 YUV 格式中 data[0] 就是 8 位亮度，其他格式转换成 GRAY8
+            switch (frame->format)
+            {
+            case AV_PIX_FMT_YUV420P:
+            case AV_PIX_FMT_YUVJ420P:
+            case AV_PIX_FMT_YUV422P:
+            case AV_PIX_FMT_YUVJ422P:
+            case AV_PIX_FMT_YUV444P:
+            case AV_PIX_FMT_YUVJ444P:
+            case AV_PIX_FMT_NV12:
+            case AV_PIX_FMT_GRAY8:
+                luma     = frame->data[0];
+                linesize = frame->linesize[0];
+                break;
+            default:
+                sws = sws_getCachedContext(sws, frame->width, frame->height, frame->format,
+                                           frame->width, frame->height, AV_PIX_FMT_GRAY8,
+                                           SWS_POINT, NULL, NULL, NULL);
+                av_frame_unref(gray);
+                gray->format = AV_PIX_FMT_GRAY8;
+                gray->width  = frame->width;
+                gray->height = frame->height;
+                if (!sws || av_frame_get_buffer(gray, 0) < 0)
+                {
+                    fprintf(stderr, "Could not convert %s to gray\n", av_get_pix_fmt_name(frame->format));
+                    ret = AVERROR(EINVAL);
+                    goto end;
+                }
+                sws_scale(sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                          gray->data, gray->linesize);
+                luma     = gray->data[0];
+                linesize = gray->linesize[0];
+                break;
+            }
+
+            if (read_barcode(luma, linesize, frame->width, frame->height, cell, &pts, &send_time) < 0)
+            {
+                nb_unreadable++;
+                av_frame_unref(frame);
+                continue;
+            }
+            nb_read++;
+
+            // 帧号每帧加 1：比已读到的最大帧号大时，中间跳过的帧号先算作丢失，之后迟到的帧再从丢失中扣除
+            if (first_pts < 0)
+            {
+                first_pts = max_pts = pts;
+                seen[pts % BARCODE_WINDOW / 8] |= 1 << (pts % 8);
+            }
+            else if (pts > max_pts)
+            {
+                nb_lost += pts - max_pts - 1;
+                for (k = max_pts + 1; k < pts && k <= max_pts + BARCODE_WINDOW; k++)
+                {
+                    seen[k % BARCODE_WINDOW / 8] &= ~(1 << (k % 8));
+                }
+                max_pts = pts;
+                seen[pts % BARCODE_WINDOW / 8] |= 1 << (pts % 8);
+            }
+            else if (max_pts - pts >= BARCODE_WINDOW)
+            {
+                nb_reorder++;
+            }
+            else if (seen[pts % BARCODE_WINDOW / 8] & (1 << (pts % 8)))
+            {
+                nb_dup++;
+            }
+            else
+            {
+                nb_reorder++;
+                seen[pts % BARCODE_WINDOW / 8] |= 1 << (pts % 8);
+                // 比第一个帧号还小：范围向前扩展，中间的帧号同样先算作丢失
+                if (pts < first_pts)
+                {
+                    nb_lost  += first_pts - pts - 1;
+                    first_pts = pts;
+                }
+                else
+                {
+                    nb_lost--;
+                }
+            }
+
+            if (latency_size <= nb_read)
+            {
+                latency_size = FFMAX(2 * latency_size, 1024);
+                tmp = av_realloc_array(latency, latency_size, sizeof(*latency));
+                if (!tmp)
+                {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                latency = tmp;
+            }
+            latency[nb_read - 1] = now - send_time;
+            if (print)
+            {
+                printf("%"PRId64"\t%"PRIu32"\t%"PRId64"\t%.3f\n", nb_frames - 1, pts, send_time, (now - send_time) / 1000.0);
+            }
+            av_frame_unref(frame);
+        }
+        if (ret == AVERROR_EOF)
+        {
+            break;
+        }
+        else if (ret != AVERROR(EAGAIN))
+        {
+            fprintf(stderr, "Error decoding: %s\n", av_err2str(ret));
+            goto end;
+        }
+    }
+    elapsed = FFMAX(av_gettime_relative() - t_start, 1);
+
+    fprintf(stderr, "barcode: %"PRId64" frames, %"PRId64" barcodes read, %"PRId64" unreadable, %.1f frames/s\n",
+            nb_frames, nb_read, nb_unreadable, nb_frames * 1000000.0 / elapsed);
+    if (nb_read)
+    {
+        qsort(latency, nb_read, sizeof(*latency), compare_int64);
+        fprintf(stderr, "barcode: frame numbers %"PRId64"..%"PRId64", %"PRId64" lost (%.3f%%), %"PRId64" duplicated, "
+                "%"PRId64" out of order\n",
+                first_pts, max_pts, nb_lost, 100.0 * nb_lost / (nb_read + nb_lost), nb_dup, nb_reorder);
+        fprintf(stderr, "barcode: latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                latency[nb_read / 2] / 1000.0, latency[nb_read * 99 / 100] / 1000.0, latency[nb_read - 1] / 1000.0);
+    }
+    ret = nb_read ? 0 : AVERROR_INVALIDDATA;
+
+end:
+    av_free(latency);
+    sws_freeContext(sws);
+    av_frame_free(&gray);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt_ctx);
+    return ret < 0;
+}
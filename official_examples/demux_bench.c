@@ -0,0 +1,664 @@
+/**
+ * @file
+ * 解复用 + 解码的吞吐量测试。
+ *
+ * 用 avformat_open_input 打开输入文件，解复用并解码其中所有的音视频流，解码线程数和线程类型
+ * （frame/slice）可以配置，解码出的帧可以直接丢弃或者计算校验和。结束时打印每个流的帧数和 fps、
+ * 解码延迟的 p50/p90/p99，以及进程的 CPU 占用，用于估算播放和分析集群的规模。
+ *
+ * -parallel 1 时由一个解复用线程按 stream_index 把数据包分发到每个流各自的解码线程，
+ * 线程之间使用单生产者单消费者的无锁队列，多音轨 + 视频的文件可以同时解码所有轨道，
+ * 队列深度统计可以看出哪个轨道解码得慢。
+ * @example demux_bench.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <libavutil/adler32.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+
+/**
+ * @brief 单生产者（解复用线程）单消费者（解码线程）的无锁数据包队列。
+ * head 只由消费者修改，tail 只由生产者修改，队列容量为 2 的幂
+ */
+typedef struct PacketQueue {
+    AVPacket **slots;
+    unsigned int size;
+    atomic_uint head, tail;
+
+    // 生产者一侧的统计：入队次数、入队时的队列深度之和及最大值、队列已满需要等待的次数
+    int64_t nb_push, depth_sum, nb_full;
+    unsigned int max_depth;
+    // 消费者一侧的统计：队列为空需要等待的次数
+    int64_t nb_empty;
+} PacketQueue;
+
+/**
+ * @brief 一个输入流的解码器及其统计信息
+ */
+typedef struct StreamDecoder {
+    // 输入流和对应的解码器上下文，不解码的流 dec 为 NULL
+    AVStream *st;
+    AVCodecContext *dec;
+    // 接收解码结果的帧
+    AVFrame *frame;
+
+    // 送入解码器的数据包数、解码出的帧数
+    int64_t nb_packets, nb_frames;
+    // 所有解码帧数据的 Adler-32 校验和
+    uint32_t checksum;
+    // 每一帧的解码延迟（微秒）：从对应的数据包送入解码器到取出这一帧
+    int64_t *latency;
+    int nb_latency, latency_size;
+
+    // 并行模式：这个流的解码线程、数据包队列，以及解码线程的返回值
+    pthread_t thread;
+    PacketQueue queue;
+    int ret;
+} StreamDecoder;
+
+static int thread_count = 0;                     /* 解码线程数，0 表示由 libavcodec 根据 CPU 数量决定 */
+static int thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+static int checksum     = 0;                     /* 1: 计算解码帧的校验和，0: 直接丢弃 */
+static int parallel     = 0;                     /* 1: 每个流在独立的线程中解码 */
+static int queue_size   = 64;                    /* 并行模式下每个流的队列容量（数据包个数） */
+
+
+
+
+/**
+ * @brief 返回进程到目前为止消耗的用户态和内核态 CPU 时间（微秒）
+ */
+static void get_cpu_time(int64_t *user, int64_t *sys)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    *user = (int64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+    *sys  = (int64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+}
+
+
+
+
+/**
+ * @brief 把一帧的有效数据（不含行尾的对齐填充）累加到校验和中
+ */
+static uint32_t frame_checksum(uint32_t sum, const AVFrame *frame, enum AVMediaType type)
+{
+    int plane, y;
+
+    if (type == AVMEDIA_TYPE_VIDEO)
+    {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+        int linesizes[4];
+
+        if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+            av_image_fill_linesizes(linesizes, frame->format, frame->width) < 0)
+        {
+            return sum;
+        }
+        for (plane = 0; plane < 4 && frame->data[plane]; plane++)
+        {
+            int h = frame->height;
+
+            if (plane == 1 || plane == 2)
+            {
+                h = AV_CEIL_RSHIFT(h, desc->log2_chroma_h);
+            }
+            for (y = 0; y < h; y++)
+            {
+                sum = av_adler32_update(sum, frame->data[plane] + y * frame->linesize[plane], linesizes[plane]);
+            }
+        }
+    }
+    else
+    {
+        int planar = av_sample_fmt_is_planar(frame->format);
+        int size   = frame->nb_samples * av_get_bytes_per_sample(frame->format) *
+                     (planar ? 1 : frame->channels);
+
+        for (plane = 0; plane < (planar ? frame->channels : 1); plane++)
+        {
+            sum = av_adler32_update(sum, frame->extended_data[plane], size);
+        }
+    }
+
+    return sum;
+}
+
+
+
+
+/**
+ * @brief 记录一帧的解码延迟
+ */
+static void add_latency(StreamDecoder *sd, int64_t latency)
+{
+    if (sd->nb_latency == sd->latency_size)
+    {
+        int size = sd->latency_size ? sd->latency_size * 2 : 1024;
+        int64_t *p = av_realloc_array(sd->latency, size, sizeof(*p));
+
+        if (!p)
+        {
+            return;
+        }
+        sd->latency      = p;
+        sd->latency_size = size;
+    }
+    sd->latency[sd->nb_latency++] = latency;
+}
+
+
+
+
+/**
+ * @brief 把一个数据包送入解码器（pkt 为 NULL 时冲刷解码器），并取出所有已经解码完成的帧
+ * @return 0 表示成功，负数表示错误码
+ */
+static int decode_packet(StreamDecoder *sd, const AVPacket *pkt)
+{
+    AVCodecContext *dec = sd->dec;
+    int ret;
+
+    // reordered_opaque 会原样复制到由这个数据包解码出的帧上（帧线程和 B 帧重排时也一样），
+    // 用它携带送入的时刻来计算每一帧的解码延迟
+    dec->reordered_opaque = av_gettime_relative();
+    ret = avcodec_send_packet(dec, pkt);
+    if (ret < 0 && ret != AVERROR_EOF)
+    {
+        fprintf(stderr, "Error sending a packet of stream #%d for decoding: %s\n",
+                sd->st->index, av_err2str(ret));
+        return ret;
+    }
+    if (pkt)
+    {
+        sd->nb_packets++;
+    }
+
+    for (;;)
+    {
+        ret = avcodec_receive_frame(dec, sd->frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        {
+            return 0;
+        }
+        if (ret < 0)
+        {
+            fprintf(stderr, "Error decoding stream #%d: %s\n", sd->st->index, av_err2str(ret));
+            return ret;
+        }
+
+        add_latency(sd, av_gettime_relative() - sd->frame->reordered_opaque);
+        sd->nb_frames++;
+        if (checksum)
+        {
+            sd->checksum = frame_checksum(sd->checksum, sd->frame, dec->codec_type);
+        }
+        av_frame_unref(sd->frame);
+    }
+}
+
+
+
+
+/**
+ * @brief 队列已满或为空时的等待：先让出 CPU，多次仍未就绪再睡眠，避免空转占满一个核
+ */
+static void queue_backoff(int *spins)
+{
+    if (++*spins < 64)
+    {
+        sched_yield();
+    }
+    else
+    {
+        usleep(100);
+    }
+}
+
+
+
+
+static int queue_init(PacketQueue *q, int size)
+{
+    q->size = 1;
+    while (q->size < (unsigned int)size)
+    {
+        q->size <<= 1;
+    }
+    q->slots = av_calloc(q->size, sizeof(*q->slots));
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+
+    return q->slots ? 0 : AVERROR(ENOMEM);
+}
+
+
+
+
+/**
+ * @brief 生产者入队一个数据包（NULL 表示输入结束），队列已满时等待
+ */
+static void queue_push(PacketQueue *q, AVPacket *pkt)
+{
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int depth;
+    int spins = 0;
+
+    while ((depth = tail - atomic_load_explicit(&q->head, memory_order_acquire)) == q->size)
+    {
+        if (!spins)
+        {
+            q->nb_full++;
+        }
+        queue_backoff(&spins);
+    }
+
+    q->nb_push++;
+    q->depth_sum += depth;
+    q->max_depth = FFMAX(q->max_depth, depth);
+
+    q->slots[tail & (q->size - 1)] = pkt;
+    // release：消费者看到新的 tail 时，一定也能看到写入的数据包
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+
+
+
+/**
+ * @brief 消费者出队一个数据包，队列为空时等待
+ */
+static AVPacket *queue_pop(PacketQueue *q)
+{
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    AVPacket *pkt;
+    int spins = 0;
+
+    while (atomic_load_explicit(&q->tail, memory_order_acquire) == head)
+    {
+        if (!spins)
+        {
+            q->nb_empty++;
+        }
+        queue_backoff(&spins);
+    }
+
+    pkt = q->slots[head & (q->size - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return pkt;
+}
+
+
+
+
+/**
+ * @brief 并行模式下每个流的解码线程：从队列中取出数据包解码，遇到 NULL 时冲刷解码器并退出。
+ * 解码出错后继续取出并丢弃数据包，不让解复用线程阻塞在已满的队列上
+ */
+static void *decode_thread_main(void *arg)
+{
+    StreamDecoder *sd = arg;
+    AVPacket *pkt;
+
+    while ((pkt = queue_pop(&sd->queue)))
+    {
+        if (sd->ret >= 0)
+        {
+            sd->ret = decode_packet(sd, pkt);
+        }
+        av_packet_free(&pkt);
+    }
+    if (sd->ret >= 0)
+    {
+        sd->ret = decode_packet(sd, NULL);
+    }
+
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief 并行模式：当前线程只负责解复用，把数据包按 stream_index 分发给各个流的解码线程
+ * @return 0 表示成功，负数表示错误码
+ */
+static int demux_parallel(AVFormatContext *fmt_ctx, StreamDecoder *decoders, AVPacket *pkt)
+{
+    unsigned int s, nb_started = 0;
+    int ret = 0;
+
+    for (s = 0; s < fmt_ctx->nb_streams; s++)
+    {
+        if (!decoders[s].dec)
+        {
+            continue;
+        }
+        if ((ret = queue_init(&decoders[s].queue, queue_size)) < 0 ||
+            (ret = AVERROR(pthread_create(&decoders[s].thread, NULL, decode_thread_main, &decoders[s]))))
+        {
+            break;
+        }
+        nb_started = s + 1;
+    }
+
+    while (ret >= 0 && (ret = av_read_frame(fmt_ctx, pkt)) >= 0)
+    {
+        StreamDecoder *sd = &decoders[pkt->stream_index];
+        AVPacket *copy;
+
+        if (!sd->dec)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        copy = av_packet_alloc();
+        if (!copy)
+        {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        av_packet_move_ref(copy, pkt);
+        queue_push(&sd->queue, copy);
+    }
+    if (ret == AVERROR_EOF)
+    {
+        ret = 0;
+    }
+    else if (ret < 0)
+    {
+        fprintf(stderr, "Error reading the input: %s\n", av_err2str(ret));
+    }
+
+    // 通知所有解码线程输入结束，等待它们冲刷解码器
+    for (s = 0; s < nb_started; s++)
+    {
+        if (decoders[s].dec)
+        {
+            queue_push(&decoders[s].queue, NULL);
+            pthread_join(decoders[s].thread, NULL);
+            if (decoders[s].ret < 0 && ret >= 0)
+            {
+                ret = decoders[s].ret;
+            }
+        }
+    }
+
+    return ret;
+}
+
+
+
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+
+
+/**
+ * @brief 打印一个流的统计信息：帧数、fps、解码延迟的百分位数
+ */
+static void print_stream_stats(StreamDecoder *sd, int64_t elapsed)
+{
+    int64_t p50 = 0, p90 = 0, p99 = 0;
+
+    if (sd->nb_latency)
+    {
+        qsort(sd->latency, sd->nb_latency, sizeof(*sd->latency), compare_int64);
+        p50 = sd->latency[(sd->nb_latency - 1) * 50 / 100];
+        p90 = sd->latency[(sd->nb_latency - 1) * 90 / 100];
+        p99 = sd->latency[(sd->nb_latency - 1) * 99 / 100];
+    }
+
+    printf("stream #%d (%s, %s): %"PRId64" packets, %"PRId64" frames, %.1f fps, "
+           "latency p50 %.3f ms p90 %.3f ms p99 %.3f ms",
+           sd->st->index, av_get_media_type_string(sd->dec->codec_type), sd->dec->codec->name,
+           sd->nb_packets, sd->nb_frames, sd->nb_frames * 1000000.0 / (elapsed > 0 ? elapsed : 1),
+           p50 / 1000.0, p90 / 1000.0, p99 / 1000.0);
+    if (checksum)
+    {
+        printf(", adler32 %08"PRIx32, sd->checksum);
+    }
+    // 并行模式：平均队列深度高、经常满的流就是拖慢整体的慢轨道；经常为空说明解码线程在等数据
+    if (sd->queue.slots)
+    {
+        printf(", queue depth avg %.1f max %u/%u, full %"PRId64", empty %"PRId64,
+               sd->queue.nb_push ? (double)sd->queue.depth_sum / sd->queue.nb_push : 0.0,
+               sd->queue.max_depth, sd->queue.size, sd->queue.nb_full, sd->queue.nb_empty);
+    }
+    printf("\n");
+}
+
+
+
+
+/**
+ * @brief 为一个音视频流打开解码器，其他类型的流不解码
+ * @return 0 表示成功（或者跳过），负数表示错误码
+ */
+static int open_decoder(StreamDecoder *sd, AVStream *st)
+{
+    const AVCodec *codec;
+    int ret;
+
+    sd->st = st;
+    if (st->codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
+        st->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+    {
+        return 0;
+    }
+
+    codec = avcodec_find_decoder(st->codecpar->codec_id);
+    if (!codec)
+    {
+        fprintf(stderr, "No decoder for stream #%d (%s), skipped\n",
+                st->index, avcodec_get_name(st->codecpar->codec_id));
+        return 0;
+    }
+
+    sd->dec   = avcodec_alloc_context3(codec);
+    sd->frame = av_frame_alloc();
+    if (!sd->dec || !sd->frame)
+    {
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = avcodec_parameters_to_context(sd->dec, st->codecpar)) < 0)
+    {
+        return ret;
+    }
+    sd->dec->pkt_timebase = st->time_base;
+    sd->dec->thread_count = thread_count;
+    sd->dec->thread_type  = thread_type;
+
+    if ((ret = avcodec_open2(sd->dec, codec, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open the decoder of stream #%d: %s\n", st->index, av_err2str(ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    StreamDecoder *decoders = NULL;
+    AVPacket *pkt = NULL;
+    int64_t t_start, elapsed, user_start, sys_start, user_end, sys_end, nb_frames = 0;
+    unsigned int s;
+    int ret, i;
+
+    if (argc < 2)
+    {
+        printf("usage: %s input_file [-threads n] [-thread_type frame|slice|both] [-checksum 1]\n"
+               "       [-parallel 1] [-queue_size packets]\n"
+               "demux and decode every audio and video stream of input_file, then print\n"
+               "fps, decode latency percentiles and CPU usage.\n"
+               "-parallel 1 decodes each stream on its own thread fed by a lock-free queue.\n"
+               "\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-threads"))
+        {
+            thread_count = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-thread_type"))
+        {
+            if (!strcmp(argv[i + 1], "frame"))
+                thread_type = FF_THREAD_FRAME;
+            else if (!strcmp(argv[i + 1], "slice"))
+                thread_type = FF_THREAD_SLICE;
+            else if (!strcmp(argv[i + 1], "both"))
+                thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+            else
+            {
+                fprintf(stderr, "Unknown thread type '%s'\n", argv[i + 1]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-checksum"))
+        {
+            checksum = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-parallel"))
+        {
+            parallel = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-queue_size"))
+        {
+            queue_size = FFMAX(atoi(argv[i + 1]), 1);
+        }
+    }
+
+    if ((ret = avformat_open_input(&fmt_ctx, argv[1], NULL, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", argv[1], av_err2str(ret));
+        return 1;
+    }
+    if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+    {
+        fprintf(stderr, "Cannot find stream information\n");
+        goto end;
+    }
+
+    decoders = av_mallocz_array(fmt_ctx->nb_streams, sizeof(*decoders));
+    pkt      = av_packet_alloc();
+    if (!decoders || !pkt)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (s = 0; s < fmt_ctx->nb_streams; s++)
+    {
+        if ((ret = open_decoder(&decoders[s], fmt_ctx->streams[s])) < 0)
+        {
+            goto end;
+        }
+    }
+
+    get_cpu_time(&user_start, &sys_start);
+    t_start = av_gettime_relative();
+
+    if (parallel)
+    {
+        if ((ret = demux_parallel(fmt_ctx, decoders, pkt)) < 0)
+        {
+            goto end;
+        }
+    }
+    else
+    {
+        while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0)
+        {
+            StreamDecoder *sd = &decoders[pkt->stream_index];
+
+            if (sd->dec)
+            {
+                ret = decode_packet(sd, pkt);
+            }
+            av_packet_unref(pkt);
+            if (ret < 0)
+            {
+                goto end;
+            }
+        }
+        if (ret != AVERROR_EOF)
+        {
+            fprintf(stderr, "Error reading '%s': %s\n", argv[1], av_err2str(ret));
+            goto end;
+        }
+
+        // 冲刷所有解码器，取出其中缓冲的帧
+        for (s = 0; s < fmt_ctx->nb_streams; s++)
+        {
+            if (decoders[s].dec && (ret = decode_packet(&decoders[s], NULL)) < 0)
+            {
+                goto end;
+            }
+        }
+    }
+    ret = 0;
+
+    elapsed = av_gettime_relative() - t_start;
+    get_cpu_time(&user_end, &sys_end);
+
+    for (s = 0; s < fmt_ctx->nb_streams; s++)
+    {
+        if (decoders[s].dec)
+        {
+            print_stream_stats(&decoders[s], elapsed);
+            nb_frames += decoders[s].nb_frames;
+        }
+    }
+    // CPU 占用可以超过 100%，表示平均使用了多个核
+    printf("total: %"PRId64" frames in %.3f s, %.1f fps, cpu user %.3f s sys %.3f s (%.0f%%)\n",
+           nb_frames, elapsed / 1000000.0, nb_frames * 1000000.0 / (elapsed > 0 ? elapsed : 1),
+           (user_end - user_start) / 1000000.0, (sys_end - sys_start) / 1000000.0,
+           (user_end - user_start + sys_end - sys_start) * 100.0 / (elapsed > 0 ? elapsed : 1));
+
+end:
+    if (decoders)
+    {
+        for (s = 0; s < fmt_ctx->nb_streams; s++)
+        {
+            avcodec_free_context(&decoders[s].dec);
+            av_frame_free(&decoders[s].frame);
+            av_freep(&decoders[s].latency);
+            av_freep(&decoders[s].queue.slots);
+        }
+        av_freep(&decoders);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+
+    return ret < 0;
+}
@@ -23,27 +23,766 @@
 /**
  * @file
  * Shows how the metadata API can be used in application programs.
+ *
+ * 指纹模式（-fingerprint）：在打印元数据的同一个输入上，只解码主视频流的关键帧（解码器支持时直接以
+ * lowres 缩小解码），缩小成 32x32 的灰度图，计算 DCT 感知哈希（pHash，64 位），每个关键帧一行写成指纹序列。
+ * 批量匹配（-match）：读入整个库的指纹序列，把每个哈希切成 4 段 16 位，每段建一张倒排表（多索引哈希）。
+ * 汉明距离不超过 d 的两个哈希至少有一段的距离不超过 d / 4，所以只需要在每张表中探测这么多个相邻的桶，
+ * 再用完整的 64 位验证候选，不需要两两比较文件。
  * @example metadata.c
  */
 
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
 #include <libavutil/dict.h>
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+
+#define PHASH_SIZE  32                           /* 计算 pHash 之前缩小到的边长 */
+#define PHASH_LOW   8                            /* 保留的低频 DCT 系数的边长（不含直流所在的第 0 行和第 0 列），8x8 = 64 位 */
+#define MIH_MIN_BITS    8                        /* 多索引哈希每段的位数约为 log2(哈希个数)，限制在这个范围内 */
+#define MIH_MAX_BITS    24
+#define MIH_MAX_CHUNKS  (64 / MIH_MIN_BITS)      /* 64 位哈希最多切成的段数 */
+#define MIH_MAX_RADIUS  3                        /* 每段的探测半径，超过 3 时探测的桶数增长得很快 */
+
+static double fp_interval = 1.0;                 /* 两个指纹之间的最小间隔（秒），更密的关键帧不解码 */
+static int match_distance = 8;                   /* 汉明距离不超过它的两个哈希视为相同的画面 */
+static int match_min = 3;                        /* 两个文件至少有这么多个哈希相同才报告为近似重复 */
+
+/* DCT-II 的基函数：第 u 行是频率 u + 1，跳过直流 */
+static float dct_basis[PHASH_LOW][PHASH_SIZE];
+
+
+/**
+ * @brief 一个文件的指纹序列（读入 -match 的库时使用）
+ */
+typedef struct FpLibrary {
+    // 文件名（指纹序列文件头中记录的输入文件名）
+    char **names;
+    int nb_files;
+    // 所有文件的哈希依次存放，file[i] 是第 i 个哈希所属的文件，同一文件的哈希连续
+    uint64_t *hash;
+    int *file;
+    int64_t nb;
+    int64_t size;
+    // 多索引：哈希切成 nb_chunks 段，第 c 段是从第 shift[c] 位开始的 bits[c] 位；
+    // 第 c 段取值为 k 的哈希是 ids[c][offsets[c][k] .. offsets[c][k + 1])
+    int nb_chunks;
+    int shift[MIH_MAX_CHUNKS];
+    int bits[MIH_MAX_CHUNKS];
+    int64_t *offsets[MIH_MAX_CHUNKS];
+    int64_t *ids[MIH_MAX_CHUNKS];
+} FpLibrary;
+
+
+
+
+/**
+ * @brief 计算 32x32 图像的二维 DCT 中频率 1..8 x 1..8 的系数：先对列变换得到 8x32，再对行变换得到 8x8
+ */
+static void phash_dct_c(const float *x, float *out)
+{
+    float t[PHASH_LOW][PHASH_SIZE];
+    int u, v, i, j;
+
+    for (u = 0; u < PHASH_LOW; u++)
+    {
+        for (j = 0; j < PHASH_SIZE; j++)
+        {
+            t[u][j] = 0;
+            for (i = 0; i < PHASH_SIZE; i++)
+            {
+                t[u][j] += dct_basis[u][i] * x[i * PHASH_SIZE + j];
+            }
+        }
+    }
+    for (u = 0; u < PHASH_LOW; u++)
+    {
+        for (v = 0; v < PHASH_LOW; v++)
+        {
+            out[u * PHASH_LOW + v] = 0;
+            for (j = 0; j < PHASH_SIZE; j++)
+            {
+                out[u * PHASH_LOW + v] += t[u][j] * dct_basis[v][j];
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief SSE2 实现：列变换时一行 32 个系数放在 8 个向量中，每个输入行广播一个基函数值后乘加；
+ * 行变换是长度为 32 的点积
+ */
+__attribute__((target("sse2")))
+static void phash_dct_sse2(const float *x, float *out)
+{
+    __m128 t[PHASH_SIZE / 4], d, acc;
+    float s[4];
+    int u, v, i, j;
+
+    for (u = 0; u < PHASH_LOW; u++)
+    {
+        for (j = 0; j < PHASH_SIZE / 4; j++)
+        {
+            t[j] = _mm_setzero_ps();
+        }
+        for (i = 0; i < PHASH_SIZE; i++)
+        {
+            d = _mm_set1_ps(dct_basis[u][i]);
+            for (j = 0; j < PHASH_SIZE / 4; j++)
+            {
+                t[j] = _mm_add_ps(t[j], _mm_mul_ps(d, _mm_loadu_ps(x + i * PHASH_SIZE + 4 * j)));
+            }
+        }
+        for (v = 0; v < PHASH_LOW; v++)
+        {
+            acc = _mm_setzero_ps();
+            for (j = 0; j < PHASH_SIZE / 4; j++)
+            {
+                acc = _mm_add_ps(acc, _mm_mul_ps(t[j], _mm_loadu_ps(dct_basis[v] + 4 * j)));
+            }
+            _mm_storeu_ps(s, acc);
+            out[u * PHASH_LOW + v] = (s[0] + s[1]) + (s[2] + s[3]);
+        }
+    }
+}
+#elif defined(__aarch64__)
+static void phash_dct_neon(const float *x, float *out)
+{
+    float32x4_t t[PHASH_SIZE / 4], acc;
+    int u, v, i, j;
+
+    for (u = 0; u < PHASH_LOW; u++)
+    {
+        for (j = 0; j < PHASH_SIZE / 4; j++)
+        {
+            t[j] = vdupq_n_f32(0);
+        }
+        for (i = 0; i < PHASH_SIZE; i++)
+        {
+            for (j = 0; j < PHASH_SIZE / 4; j++)
+            {
+                t[j] = vfmaq_n_f32(t[j], vld1q_f32(x + i * PHASH_SIZE + 4 * j), dct_basis[u][i]);
+            }
+        }
+        for (v = 0; v < PHASH_LOW; v++)
+        {
+            acc = vdupq_n_f32(0);
+            for (j = 0; j < PHASH_SIZE / 4; j++)
+            {
+                acc = vfmaq_f32(acc, t[j], vld1q_f32(dct_basis[v] + 4 * j));
+            }
+            out[u * PHASH_LOW + v] = vaddvq_f32(acc);
+        }
+    }
+}
+#endif
+
+/* 当前 CPU 上最快的实现，由 phash_init 选择 */
+static void (*phash_dct)(const float *x, float *out) = phash_dct_c;
+
+static void phash_init(void)
+{
+    int u, i;
+
+    for (u = 0; u < PHASH_LOW; u++)
+    {
+        for (i = 0; i < PHASH_SIZE; i++)
+        {
+            dct_basis[u][i] = cos(M_PI * (u + 1) * (2 * i + 1) / (2 * PHASH_SIZE));
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    {
+        phash_dct = phash_dct_sse2;
+    }
+#elif defined(__aarch64__)
+    phash_dct = phash_dct_neon;
+#endif
+}
+
+static int compare_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief 32x32 灰度图的 pHash：第 i 位表示第 i 个低频系数是否大于 64 个系数的中位数
+ */
+static uint64_t phash(const uint8_t *gray)
+{
+    float x[PHASH_SIZE * PHASH_SIZE], c[PHASH_LOW * PHASH_LOW], sorted[PHASH_LOW * PHASH_LOW];
+    uint64_t h = 0;
+    float median;
+    int i;
+
+    for (i = 0; i < PHASH_SIZE * PHASH_SIZE; i++)
+    {
+        x[i] = gray[i];
+    }
+    phash_dct(x, c);
+
+    memcpy(sorted, c, sizeof(c));
+    qsort(sorted, PHASH_LOW * PHASH_LOW, sizeof(*sorted), compare_float);
+    median = (sorted[PHASH_LOW * PHASH_LOW / 2 - 1] + sorted[PHASH_LOW * PHASH_LOW / 2]) / 2;
+    for (i = 0; i < PHASH_LOW * PHASH_LOW; i++)
+    {
+        if (c[i] > median)
+        {
+            h |= UINT64_C(1) << i;
+        }
+    }
+    return h;
+}
+
+
+
+
+/**
+ * @brief 打开主视频流的解码器：只解码关键帧，关闭环路滤波，解码器支持时用 lowres 直接输出缩小的图像
+ * （不小于 pHash 输入的两倍）
+ */
+static int open_keyframe_decoder(AVFormatContext *fmt_ctx, int *index, AVCodecContext **dec)
+{
+    const AVCodec *codec;
+    AVCodecParameters *par;
+    unsigned int s;
+    int ret;
+
+    if ((ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
+    {
+        fprintf(stderr, "No video stream\n");
+        return ret;
+    }
+    *index = ret;
+    par    = fmt_ctx->streams[*index]->codecpar;
+    for (s = 0; s < fmt_ctx->nb_streams; s++)
+    {
+        fmt_ctx->streams[s]->discard = s == (unsigned int)*index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+    }
+
+    *dec = avcodec_alloc_context3(codec);
+    if (!*dec)
+    {
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = avcodec_parameters_to_context(*dec, par)) < 0)
+    {
+        return ret;
+    }
+    (*dec)->pkt_timebase     = fmt_ctx->streams[*index]->time_base;
+    (*dec)->skip_frame       = AVDISCARD_NONKEY;
+    (*dec)->skip_loop_filter = AVDISCARD_ALL;
+    (*dec)->flags2          |= AV_CODEC_FLAG2_FAST;
+    (*dec)->thread_count     = 0;
+    (*dec)->thread_type      = FF_THREAD_SLICE;
+    while ((*dec)->lowres < codec->max_lowres &&
+           (par->width >> ((*dec)->lowres + 1)) >= 2 * PHASH_SIZE &&
+           (par->height >> ((*dec)->lowres + 1)) >= 2 * PHASH_SIZE)
+    {
+        (*dec)->lowres++;
+    }
+
+    if ((ret = avcodec_open2(*dec, codec, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open the video decoder: %s\n", av_err2str(ret));
+    }
+    return ret;
+}
+
+/**
+ * @brief 在已经打开的输入上生成指纹序列，写到 output（"-" 表示 stdout）：第一行记录输入文件名，
+ * 之后每行一个关键帧的时间（秒）和 16 位十六进制的 pHash。与上一个相同的哈希不重复写出
+ */
+static int write_fingerprint(AVFormatContext *fmt_ctx, const char *input, const char *output)
+{
+    AVCodecContext *dec = NULL;
+    struct SwsContext *sws_ctx = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    uint8_t gray[PHASH_SIZE * PHASH_SIZE];
+    uint8_t *dst[4] = { gray };
+    int dst_linesize[4] = { PHASH_SIZE };
+    int64_t t_start = av_gettime_relative(), nb_keyframes = 0, nb_skipped = 0, nb_hashes = 0;
+    uint64_t h, last = 0;
+    double t, last_t = -HUGE_VAL;
+    AVRational tb;
+    FILE *out = NULL;
+    int index, ret;
+
+    phash_init();
+    if (!pkt || !frame)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = open_keyframe_decoder(fmt_ctx, &index, &dec)) < 0)
+    {
+        goto end;
+    }
+    tb  = fmt_ctx->streams[index]->time_base;
+    out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (!out)
+    {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not open '%s': %s\n", output, av_err2str(ret));
+        goto end;
+    }
+    fprintf(out, "# fingerprint %s\n", input);
+
+    while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0)
+    {
+        // 离上一个指纹太近的关键帧不解码
+        t = pkt->pts != AV_NOPTS_VALUE ? pkt->pts * av_q2d(tb) : last_t + fp_interval;
+        if (pkt->stream_index != index || !(pkt->flags & AV_PKT_FLAG_KEY) || t - last_t < fp_interval)
+        {
+            nb_skipped += pkt->stream_index == index;
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        // 与 thumbnail_demo 一样，送入关键帧后立即冲刷取出，再重置解码器
+        nb_keyframes++;
+        ret = avcodec_send_packet(dec, pkt);
+        av_packet_unref(pkt);
+        if (ret < 0 || (ret = avcodec_send_packet(dec, NULL)) < 0)
+        {
+            break;
+        }
+        ret = avcodec_receive_frame(dec, frame);
+        avcodec_flush_buffers(dec);
+        if (ret == AVERROR_EOF)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            break;
+        }
+
+        sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, frame->format,
+                                       PHASH_SIZE, PHASH_SIZE, AV_PIX_FMT_GRAY8, SWS_AREA, NULL, NULL, NULL);
+        if (!sws_ctx)
+        {
+            ret = AVERROR(EINVAL);
+            break;
+        }
+        sws_scale(sws_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                  dst, dst_linesize);
+        if (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+        {
+            t = frame->best_effort_timestamp * av_q2d(tb);
+        }
+        av_frame_unref(frame);
+
+        last_t = t;
+        h      = phash(gray);
+        if (nb_hashes && h == last)
+        {
+            continue;
+        }
+        fprintf(out, "%.3f %016"PRIx64"\n", t, h);
+        last = h;
+        nb_hashes++;
+    }
+    if (ret == AVERROR_EOF)
+    {
+        ret = 0;
+    }
+    else if (ret < 0)
+    {
+        fprintf(stderr, "Error while fingerprinting '%s': %s\n", input, av_err2str(ret));
+    }
+
+    fprintf(stderr, "fingerprint: %"PRId64" hashes from %"PRId64" decoded keyframes (lowres %d), "
+            "%"PRId64" video packets skipped, %.1f ms\n",
+            nb_hashes, nb_keyframes, dec->lowres, nb_skipped, (av_gettime_relative() - t_start) / 1000.0);
+
+end:
+    if (out && out != stdout && fclose(out) && ret >= 0)
+    {
+        ret = AVERROR(errno);
+    }
+    avcodec_free_context(&dec);
+    sws_freeContext(sws_ctx);
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 读入一个指纹序列文件，追加到库中
+ */
+static int load_fingerprint(FpLibrary *lib, const char *path)
+{
+    char line[4096], *name;
+    uint64_t h;
+    double t;
+    FILE *f = fopen(path, "r");
+    void *p;
+
+    if (!f)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", path, strerror(errno));
+        return AVERROR(errno);
+    }
+    name = NULL;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (!strncmp(line, "# fingerprint ", 14))
+        {
+            line[strcspn(line, "\r\n")] = 0;
+            av_free(name);
+            if (!(name = av_strdup(line + 14)))
+            {
+                goto fail;
+            }
+            continue;
+        }
+        if (sscanf(line, "%lf %"SCNx64, &t, &h) != 2)
+        {
+            continue;
+        }
+        if (lib->nb == lib->size)
+        {
+            lib->size = FFMAX(2 * lib->size, 4096);
+            if (!(p = av_realloc_array(lib->hash, lib->size, sizeof(*lib->hash))))
+            {
+                goto fail;
+            }
+            lib->hash = p;
+            if (!(p = av_realloc_array(lib->file, lib->size, sizeof(*lib->file))))
+            {
+                goto fail;
+            }
+            lib->file = p;
+        }
+        lib->hash[lib->nb]   = h;
+        lib->file[lib->nb++] = lib->nb_files;
+    }
+    fclose(f);
+
+    if (!(p = av_realloc_array(lib->names, lib->nb_files + 1, sizeof(*lib->names))))
+    {
+        av_free(name);
+        return AVERROR(ENOMEM);
+    }
+    lib->names = p;
+    if (!name && !(name = av_strdup(path)))
+    {
+        return AVERROR(ENOMEM);
+    }
+    lib->names[lib->nb_files++] = name;
+    return 0;
+
+fail:
+    fclose(f);
+    av_free(name);
+    return AVERROR(ENOMEM);
+}
+
+/* 哈希 h 在第 c 段的取值 */
+static inline uint32_t mih_key(const FpLibrary *lib, int c, uint64_t h)
+{
+    return (h >> lib->shift[c]) & ((1ULL << lib->bits[c]) - 1);
+}
+
+/**
+ * @brief 按哈希个数 N 选择分段（标准的多索引哈希）：每段约 log2(N) 位，使每个桶平均约有一个哈希，
+ * 段数为 64 / log2(N)，各段的位数相差不超过 1。为每一段建立倒排表：先数每个桶的个数得到偏移，
+ * 再把哈希的序号放进各自的桶。每段位数取 ceil(log2(N)) 时桶数小于 2N（N 小于 128 时每段固定 2^8 个桶），
+ * 索引占用 nb_chunks * (8 * 2^bits + 8 * N) 字节，即每个哈希不超过 24 * nb_chunks 字节；
+ * 段数不超过 MIH_MAX_CHUNKS，加上哈希本身和匹配时的标记，总共不超过每个哈希 212 字节
+ */
+static int build_index(FpLibrary *lib)
+{
+    int64_t i, k, *pos;
+    int c, bits;
+
+    bits = lib->nb > 1LL << MIH_MAX_BITS ? MIH_MAX_BITS : av_log2(FFMAX(lib->nb, 2) - 1) + 1;
+    bits = av_clip(bits, MIH_MIN_BITS, MIH_MAX_BITS);
+    lib->nb_chunks = (64 + bits - 1) / bits;
+    for (c = 0; c < lib->nb_chunks; c++)
+    {
+        lib->bits[c]  = 64 / lib->nb_chunks + (c < 64 % lib->nb_chunks);
+        lib->shift[c] = c ? lib->shift[c - 1] + lib->bits[c - 1] : 0;
+    }
+
+    pos = av_malloc_array(1 << lib->bits[0], sizeof(*pos));
+    if (!pos)
+    {
+        return AVERROR(ENOMEM);
+    }
+    for (c = 0; c < lib->nb_chunks; c++)
+    {
+        lib->offsets[c] = av_mallocz_array((1 << lib->bits[c]) + 1, sizeof(**lib->offsets));
+        lib->ids[c]     = av_malloc_array(FFMAX(lib->nb, 1), sizeof(**lib->ids));
+        if (!lib->offsets[c] || !lib->ids[c])
+        {
+            av_free(pos);
+            return AVERROR(ENOMEM);
+        }
+        for (i = 0; i < lib->nb; i++)
+        {
+            lib->offsets[c][mih_key(lib, c, lib->hash[i]) + 1]++;
+        }
+        for (k = 0; k < 1 << lib->bits[c]; k++)
+        {
+            lib->offsets[c][k + 1] += lib->offsets[c][k];
+            pos[k] = lib->offsets[c][k];
+        }
+        for (i = 0; i < lib->nb; i++)
+        {
+            lib->ids[c][pos[mih_key(lib, c, lib->hash[i])]++] = i;
+        }
+    }
+    av_free(pos);
+    return 0;
+}
+
+/**
+ * @brief 批量匹配：list 中每行一个指纹序列文件。对每个文件的每个哈希，在 nb_chunks 张表中探测与对应段的距离
+ * 不超过 match_distance / nb_chunks 的所有桶，验证完整的汉明距离，统计它在其他文件中命中的哈希个数，
+ * 命中不少于 match_min 个的文件对打印为近似重复。每对文件只在序号较小的一方处理一次
+ */
+static int run_match(const char *list)
+{
+    FpLibrary lib = { 0 };
+    char line[4096];
+    FILE *f;
+    uint32_t *masks = NULL;
+    int64_t *seen = NULL, *file_seen = NULL, *hits = NULL;
+    int *touched = NULL;
+    int nb_masks = 0, nb_touched, nb_pairs = 0, radius;
+    int64_t t_start = av_gettime_relative(), t_index, nb_probes = 0, nb_candidates = 0;
+    int64_t i, j, k, first;
+    int ret = 0, c, m, g;
+    uint32_t key;
+    uint64_t h;
+
+    f = fopen(list, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", list, strerror(errno));
+        return AVERROR(errno);
+    }
+    while (ret >= 0 && fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] && line[0] != '#')
+        {
+            ret = load_fingerprint(&lib, line);
+        }
+    }
+    fclose(f);
+    if (ret < 0 || (ret = build_index(&lib)) < 0)
+    {
+        goto end;
+    }
+    t_index = av_gettime_relative();
+
+    radius = match_distance / lib.nb_chunks;
+    if (radius > MIH_MAX_RADIUS)
+    {
+        fprintf(stderr, "-distance must be at most %d for %"PRId64" hashes (%d chunks)\n",
+                (MIH_MAX_RADIUS + 1) * lib.nb_chunks - 1, lib.nb, lib.nb_chunks);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    // 最宽的一段之内距离不超过 radius 的所有异或掩码，从小到大排列；先数个数再分配
+    for (k = 0; k < 1 << lib.bits[0]; k++)
+    {
+        nb_masks += av_popcount(k) <= radius;
+    }
+    masks     = av_malloc_array(nb_masks, sizeof(*masks));
+    seen      = av_malloc_array(FFMAX(lib.nb, 1), sizeof(*seen));
+    file_seen = av_malloc_array(FFMAX(lib.nb_files, 1), sizeof(*file_seen));
+    hits      = av_mallocz_array(FFMAX(lib.nb_files, 1), sizeof(*hits));
+    touched   = av_malloc_array(FFMAX(lib.nb_files, 1), sizeof(*touched));
+    if (!masks || !seen || !file_seen || !hits || !touched)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (k = 0, m = 0; k < 1 << lib.bits[0]; k++)
+    {
+        if (av_popcount(k) <= radius)
+        {
+            masks[m++] = k;
+        }
+    }
+    for (i = 0; i < lib.nb; i++)
+    {
+        seen[i] = -1;
+    }
+    for (g = 0; g < lib.nb_files; g++)
+    {
+        file_seen[g] = -1;
+    }
+
+    for (first = 0; first < lib.nb; first = i)
+    {
+        nb_touched = 0;
+        for (i = first; i < lib.nb && lib.file[i] == lib.file[first]; i++)
+        {
+            h = lib.hash[i];
+            for (c = 0; c < lib.nb_chunks; c++)
+            {
+                key = mih_key(&lib, c, h);
+                // 窄一位的段只用不超出它的位数的掩码
+                for (m = 0; m < nb_masks && masks[m] >> lib.bits[c] == 0; m++)
+                {
+                    k = key ^ masks[m];
+                    nb_probes++;
+                    for (j = lib.offsets[c][k]; j < lib.offsets[c][k + 1]; j++)
+                    {
+                        int64_t id = lib.ids[c][j];
+
+                        // 同一个候选可能在几段中都命中，只验证一次
+                        g = lib.file[id];
+                        if (g <= lib.file[i] || seen[id] == i)
+                        {
+                            continue;
+                        }
+                        seen[id] = i;
+                        nb_candidates++;
+                        if (av_popcount64(h ^ lib.hash[id]) > match_distance || file_seen[g] == i)
+                        {
+                            continue;
+                        }
+                        file_seen[g] = i;
+                        if (!hits[g]++)
+                        {
+                            touched[nb_touched++] = g;
+                        }
+                    }
+                }
+            }
+        }
+
+        for (k = 0; k < nb_touched; k++)
+        {
+            g = touched[k];
+            if (hits[g] >= match_min)
+            {
+                printf("match %s %s: %"PRId64" of %"PRId64" hashes\n", lib.names[lib.file[first]], lib.names[g],
+                       hits[g], i - first);
+                nb_pairs++;
+            }
+            hits[g] = 0;
+        }
+    }
+
+    fprintf(stderr, "match: %"PRId64" hashes in %d files, %d chunks of %d-%d bits, index %.1f ms, "
+            "%"PRId64" bucket probes, %"PRId64" candidates verified, %d near-duplicate pairs, %.1f ms\n",
+            lib.nb, lib.nb_files, lib.nb_chunks, lib.bits[lib.nb_chunks - 1], lib.bits[0],
+            (t_index - t_start) / 1000.0, nb_probes, nb_candidates, nb_pairs,
+            (av_gettime_relative() - t_start) / 1000.0);
+
+end:
+    for (g = 0; g < lib.nb_files; g++)
+    {
+        av_free(lib.names[g]);
+    }
+    for (c = 0; c < MIH_MAX_CHUNKS; c++)
+    {
+        av_free(lib.offsets[c]);
+        av_free(lib.ids[c]);
+    }
+    av_free(lib.names);
+    av_free(lib.hash);
+    av_free(lib.file);
+    av_free(masks);
+    av_free(seen);
+    av_free(file_seen);
+    av_free(hits);
+    av_free(touched);
+    return ret;
+}
+
+
+
+
 
 int main(int argc, char **argv)
 {
     AVFormatContext *fmt_ctx = NULL;
     AVDictionaryEntry *tag = NULL;
-    int ret;
+    const char *fp_output = NULL;
+    int i, ret;
 
-    if (argc != 2) {
-        printf("usage: %s <input_file>\n"
+    if (argc < 2) {
+        printf("usage: %s <input_file> [-fingerprint out.fp] [-interval seconds]\n"
+               "       %s -match list_file [-distance d] [-min_matches n]\n"
                "example program to demonstrate the use of the libavformat metadata API.\n"
-               "\n", argv[0]);
+               "-fingerprint writes a 64-bit DCT pHash of the main video stream's keyframes, at most one\n"
+               "every -interval seconds (default 1), to out.fp ('-' for stdout).\n"
+               "-match reads the fingerprint files listed in list_file (one per line) and prints every pair of\n"
+               "inputs sharing at least -min_matches (default 3) hashes within Hamming distance -distance (default 8).\n"
+               "\n", argv[0], argv[0]);
         return 1;
     }
 
+    // 批量匹配只读指纹文件，不打开任何媒体文件
+    if (!strcmp(argv[1], "-match")) {
+        if (argc < 3) {
+            fprintf(stderr, "-match needs a list file\n");
+            return 1;
+        }
+        for (i = 3; i + 1 < argc; i += 2) {
+            if (!strcmp(argv[i], "-distance")) {
+                match_distance = atoi(argv[i + 1]);
+            } else if (!strcmp(argv[i], "-min_matches")) {
+                match_min = atoi(argv[i + 1]);
+            } else {
+                fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+        // 上限取决于库的大小（段数），读入指纹之后在 run_match 中检查
+        if (match_distance < 0) {
+            fprintf(stderr, "-distance must not be negative\n");
+            return 1;
+        }
+        if (match_min <= 0) {
+            fprintf(stderr, "-min_matches must be positive\n");
+            return 1;
+        }
+        return run_match(argv[2]) < 0;
+    }
+
+    for (i = 2; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-fingerprint")) {
+            fp_output = argv[i + 1];
+        } else if (!strcmp(argv[i], "-interval")) {
+            fp_interval = atof(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
     if ((ret = avformat_open_input(&fmt_ctx, argv[1], NULL, NULL)))
         return ret;
 
@@ -52,8 +791,16 @@ int main(int argc, char **argv)
         return ret;
     }
 
-    while ((tag = av_dict_get(fmt_ctx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX)))
-        printf("%s=%s\n", tag->key, tag->value);
+    // 写指纹到 stdout 时不打印元数据，输出只有指纹序列
+    if (!fp_output || strcmp(fp_output, "-"))
+        while ((tag = av_dict_get(fmt_ctx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX)))
+            printf("%s=%s\n", tag->key, tag->value);
+
+    // 指纹在同一个已经打开的输入上生成
+    if (fp_output && (ret = write_fingerprint(fmt_ctx, argv[1], fp_output)) < 0) {
+        avformat_close_input(&fmt_ctx);
+        return 1;
+    }
 
     avformat_close_input(&fmt_ctx);
     return 0;
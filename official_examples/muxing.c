@@ -29,26 +29,145 @@
  * @example muxing.c
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE                              /* fallocate() */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <limits.h>
+#if HAVE_LIBURING
+#include <liburing.h>                           /* 共享 I/O 引擎的 io_uring 实现（-io_engine uring） */
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <libavutil/avassert.h>
 #include <libavutil/channel_layout.h>            /* 包含了有关音频通道布局的信息 */
 #include <libavutil/opt.h>                       /* 用于处理 FFmpeg 中的选项，这些选项用于配置不同编码器和过滤器的参数 */
 #include <libavutil/mathematics.h>               /* 包含了一些数学函数和常量，用于进行时间码、时间戳等计算 */
 #include <libavutil/timestamp.h>                 /* 提供了一些处理时间戳的函数，这在音视频处理中非常重要，用于确定帧的时间顺序和持续时间等信息 */
+#include <libavutil/time.h>                      /* 提供 av_gettime_relative 等计时函数，用于统计各阶段耗时 */
+#include <libavutil/fifo.h>                      /* 提供 AVFifoBuffer，用于在线程之间传递数据包 */
+#include <libavutil/audio_fifo.h>                /* 提供 AVAudioFifo，响度表用它缓存待测量的样本 */
+#include <libavutil/avstring.h>                  /* 提供 av_strstart、av_strlcpy 等字符串函数 */
+#include <libavutil/hash.h>                      /* 提供 MD5 等哈希算法，用于计算输出内容的哈希 */
+#include <libavutil/crc.h>                       /* 提供 av_crc，用于条码的校验 */
+#include <libavutil/intreadwrite.h>              /* 提供 AV_WL32 等按固定字节序读写整数的宏 */
+#include <libavutil/cpu.h>                       /* 提供 av_get_cpu_flags，用于在运行时选择硬件加速的实现 */
+#include <libavutil/imgutils.h>                  /* 提供 av_image_get_buffer_size，用于计算图像占用的内存 */
 #include <libavcodec/avcodec.h>                  /* 包含了音视频编解码器的定义和函数，允许你进行音视频编码和解码操作 */
 #include <libavformat/avformat.h>                /* 包含了多种媒体格式的定义和函数，用于音视频文件的读取和写入 */
 #include <libswscale/swscale.h>                  /* 提供了图像缩放和转换的功能，用于处理视频帧的大小和格式 */
 #include <libswresample/swresample.h>            /* 用于音频重采样的功能，允许你改变音频的采样率和通道数 */
 
+#include "sample_convert.h"                      /* 把各种采样格式的样本转换成 float，与 avsync_detect 共用 */
+
 #define STREAM_DURATION   10.0                   /* 视频流的持续时间（单位：秒） */
 #define STREAM_FRAME_RATE 25                     /* 视频流的帧率（每秒帧数）*/
 #define STREAM_PIX_FMT    AV_PIX_FMT_YUV420P     /* 默认视频像素格式 */
 #define SCALE_FLAGS SWS_BICUBIC                  /* 视频像素格式转换的标志，*/
+#define FRAME_CACHE_PERIOD 256                   /* fill_yuv_image 生成的测试图像的周期（帧数） */
+#define MAX_STORE_STREAMS 2                      /* 数据包仓库支持的流个数（一路视频 + 一路音频） */
+#define BARCODE_CELL 8                           /* 条码每一位是一个与编码块对齐的 8x8 亮度块 */
+#define BARCODE_COLS 32                          /* 条码每行的位数，条码共 BARCODE_ROWS 行、128 位 */
+#define BARCODE_ROWS 4
+#define BARCODE_MAGIC 0xB4C0                     /* 条码的前 16 位，用于识别条码 */
+#define SYNC_TONE_HZ 1000                        /* 音画同步测试模式中短音的频率 */
+
+/* 运行选项，由命令行中 "-name value" 形式的参数设置 */
+static int async_drain = 0;                      /* 1: 流结束时在独立线程中冲刷（drain）编码器 */
+static int reserve_moov = 0;                     /* 1: MP4/MOV 在文件头预留 moov 空间，结束时原地写入 */
+static int log_packets = 1;                      /* 0: 不打印每个数据包的信息（输出到 stdout 时自动关闭） */
+static int deterministic = 0;                    /* 1: 可复现模式，单线程、bitexact，并计算数据包哈希 */
+static int frame_cache = 0;                      /* 大于 0 时预先渲染这么多帧视频，编码时只交出引用 */
+static int replay_loops = 0;                     /* 大于 0 时只编码一次，把数据包存入内存，再回放这么多轮给复用器 */
+static int replay_outputs = 1;                   /* 回放时同时写出的输出文件个数，文件名中的 %d 替换为序号 */
+static int barcode = 0;                          /* 1: 在每帧视频的左上角打上记录 next_pts 和发送时间的亮度条码 */
+static double sync_period = 0;                   /* 大于 0 时为音画同步测试模式：每隔这么多秒视频闪白一帧，音频同时响一段短音 */
+static int loudness = 0;                         /* 1: 在独立线程中测量送入编码器的音频的 EBU R128 响度；2: 同时每秒打印一次 */
+
+/* 输出目标（-sink）：写文件，或者用于分离编码、复用和文件系统开销的几种不落盘的输出 */
+enum {
+    SINK_FILE,                                   /* 写到输出文件（默认） */
+    SINK_NULL,                                   /* 数据包编码后直接丢弃，不经过复用器 */
+    SINK_MEM,                                    /* 复用到内存中的动态缓冲区（avio_open_dyn_buf） */
+    SINK_COUNT,                                  /* 复用后只统计字节数，不保存数据 */
+};
+static int output_sink = SINK_FILE;
+
+/* 分层耗时（微秒）：编码器、复用器、I/O（写系统调用、seek 以及等待下游的阻塞时间）。
+ * 按线程统计，多会话模式下每个工作线程累加自己的部分，主线程打印的就是主线程的耗时 */
+static _Thread_local int64_t encode_time = 0, mux_time = 0, io_time = 0;
+
+/* 多会话模式（-sessions）：会话个数、工作线程个数，以及所有会话排队等待写出的数据的内存上限 */
+static int nb_sessions = 0;
+static int nb_workers = 0;                       /* 0 表示使用 CPU 个数 */
+static int64_t session_mem_budget = 64 << 20;
+
+/* 图像序列模式（-image_seq）：每帧编码成一个文件，与多会话模式共用 nb_workers 个工作线程 */
+static int image_seq = 0;
+
+/* 剪辑模式（-clip_input）：输入文件，以及剪辑范围的起点和终点（秒，相对文件开头），clip_end 小于 0 表示到文件结尾 */
+static const char *clip_input = NULL;
+static double clip_start = 0;
+static double clip_end = -1;
+/* 剪辑模式：写完后把输出解码一遍（-clip_verify），检查视频帧数和解码错误 */
+static int clip_verify = 0;
+
+/* 拼接模式（-concat）：输入列表文件，以及预读线程最多提前打开的输入个数 */
+static const char *concat_list = NULL;
+static int concat_prefetch = 2;
+
+/* 质量检查（-qc）：事件文件，以及写出的黑场、静帧、静音区间的最短持续时间（秒） */
+static const char *qc_name = NULL;
+static double qc_min_duration = 2.0;
+
+/* 确定性模式下所有写入复用器的数据包的哈希 */
+static struct AVHashContext *packet_hash = NULL;
+
+/* 完整性清单（-manifest）：每个数据包一行，记录流索引、pts、dts、大小，以及复用器为它写出的字节的偏移和 CRC32C */
+static FILE *manifest = NULL;
+
+/* 冲刷线程与主线程之间共享的锁和条件变量，保护所有流的 drain_fifo 和 drain_done */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  drain_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief 音频信号生成器在某一帧开始时的状态，与编码器无关，用于从检查点恢复
+ */
+typedef struct GeneratorState {
+    // 这一帧在编码器时间基准下的 pts
+    int64_t pts;
+    // 生成这一帧之前的 next_pts 和 samples_count
+    int64_t next_pts;
+    int samples_count;
+    // 生成这一帧之前的正弦波相位和频率增量
+    float t, tincr;
+} GeneratorState;
 
+/* 保留的音频帧状态个数，需要覆盖编码器内部缓冲的帧以及一个 GOP 内的音频帧 */
+#define GENERATOR_HISTORY 256
 
 /**
  * @brief 这是一个封装输出 AVStream 的结构体，用于存储编码器相关的信息，以及当前帧的时间戳
@@ -80,9 +199,101 @@ typedef struct OutputStream {
     struct SwsContext *sws_ctx;
     // 指向 SwsContext 结构体的指针，表示用于"音频帧重采样"的上下文
     struct SwrContext *swr_ctx;
+
+    // 已送入编码器的帧数，用于统计稳态吞吐量
+    int64_t nb_frames;
+
+    // 帧缓存（-frame_cache）：预先渲染并转换好的只读帧，第 n 帧使用 cache[n % nb_cache] 的引用
+    AVFrame **cache;
+    int nb_cache;
+
+    // 时间戳快速路径：STREAM_DURATION 换算到编码器时间基准后向下取整，
+    // next_pts > end_pts 与 av_compare_ts(next_pts, time_base, STREAM_DURATION, 1/1) > 0 完全等价
+    int64_t end_pts;
+    // 编码器时间基准为 1/sample_rate，samples_count 可以直接作为 pts
+    int samples_pts;
+    // 调度时钟：next_pts * clock_scale 是公共时间基准下的时间，0 表示无法精确换算，退回 av_compare_ts
+    int64_t clock_scale;
+
+    // 异步冲刷相关：冲刷线程、线程产出但尚未写入文件的数据包队列（元素为 AVPacket *）
+    pthread_t drain_thread;
+    AVFifoBuffer *drain_fifo;
+    // 冲刷线程是否已启动、是否已结束、是否已被 join
+    int draining, drain_done, drain_joined;
+    // 冲刷开始和结束的时间（微秒），用于统计尾部耗时
+    int64_t drain_start, drain_end;
+
+    // 已交给复用器的最后一个数据包的结束时间（编码器时间基准）
+    int64_t written_end;
+    // 编码器已经冲刷完毕，所有数据包都已交给复用器
+    int eof;
+    // 剪辑模式：重新编码的数据包的 dts 要减去的量（编码器时间基准），与拷贝的带 B 帧的 GOP 衔接时 dts 保持递增；其他情况下为 0
+    int64_t dts_shift;
+    // 剪辑模式：源码流是 avcC/hvcC 格式时 NAL 长度字段的字节数，编码器输出的 Annex B 数据包写出前改写成长度前缀；其他情况下为 0
+    int nal_length_size;
+    // 检查点：最近生成的若干音频帧开始时的生成器状态，恢复时从已写出内容的结束位置找回对应的状态
+    GeneratorState history[GENERATOR_HISTORY];
+    int nb_history;
 } OutputStream;
 
 
+/**
+ * @brief 检查点（-checkpoint）。长时间编码时在 GOP 边界把与编码器无关的状态（next_pts、
+ * samples_count、生成器相位、已写出的字节数）保存到文件，崩溃后重新运行会截断输出到最后一个
+ * 检查点并从那里继续，最多重做一个检查点间隔的工作
+ */
+typedef struct Checkpoint {
+    // 检查点文件名，NULL 表示未启用
+    const char *filename;
+    // 每隔多少个 GOP 保存一次
+    int gops;
+    OutputStream *video, *audio;
+    // 输出层，保存检查点前需要把它缓冲的数据写到文件
+    struct OutputIO *io;
+    // 本次运行开始写入时文件中已有的字节数（恢复时不为 0）
+    int64_t base_offset;
+    // 下一个检查点所在的视频关键帧 pts 不早于这个值（编码器时间基准）
+    int64_t next_pts;
+    int64_t nb_saved;
+} Checkpoint;
+
+static Checkpoint checkpoint = { 0 };
+
+/**
+ * @brief 数据包仓库中一个数据包的时间信息，负载保存在 arena 中 offset 处
+ */
+typedef struct StoredPacket {
+    int64_t pts, dts, duration;
+    int64_t offset;
+    int size;
+    int stream_index;
+    int flags;
+} StoredPacket;
+
+/**
+ * @brief 数据包仓库（-replay_loops）。编码时所有数据包的负载依次追加到一块连续的 arena 中，
+ * 每个负载后面跟着 AV_INPUT_BUFFER_PADDING_SIZE 个 0；编码结束后 arena 被包装成一个 AVBufferRef，
+ * 回放时每个数据包只是引用 arena 中的一段，不再复制负载
+ */
+typedef struct PacketStore {
+    uint8_t *arena;
+    size_t arena_len, arena_size;
+    AVBufferRef *buf;
+
+    StoredPacket *packets;
+    int nb_packets, packets_size;
+
+    // 每个流的 dts 最小值（不大于 0，有 B 帧时为负）和 pts/dts + duration 的最大值，
+    // 单位为流的时间基准，用于计算回放一轮的时长
+    int64_t start[MAX_STORE_STREAMS], end[MAX_STORE_STREAMS];
+} PacketStore;
+
+static PacketStore packet_store = { 0 };
+
+static int write_checkpoint(AVFormatContext *oc, int64_t key_pts);
+static void manifest_add_segment(int stream_index, int64_t pts, int64_t dts, int size, int64_t end);
+
+
 
 
 
@@ -111,6 +322,11 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
     // 可能使用不同的时间基准，因此在处理多媒体数据时需要注意时间基准的匹配和转换。
     AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
 
+    if (!log_packets)
+    {
+        return;
+    }
+
     // pts: 音视频包的显示时间戳
     // pts_time: 以可读的格式显示音视频包的显示时间戳
     // dts: 音视频包的解码时间戳
@@ -130,628 +346,721 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt)
 
 
 /**
- * @brief 这段代码是一个用于编码并写入帧数据到媒体文件的函数，它通常在音视频
- * 处理中用于将帧数据经过编码后写入媒体文件。
- * @param fmt_ctx 指向音视频格式上下文的常量指针，包含了音视频文件的相关信息，如编解码器、流信息
- * @param c 指向音视频编码器上下文的指针，表示与输出流相关联的编码器的参数和状态
- * @param st 指向输出流的指针，表示输出流的相关信息，包括流的编解码参数和时间基准等
- * @param frame 指向输入帧的指针，表示待编码的原始帧数据
- * @param pkt 指向输出数据包的指针，用于存储编码后的数据包
- * @return int 
+ * @brief 查表法计算 CRC32C（Castagnoli，多项式 0x82F63B78），在没有硬件指令时使用
  */
-static int write_frame(AVFormatContext *fmt_ctx,
-                       AVCodecContext *c,
-                       AVStream *st,
-                       AVFrame *frame,
-                       AVPacket *pkt)
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_update_c(uint32_t crc, const uint8_t *buf, size_t len)
 {
-    int ret;
+    while (len--)
+    {
+        crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
 
-    // 将输入帧 frame 发送到编码器 c 进行编码。avcodec_send_frame 函数会将帧数据传递给编码器，但不会立即产生输出数据
-    ret = avcodec_send_frame(c, frame);
-    if (ret < 0) {
-        fprintf(stderr, "Error sending a frame to the encoder: %s\n",
-                av_err2str(ret));
-        exit(1);
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief 使用 SSE4.2 的 crc32 指令计算 CRC32C，每条指令处理 8（32 位系统为 4）个字节
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint32_t v32;
+#if defined(__x86_64__)
+    uint64_t v64;
+
+    while (len >= 8)
+    {
+        memcpy(&v64, buf, 8);
+        crc  = (uint32_t)_mm_crc32_u64(crc, v64);
+        buf += 8;
+        len -= 8;
+    }
+#endif
+    while (len >= 4)
+    {
+        memcpy(&v32, buf, 4);
+        crc  = _mm_crc32_u32(crc, v32);
+        buf += 4;
+        len -= 4;
+    }
+    while (len--)
+    {
+        crc = _mm_crc32_u8(crc, *buf++);
     }
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+/**
+ * @brief 使用 ARMv8 CRC 扩展指令计算 CRC32C
+ */
+static uint32_t crc32c_update_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t v64;
 
-    while (ret >= 0)
+    while (len >= 8)
     {
-        // 在一个循环中，这行代码尝试从编码器 c 获取编码后的数据包，并将器存储在 pkt 中。如果返回 AVERROR(EAGAIN），表示
-        // 编码器需要更多的输入数据；如果返回 AVERROR_EOF，表示编码器已经完成编码；如果返回负数，表示编码出现错误。
-        ret = avcodec_receive_packet(c, pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-        {
-            break;
-        }
-        else if (ret < 0)
-        {
-            fprintf(stderr, "Error encoding a frame: %s\n", av_err2str(ret));
-            exit(1);
-        }
+        memcpy(&v64, buf, 8);
+        crc  = __crc32cd(crc, v64);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = __crc32cb(crc, *buf++);
+    }
+    return crc;
+}
+#endif
 
-        // 这一行代码将输出数据包的时间戳从编码器时间基准（c->time_base）重新映射到输出流的时间基准（st->time_base）, 这是为了
-        // 确保输出的时间戳与输出流的时间戳基准相匹配
-        av_packet_rescale_ts(pkt, c->time_base, st->time_base);
-        // 设置输出数据包的流索引，以指示数据包属于哪个输出流
-        pkt->stream_index = st->index;
+/* 当前 CPU 上最快的 CRC32C 实现，由 crc32c_init 选择 */
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *buf, size_t len) = crc32c_update_c;
 
-        log_packet(fmt_ctx, pkt);
-        // 这一行代码将编辑后的的数据包写入到媒体文件当中。fmt_ctx 是表示媒体文件格式的上下文，pkt 包含了编码后的数据。函数会将
-        // 数据包写入媒体文件，并自动处理时间戳和媒体文件的格式
-        ret = av_interleaved_write_frame(fmt_ctx, pkt);
-        /* pkt is now blank (av_interleaved_write_frame() takes ownership of
-         * its contents and resets pkt), so that no unreferencing is necessary.
-         * This would be different if one used av_write_frame(). */
-        if (ret < 0) {
-            fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(ret));
-            exit(1);
+/**
+ * @brief 生成查表法使用的表，并根据 CPU 能力选择 CRC32C 的实现
+ */
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
         }
+        crc32c_table[i] = crc;
     }
 
-    return ret == AVERROR_EOF ? 1 : 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE42)
+    {
+        crc32c_update = crc32c_update_sse42;
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_update = crc32c_update_armv8;
+#endif
 }
 
 
 
 
 
+
 /**
- * @brief 用于向输出文件中添加一个输出流，并初始化相关的编码器参数
- * 这个函数的主要目的是为输出流配置编码器参数，并将其添加到输出媒体文件的格式上下文中，以便后续可以使用这些配置来编码和写入音视频
- * 数据。函数根据流的类型（音频或者视频）和选择的编码器类型来设置参数，以确保输出流的数据按照所需的方式编码和写入到媒体文件中。
- * @param ost 指向自定义的 OutputStream 结构体的指针用于表示输出流的相关信息，如编码器上下文，帧数据等。
- * @param oc 指向输出媒体文件的格式上下文的指针，用于表示输出文件的信息，如文件格式、流信息等。
- * @param codec 指向编码器指针的指针，用于存储找到的编码器
- * @param codec_id 一个枚举值，表示要使用的编码器的标识符
+ * @brief 把数据包的流索引、时间戳、标志和内容加入 packet_hash。数值字段按固定的小端序列化，
+ * 保证不同平台上得到相同的哈希
  */
-static void add_stream(OutputStream *ost,
-                       AVFormatContext *oc,
-                       const AVCodec **codec,
-                       enum AVCodecID codec_id)
+static void update_packet_hash(const AVPacket *pkt)
 {
-    AVCodecContext *c;
-    int i;
+    uint8_t header[36];
+
+    AV_WL32(header,      pkt->stream_index);
+    AV_WL64(header + 4,  pkt->pts);
+    AV_WL64(header + 12, pkt->dts);
+    AV_WL64(header + 20, pkt->duration);
+    AV_WL32(header + 28, pkt->flags);
+    AV_WL32(header + 32, pkt->size);
+    av_hash_update(packet_hash, header, sizeof(header));
+    av_hash_update(packet_hash, pkt->data, pkt->size);
+}
 
-    // 根据给定的编码器标识符查找对应的编码器，并将其复制给 *codec 指针
-    *codec = avcodec_find_encoder(codec_id);
-    if (!(*codec))
+
+
+
+
+/**
+ * @brief 把一个数据包的负载复制到数据包仓库的 arena 中，并记录它的时间信息
+ * @return 0 表示成功，负数表示错误码
+ */
+static int packet_store_add(PacketStore *ps, const AVPacket *pkt)
+{
+    size_t need = ps->arena_len + pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+    StoredPacket *sp;
+    int64_t end;
+
+    if (pkt->stream_index >= MAX_STORE_STREAMS)
     {
-        fprintf(stderr, "Could not find encoder for '%s'\n",
-                avcodec_get_name(codec_id));
-        exit(1);
+        return AVERROR(EINVAL);
     }
 
-    // 分配一个用于临时存储数据包的内存，并将其复制给 ost->tmp_pkt，这个数据包用于暂时存储编码后的数据
-    ost->tmp_pkt = av_packet_alloc();
-    if (!ost->tmp_pkt) {
-        fprintf(stderr, "Could not allocate AVPacket\n");
-        exit(1);
-    }
+    if (need > ps->arena_size)
+    {
+        size_t size = FFMAX(need, ps->arena_size * 2);
+        uint8_t *arena = av_realloc(ps->arena, size);
 
-    // 创建一个新的输出流并将其赋值给 ost->st, 这个新的输出流会添加到输出文件的格式上下文 oc 中。如果创建失败，会打印错误消息
-    // 并终止程序
-    ost->st = avformat_new_stream(oc, NULL);
-    if (!ost->st) {
-        fprintf(stderr, "Could not allocate stream\n");
-        exit(1);
+        if (!arena)
+        {
+            return AVERROR(ENOMEM);
+        }
+        ps->arena      = arena;
+        ps->arena_size = size;
     }
+    if (ps->nb_packets == ps->packets_size)
+    {
+        int size = ps->packets_size ? ps->packets_size * 2 : 4096;
+        StoredPacket *packets = av_realloc_array(ps->packets, size, sizeof(*packets));
 
-    // 设置新创建的输出流的标识符，通常用于标识不同的流
-    ost->st->id = oc->nb_streams - 1;
-    // 为找到的编码器分配一个编码器上下文，并将其赋值给 ost->enc。编码器上下文包含了编码器的配置参数。
-    c = avcodec_alloc_context3(*codec);
-    if (!c) {
-        fprintf(stderr, "Could not alloc an encoding context\n");
-        exit(1);
+        if (!packets)
+        {
+            return AVERROR(ENOMEM);
+        }
+        ps->packets      = packets;
+        ps->packets_size = size;
     }
-    ost->enc = c;
 
-    // 根据编码器类型（音频或视频），来设置编码器参数，包括采样率、位率、分辨率、时间基准等
-    // 1. 对于音频流，设置了音频编码参数，如采样格式、采样率、位率、声道、布局等
-    // 2. 对于视频流，设置了视频编码参数，如位率、分辨率、帧率、像素格式等。
-    // 这些参数会根据具体的编码器类型和需求设置
-    switch ((*codec)->type) {
-        case AVMEDIA_TYPE_AUDIO:
-        {
-            c->sample_fmt  = (*codec)->sample_fmts ? (*codec)->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
-            c->bit_rate    = 64000;
-            c->sample_rate = 44100;
-            if ((*codec)->supported_samplerates)
-            {
-                c->sample_rate = (*codec)->supported_samplerates[0];
-                for (i = 0; (*codec)->supported_samplerates[i]; i++)
-                {
-                    if ((*codec)->supported_samplerates[i] == 44100)
-                    {
-                        c->sample_rate = 44100;
-                    }
+    memcpy(ps->arena + ps->arena_len, pkt->data, pkt->size);
+    memset(ps->arena + ps->arena_len + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
 
-                }
-            }
-            c->channels       = av_get_channel_layout_nb_channels(c->channel_layout);
-            c->channel_layout = AV_CH_LAYOUT_STEREO;
-            if ((*codec)->channel_layouts)
-            {
-                c->channel_layout = (*codec)->channel_layouts[0];
-                for (i = 0; (*codec)->channel_layouts[i]; i++)
-                {
-                    if ((*codec)->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
-                    {
-                        c->channel_layout = AV_CH_LAYOUT_STEREO;
-                    }
-                }
-            }
-            c->channels        = av_get_channel_layout_nb_channels(c->channel_layout);
-            ost->st->time_base = (AVRational){ 1, c->sample_rate };
-            break;
-        }
-        case AVMEDIA_TYPE_VIDEO:
-        {
-            c->codec_id = codec_id;
+    sp = &ps->packets[ps->nb_packets];
+    sp->pts          = pkt->pts;
+    sp->dts          = pkt->dts;
+    sp->duration     = pkt->duration;
+    sp->offset       = ps->arena_len;
+    sp->size         = pkt->size;
+    sp->stream_index = pkt->stream_index;
+    sp->flags        = pkt->flags;
 
-            c->bit_rate = 400000;
-            /* Resolution must be a multiple of two. */
-            c->width    = 352;
-            c->height   = 288;
-            /* timebase: This is the fundamental unit of time (in seconds) in terms
-             * of which frame timestamps are represented. For fixed-fps content,
-             * timebase should be 1/framerate and timestamp increments should be
-             * identical to 1. */
-            ost->st->time_base = (AVRational){ 1, STREAM_FRAME_RATE };
-            c->time_base       = ost->st->time_base;
+    end = FFMAX(pkt->pts, pkt->dts) + pkt->duration;
+    ps->start[pkt->stream_index] = FFMIN(ps->start[pkt->stream_index], pkt->dts);
+    ps->end[pkt->stream_index] = FFMAX(ps->end[pkt->stream_index], end);
 
-            c->gop_size      = 12; /* emit one intra frame every twelve frames at most */
-            c->pix_fmt       = STREAM_PIX_FMT;
-            if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
-                /* just for testing, we also add B-frames */
-                c->max_b_frames = 2;
-            }
-            if (c->codec_id == AV_CODEC_ID_MPEG1VIDEO) {
-                /* Needed to avoid using macroblocks in which some coeffs overflow.
-                 * This does not happen with normal video, it just happens here as
-                 * the motion of the chroma plane does not match the luma plane. */
-                c->mb_decision = 2;
-            }
-            break;
-        }
-        default:
-            break;
-    }
+    ps->nb_packets++;
+    ps->arena_len = need;
 
-    // 检查输出文件格式的标志位，如果需要在全局添加流头信息，则将编码器上下文的标志 AV_CODEC_FLAG_GLOBAL_HEADER
-    // 设置为相应的值，这是一种格式要求，在某些情况下，流头信息需要被单独添加到输出流文件。
-    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-    {
-        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    }
+    return 0;
 }
 
 
 
 
 
-
 /**
- * @brief 用于分配并配置一个音频帧。音频帧通常用于存储音频数据，以便后续进行编码、解码或处理。
- * 这个函数的主要作用是创建一个音频帧并为其设置相关属性，以便在处理音频数据时可以有效的使用它。
- * 通常，它用于音频解码或编码过程中，以便准备好的音频数据可以被编码器或解码器使用。
- * @param sample_fmt 一个枚举值，表示音频样本的格式，例如 "AV_SAMPLE_FMT_FLTP" 表示浮点数样本。
- * @param channel_layout 一个表示音频通道布局的整数值，例如 "AV_CH_LAYOUT_STEREO" 表示立体声通道布局。
- * @param sample_rate 音频采样率，表示每秒采集的音频样本数量。
- * @param nb_samples 音频中包含的音频样本数量
- * */
-static AVFrame *alloc_audio_frame(enum AVSampleFormat sample_fmt,
-                                  uint64_t channel_layout,
-                                  int sample_rate,
-                                  int nb_samples)
+ * @brief 把一个已经设置好流索引和时间戳的数据包写入媒体文件，所有写入复用器的数据包都经过这里
+ * @param fmt_ctx 输出媒体文件的格式上下文
+ * @param pkt 待写入的数据包，写入后被清空
+ */
+static void write_packet(AVFormatContext *fmt_ctx, AVPacket *pkt)
 {
-    // 分配一个新的音频帧，音频帧用于存储音频数据
-    AVFrame *frame = av_frame_alloc();
-    int ret;
+    int64_t t0, pts, dts;
+    int ret, stream_index, size;
 
-    if (!frame)
+    log_packet(fmt_ctx, pkt);
+
+    // 确定性模式下，按写入顺序对数据包的内容和时间信息计算哈希，用于和基准（golden）运行比较
+    if (packet_hash)
     {
-        fprintf(stderr, "Error allocating an audio frame\n");
-        exit(1);
+        update_packet_hash(pkt);
     }
 
-    // 设置音频样本的格式
-    frame->format = sample_fmt;
-    // 设置音频通道布局
-    frame->channel_layout = channel_layout;
-    // 设置音频采样率
-    frame->sample_rate = sample_rate;
-    // 设置音频帧中包含的音频样本数量
-    frame->nb_samples = nb_samples;
-
-    if (nb_samples)
+    // 回放模式：编码阶段只把数据包存进内存，编码结束后再回放给复用器
+    if (replay_loops)
     {
-        // 分配音频缓冲区，用于存储音频样本数据
-        ret = av_frame_get_buffer(frame, 0);
+        ret = packet_store_add(&packet_store, pkt);
+        av_packet_unref(pkt);
         if (ret < 0)
         {
-            fprintf(stderr, "Error allocating an audio buffer\n");
+            fprintf(stderr, "Error storing a packet for replay: %s\n", av_err2str(ret));
             exit(1);
         }
+        return;
     }
 
-    return frame;
-}
-
+    // null 输出：编码的开销已经产生，数据包不再交给复用器
+    if (output_sink == SINK_NULL)
+    {
+        av_packet_unref(pkt);
+        return;
+    }
+
+    // 完整性清单：数据包交给复用器之后，pkt 会被清空，先记下它的信息
+    stream_index = pkt->stream_index;
+    pts          = pkt->pts;
+    dts          = pkt->dts;
+    size         = pkt->size;
+
+    // 这一行代码将编辑后的的数据包写入到媒体文件当中。fmt_ctx 是表示媒体文件格式的上下文，pkt 包含了编码后的数据。函数会将
+    // 数据包写入媒体文件，并自动处理时间戳和媒体文件的格式
+    t0  = av_gettime_relative();
+    ret = av_interleaved_write_frame(fmt_ctx, pkt);
+    mux_time += av_gettime_relative() - t0;
+    /* pkt is now blank (av_interleaved_write_frame() takes ownership of
+     * its contents and resets pkt), so that no unreferencing is necessary.
+     * This would be different if one used av_write_frame(). */
+    if (ret < 0) {
+        fprintf(stderr, "Error while writing output packet: %s\n", av_err2str(ret));
+        exit(1);
+    }
+
+    // 复用器处理这个数据包时写出的字节（经过比特流过滤器和封装之后）到 avio 的当前位置为止，
+    // 它们的 CRC32C 在写入路径上计算，之后可以把文件的损坏定位到具体的数据包
+    if (manifest)
+    {
+        manifest_add_segment(stream_index, pts, dts, size, avio_tell(fmt_ctx->pb));
+    }
+}
 
 
 
 
 
+/* 质量检查（-qc）的阈值：黑场为亮度均值和标准差都很低，静帧为与上一帧的平均绝对差几乎为 0，静音为整帧 RMS 低于 -60 dBFS */
+#define QC_BLACK_MEAN   32.0
+#define QC_BLACK_STDDEV 8.0
+#define QC_FREEZE_MAD   0.5
+#define QC_SILENCE_DB   -60.0
+
 /**
- * @brief 用于初始化音频编码器的相关设置和参数包括打开编码器、设
- * 置参数、创建重采样器上下文等，并将音频流编码并写入容器中
- * @param oc 表示媒体格式的上下文，通常用于表示媒体文件的格式信息和写入媒体文件
- * @param codec 表示要使用的音频编码器，指定了音频数据的编码方式
- * @param ost 表示输出流，包括音频编码器的相关设置和参数
- * @param opt_arg 用于配置音频编码器的选项参数的字典
+ * @brief 质量检查中的一种区间（黑场、静帧或静音）：连续满足条件的帧合并成一个区间，
+ * 条件不再满足时，持续时间不少于 -qc_min_duration 的区间作为一个事件写出
  */
-static void open_audio(AVFormatContext *oc,
-                       const AVCodec *codec,
-                       OutputStream *ost,
-                       AVDictionary *opt_arg)
-{
-    // 声明一个指向音频编码上下文结构体的指针
-    AVCodecContext *c;
-    // 用于存储样本数量
-    int nb_samples;
-    // 存储函数的返回值或者错误代码
-    int ret;
-    // 用于存储一些选项
-    AVDictionary *opt = NULL;
+typedef struct QcInterval {
+    const char *type;
+    int active;
+    double start, end;
+    int64_t frames;
+    // 已经写出的事件个数
+    int count;
+} QcInterval;
 
-    // 音频编码上下文
-    c = ost->enc;
+/**
+ * @brief 质量检查的状态：在 write_frame 中对送入编码器的每一帧做检测，不需要额外解码一遍输出
+ */
+typedef struct QcState {
+    FILE *out;
+    double min_duration;
+    QcInterval black, freeze, silence;
+    int video_index, audio_index;
+    // 上一帧视频的亮度平面（紧凑存放），用于静帧检测
+    uint8_t *prev;
+    int prev_w, prev_h;
+    // 检测的总耗时（微秒）
+    int64_t time;
+} QcState;
+
+static QcState qc;
 
-    // 拷贝传入的字典
-    av_dict_copy(&opt, opt_arg, 0);
-    // 打开音频编码器，并将选项 opt 应用于它
-    ret = avcodec_open2(c, codec, &opt);
-    // 释放字典
-    av_dict_free(&opt);
-    if (ret < 0)
+/**
+ * @brief 累加一行亮度的和与平方和
+ */
+static void luma_stats_c(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq)
+{
+    uint64_t s = 0, s2 = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
     {
-        fprintf(stderr, "Could not open audio codec: %s\n", av_err2str(ret));
-        exit(1);
+        s  += p[i];
+        s2 += p[i] * p[i];
     }
+    *sum   += s;
+    *sumsq += s2;
+}
 
-    // 信号生成器时间
-    ost->t     = 0;
-    // 信号生成器，频率增加量
-    ost->tincr = 2 * M_PI * 110.0 / c->sample_rate;
-    // 信号生成器，频率增加量的增加量
-    ost->tincr2 = 2 * M_PI * 110.0 / c->sample_rate / c->sample_rate;
+/**
+ * @brief 返回两行亮度的绝对差之和
+ */
+static uint64_t luma_sad_c(const uint8_t *a, const uint8_t *b, int n)
+{
+    uint64_t s = 0;
+    int i;
 
-    // 根据音频编码器的能力，设置 nb_samples，如果支持可变帧大小，则将 nb_samples 设置为 10000
-    // 否则设置为 c->frame_size
-    if (c->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+    for (i = 0; i < n; i++)
     {
-        nb_samples = 10000;
+        s += abs(a[i] - b[i]);
     }
-    else
+    return s;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief SSE2 实现：和用 psadbw 对 0 求出，平方和扩展到 16 位后用 pmaddwd 求出。
+ * 32 位的平方和在一行之内不会溢出
+ */
+__attribute__((target("sse2")))
+static void luma_stats_sse2(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s = zero, s2 = zero, v, lo, hi;
+    uint32_t q[4];
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16)
     {
-        nb_samples = c->frame_size;
+        v  = _mm_loadu_si128((const __m128i *)(p + i));
+        s  = _mm_add_epi64(s, _mm_sad_epu8(v, zero));
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        s2 = _mm_add_epi32(s2, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
     }
+    _mm_storeu_si128((__m128i *)q, s2);
+    *sum   += (uint64_t)_mm_cvtsi128_si32(s) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+    *sumsq += (uint64_t)q[0] + q[1] + q[2] + q[3];
+    luma_stats_c(p + i, n - i, sum, sumsq);
+}
 
+__attribute__((target("sse2")))
+static uint64_t luma_sad_sse2(const uint8_t *a, const uint8_t *b, int n)
+{
+    __m128i s = _mm_setzero_si128();
+    int i;
 
-    // 分配音频帧和临时音频帧的内存空间
-    ost->frame     = alloc_audio_frame(c->sample_fmt, c->channel_layout,
-                                       c->sample_rate, nb_samples);
-    ost->tmp_frame = alloc_audio_frame(AV_SAMPLE_FMT_S16, c->channel_layout,
-                                       c->sample_rate, nb_samples);
-
-    // 将音频编码器的参数复制到输出流的编解码器参数中
-    ret = avcodec_parameters_from_context(ost->st->codecpar, c);
-    if (ret < 0)
+    for (i = 0; i + 16 <= n; i += 16)
     {
-        fprintf(stderr, "Could not copy the stream parameters\n");
-        exit(1);
+        s = _mm_add_epi64(s, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                          _mm_loadu_si128((const __m128i *)(b + i))));
     }
+    return (uint64_t)_mm_cvtsi128_si32(s) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(s, 8)) +
+           luma_sad_c(a + i, b + i, n - i);
+}
+#elif defined(__aarch64__)
+static void luma_stats_neon(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq)
+{
+    uint32x4_t s = vdupq_n_u32(0), s2 = vdupq_n_u32(0);
+    uint8x16_t v;
+    int i;
 
-    // 创建音频重采样器上下文
-    ost->swr_ctx = swr_alloc();
-    if (!ost->swr_ctx)
+    for (i = 0; i + 16 <= n; i += 16)
     {
-        fprintf(stderr, "Could not allocate resampler context\n");
-        exit(1);
+        v  = vld1q_u8(p + i);
+        s  = vpadalq_u16(s, vpaddlq_u8(v));
+        s2 = vpadalq_u16(s2, vmull_u8(vget_low_u8(v), vget_low_u8(v)));
+        s2 = vpadalq_u16(s2, vmull_u8(vget_high_u8(v), vget_high_u8(v)));
     }
+    *sum   += vaddvq_u32(s);
+    *sumsq += vaddlvq_u32(s2);
+    luma_stats_c(p + i, n - i, sum, sumsq);
+}
 
-    // 设置音频重采样器上下文的参数，包括输入通道数、输入采样率、输入采样格式、输出通道数、输出采样率和输出采样格式
-    av_opt_set_int       (ost->swr_ctx, "in_channel_count",   c->channels,       0);
-    av_opt_set_int       (ost->swr_ctx, "in_sample_rate",     c->sample_rate,    0);
-    av_opt_set_sample_fmt(ost->swr_ctx, "in_sample_fmt",      AV_SAMPLE_FMT_S16, 0);
-    av_opt_set_int       (ost->swr_ctx, "out_channel_count",  c->channels,       0);
-    av_opt_set_int       (ost->swr_ctx, "out_sample_rate",    c->sample_rate,    0);
-    av_opt_set_sample_fmt(ost->swr_ctx, "out_sample_fmt",     c->sample_fmt,     0);
+static uint64_t luma_sad_neon(const uint8_t *a, const uint8_t *b, int n)
+{
+    uint32x4_t s = vdupq_n_u32(0);
+    int i;
 
-    /* initialize the resampling context */
-    if ((ret = swr_init(ost->swr_ctx)) < 0)
+    for (i = 0; i + 16 <= n; i += 16)
     {
-        fprintf(stderr, "Failed to initialize the resampling context\n");
-        exit(1);
+        s = vpadalq_u16(s, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
     }
+    return vaddlvq_u32(s) + luma_sad_c(a + i, b + i, n - i);
 }
+#endif
 
-
-
-
-
+/* 当前 CPU 上最快的实现，由 qc_start 选择 */
+static void (*luma_stats)(const uint8_t *p, int n, uint64_t *sum, uint64_t *sumsq) = luma_stats_c;
+static uint64_t (*luma_sad)(const uint8_t *a, const uint8_t *b, int n) = luma_sad_c;
 
 /**
- * 生成音频帧并且填充音频数据
- * */
-static AVFrame *get_audio_frame(OutputStream *ost)
+ * @brief 把一个区间作为一行 JSON 写出
+ */
+static void qc_emit(QcInterval *in, int stream_index)
 {
-    // 初始化为输出流中的临时音频帧
-    AVFrame *frame = ost->tmp_frame;
-    int j, i, v;
-    // 初始化为音频帧中第一个数据平面的指针，用于填充音频帧的样本数据
-    int16_t *q = (int16_t*)frame->data[0];
-
-    // 比较时间戳，检查是否超过了预定的流时长，如果超过了就返回 null，不再生成更多的音频帧
-    if (av_compare_ts(ost->next_pts,
-                      ost->enc->time_base,
-                      STREAM_DURATION,
-                      (AVRational){ 1, 1 }) > 0)
+    if (in->end - in->start >= qc.min_duration)
     {
-        return NULL;
+        fprintf(qc.out, "{\"type\":\"%s\",\"stream\":%d,\"start\":%.6f,\"end\":%.6f,\"duration\":%.6f,"
+                "\"frames\":%"PRId64"}\n",
+                in->type, stream_index, in->start, in->end, in->end - in->start, in->frames);
+        in->count++;
     }
+    in->active = 0;
+}
 
-
-    // 进入一个循环，用于生成音频样本数据
-    // 遍历音频帧中的每一个样本
-    for (j = 0; j < frame->nb_samples; j++)
+/**
+ * @brief 用一帧的检测结果更新区间，帧覆盖 [t, t + duration)
+ */
+static void qc_update(QcInterval *in, int stream_index, int hit, double t, double duration)
+{
+    if (hit)
     {
-        // 计算一个样本的音频数据。这里使用正弦函数来生成音频信号的振幅，乘以10000以将其缩放到合适的范围 ost->t 表示时间
-        // 根据正弦函数的变化来生成音频波形
-        v = (int)(sin(ost->t) * 10000);
-
-        // 遍历每个音频通道
-        for (i = 0; i < ost->enc->channels; i++)
+        if (!in->active)
         {
-            // 将计算得到的音频数据存储到音频帧中，并移动指针 q 到下一个样本位置
-            *q++ = v;
+            in->active = 1;
+            in->start  = t;
+            in->frames = 0;
         }
-
-        // 控制正弦波的时间和频率
-        ost->t     += ost->tincr;
-        ost->tincr += ost->tincr2;
+        in->end = t + duration;
+        in->frames++;
+    }
+    else if (in->active)
+    {
+        qc_emit(in, stream_index);
     }
-
-    // 设置音频帧的时间戳为下一个时间戳
-    frame->pts = ost->next_pts;
-    // 增加下一个时间戳，以确保下一个音频帧具有递增的时间戳
-    ost->next_pts  += frame->nb_samples;
-
-    // 返回填充好数据的音频帧
-    return frame;
 }
 
-
-
-
-
-
-/**
- * 将生成的音频帧进行编码，并将编码后的音频数据写入到输出媒体文件中，同时更新时间戳和样本计数
- * */
-static int write_audio_frame(AVFormatContext *oc, OutputStream *ost)
+static void qc_video_frame(const AVFrame *frame, double t, double duration)
 {
-    // 表示音频编码器的上下文
-    AVCodecContext *c;
-    // 存储音频帧
-    AVFrame *frame;
-    // 存储函数返回值或者错误代码
-    int ret;
-    // 用于表示目标样本数
-    int dst_nb_samples;
-    // 将输出流结构体中的音频编码器上下文赋值给c
-    c = ost->enc;
-    // 获取音频帧
-    frame = get_audio_frame(ost);
+    const int w = frame->width, h = frame->height;
+    uint64_t sum = 0, sumsq = 0, sad = 0;
+    double mean, var;
+    int y;
 
-    if (frame)
+    if (qc.prev_w != w || qc.prev_h != h)
     {
-        // 将原音频帧的样本数与音频编码器的采样率进行比例缩放，以获得目标音频帧的样本数。这一步
-        // 通常涉及到重采样，以确保音频数据与编码器的期望格式相匹配
-        dst_nb_samples = av_rescale_rnd(swr_get_delay(ost->swr_ctx, c->sample_rate) + frame->nb_samples,
-                                        c->sample_rate,
-                                        c->sample_rate,
-                                        AV_ROUND_UP);
-        // 确保 dst_nb_samples 与源音频帧的样本数一致
-        av_assert0(dst_nb_samples == frame->nb_samples);
-
-        // 确保 ost->frame 可以被写入，因为编码器可能会在内部保留对输入帧的引用
-        ret = av_frame_make_writable(ost->frame);
-        if (ret < 0)
-            exit(1);
-
-        // 将音频数据从源格式转换为目标格式
-        // ost->swr_ctx 是一个音频重采样器上下文，用于执行格式转换
-        // ost->frame->data 存储着目标音频数据的位置
-        // dst_nb_samples 表示目标样本数
-        // frame->data 存储着源音频数据的位置
-        // frame->nb_samples 表示源音频帧的样本数
-        ret = swr_convert(ost->swr_ctx,
-                          ost->frame->data,
-                          dst_nb_samples,
-                          (const uint8_t **)frame->data,
-                          frame->nb_samples);
-        if (ret < 0)
+        av_freep(&qc.prev);
+        qc.prev_w = qc.prev_h = 0;
+        qc.prev = av_malloc((size_t)w * h);
+        if (!qc.prev)
         {
-            fprintf(stderr, "Error while converting\n");
+            fprintf(stderr, "Could not allocate the freeze detection buffer\n");
             exit(1);
         }
-        // 将frame更新为转换后的音频帧
-        frame = ost->frame;
-        // 根据样本计数和编码器的时间基准计算音频帧的时间戳
-        frame->pts = av_rescale_q(ost->samples_count, (AVRational){1, c->sample_rate}, c->time_base);
-        // 增加样本计数以跟踪以处理的样本数量
-        ost->samples_count += dst_nb_samples;
+        for (y = 0; y < h; y++)
+        {
+            memcpy(qc.prev + (size_t)y * w, frame->data[0] + (ptrdiff_t)y * frame->linesize[0], w);
+        }
+        // 第一帧没有可以比较的上一帧，只当作非静帧处理
+        sad = (uint64_t)-1;
     }
 
-    // 将编码后的音频数帧写入到输出媒体文件中，其中包括媒体容器、音频编码器上下文、输出流、音频帧和临时数据包
-    return write_frame(oc, c, ost->st, frame, ost->tmp_pkt);
-}
-
-
+    for (y = 0; y < h; y++)
+    {
+        const uint8_t *row  = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        uint8_t       *prev = qc.prev + (size_t)y * w;
 
+        luma_stats(row, w, &sum, &sumsq);
+        if (sad != (uint64_t)-1)
+        {
+            sad += luma_sad(row, prev, w);
+            memcpy(prev, row, w);
+        }
+    }
+    qc.prev_w = w;
+    qc.prev_h = h;
 
+    mean = (double)sum / ((double)w * h);
+    var  = FFMAX((double)sumsq / ((double)w * h) - mean * mean, 0);
+    qc_update(&qc.black, qc.video_index, mean < QC_BLACK_MEAN && sqrt(var) < QC_BLACK_STDDEV, t, duration);
+    qc_update(&qc.freeze, qc.video_index, sad != (uint64_t)-1 && sad < QC_FREEZE_MAD * w * h, t, duration);
+}
 
+static void qc_audio_frame(const AVFrame *frame, double t, double duration)
+{
+    enum AVSampleFormat fmt = frame->format;
+    enum AVSampleFormat packed = av_get_packed_sample_fmt(fmt);
+    int planar = av_sample_fmt_is_planar(fmt);
+    int channels = frame->channels;
+    int planes = planar ? channels : 1;
+    int n = frame->nb_samples * (planar ? 1 : channels);
+    double sumsq = 0, v;
+    int p, i;
+
+    if (!sample_fmt_to_float_supported(fmt))
+    {
+        return;
+    }
+    for (p = 0; p < planes; p++)
+    {
+        for (i = 0; i < n; i++)
+        {
+            v = sample_to_float(frame->extended_data[p], packed, i);
+            sumsq += v * v;
+        }
+    }
+    // 全 0 的帧 RMS 为 0，按 -inf dBFS 处理
+    v = sumsq / FFMAX((int64_t)n * planes, 1);
+    qc_update(&qc.silence, qc.audio_index, v < pow(10, QC_SILENCE_DB / 10), t, duration);
+}
 
 /**
- * 为图像帧分配内存，并设置图像帧的基本属性，以便后续在图像处理或编码中使用。
- * 这是一个常见的多媒体处理函数，用于准备图像数据以供进一步处理
- * */
-static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
+ * @brief 在 write_frame 中调用：检测一帧送入编码器的视频或音频
+ */
+static void qc_frame(const OutputStream *ost, const AVFrame *frame)
 {
-    // 表示图像帧
-    AVFrame *picture;
-    // 存储函数返回值或者错误代码
-    int ret;
+    const AVCodecContext *c = ost->enc;
+    int64_t t0 = av_gettime_relative();
+    double t = frame->pts * av_q2d(c->time_base);
 
-    // 分配一个空的AVFrame结构体，并将地址赋值给 picture，这个函数
-    // 分配了一个用于存储图像数据的框架，但是还没有分配数据缓冲区
-    picture = av_frame_alloc();
-    if (!picture)
+    if (c->codec_type == AVMEDIA_TYPE_VIDEO)
     {
-        return NULL;
+        qc.video_index = ost->st->index;
+        qc_video_frame(frame, t, av_q2d(c->time_base));
     }
-
-    // 设置图像帧的像素格式，通常是枚举值 pix_fmt, 表示图像的颜色编码格式，如 yuv420，rgb 等
-    picture->format = pix_fmt;
-    // 设置图像帧的宽度
-    picture->width  = width;
-    // 设置图像帧的高度
-    picture->height = height;
-
-    // 分配图像帧的数据缓冲区，这个函数会根据图像帧的属性（像素格式、宽度、高度等）自动分配合适大小的内存
-    // 用于存储图像数据
-    ret = av_frame_get_buffer(picture, 0);
-    if (ret < 0)
+    else if (c->codec_type == AVMEDIA_TYPE_AUDIO)
     {
-        fprintf(stderr, "Could not allocate frame data.\n");
-        exit(1);
+        qc.audio_index = ost->st->index;
+        qc_audio_frame(frame, t, (double)frame->nb_samples / c->sample_rate);
     }
-
-    return picture;
-}
-
-
-
+    qc.time += av_gettime_relative() - t0;
+}
 
 /**
- * @brief 初始化视频编码器，包括打开编码器、分配图像帧内存、处理不同的像素格式以及复制流
- * 参数到复用器中。这是一个用于准备视频编码的关键函数，在多媒体处理应用程序中常用于处理和
- * 编码视频流
- * @param oc 表示媒体格式的上下文，通常用于表示媒体文件的格式信息和写入媒体文件
- * @param codec 表示要使用的视频编码器，指定了视频数据的编码方式，确定了视频数据的压缩格式
- * @param ost 表示输出流，包括视频编码器的相关设置和参数，例如视频编码器上下文、临时帧
- * @param opt_arg 表示用于配置视频编码器的选项参数的字典
+ * @brief 打开事件文件（"-" 表示 stderr）并选择 SIMD 实现；视频只支持 8 位亮度平面在前的像素格式
  */
-static void open_video(AVFormatContext *oc,
-                       const AVCodec *codec,
-                       OutputStream *ost,
-                       AVDictionary *opt_arg)
+static int qc_start(const char *filename, double min_duration, enum AVPixelFormat pix_fmt)
 {
-    // 存储函数返回值或者错误代码
-    int ret;
-    // 将输出流中的编码器上下文赋值给c
-    AVCodecContext *c = ost->enc;
-    // 存储一些选项参数
-    AVDictionary *opt = NULL;
-    // 将传入的 opt_arg 字典拷贝到opt字典中，以便后续用于配置视频编码器的选项
-    av_dict_copy(&opt, opt_arg, 0);
-
-    // 打开视频编码器，并将 opt 应用与它
-    ret = avcodec_open2(c, codec, &opt);
-    av_dict_free(&opt);
-    if (ret < 0)
+    switch (pix_fmt)
     {
-        fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
-        exit(1);
+    case AV_PIX_FMT_NONE:
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+    case AV_PIX_FMT_GRAY8:
+        break;
+    default:
+        fprintf(stderr, "-qc does not support pixel format %s\n", av_get_pix_fmt_name(pix_fmt));
+        return AVERROR(ENOSYS);
     }
 
-    // 分配并且初始化一个重复使用的视频帧
-    // 使用 alloc_picture 函数分配图像帧内存，传入了像素格式 c->pic_fmt,宽度 c->width 和高度 c->height
-    ost->frame = alloc_picture(c->pix_fmt, c->width, c->height);
-    if (!ost->frame)
+    qc.out = strcmp(filename, "-") ? fopen(filename, "w") : stderr;
+    if (!qc.out)
     {
-        fprintf(stderr, "Could not allocate video frame\n");
-        exit(1);
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        return AVERROR(errno);
+    }
+    qc.min_duration = min_duration;
+    qc.black.type   = "black";
+    qc.freeze.type  = "freeze";
+    qc.silence.type = "silence";
+#if defined(__x86_64__) || defined(__i386__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    {
+        luma_stats = luma_stats_sse2;
+        luma_sad   = luma_sad_sse2;
     }
+#elif defined(__aarch64__)
+    luma_stats = luma_stats_neon;
+    luma_sad   = luma_sad_neon;
+#endif
+    return 0;
+}
 
-    // 根据像素格式 c->pic_fmt 的不同，可能需要分配一个临时的 yuv420p 格式图像帧， ost->tmp_frame
-    // 如果视频的输出像素格式不是 yuv420p，就需要分配一个 yuv420p 格式的临时图像帧，后续会将它转换为所需要的输出格式
-    ost->tmp_frame = NULL;
-    if (c->pix_fmt != AV_PIX_FMT_YUV420P)
+/**
+ * @brief 结束时写出仍在进行中的区间，打印事件个数和检测耗时
+ */
+static void qc_finish(void)
+{
+    if (!qc.out)
     {
-        ost->tmp_frame = alloc_picture(AV_PIX_FMT_YUV420P, c->width, c->height);
-        if (!ost->tmp_frame)
-        {
-            fprintf(stderr, "Could not allocate temporary picture\n");
-            exit(1);
-        }
+        return;
+    }
+    if (qc.black.active)
+    {
+        qc_emit(&qc.black, qc.video_index);
+    }
+    if (qc.freeze.active)
+    {
+        qc_emit(&qc.freeze, qc.video_index);
+    }
+    if (qc.silence.active)
+    {
+        qc_emit(&qc.silence, qc.audio_index);
+    }
+    fprintf(stderr, "qc: %d black, %d freeze, %d silence intervals of at least %.2f s, detection %.3f s\n",
+            qc.black.count, qc.freeze.count, qc.silence.count, qc.min_duration, qc.time / 1000000.0);
+    if (qc.out != stderr)
+    {
+        fclose(qc.out);
     }
+    qc.out = NULL;
+    av_freep(&qc.prev);
+}
 
-    // 将视频流的参数复制到复用器中，
-    ret = avcodec_parameters_from_context(ost->st->codecpar, c);
-    if (ret < 0)
+
+
+
+
+/**
+ * @brief 在 [p, end) 中查找下一个起始码 00 00 01
+ * @return 起始码的位置，没有找到时返回 end
+ */
+static const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end)
+{
+    for (; p + 3 <= end; p++)
     {
-        fprintf(stderr, "Could not copy the stream parameters\n");
-        exit(1);
+        if (!p[0] && !p[1] && p[2] == 1)
+        {
+            return p;
+        }
     }
+    return end;
 }
 
 
 
 
+
 /**
- * @brief 生成一个 yuv 格式的图像数据帧，其中包含 y、cb、cr 分量的数据。
- * 生成的图像数据可以用于视频编码或处理，以产生特定的图像效果
- * @param pict 图像帧
- * @param frame_index 当前帧的索引或者帧号，用于生成图像数据的模式
- * @param width 图像的宽度
- * @param height 图像的高度
+ * @brief 剪辑模式：把编码器输出的 Annex B 数据包（起始码分隔的 NAL）原地改写成长度前缀的格式，
+ * 与 avcC/hvcC 格式的源码流一致，拷贝的 GOP 和重新编码的 GOP 在输出中使用同一种码流格式
+ * @param pkt 编码器输出的数据包
+ * @param length_size NAL 长度字段的字节数（1、2 或 4），取自源文件的 avcC/hvcC
+ * @return 0 表示成功，负数表示错误码
  */
-static void fill_yuv_image(AVFrame *pict,
-                           int frame_index,
-                           int width,
-                           int height)
+static int annexb_to_length_prefixed(AVPacket *pkt, int length_size)
 {
-    int x, y, i;
+    const uint8_t *end = pkt->data + pkt->size, *nal, *next, *nal_end;
+    AVPacket *out;
+    uint8_t *dst;
+    int64_t size = 0;
+    int ret, pass;
 
-    // 将帧号赋值给变量i，用于生成图像数据的模式
-    i = frame_index;
+    if (find_start_code(pkt->data, FFMIN(pkt->data + 4, end)) == FFMIN(pkt->data + 4, end))
+    {
+        fprintf(stderr, "The encoder output is not in Annex B format\n");
+        return AVERROR_BUG;
+    }
+    if (!(out = av_packet_alloc()))
+    {
+        return AVERROR(ENOMEM);
+    }
 
-    // 遍历图像的每一行
-    for (y = 0; y < height; y++)
+    // 第一遍计算输出的大小，第二遍写出；NAL 末尾的 0（4 字节起始码的第一个字节或 trailing_zero_8bits）不属于 NAL
+    for (pass = 0; pass < 2; pass++)
     {
-        // 遍历图像的每一列
-        for (x = 0; x < width; x++)
+        dst = out->data;
+        for (nal = find_start_code(pkt->data, end); nal < end; nal = next)
         {
-            // 当前像素位置 (x, y) 处， 将计算得到的Y分量值（亮度值）存储到图像帧的Y分量数据平面中。
-            // 这个计算使用了 (x + y + i * 3)，其中 i 是帧号，用于生成不同的模式。
-            pict->data[0][y * pict->linesize[0] + x] = x + y + i * 3;
+            nal    += 3;
+            next    = find_start_code(nal, end);
+            nal_end = next;
+            while (nal_end > nal && !nal_end[-1])
+            {
+                nal_end--;
+            }
+            if (length_size < 4 && nal_end - nal >= 1LL << (8 * length_size))
+            {
+                fprintf(stderr, "A NAL unit of %d bytes does not fit the %d-byte length field of the source\n",
+                        (int)(nal_end - nal), length_size);
+                av_packet_free(&out);
+                return AVERROR(EINVAL);
+            }
+            if (!pass)
+            {
+                size += length_size + (nal_end - nal);
+                continue;
+            }
+            switch (length_size)
+            {
+            case 1:  dst[0] = nal_end - nal;            break;
+            case 2:  AV_WB16(dst, nal_end - nal);       break;
+            default: AV_WB32(dst, nal_end - nal);       break;
+            }
+            memcpy(dst + length_size, nal, nal_end - nal);
+            dst += length_size + (nal_end - nal);
+        }
+        if (!pass && (ret = av_new_packet(out, size)) < 0)
+        {
+            av_packet_free(&out);
+            return ret;
         }
     }
 
-    // 外部循环，遍历 Cb 和 Cr 分量的每一行，注意是图像高度的一半
-    for (y = 0; y < height / 2; y++) {
-        // 内部循环，遍历Cb和Cr分量的每一列，注意是图像宽度的一半。
-        for (x = 0; x < width / 2; x++) {
-            // 在当前位置 (x, y) 处，将计算得到的Cb分量值（蓝色色度值）存储到图像帧的Cb分量数据平面中
-            pict->data[1][y * pict->linesize[1] + x] = 128 + y + i * 2;
-            // 在当前位置 (x, y) 处，将计算得到的Cr分量值（红色色度值）存储到图像帧的Cr分量数据平面中。
-            pict->data[2][y * pict->linesize[2] + x] = 64 + x + i * 5;
-        }
+    if ((ret = av_packet_copy_props(out, pkt)) < 0)
+    {
+        av_packet_free(&out);
+        return ret;
     }
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, out);
+    av_packet_free(&out);
+    return 0;
 }
 
 
@@ -759,85 +1068,161 @@ static void fill_yuv_image(AVFrame *pict,
 
 
 /**
- * @brief 生成视频帧并填充视频数据。
- * 该函数根据一定的时间间隔生成视频帧，然后将其准备好以供编码和写入媒体文件
- * @param ost 表示输出流，包含了与输出视频流相关的设置和参数，例如视频编码器的上下文、帧信息等。
- * @return AVFrame* 
+ * @brief 这段代码是一个用于编码并写入帧数据到媒体文件的函数，它通常在音视频
+ * 处理中用于将帧数据经过编码后写入媒体文件。
+ * @param fmt_ctx 指向音视频格式上下文的常量指针，包含了音视频文件的相关信息，如编解码器、流信息
+ * @param ost 输出流，使用其中的编码器上下文 enc、输出流 st 以及用于存储编码后数据包的 tmp_pkt
+ * @param frame 指向输入帧的指针，表示待编码的原始帧数据，NULL 表示冲刷编码器
+ * @return int 
  */
-static AVFrame *get_video_frame(OutputStream *ost)
+static int write_frame(AVFormatContext *fmt_ctx,
+                       OutputStream *ost,
+                       AVFrame *frame)
 {
-    // 指向视频编码器上下文的指针，用于表示视频编码器的参数和配置
+    // 音视频编码器上下文，表示与输出流相关联的编码器的参数和状态
     AVCodecContext *c = ost->enc;
+    // 输出流，包括流的编解码参数和时间基准等
+    AVStream *st = ost->st;
+    // 用于存储编码后的数据包
+    AVPacket *pkt = ost->tmp_pkt;
+    int64_t t0;
+    int ret;
 
-    // 检查是否需要生成更多的视频帧，使用 av_compare_ts 函数比较 ost->next_pts 和 c->time_base
-    // 以确定是否超过了预定的流时长 STREAM_DURATION, 如果超过了流时长，就返回 null，不再返回更多的视频帧
-    if (av_compare_ts(ost->next_pts,
-                      c->time_base,
-                      STREAM_DURATION,
-                      (AVRational){ 1, 1 }) > 0)
+    // 质量检查：在帧交给编码器之前检测黑场、静帧和静音
+    if (qc.out && frame)
     {
-        return NULL;
+        qc_frame(ost, frame);
     }
 
-    // 检查是否可以使帧可写，使用 av_frame_make_writable 函数确保 ost->frame 可以被写入
-    // 因为编码器可能会在内部保留对输入帧的引用
-    // 如果无法使帧可写，就退出程序
-    if (av_frame_make_writable(ost->frame) < 0)
-    {
+    // 将输入帧 frame 发送到编码器 c 进行编码。avcodec_send_frame 函数会将帧数据传递给编码器，但不会立即产生输出数据
+    t0  = av_gettime_relative();
+    ret = avcodec_send_frame(c, frame);
+    encode_time += av_gettime_relative() - t0;
+    if (ret < 0) {
+        fprintf(stderr, "Error sending a frame to the encoder: %s\n",
+                av_err2str(ret));
         exit(1);
     }
 
-    if (c->pix_fmt != AV_PIX_FMT_YUV420P)
+    while (ret >= 0)
     {
-        // 如果视频帧的像素格式不是 AV_PIC_FMT_YUV420P，说明输出视频需要的像素格式与生成的图像格式不匹配
-        // 创建一个图像格式转换上下文 ost->sws_ctx, 用于将生成的 YUV420P 格式图像转换为编码期望的格式 c->pix_fmt
-        // 如果无法创建转换上下文，就在标准错误流中打印错误消息并退出程序
-        if (!ost->sws_ctx)
+        // 在一个循环中，这行代码尝试从编码器 c 获取编码后的数据包，并将器存储在 pkt 中。如果返回 AVERROR(EAGAIN），表示
+        // 编码器需要更多的输入数据；如果返回 AVERROR_EOF，表示编码器已经完成编码；如果返回负数，表示编码出现错误。
+        t0  = av_gettime_relative();
+        ret = avcodec_receive_packet(c, pkt);
+        encode_time += av_gettime_relative() - t0;
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
         {
-            ost->sws_ctx = sws_getContext(c->width,
-                                          c->height,
-                                          AV_PIX_FMT_YUV420P,
-                                          c->width,
-                                          c->height,
-                                          c->pix_fmt,
-                                          SCALE_FLAGS,
-                                          NULL,
-                                          NULL,
-                                          NULL);
-            if (!ost->sws_ctx)
+            break;
+        }
+        else if (ret < 0)
+        {
+            fprintf(stderr, "Error encoding a frame: %s\n", av_err2str(ret));
+            exit(1);
+        }
+
+        // 检查点：视频关键帧到达时，它之前的数据包都已交给复用器，在这里切分最安全
+        if (checkpoint.filename && ost == checkpoint.video &&
+            (pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts >= checkpoint.next_pts)
+        {
+            if ((ret = write_checkpoint(fmt_ctx, pkt->pts)) < 0)
             {
-                fprintf(stderr, "Could not initialize the conversion context\n");
+                fprintf(stderr, "Error writing a checkpoint: %s\n", av_err2str(ret));
                 exit(1);
             }
         }
+        // 记录已写出内容的结束时间（编码器时间基准），恢复时音频从这里继续
+        ost->written_end = pkt->pts + pkt->duration;
+        pkt->dts -= ost->dts_shift;
+        if (ost->nal_length_size && (ret = annexb_to_length_prefixed(pkt, ost->nal_length_size)) < 0)
+        {
+            fprintf(stderr, "Error converting a re-encoded packet: %s\n", av_err2str(ret));
+            exit(1);
+        }
 
-        // 调用 fill_yuv_image 函数，根据 ost->next_pts、c->width、c->height
-        // 生成 yuv 格式的图像数据。这个函数负责填充 y、db 和 cr 分量的数据
-        fill_yuv_image(ost->tmp_frame, ost->next_pts, c->width, c->height);
+        // 这一行代码将输出数据包的时间戳从编码器时间基准（c->time_base）重新映射到输出流的时间基准（st->time_base）, 这是为了
+        // 确保输出的时间戳与输出流的时间戳基准相匹配
+        av_packet_rescale_ts(pkt, c->time_base, st->time_base);
+        // 设置输出数据包的流索引，以指示数据包属于哪个输出流
+        pkt->stream_index = st->index;
 
-        // 使用 sws_scale 函数将生成的 yuv 数据从 yuv420p 格式转换为编码器期望的像素格式 c->pic_fmt
-        // ost->sws_ctx 是图像格式转换上下文
-        // ost->tmp_frame 存储着待转换的图像数据
-        // ost->frame 存储着转换后的图像数据
-        sws_scale(ost->sws_ctx,
-                  (const uint8_t * const *) ost->tmp_frame->data,
-                  ost->tmp_frame->linesize,
-                  0,
-                  c->height,
-                  ost->frame->data,
-                  ost->frame->linesize);
+        write_packet(fmt_ctx, pkt);
     }
-    else
+
+    if (ret == AVERROR_EOF)
     {
-        // 如果像素格式是yuv420p，则直接调用 fill_yuv_image 函数填充 ost->frame
-        fill_yuv_image(ost->frame, ost->next_pts, c->width, c->height);
+        ost->eof = 1;
     }
 
-    // 设置生成的帧的时间戳，并递增 ost->next_pts，以确保每帧具有递增的时间戳
-    ost->frame->pts = ost->next_pts++;
+    return ret == AVERROR_EOF ? 1 : 0;
+}
 
-    // 返回填充好的视频帧
-    return ost->frame;
+
+
+
+
+/**
+ * @brief 冲刷线程的入口函数。向编码器发送 NULL 帧，然后取出编码器中剩余的全部数据包，
+ * 放入 ost->drain_fifo，由主线程负责写入媒体文件（AVFormatContext 不能被多个线程同时写入）。
+ * 对于 lookahead 很深的编码器，这一步可能耗时数秒，放到独立线程后主线程可以继续编码其他流。
+ * @param arg 指向要冲刷的 OutputStream
+ */
+static void *drain_thread_main(void *arg)
+{
+    OutputStream *ost = arg;
+    AVPacket *pkt;
+    int ret;
+
+    ret = avcodec_send_frame(ost->enc, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Error sending a frame to the encoder: %s\n",
+                av_err2str(ret));
+        exit(1);
+    }
+
+    for (;;)
+    {
+        pkt = av_packet_alloc();
+        if (!pkt) {
+            fprintf(stderr, "Could not allocate AVPacket\n");
+            exit(1);
+        }
+
+        ret = avcodec_receive_packet(ost->enc, pkt);
+        if (ret == AVERROR_EOF)
+        {
+            av_packet_free(&pkt);
+            break;
+        }
+        else if (ret < 0)
+        {
+            fprintf(stderr, "Error encoding a frame: %s\n", av_err2str(ret));
+            exit(1);
+        }
+
+        // 与 write_frame 相同，把时间戳转换到输出流的时间基准，并设置流索引
+        av_packet_rescale_ts(pkt, ost->enc->time_base, ost->st->time_base);
+        pkt->stream_index = ost->st->index;
+
+        pthread_mutex_lock(&drain_lock);
+        if (av_fifo_space(ost->drain_fifo) < sizeof(pkt) &&
+            av_fifo_grow(ost->drain_fifo, av_fifo_size(ost->drain_fifo)) < 0)
+        {
+            fprintf(stderr, "Could not grow the drain queue\n");
+            exit(1);
+        }
+        av_fifo_generic_write(ost->drain_fifo, &pkt, sizeof(pkt), NULL);
+        pthread_cond_signal(&drain_cond);
+        pthread_mutex_unlock(&drain_lock);
+    }
+
+    pthread_mutex_lock(&drain_lock);
+    ost->drain_done = 1;
+    ost->drain_end  = av_gettime_relative();
+    pthread_cond_signal(&drain_cond);
+    pthread_mutex_unlock(&drain_lock);
+
+    return NULL;
 }
 
 
@@ -845,91 +1230,7045 @@ static AVFrame *get_video_frame(OutputStream *ost)
 
 
 /**
- * 编码，并将视频写入视频文件
-*/
-static int write_video_frame(AVFormatContext *oc, OutputStream *ost)
+ * @brief 流结束时启动冲刷线程，代替 write_frame(..., NULL) 中同步的冲刷循环
+ * @param ost 已经没有更多输入帧的输出流
+ */
+static void start_drain(OutputStream *ost)
 {
-    return write_frame(oc, ost->enc, ost->st, get_video_frame(ost), ost->tmp_pkt);
+    int ret;
+
+    ost->drain_fifo = av_fifo_alloc(16 * sizeof(AVPacket *));
+    if (!ost->drain_fifo) {
+        fprintf(stderr, "Could not allocate the drain queue\n");
+        exit(1);
+    }
+
+    ost->draining    = 1;
+    ost->drain_start = av_gettime_relative();
+    ret = pthread_create(&ost->drain_thread, NULL, drain_thread_main, ost);
+    if (ret) {
+        fprintf(stderr, "Could not create the drain thread: %s\n", strerror(ret));
+        exit(1);
+    }
 }
 
 
 
 
 
-/**
- * @brief 关闭输出流，并释放相应的内存资源
- * @param oc 
- * @param ost 
- */
-static void close_stream(AVFormatContext *oc, OutputStream *ost)
-{
-    avcodec_free_context(&ost->enc);
-    av_frame_free(&ost->frame);
-    av_frame_free(&ost->tmp_frame);
-    av_packet_free(&ost->tmp_pkt);
-    sws_freeContext(ost->sws_ctx);
-    swr_free(&ost->swr_ctx);
-}
+/**
+ * @brief 判断冲刷线程是否有需要主线程处理的结果（新的数据包，或者线程已经结束等待 join）。
+ * 调用者需要持有 drain_lock
+ */
+static int drain_ready(const OutputStream *ost)
+{
+    return ost->draining && !ost->drain_joined &&
+           (av_fifo_size(ost->drain_fifo) > 0 || ost->drain_done);
+}
+
+
+
+
+
+/**
+ * @brief 把冲刷线程已经产出的数据包写入媒体文件；如果线程已经结束且队列已空，则 join 该线程
+ * @return 1 表示该流的冲刷已经全部完成，0 表示仍在进行
+ */
+static int write_drained_packets(AVFormatContext *oc, OutputStream *ost)
+{
+    AVPacket *pkt;
+    int done;
+
+    if (!ost->draining)
+        return 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&drain_lock);
+        done = ost->drain_done;
+        pkt  = NULL;
+        if (av_fifo_size(ost->drain_fifo) > 0)
+            av_fifo_generic_read(ost->drain_fifo, &pkt, sizeof(pkt), NULL);
+        pthread_mutex_unlock(&drain_lock);
+
+        if (!pkt)
+            break;
+
+        write_packet(oc, pkt);
+        av_packet_free(&pkt);
+    }
+
+    // 只有在读取队列之前线程就已经结束，才能确定队列中不会再有新的数据包
+    if (done && !ost->drain_joined)
+    {
+        pthread_join(ost->drain_thread, NULL);
+        ost->drain_joined = 1;
+    }
+
+    return ost->drain_joined;
+}
+
+
+
+
+
+/**
+ * @brief 用于向输出文件中添加一个输出流，并初始化相关的编码器参数
+ * 这个函数的主要目的是为输出流配置编码器参数，并将其添加到输出媒体文件的格式上下文中，以便后续可以使用这些配置来编码和写入音视频
+ * 数据。函数根据流的类型（音频或者视频）和选择的编码器类型来设置参数，以确保输出流的数据按照所需的方式编码和写入到媒体文件中。
+ * @param ost 指向自定义的 OutputStream 结构体的指针用于表示输出流的相关信息，如编码器上下文，帧数据等。
+ * @param oc 指向输出媒体文件的格式上下文的指针，用于表示输出文件的信息，如文件格式、流信息等。
+ * @param codec 指向编码器指针的指针，用于存储找到的编码器
+ * @param codec_id 一个枚举值，表示要使用的编码器的标识符
+ */
+static void add_stream(OutputStream *ost,
+                       AVFormatContext *oc,
+                       const AVCodec **codec,
+                       enum AVCodecID codec_id)
+{
+    AVCodecContext *c;
+    int i;
+
+    // 根据给定的编码器标识符查找对应的编码器，并将其复制给 *codec 指针
+    *codec = avcodec_find_encoder(codec_id);
+    if (!(*codec))
+    {
+        fprintf(stderr, "Could not find encoder for '%s'\n",
+                avcodec_get_name(codec_id));
+        exit(1);
+    }
+
+    // 分配一个用于临时存储数据包的内存，并将其复制给 ost->tmp_pkt，这个数据包用于暂时存储编码后的数据
+    ost->tmp_pkt = av_packet_alloc();
+    if (!ost->tmp_pkt) {
+        fprintf(stderr, "Could not allocate AVPacket\n");
+        exit(1);
+    }
+
+    // 创建一个新的输出流并将其赋值给 ost->st, 这个新的输出流会添加到输出文件的格式上下文 oc 中。如果创建失败，会打印错误消息
+    // 并终止程序
+    ost->st = avformat_new_stream(oc, NULL);
+    if (!ost->st) {
+        fprintf(stderr, "Could not allocate stream\n");
+        exit(1);
+    }
+
+    // 设置新创建的输出流的标识符，通常用于标识不同的流
+    ost->st->id = oc->nb_streams - 1;
+    // 为找到的编码器分配一个编码器上下文，并将其赋值给 ost->enc。编码器上下文包含了编码器的配置参数。
+    c = avcodec_alloc_context3(*codec);
+    if (!c) {
+        fprintf(stderr, "Could not alloc an encoding context\n");
+        exit(1);
+    }
+    ost->enc = c;
+
+    // 根据编码器类型（音频或视频），来设置编码器参数，包括采样率、位率、分辨率、时间基准等
+    // 1. 对于音频流，设置了音频编码参数，如采样格式、采样率、位率、声道、布局等
+    // 2. 对于视频流，设置了视频编码参数，如位率、分辨率、帧率、像素格式等。
+    // 这些参数会根据具体的编码器类型和需求设置
+    switch ((*codec)->type) {
+        case AVMEDIA_TYPE_AUDIO:
+        {
+            c->sample_fmt  = (*codec)->sample_fmts ? (*codec)->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+            c->bit_rate    = 64000;
+            c->sample_rate = 44100;
+            if ((*codec)->supported_samplerates)
+            {
+                c->sample_rate = (*codec)->supported_samplerates[0];
+                for (i = 0; (*codec)->supported_samplerates[i]; i++)
+                {
+                    if ((*codec)->supported_samplerates[i] == 44100)
+                    {
+                        c->sample_rate = 44100;
+                    }
+
+                }
+            }
+            c->channels       = av_get_channel_layout_nb_channels(c->channel_layout);
+            c->channel_layout = AV_CH_LAYOUT_STEREO;
+            if ((*codec)->channel_layouts)
+            {
+                c->channel_layout = (*codec)->channel_layouts[0];
+                for (i = 0; (*codec)->channel_layouts[i]; i++)
+                {
+                    if ((*codec)->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
+                    {
+                        c->channel_layout = AV_CH_LAYOUT_STEREO;
+                    }
+                }
+            }
+            c->channels        = av_get_channel_layout_nb_channels(c->channel_layout);
+            ost->st->time_base = (AVRational){ 1, c->sample_rate };
+            break;
+        }
+        case AVMEDIA_TYPE_VIDEO:
+        {
+            c->codec_id = codec_id;
+
+            c->bit_rate = 400000;
+            /* Resolution must be a multiple of two. */
+            c->width    = 352;
+            c->height   = 288;
+            /* timebase: This is the fundamental unit of time (in seconds) in terms
+             * of which frame timestamps are represented. For fixed-fps content,
+             * timebase should be 1/framerate and timestamp increments should be
+             * identical to 1. */
+            ost->st->time_base = (AVRational){ 1, STREAM_FRAME_RATE };
+            c->time_base       = ost->st->time_base;
+
+            c->gop_size      = 12; /* emit one intra frame every twelve frames at most */
+            c->pix_fmt       = STREAM_PIX_FMT;
+            if (c->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
+                /* just for testing, we also add B-frames */
+                c->max_b_frames = 2;
+            }
+            if (c->codec_id == AV_CODEC_ID_MPEG1VIDEO) {
+                /* Needed to avoid using macroblocks in which some coeffs overflow.
+                 * This does not happen with normal video, it just happens here as
+                 * the motion of the chroma plane does not match the luma plane. */
+                c->mb_decision = 2;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    // 检查输出文件格式的标志位，如果需要在全局添加流头信息，则将编码器上下文的标志 AV_CODEC_FLAG_GLOBAL_HEADER
+    // 设置为相应的值，这是一种格式要求，在某些情况下，流头信息需要被单独添加到输出流文件。
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+    {
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    // 确定性模式：编码器只使用一个线程（多线程编码器的输出可能依赖线程调度），并且不写入
+    // 版本号等随构建变化的信息
+    if (deterministic)
+    {
+        c->thread_count = 1;
+        c->flags |= AV_CODEC_FLAG_BITEXACT;
+    }
+}
+
+
+
+
+
+
+/**
+ * @brief 用于分配并配置一个音频帧。音频帧通常用于存储音频数据，以便后续进行编码、解码或处理。
+ * 这个函数的主要作用是创建一个音频帧并为其设置相关属性，以便在处理音频数据时可以有效的使用它。
+ * 通常，它用于音频解码或编码过程中，以便准备好的音频数据可以被编码器或解码器使用。
+ * @param sample_fmt 一个枚举值，表示音频样本的格式，例如 "AV_SAMPLE_FMT_FLTP" 表示浮点数样本。
+ * @param channel_layout 一个表示音频通道布局的整数值，例如 "AV_CH_LAYOUT_STEREO" 表示立体声通道布局。
+ * @param sample_rate 音频采样率，表示每秒采集的音频样本数量。
+ * @param nb_samples 音频中包含的音频样本数量
+ * */
+static AVFrame *alloc_audio_frame(enum AVSampleFormat sample_fmt,
+                                  uint64_t channel_layout,
+                                  int sample_rate,
+                                  int nb_samples)
+{
+    // 分配一个新的音频帧，音频帧用于存储音频数据
+    AVFrame *frame = av_frame_alloc();
+    int ret;
+
+    if (!frame)
+    {
+        fprintf(stderr, "Error allocating an audio frame\n");
+        exit(1);
+    }
+
+    // 设置音频样本的格式
+    frame->format = sample_fmt;
+    // 设置音频通道布局
+    frame->channel_layout = channel_layout;
+    // 设置音频采样率
+    frame->sample_rate = sample_rate;
+    // 设置音频帧中包含的音频样本数量
+    frame->nb_samples = nb_samples;
+
+    if (nb_samples)
+    {
+        // 分配音频缓冲区，用于存储音频样本数据
+        ret = av_frame_get_buffer(frame, 0);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Error allocating an audio buffer\n");
+            exit(1);
+        }
+    }
+
+    return frame;
+}
+
+
+
+
+
+
+/**
+ * @brief 编码器打开后预先完成时间基准的换算，之后每一帧只需要整数比较
+ * @param ost 输出流
+ */
+static void init_stream_timing(OutputStream *ost)
+{
+    AVCodecContext *c = ost->enc;
+
+    ost->end_pts = av_rescale_q_rnd(STREAM_DURATION, (AVRational){ 1, 1 }, c->time_base, AV_ROUND_DOWN);
+    ost->samples_pts = c->codec_type == AVMEDIA_TYPE_AUDIO &&
+                       c->time_base.num == 1 && c->time_base.den == c->sample_rate;
+}
+
+
+
+
+/**
+ * @brief 为所有输出流选择一个公共时间基准 1/D（D 为各流时间基准分母的最小公倍数），
+ * 使每个流的 next_pts 乘以一个整数就能换算到公共时间基准，选择下一个要编码的流时不再需要 av_compare_ts。
+ * 换算可能溢出时该流的 clock_scale 为 0，比较时退回 av_compare_ts
+ * @param streams 输出流数组
+ * @param nb_streams 输出流个数
+ */
+static void init_scheduler_clock(OutputStream **streams, int nb_streams)
+{
+    int64_t den = 1;
+    int i;
+
+    for (i = 0; i < nb_streams; i++)
+    {
+        int64_t d = streams[i]->enc->time_base.den;
+
+        den = den / av_gcd(den, d) * d;
+        if (den > INT_MAX)
+        {
+            break;
+        }
+    }
+
+    for (i = 0; i < nb_streams; i++)
+    {
+        AVRational tb = streams[i]->enc->time_base;
+
+        streams[i]->clock_scale = 0;
+        if (den > INT_MAX)
+        {
+            continue;
+        }
+        streams[i]->clock_scale = tb.num * (den / tb.den);
+        // next_pts 最多比 end_pts 多出一帧，留出足够余量保证乘法不会溢出
+        if (streams[i]->clock_scale > INT64_MAX / 4 / FFMAX(streams[i]->end_pts + 1, 1))
+        {
+            streams[i]->clock_scale = 0;
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief 判断流 a 的下一帧是否不晚于流 b 的下一帧
+ */
+static inline int stream_before(const OutputStream *a, const OutputStream *b)
+{
+    if (a->clock_scale && b->clock_scale)
+    {
+        return a->next_pts * a->clock_scale <= b->next_pts * b->clock_scale;
+    }
+    return av_compare_ts(a->next_pts, a->enc->time_base, b->next_pts, b->enc->time_base) <= 0;
+}
+
+
+
+
+/**
+ * @brief 用于初始化音频编码器的相关设置和参数包括打开编码器、设
+ * 置参数、创建重采样器上下文等，并将音频流编码并写入容器中
+ * @param oc 表示媒体格式的上下文，通常用于表示媒体文件的格式信息和写入媒体文件
+ * @param codec 表示要使用的音频编码器，指定了音频数据的编码方式
+ * @param ost 表示输出流，包括音频编码器的相关设置和参数
+ * @param opt_arg 用于配置音频编码器的选项参数的字典
+ */
+static void open_audio(AVFormatContext *oc,
+                       const AVCodec *codec,
+                       OutputStream *ost,
+                       AVDictionary *opt_arg)
+{
+    // 声明一个指向音频编码上下文结构体的指针
+    AVCodecContext *c;
+    // 用于存储样本数量
+    int nb_samples;
+    // 存储函数的返回值或者错误代码
+    int ret;
+    // 用于存储一些选项
+    AVDictionary *opt = NULL;
+
+    // 音频编码上下文
+    c = ost->enc;
+
+    // 拷贝传入的字典
+    av_dict_copy(&opt, opt_arg, 0);
+    // 打开音频编码器，并将选项 opt 应用于它
+    ret = avcodec_open2(c, codec, &opt);
+    // 释放字典
+    av_dict_free(&opt);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not open audio codec: %s\n", av_err2str(ret));
+        exit(1);
+    }
+
+    // 信号生成器时间
+    ost->t     = 0;
+    // 信号生成器，频率增加量
+    ost->tincr = 2 * M_PI * 110.0 / c->sample_rate;
+    // 信号生成器，频率增加量的增加量
+    ost->tincr2 = 2 * M_PI * 110.0 / c->sample_rate / c->sample_rate;
+
+    // 根据音频编码器的能力，设置 nb_samples，如果支持可变帧大小，则将 nb_samples 设置为 10000
+    // 否则设置为 c->frame_size
+    if (c->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+    {
+        nb_samples = 10000;
+    }
+    else
+    {
+        nb_samples = c->frame_size;
+    }
+
+
+    // 分配音频帧和临时音频帧的内存空间
+    ost->frame     = alloc_audio_frame(c->sample_fmt, c->channel_layout,
+                                       c->sample_rate, nb_samples);
+    ost->tmp_frame = alloc_audio_frame(AV_SAMPLE_FMT_S16, c->channel_layout,
+                                       c->sample_rate, nb_samples);
+
+    // 将音频编码器的参数复制到输出流的编解码器参数中
+    ret = avcodec_parameters_from_context(ost->st->codecpar, c);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not copy the stream parameters\n");
+        exit(1);
+    }
+
+    // 创建音频重采样器上下文
+    ost->swr_ctx = swr_alloc();
+    if (!ost->swr_ctx)
+    {
+        fprintf(stderr, "Could not allocate resampler context\n");
+        exit(1);
+    }
+
+    // 设置音频重采样器上下文的参数，包括输入通道数、输入采样率、输入采样格式、输出通道数、输出采样率和输出采样格式
+    av_opt_set_int       (ost->swr_ctx, "in_channel_count",   c->channels,       0);
+    av_opt_set_int       (ost->swr_ctx, "in_sample_rate",     c->sample_rate,    0);
+    av_opt_set_sample_fmt(ost->swr_ctx, "in_sample_fmt",      AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_int       (ost->swr_ctx, "out_channel_count",  c->channels,       0);
+    av_opt_set_int       (ost->swr_ctx, "out_sample_rate",    c->sample_rate,    0);
+    av_opt_set_sample_fmt(ost->swr_ctx, "out_sample_fmt",     c->sample_fmt,     0);
+
+    /* initialize the resampling context */
+    if ((ret = swr_init(ost->swr_ctx)) < 0)
+    {
+        fprintf(stderr, "Failed to initialize the resampling context\n");
+        exit(1);
+    }
+
+    init_stream_timing(ost);
+}
+
+
+
+
+
+
+/**
+ * @brief EBU R128 响度表（-loudness）。write_audio_frame 把交给编码器的每一帧的样本拷贝进响度表自己的缓冲区，
+ * 由独立的线程按 ITU-R BS.1770 计算：K 加权（高架 + 高通两个双二阶节）、100ms 子块上的瞬时（400ms）
+ * 和短期（3s）响度、经过绝对门限（-70 LUFS）和相对门限（-10 LU）的综合响度，以及 4 倍过采样的真峰值。
+ * 编码线程只多做一次样本拷贝；不持有帧的引用，下一帧的 av_frame_make_writable 不需要复制整帧
+ */
+#define LOUDNESS_MAX_CHANNELS 8
+#define LOUDNESS_TP_TAPS      12                 /* 真峰值插值滤波器每个相位的抽头数 */
+#define LOUDNESS_SHORT_BLOCKS 30                 /* 短期响度的窗口（100ms 子块个数） */
+#define LOUDNESS_CHUNK        4096               /* 测量线程每次从缓冲区取出的样本数 */
+
+typedef struct LoudnessMeter {
+    int sample_rate;
+    int channels;
+    enum AVSampleFormat format;
+    // 每个声道的权重：左右中 1.0，环绕 1.41，LFE 不计入
+    double weight[LOUDNESS_MAX_CHANNELS];
+
+    // K 加权滤波器：两个双二阶节（a[i][0] 为 1），以及每个声道的转置直接 II 型状态
+    double b[2][3], a[2][3];
+    double z[LOUDNESS_MAX_CHANNELS][2][2];
+
+    // 当前 100ms 子块已经累积的样本数和加权平方和；最近 LOUDNESS_SHORT_BLOCKS 个子块的平方和
+    int sub_size;
+    int sub_pos;
+    double sub_sum;
+    double subs[LOUDNESS_SHORT_BLOCKS];
+    int64_t nb_subs;
+    // 每 100ms 一个的 400ms 块的能量（均方），结束时用于门限计算
+    double *blocks;
+    int nb_blocks;
+    int blocks_size;
+    // 最近一次以及最大的瞬时、短期响度（LUFS）
+    double momentary, short_term;
+    double max_momentary, max_short_term;
+
+    // 真峰值：按相位转置的插值系数 coef[k][phase]，每个声道最近的 LOUDNESS_TP_TAPS - 1 个样本之后接着当前帧
+    float coef[LOUDNESS_TP_TAPS][4];
+    float *tp_buf[LOUDNESS_MAX_CHANNELS];
+    int tp_size;
+    float peak;
+    // 测量线程遇到的错误，出错后不再测量，结束时报告错误而不是打印结果
+    int error;
+
+    // 待测量样本的缓冲区（格式与编码器的输入相同）、测量线程每次取出样本的缓冲区、线程，以及保护 fifo 和 eof 的锁
+    AVAudioFifo *fifo;
+    uint8_t **chunk;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int eof;
+    // 2: 每秒打印一次当前的响度
+    int verbose;
+    // 统计信息：测量线程的忙碌时间、编码线程入队的耗时（微秒）
+    int64_t busy;
+    int64_t push_time;
+} LoudnessMeter;
+
+static LoudnessMeter loudness_meter;
+
+/* 把能量（均方）换算成 LUFS */
+static double loudness_lufs(double energy)
+{
+    return energy > 0 ? -0.691 + 10 * log10(energy) : -HUGE_VAL;
+}
+
+/**
+ * @brief 在 LOUDNESS_TP_TAPS 个样本 x[0..] 上插值出 x[5]、x[5.25]、x[5.5]、x[5.75]，返回 4 个值绝对值的最大值和 peak 中的较大者
+ */
+static float loudness_peak_c(const float coef[][4], const float *x, int n, float peak)
+{
+    float v[4];
+    int i, k, p;
+
+    for (i = 0; i < n; i++)
+    {
+        for (p = 0; p < 4; p++)
+        {
+            v[p] = 0;
+            for (k = 0; k < LOUDNESS_TP_TAPS; k++)
+            {
+                v[p] += x[i + k] * coef[k][p];
+            }
+            peak = FFMAX(peak, fabsf(v[p]));
+        }
+    }
+    return peak;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief 真峰值的 SSE 实现：4 个相位放在一个向量中，每个抽头一次乘加，最大值也在向量中累积
+ */
+__attribute__((target("sse2")))
+static float loudness_peak_sse2(const float coef[][4], const float *x, int n, float peak)
+{
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 c[LOUDNESS_TP_TAPS], acc, vmax = _mm_set1_ps(peak);
+    float m[4];
+    int i, k;
+
+    for (k = 0; k < LOUDNESS_TP_TAPS; k++)
+    {
+        c[k] = _mm_loadu_ps(coef[k]);
+    }
+    for (i = 0; i < n; i++)
+    {
+        acc = _mm_mul_ps(_mm_set1_ps(x[i]), c[0]);
+        for (k = 1; k < LOUDNESS_TP_TAPS; k++)
+        {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(x[i + k]), c[k]));
+        }
+        vmax = _mm_max_ps(vmax, _mm_and_ps(acc, abs_mask));
+    }
+    _mm_storeu_ps(m, vmax);
+    return FFMAX(FFMAX(m[0], m[1]), FFMAX(m[2], m[3]));
+}
+#elif defined(__aarch64__)
+static float loudness_peak_neon(const float coef[][4], const float *x, int n, float peak)
+{
+    float32x4_t c[LOUDNESS_TP_TAPS], acc, vmax = vdupq_n_f32(peak);
+    int i, k;
+
+    for (k = 0; k < LOUDNESS_TP_TAPS; k++)
+    {
+        c[k] = vld1q_f32(coef[k]);
+    }
+    for (i = 0; i < n; i++)
+    {
+        acc = vmulq_n_f32(c[0], x[i]);
+        for (k = 1; k < LOUDNESS_TP_TAPS; k++)
+        {
+            acc = vfmaq_n_f32(acc, c[k], x[i + k]);
+        }
+        vmax = vmaxq_f32(vmax, vabsq_f32(acc));
+    }
+    return vmaxvq_f32(vmax);
+}
+#endif
+
+/* 当前 CPU 上最快的真峰值实现，由 loudness_start 选择 */
+static float (*loudness_peak)(const float coef[][4], const float *x, int n, float peak) = loudness_peak_c;
+
+/**
+ * @brief 用门限计算到目前为止的综合响度：先去掉低于 -70 LUFS 的块，再去掉低于它们平均值 10 LU 的块
+ */
+static double loudness_integrated(const LoudnessMeter *m)
+{
+    double abs_gate = pow(10, (-70 + 0.691) / 10), rel_gate, sum = 0;
+    int i, n = 0;
+
+    for (i = 0; i < m->nb_blocks; i++)
+    {
+        if (m->blocks[i] > abs_gate)
+        {
+            sum += m->blocks[i];
+            n++;
+        }
+    }
+    if (!n)
+    {
+        return -HUGE_VAL;
+    }
+    rel_gate = sum / n / 10;
+
+    sum = 0;
+    n   = 0;
+    for (i = 0; i < m->nb_blocks; i++)
+    {
+        if (m->blocks[i] > abs_gate && m->blocks[i] > rel_gate)
+        {
+            sum += m->blocks[i];
+            n++;
+        }
+    }
+    return n ? loudness_lufs(sum / n) : -HUGE_VAL;
+}
+
+/**
+ * @brief 一个 100ms 子块结束：更新瞬时、短期响度，记录 400ms 块的能量
+ */
+static int loudness_end_sub_block(LoudnessMeter *m)
+{
+    double sum = 0, *blocks;
+    int i, n;
+
+    m->subs[m->nb_subs++ % LOUDNESS_SHORT_BLOCKS] = m->sub_sum;
+    m->sub_sum = 0;
+    m->sub_pos = 0;
+
+    if (m->nb_subs >= 4)
+    {
+        for (i = 1; i <= 4; i++)
+        {
+            sum += m->subs[(m->nb_subs - i) % LOUDNESS_SHORT_BLOCKS];
+        }
+        if (m->nb_blocks == m->blocks_size)
+        {
+            m->blocks_size = FFMAX(2 * m->blocks_size, 1024);
+            blocks = av_realloc_array(m->blocks, m->blocks_size, sizeof(*blocks));
+            if (!blocks)
+            {
+                return AVERROR(ENOMEM);
+            }
+            m->blocks = blocks;
+        }
+        m->blocks[m->nb_blocks++] = sum / (4 * m->sub_size);
+        m->momentary     = loudness_lufs(sum / (4 * m->sub_size));
+        m->max_momentary = FFMAX(m->max_momentary, m->momentary);
+    }
+    if (m->nb_subs >= LOUDNESS_SHORT_BLOCKS)
+    {
+        for (i = 0, sum = 0; i < LOUDNESS_SHORT_BLOCKS; i++)
+        {
+            sum += m->subs[i];
+        }
+        m->short_term     = loudness_lufs(sum / (LOUDNESS_SHORT_BLOCKS * m->sub_size));
+        m->max_short_term = FFMAX(m->max_short_term, m->short_term);
+    }
+
+    if (m->verbose > 1 && m->nb_subs % 10 == 0)
+    {
+        n = (int)(m->nb_subs / 10);
+        fprintf(stderr, "loudness: t=%ds M %.1f S %.1f I %.1f LUFS\n", n, m->momentary, m->short_term,
+                loudness_integrated(m));
+    }
+    return 0;
+}
+
+/**
+ * @brief 测量一段音频
+ * @param data 每个平面的样本，格式为 m->format
+ * @param n 样本数
+ */
+static int loudness_process(LoudnessMeter *m, uint8_t *const *data, int n)
+{
+    enum AVSampleFormat fmt = m->format;
+    enum AVSampleFormat packed = av_get_packed_sample_fmt(fmt);
+    int planar = av_sample_fmt_is_planar(fmt);
+    int stride = planar ? 1 : m->channels;
+    int ch, i, j, ret;
+    const uint8_t *src;
+    float *x;
+    double y, t;
+
+    if (!sample_fmt_to_float_supported(fmt))
+    {
+        fprintf(stderr, "loudness: unsupported sample format %s\n", av_get_sample_fmt_name(fmt));
+        return AVERROR(EINVAL);
+    }
+
+    if (n > m->tp_size)
+    {
+        for (ch = 0; ch < m->channels; ch++)
+        {
+            x = av_realloc_array(m->tp_buf[ch], n + LOUDNESS_TP_TAPS - 1, sizeof(*x));
+            if (!x)
+            {
+                return AVERROR(ENOMEM);
+            }
+            // 第一次分配时历史样本还不存在，按静音处理
+            if (!m->tp_size)
+            {
+                memset(x, 0, (LOUDNESS_TP_TAPS - 1) * sizeof(*x));
+            }
+            m->tp_buf[ch] = x;
+        }
+        m->tp_size = n;
+    }
+
+    for (ch = 0; ch < m->channels; ch++)
+    {
+        // 当前帧的样本接在上一帧最后 LOUDNESS_TP_TAPS - 1 个样本之后，插值可以跨越帧边界
+        x   = m->tp_buf[ch] + LOUDNESS_TP_TAPS - 1;
+        src = data[planar ? ch : 0];
+        j   = planar ? 0 : ch;
+        for (i = 0; i < n; i++)
+        {
+            x[i] = sample_to_float(src, packed, j + i * stride);
+        }
+
+        m->peak = loudness_peak(m->coef, m->tp_buf[ch], n, m->peak);
+    }
+
+    // K 加权是递归滤波，逐个样本计算；子块边界按样本对齐，所有声道一起推进
+    for (i = 0; i < n; i++)
+    {
+        for (ch = 0; ch < m->channels; ch++)
+        {
+            if (!m->weight[ch])
+            {
+                continue;
+            }
+            y = m->tp_buf[ch][LOUDNESS_TP_TAPS - 1 + i];
+            for (j = 0; j < 2; j++)
+            {
+                t = m->b[j][0] * y + m->z[ch][j][0];
+                m->z[ch][j][0] = m->b[j][1] * y - m->a[j][1] * t + m->z[ch][j][1];
+                m->z[ch][j][1] = m->b[j][2] * y - m->a[j][2] * t;
+                y = t;
+            }
+            m->sub_sum += m->weight[ch] * y * y;
+        }
+        if (++m->sub_pos == m->sub_size && (ret = loudness_end_sub_block(m)) < 0)
+        {
+            return ret;
+        }
+    }
+
+    for (ch = 0; ch < m->channels; ch++)
+    {
+        memmove(m->tp_buf[ch], m->tp_buf[ch] + n, (LOUDNESS_TP_TAPS - 1) * sizeof(**m->tp_buf));
+    }
+    return 0;
+}
+
+static void *loudness_main(void *arg)
+{
+    LoudnessMeter *m = arg;
+    int64_t t;
+    int n, ret = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&m->lock);
+        while (!av_audio_fifo_size(m->fifo) && !m->eof)
+        {
+            pthread_cond_wait(&m->cond, &m->lock);
+        }
+        if (!av_audio_fifo_size(m->fifo))
+        {
+            pthread_mutex_unlock(&m->lock);
+            break;
+        }
+        n = av_audio_fifo_read(m->fifo, (void **)m->chunk, LOUDNESS_CHUNK);
+        pthread_mutex_unlock(&m->lock);
+
+        // 出错之后继续清空缓冲区，不再测量
+        t = av_gettime_relative();
+        if (ret >= 0 && (ret = n < 0 ? n : loudness_process(m, m->chunk, n)) < 0)
+        {
+            m->error = ret;
+        }
+        m->busy += av_gettime_relative() - t;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 释放响度表的缓冲区，m->fifo 置为 NULL
+ */
+static void loudness_free(LoudnessMeter *m)
+{
+    int ch;
+
+    for (ch = 0; ch < LOUDNESS_MAX_CHANNELS; ch++)
+    {
+        av_freep(&m->tp_buf[ch]);
+    }
+    av_freep(&m->blocks);
+    if (m->chunk)
+    {
+        av_freep(&m->chunk[0]);
+    }
+    av_freep(&m->chunk);
+    av_audio_fifo_free(m->fifo);
+    m->fifo = NULL;
+}
+
+/**
+ * @brief 按编码器的采样率和声道布局初始化响度表并启动测量线程
+ */
+static int loudness_start(LoudnessMeter *m, const AVCodecContext *c, int verbose)
+{
+    double f0, g, q, k, vh, vb, a0;
+    double x, w;
+    int ch, i, p;
+    uint64_t id;
+
+    memset(m, 0, sizeof(*m));
+    m->sample_rate    = c->sample_rate;
+    m->channels       = c->channels;
+    m->format         = c->sample_fmt;
+    m->verbose        = verbose;
+    m->sub_size       = c->sample_rate / 10;
+    m->momentary      = -HUGE_VAL;
+    m->short_term     = -HUGE_VAL;
+    m->max_momentary  = -HUGE_VAL;
+    m->max_short_term = -HUGE_VAL;
+    if (m->channels > LOUDNESS_MAX_CHANNELS)
+    {
+        fprintf(stderr, "loudness: at most %d channels are supported\n", LOUDNESS_MAX_CHANNELS);
+        return AVERROR(EINVAL);
+    }
+
+    for (ch = 0; ch < m->channels; ch++)
+    {
+        id = c->channel_layout ? av_channel_layout_extract_channel(c->channel_layout, ch) : 0;
+        if (id == AV_CH_LOW_FREQUENCY || id == AV_CH_LOW_FREQUENCY_2)
+        {
+            m->weight[ch] = 0;
+        }
+        else if (id & (AV_CH_BACK_LEFT | AV_CH_BACK_RIGHT | AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT))
+        {
+            m->weight[ch] = 1.41;
+        }
+        else
+        {
+            m->weight[ch] = 1.0;
+        }
+    }
+
+    // BS.1770 的两级滤波器在 48kHz 下给出了系数，这里按任意采样率重新做双线性变换
+    f0 = 1681.974450955533;
+    g  = 3.999843853973347;
+    q  = 0.7071752369554196;
+    k  = tan(M_PI * f0 / m->sample_rate);
+    vh = pow(10, g / 20);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1 + k / q + k * k;
+    m->b[0][0] = (vh + vb * k / q + k * k) / a0;
+    m->b[0][1] = 2 * (k * k - vh) / a0;
+    m->b[0][2] = (vh - vb * k / q + k * k) / a0;
+    m->a[0][0] = 1;
+    m->a[0][1] = 2 * (k * k - 1) / a0;
+    m->a[0][2] = (1 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q  = 0.5003270373238773;
+    k  = tan(M_PI * f0 / m->sample_rate);
+    a0 = 1 + k / q + k * k;
+    m->b[1][0] = 1;
+    m->b[1][1] = -2;
+    m->b[1][2] = 1;
+    m->a[1][0] = 1;
+    m->a[1][1] = 2 * (k * k - 1) / a0;
+    m->a[1][2] = (1 - k / q + k * k) / a0;
+
+    // 真峰值插值：加 Hann 窗的 sinc，相位 p 对应 x[5 + p / 4]
+    for (p = 0; p < 4; p++)
+    {
+        for (i = 0; i < LOUDNESS_TP_TAPS; i++)
+        {
+            x = i - 5 - p / 4.0;
+            w = 0.5 * (1 + cos(M_PI * x / 6));
+            m->coef[i][p] = x == 0 ? 1 : w * sin(M_PI * x) / (M_PI * x);
+        }
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    {
+        loudness_peak = loudness_peak_sse2;
+    }
+#elif defined(__aarch64__)
+    loudness_peak = loudness_peak_neon;
+#endif
+
+    m->fifo = av_audio_fifo_alloc(m->format, m->channels, 16 * LOUDNESS_CHUNK);
+    if (!m->fifo || av_samples_alloc_array_and_samples(&m->chunk, NULL, m->channels, LOUDNESS_CHUNK,
+                                                       m->format, 0) < 0)
+    {
+        loudness_free(m);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+    if (pthread_create(&m->thread, NULL, loudness_main, m))
+    {
+        fprintf(stderr, "loudness: could not create thread\n");
+        pthread_mutex_destroy(&m->lock);
+        pthread_cond_destroy(&m->cond);
+        loudness_free(m);
+        return AVERROR(EAGAIN);
+    }
+    return 0;
+}
+
+/**
+ * @brief 在编码线程中调用：把 frame 的样本拷贝进响度表的缓冲区，不保留 frame 的引用。
+ * 缓冲区不设上限，编码线程从不等待测量
+ */
+static int loudness_push(LoudnessMeter *m, const AVFrame *frame)
+{
+    int64_t t = av_gettime_relative();
+    int ret;
+
+    pthread_mutex_lock(&m->lock);
+    ret = av_audio_fifo_write(m->fifo, (void **)frame->extended_data, frame->nb_samples);
+    if (ret >= 0)
+    {
+        pthread_cond_signal(&m->cond);
+    }
+    pthread_mutex_unlock(&m->lock);
+    m->push_time += av_gettime_relative() - t;
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * @brief 等待测量线程处理完队列中剩下的帧，打印结果并释放资源
+ * @return 0 表示成功，负数表示测量线程遇到的错误（这时不打印响度）
+ */
+static int loudness_finish(LoudnessMeter *m)
+{
+    int ret;
+
+    if (!m->fifo)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&m->lock);
+    m->eof = 1;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->thread, NULL);
+
+    // pthread_join 之后可以直接读取测量线程写入的结果
+    ret = m->error;
+    if (ret < 0)
+    {
+        fprintf(stderr, "loudness: measurement failed: %s\n", av_err2str(ret));
+    }
+    else
+    {
+        fprintf(stderr, "loudness: I %.1f LUFS, M max %.1f last %.1f, S max %.1f last %.1f, true peak %.1f dBTP\n",
+                loudness_integrated(m), m->max_momentary, m->momentary, m->max_short_term, m->short_term,
+                m->peak > 0 ? 20 * log10(m->peak) : -HUGE_VAL);
+    }
+    fprintf(stderr, "loudness: meter busy %.1f ms, push %.3f ms on encode thread\n",
+            m->busy / 1000.0, m->push_time / 1000.0);
+
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->cond);
+    loudness_free(m);
+    return ret;
+}
+
+
+
+
+
+/**
+ * @brief 音画同步测试模式（-sync_test）中事件的间隔（视频帧数）。间隔按整数帧计算，
+ * 第 k 个事件的视频帧和音频样本都从 k * sync_period_frames() / STREAM_FRAME_RATE 秒开始
+ */
+static int sync_period_frames(void)
+{
+    return (int)FFMAX(llrint(sync_period * STREAM_FRAME_RATE), 1);
+}
+
+/**
+ * @brief 音画同步测试模式中第 n 个音频样本的值：每个事件开始时响一帧长的 SYNC_TONE_HZ 短音，其余时间静音。
+ * 第 k 个事件从第 k * sync_period_frames() * sample_rate / STREAM_FRAME_RATE 个样本开始，与闪白的视频帧的 pts 相同
+ */
+static int sync_test_sample(int64_t n, int sample_rate)
+{
+    int64_t period = (int64_t)sync_period_frames() * sample_rate / STREAM_FRAME_RATE;
+    int64_t pos    = n % period;
+
+    if (pos >= sample_rate / STREAM_FRAME_RATE)
+    {
+        return 0;
+    }
+    return (int)(sin(2 * M_PI * SYNC_TONE_HZ * pos / sample_rate) * 10000);
+}
+
+
+
+
+
+/**
+ * 生成音频帧并且填充音频数据
+ * */
+static AVFrame *get_audio_frame(OutputStream *ost)
+{
+    // 初始化为输出流中的临时音频帧
+    AVFrame *frame = ost->tmp_frame;
+    int j, i, v;
+    // 初始化为音频帧中第一个数据平面的指针，用于填充音频帧的样本数据
+    int16_t *q = (int16_t*)frame->data[0];
+
+    // 比较时间戳，检查是否超过了预定的流时长，如果超过了就返回 null，不再生成更多的音频帧
+    // end_pts 在打开编码器时已经换算好，这里只需要整数比较
+    if (ost->next_pts > ost->end_pts)
+    {
+        return NULL;
+    }
+
+
+    // 进入一个循环，用于生成音频样本数据
+    // 遍历音频帧中的每一个样本
+    for (j = 0; j < frame->nb_samples; j++)
+    {
+        // 计算一个样本的音频数据。这里使用正弦函数来生成音频信号的振幅，乘以10000以将其缩放到合适的范围 ost->t 表示时间
+        // 根据正弦函数的变化来生成音频波形
+        v = (int)(sin(ost->t) * 10000);
+        // 音画同步测试模式：只在事件处响一段短音，其余时间静音
+        if (sync_period > 0)
+        {
+            v = sync_test_sample(ost->next_pts + j, ost->enc->sample_rate);
+        }
+
+        // 遍历每个音频通道
+        for (i = 0; i < ost->enc->channels; i++)
+        {
+            // 将计算得到的音频数据存储到音频帧中，并移动指针 q 到下一个样本位置
+            *q++ = v;
+        }
+
+        // 控制正弦波的时间和频率
+        ost->t     += ost->tincr;
+        ost->tincr += ost->tincr2;
+    }
+
+    // 设置音频帧的时间戳为下一个时间戳
+    frame->pts = ost->next_pts;
+    // 增加下一个时间戳，以确保下一个音频帧具有递增的时间戳
+    ost->next_pts  += frame->nb_samples;
+
+    // 返回填充好数据的音频帧
+    return frame;
+}
+
+
+
+
+
+
+/**
+ * 将生成的音频帧进行编码，并将编码后的音频数据写入到输出媒体文件中，同时更新时间戳和样本计数
+ * */
+static int write_audio_frame(AVFormatContext *oc, OutputStream *ost)
+{
+    // 表示音频编码器的上下文
+    AVCodecContext *c;
+    // 存储音频帧
+    AVFrame *frame;
+    // 存储函数返回值或者错误代码
+    int ret;
+    // 用于表示目标样本数
+    int dst_nb_samples;
+    // 生成这一帧之前的生成器状态，供检查点使用
+    GeneratorState state = { 0, ost->next_pts, ost->samples_count, ost->t, ost->tincr };
+    // 将输出流结构体中的音频编码器上下文赋值给c
+    c = ost->enc;
+    // 获取音频帧
+    frame = get_audio_frame(ost);
+
+    if (frame)
+    {
+        // 将原音频帧的样本数与音频编码器的采样率进行比例缩放，以获得目标音频帧的样本数。这一步
+        // 通常涉及到重采样，以确保音频数据与编码器的期望格式相匹配
+        dst_nb_samples = av_rescale_rnd(swr_get_delay(ost->swr_ctx, c->sample_rate) + frame->nb_samples,
+                                        c->sample_rate,
+                                        c->sample_rate,
+                                        AV_ROUND_UP);
+        // 确保 dst_nb_samples 与源音频帧的样本数一致
+        av_assert0(dst_nb_samples == frame->nb_samples);
+
+        // 确保 ost->frame 可以被写入，因为编码器可能会在内部保留对输入帧的引用
+        ret = av_frame_make_writable(ost->frame);
+        if (ret < 0)
+            exit(1);
+
+        // 将音频数据从源格式转换为目标格式
+        // ost->swr_ctx 是一个音频重采样器上下文，用于执行格式转换
+        // ost->frame->data 存储着目标音频数据的位置
+        // dst_nb_samples 表示目标样本数
+        // frame->data 存储着源音频数据的位置
+        // frame->nb_samples 表示源音频帧的样本数
+        ret = swr_convert(ost->swr_ctx,
+                          ost->frame->data,
+                          dst_nb_samples,
+                          (const uint8_t **)frame->data,
+                          frame->nb_samples);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Error while converting\n");
+            exit(1);
+        }
+        // 将frame更新为转换后的音频帧
+        frame = ost->frame;
+        // 根据样本计数和编码器的时间基准计算音频帧的时间戳
+        // 时间基准就是 1/sample_rate 时（add_stream 的默认设置）无需换算
+        frame->pts = ost->samples_pts ? ost->samples_count :
+                     av_rescale_q(ost->samples_count, (AVRational){1, c->sample_rate}, c->time_base);
+        // 增加样本计数以跟踪以处理的样本数量
+        ost->samples_count += dst_nb_samples;
+        ost->nb_frames++;
+
+        if (loudness && loudness_push(&loudness_meter, frame) < 0)
+        {
+            fprintf(stderr, "Could not queue the frame for the loudness meter\n");
+            exit(1);
+        }
+
+        if (checkpoint.filename)
+        {
+            state.pts = frame->pts;
+            ost->history[ost->nb_history++ % GENERATOR_HISTORY] = state;
+        }
+    }
+    else if (async_drain)
+    {
+        // 没有更多的音频帧，在独立线程中冲刷编码器
+        start_drain(ost);
+        return 1;
+    }
+
+    // 将编码后的音频数帧写入到输出媒体文件中，其中包括媒体容器、音频编码器上下文、输出流、音频帧和临时数据包
+    return write_frame(oc, ost, frame);
+}
+
+
+
+
+
+
+/**
+ * 为图像帧分配内存，并设置图像帧的基本属性，以便后续在图像处理或编码中使用。
+ * 这是一个常见的多媒体处理函数，用于准备图像数据以供进一步处理
+ * */
+static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
+{
+    // 表示图像帧
+    AVFrame *picture;
+    // 存储函数返回值或者错误代码
+    int ret;
+
+    // 分配一个空的AVFrame结构体，并将地址赋值给 picture，这个函数
+    // 分配了一个用于存储图像数据的框架，但是还没有分配数据缓冲区
+    picture = av_frame_alloc();
+    if (!picture)
+    {
+        return NULL;
+    }
+
+    // 设置图像帧的像素格式，通常是枚举值 pix_fmt, 表示图像的颜色编码格式，如 yuv420，rgb 等
+    picture->format = pix_fmt;
+    // 设置图像帧的宽度
+    picture->width  = width;
+    // 设置图像帧的高度
+    picture->height = height;
+
+    // 分配图像帧的数据缓冲区，这个函数会根据图像帧的属性（像素格式、宽度、高度等）自动分配合适大小的内存
+    // 用于存储图像数据
+    ret = av_frame_get_buffer(picture, 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not allocate frame data.\n");
+        exit(1);
+    }
+
+    return picture;
+}
+
+
+
+
+/**
+ * @brief 初始化视频编码器，包括打开编码器、分配图像帧内存、处理不同的像素格式以及复制流
+ * 参数到复用器中。这是一个用于准备视频编码的关键函数，在多媒体处理应用程序中常用于处理和
+ * 编码视频流
+ * @param oc 表示媒体格式的上下文，通常用于表示媒体文件的格式信息和写入媒体文件
+ * @param codec 表示要使用的视频编码器，指定了视频数据的编码方式，确定了视频数据的压缩格式
+ * @param ost 表示输出流，包括视频编码器的相关设置和参数，例如视频编码器上下文、临时帧
+ * @param opt_arg 表示用于配置视频编码器的选项参数的字典
+ */
+static void open_video(AVFormatContext *oc,
+                       const AVCodec *codec,
+                       OutputStream *ost,
+                       AVDictionary *opt_arg)
+{
+    // 存储函数返回值或者错误代码
+    int ret;
+    // 将输出流中的编码器上下文赋值给c
+    AVCodecContext *c = ost->enc;
+    // 存储一些选项参数
+    AVDictionary *opt = NULL;
+    // 将传入的 opt_arg 字典拷贝到opt字典中，以便后续用于配置视频编码器的选项
+    av_dict_copy(&opt, opt_arg, 0);
+
+    // 打开视频编码器，并将 opt 应用与它
+    ret = avcodec_open2(c, codec, &opt);
+    av_dict_free(&opt);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
+        exit(1);
+    }
+
+    // 分配并且初始化一个重复使用的视频帧
+    // 使用 alloc_picture 函数分配图像帧内存，传入了像素格式 c->pic_fmt,宽度 c->width 和高度 c->height
+    ost->frame = alloc_picture(c->pix_fmt, c->width, c->height);
+    if (!ost->frame)
+    {
+        fprintf(stderr, "Could not allocate video frame\n");
+        exit(1);
+    }
+
+    // 根据像素格式 c->pic_fmt 的不同，可能需要分配一个临时的 yuv420p 格式图像帧， ost->tmp_frame
+    // 如果视频的输出像素格式不是 yuv420p，就需要分配一个 yuv420p 格式的临时图像帧，后续会将它转换为所需要的输出格式
+    ost->tmp_frame = NULL;
+    if (c->pix_fmt != AV_PIX_FMT_YUV420P)
+    {
+        ost->tmp_frame = alloc_picture(AV_PIX_FMT_YUV420P, c->width, c->height);
+        if (!ost->tmp_frame)
+        {
+            fprintf(stderr, "Could not allocate temporary picture\n");
+            exit(1);
+        }
+    }
+
+    // 将视频流的参数复制到复用器中，
+    ret = avcodec_parameters_from_context(ost->st->codecpar, c);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not copy the stream parameters\n");
+        exit(1);
+    }
+
+    init_stream_timing(ost);
+}
+
+
+
+
+/**
+ * @brief 生成一个 yuv 格式的图像数据帧，其中包含 y、cb、cr 分量的数据。
+ * 生成的图像数据可以用于视频编码或处理，以产生特定的图像效果
+ * @param pict 图像帧
+ * @param frame_index 当前帧的索引或者帧号，用于生成图像数据的模式
+ * @param width 图像的宽度
+ * @param height 图像的高度
+ */
+static void fill_yuv_image(AVFrame *pict,
+                           int frame_index,
+                           int width,
+                           int height)
+{
+    int x, y, i;
+
+    // 将帧号赋值给变量i，用于生成图像数据的模式
+    i = frame_index;
+
+    // 遍历图像的每一行
+    for (y = 0; y < height; y++)
+    {
+        // 遍历图像的每一列
+        for (x = 0; x < width; x++)
+        {
+            // 当前像素位置 (x, y) 处， 将计算得到的Y分量值（亮度值）存储到图像帧的Y分量数据平面中。
+            // 这个计算使用了 (x + y + i * 3)，其中 i 是帧号，用于生成不同的模式。
+            pict->data[0][y * pict->linesize[0] + x] = x + y + i * 3;
+        }
+    }
+
+    // 外部循环，遍历 Cb 和 Cr 分量的每一行，注意是图像高度的一半
+    for (y = 0; y < height / 2; y++) {
+        // 内部循环，遍历Cb和Cr分量的每一列，注意是图像宽度的一半。
+        for (x = 0; x < width / 2; x++) {
+            // 在当前位置 (x, y) 处，将计算得到的Cb分量值（蓝色色度值）存储到图像帧的Cb分量数据平面中
+            pict->data[1][y * pict->linesize[1] + x] = 128 + y + i * 2;
+            // 在当前位置 (x, y) 处，将计算得到的Cr分量值（红色色度值）存储到图像帧的Cr分量数据平面中。
+            pict->data[2][y * pict->linesize[2] + x] = 64 + x + i * 5;
+        }
+    }
+}
+
+
+
+
+
+/**
+ * @brief 在 yuv420p 测试图像的左上角打上亮度条码（-barcode），记录帧号（next_pts）和此刻的墙钟时间，
+ * 下游解码后用 barcode_detect 读出，计算端到端延迟和丢帧。条码共 128 位：16 位标记、32 位帧号、
+ * 64 位发送时间（微秒，av_gettime）和 16 位 CRC，按大端序逐位写成 BARCODE_CELL x BARCODE_CELL 的黑（16）白（235）块，
+ * 每块与编码器的 8x8 变换块对齐，只有直流分量，有损压缩后仍然可以可靠地读出
+ * @param pict yuv420p 图像帧，宽至少 BARCODE_COLS * BARCODE_CELL，高至少 BARCODE_ROWS * BARCODE_CELL
+ * @param frame_index 帧号
+ */
+static void stamp_barcode(AVFrame *pict, int64_t frame_index)
+{
+    uint8_t payload[16];
+    uint8_t *row;
+    int bit, x, y, i;
+
+    AV_WB16(payload, BARCODE_MAGIC);
+    AV_WB32(payload + 2, (uint32_t)frame_index);
+    AV_WB64(payload + 6, av_gettime());
+    AV_WB16(payload + 14, av_crc(av_crc_get_table(AV_CRC_16_ANSI), 0, payload, 14));
+
+    for (bit = 0; bit < 8 * sizeof(payload); bit++)
+    {
+        x   = bit % BARCODE_COLS * BARCODE_CELL;
+        y   = bit / BARCODE_COLS * BARCODE_CELL;
+        row = pict->data[0] + y * pict->linesize[0] + x;
+        for (i = 0; i < BARCODE_CELL; i++)
+        {
+            memset(row + i * pict->linesize[0], payload[bit >> 3] & (0x80 >> (bit & 7)) ? 235 : 16, BARCODE_CELL);
+        }
+    }
+}
+
+
+
+
+
+/**
+ * @brief 生成第 frame_index 帧 yuv420p 测试图像：fill_yuv_image 的渐变，音画同步测试模式中事件所在的帧整帧闪白，
+ * 最后按需要打上条码
+ */
+static void draw_test_image(AVFrame *pict, int64_t frame_index, int width, int height)
+{
+    int y;
+
+    fill_yuv_image(pict, frame_index, width, height);
+
+    if (sync_period > 0 && frame_index % sync_period_frames() == 0)
+    {
+        for (y = 0; y < height; y++)
+        {
+            memset(pict->data[0] + y * pict->linesize[0], 235, width);
+        }
+        for (y = 0; y < height / 2; y++)
+        {
+            memset(pict->data[1] + y * pict->linesize[1], 128, width / 2);
+            memset(pict->data[2] + y * pict->linesize[2], 128, width / 2);
+        }
+    }
+
+    if (barcode)
+    {
+        stamp_barcode(pict, frame_index);
+    }
+}
+
+
+
+
+
+/**
+ * @brief 渲染第 frame_index 帧测试图像，并转换为编码器需要的像素格式写入 dst
+ * @param ost 视频输出流
+ * @param dst 存放结果的图像帧，必须可写
+ * @param frame_index 帧号
+ */
+static void render_video_frame(OutputStream *ost, AVFrame *dst, int64_t frame_index)
+{
+    AVCodecContext *c = ost->enc;
+
+    if (c->pix_fmt != AV_PIX_FMT_YUV420P)
+    {
+        // 如果视频帧的像素格式不是 AV_PIC_FMT_YUV420P，说明输出视频需要的像素格式与生成的图像格式不匹配
+        // 创建一个图像格式转换上下文 ost->sws_ctx, 用于将生成的 YUV420P 格式图像转换为编码期望的格式 c->pix_fmt
+        // 如果无法创建转换上下文，就在标准错误流中打印错误消息并退出程序
+        if (!ost->sws_ctx)
+        {
+            ost->sws_ctx = sws_getContext(c->width,
+                                          c->height,
+                                          AV_PIX_FMT_YUV420P,
+                                          c->width,
+                                          c->height,
+                                          c->pix_fmt,
+                                          SCALE_FLAGS,
+                                          NULL,
+                                          NULL,
+                                          NULL);
+            if (!ost->sws_ctx)
+            {
+                fprintf(stderr, "Could not initialize the conversion context\n");
+                exit(1);
+            }
+        }
+
+        // 调用 fill_yuv_image 函数，根据 frame_index、c->width、c->height
+        // 生成 yuv 格式的图像数据。这个函数负责填充 y、db 和 cr 分量的数据
+        draw_test_image(ost->tmp_frame, frame_index, c->width, c->height);
+
+        // 使用 sws_scale 函数将生成的 yuv 数据从 yuv420p 格式转换为编码器期望的像素格式 c->pic_fmt
+        // ost->sws_ctx 是图像格式转换上下文
+        // ost->tmp_frame 存储着待转换的图像数据
+        // dst 存储着转换后的图像数据
+        sws_scale(ost->sws_ctx,
+                  (const uint8_t * const *) ost->tmp_frame->data,
+                  ost->tmp_frame->linesize,
+                  0,
+                  c->height,
+                  dst->data,
+                  dst->linesize);
+    }
+    else
+    {
+        // 如果像素格式是yuv420p，则直接调用 fill_yuv_image 函数填充 dst
+        draw_test_image(dst, frame_index, c->width, c->height);
+    }
+}
+
+
+
+
+
+/**
+ * @brief 预先渲染 nb_frames 帧测试图像并转换为编码器的像素格式，之后 get_video_frame 只交出它们的引用。
+ * fill_yuv_image 的像素值按 256 取模，测试图像以 FRAME_CACHE_PERIOD 帧为周期重复，
+ * 缓存一个完整周期（或其整数倍）时输出与不使用缓存时完全相同；更小的窗口会改变画面内容，只适合测试编码器的速度。
+ * 缓存始终持有每一帧的一个引用，编码器拿到的帧不可写，任何写入都会先复制，缓存的内容不会被改变
+ * @param ost 视频输出流
+ * @param nb_frames 缓存的帧数
+ */
+static void init_frame_cache(OutputStream *ost, int nb_frames)
+{
+    AVCodecContext *c = ost->enc;
+    int64_t t0 = av_gettime_relative();
+    int i;
+
+    ost->cache = av_calloc(nb_frames, sizeof(*ost->cache));
+    if (!ost->cache)
+    {
+        fprintf(stderr, "Could not allocate the frame cache\n");
+        exit(1);
+    }
+    for (i = 0; i < nb_frames; i++)
+    {
+        ost->cache[i] = alloc_picture(c->pix_fmt, c->width, c->height);
+        if (!ost->cache[i])
+        {
+            fprintf(stderr, "Could not allocate the frame cache\n");
+            exit(1);
+        }
+        ost->nb_cache++;
+        render_video_frame(ost, ost->cache[i], i);
+    }
+
+    fprintf(stderr, "frame cache: %d frames (%.1f MB) rendered in %.1f ms\n", nb_frames,
+            nb_frames * (double)av_image_get_buffer_size(c->pix_fmt, c->width, c->height, 1) / (1 << 20),
+            (av_gettime_relative() - t0) / 1000.0);
+}
+
+
+
+
+
+/**
+ * @brief 生成视频帧并填充视频数据。
+ * 该函数根据一定的时间间隔生成视频帧，然后将其准备好以供编码和写入媒体文件
+ * @param ost 表示输出流，包含了与输出视频流相关的设置和参数，例如视频编码器的上下文、帧信息等。
+ * @return AVFrame* 
+ */
+static AVFrame *get_video_frame(OutputStream *ost)
+{
+    // 检查是否需要生成更多的视频帧，比较 ost->next_pts 和预先换算到 c->time_base 的 end_pts
+    // 以确定是否超过了预定的流时长 STREAM_DURATION, 如果超过了流时长，就返回 null，不再返回更多的视频帧
+    if (ost->next_pts > ost->end_pts)
+    {
+        return NULL;
+    }
+
+    // 帧缓存模式：直接交出预先渲染好的帧的引用，既不生成图像也不做像素格式转换
+    if (ost->nb_cache)
+    {
+        av_frame_unref(ost->frame);
+        if (av_frame_ref(ost->frame, ost->cache[ost->next_pts % ost->nb_cache]) < 0)
+        {
+            exit(1);
+        }
+        ost->frame->pts = ost->next_pts++;
+        return ost->frame;
+    }
+
+    // 检查是否可以使帧可写，使用 av_frame_make_writable 函数确保 ost->frame 可以被写入
+    // 因为编码器可能会在内部保留对输入帧的引用
+    // 如果无法使帧可写，就退出程序
+    if (av_frame_make_writable(ost->frame) < 0)
+    {
+        exit(1);
+    }
+
+    render_video_frame(ost, ost->frame, ost->next_pts);
+
+    // 设置生成的帧的时间戳，并递增 ost->next_pts，以确保每帧具有递增的时间戳
+    ost->frame->pts = ost->next_pts++;
+
+    // 返回填充好的视频帧
+    return ost->frame;
+}
+
+
+
+
+
+/**
+ * 编码，并将视频写入视频文件
+*/
+static int write_video_frame(AVFormatContext *oc, OutputStream *ost)
+{
+    AVFrame *frame = get_video_frame(ost);
+
+    if (frame)
+    {
+        ost->nb_frames++;
+    }
+    else if (async_drain)
+    {
+        // 没有更多的视频帧，在独立线程中冲刷编码器
+        start_drain(ost);
+        return 1;
+    }
+
+    return write_frame(oc, ost, frame);
+}
+
+
+
+
+
+/**
+ * @brief 关闭输出流，并释放相应的内存资源
+ * @param oc 
+ * @param ost 
+ */
+static void close_stream(AVFormatContext *oc, OutputStream *ost)
+{
+    avcodec_free_context(&ost->enc);
+    av_frame_free(&ost->frame);
+    av_frame_free(&ost->tmp_frame);
+    av_packet_free(&ost->tmp_pkt);
+    sws_freeContext(ost->sws_ctx);
+    swr_free(&ost->swr_ctx);
+    av_fifo_freep(&ost->drain_fifo);
+    while (ost->nb_cache > 0)
+    {
+        av_frame_free(&ost->cache[--ost->nb_cache]);
+    }
+    av_freep(&ost->cache);
+}
+
+
+
+
+
+/**
+ * @brief 估算一个轨道在 moov 中的索引大小（字节）。按最坏情况计算：每个样本单独成为一个 chunk，
+ * 因此每个样本在 stsz(4) + stts(8) + stsc(12) + co64(8) 中各占一项，有 B 帧时还要加上 ctts(8)
+ * @param nb_samples 轨道中的样本（数据包）数量
+ * @param nb_sync 关键帧数量，每个关键帧在 stss 中占 4 字节
+ * @param has_ctts 是否会写 ctts（pts 与 dts 不同，即存在 B 帧）
+ * @param extradata_size 编码器的全局头大小，会被写入 stsd
+ */
+static int64_t estimate_track_index_size(int64_t nb_samples,
+                                         int64_t nb_sync,
+                                         int has_ctts,
+                                         int extradata_size)
+{
+    int64_t per_sample = 4 + 8 + 12 + 8 + (has_ctts ? 8 : 0);
+
+    // 1024 字节用于 trak/tkhd/mdia/minf/stsd 等固定大小的盒子以及编辑列表
+    return 1024 + extradata_size + nb_samples * per_sample + nb_sync * 4;
+}
+
+
+
+
+
+/**
+ * @brief 根据 STREAM_DURATION、帧率和音频帧大小估算 moov 的大小，用作 mov 复用器的 moov_size 选项。
+ * mov 复用器会在文件头后预留这么大的空间，在 av_write_trailer 时把 moov 原地写入，
+ * 从而得到 moov 在前的可流式播放文件，而不需要像 faststart 那样把整个文件再拷贝一遍
+ */
+static int64_t estimate_moov_size(const OutputStream *video, int have_video,
+                                  const OutputStream *audio, int have_audio)
+{
+    // mvhd/udta 等全局盒子
+    int64_t size = 1024;
+    int64_t nb_samples;
+
+    if (have_video)
+    {
+        // get_video_frame 在 next_pts 超过 STREAM_DURATION 之前都会产生帧，因此多出一帧
+        nb_samples = (int64_t)(STREAM_DURATION * STREAM_FRAME_RATE) + 1;
+        size += estimate_track_index_size(nb_samples,
+                                          nb_samples / FFMAX(video->enc->gop_size, 1) + 1,
+                                          video->enc->max_b_frames > 0,
+                                          video->enc->extradata_size);
+    }
+    if (have_audio)
+    {
+        // 可变帧大小的编码器每帧 10000 个样本（见 open_audio）；再加上编码器冲刷时多出的几帧
+        nb_samples = (int64_t)(STREAM_DURATION * audio->enc->sample_rate) /
+                     audio->frame->nb_samples + 1 + 4;
+        size += estimate_track_index_size(nb_samples, 0, 0, audio->enc->extradata_size);
+    }
+
+    // 留出 10% 的余量：预留空间不足时 av_write_trailer 会失败
+    return size + size / 10;
+}
+
+
+
+
+
+/**
+ * @brief 完整性清单中的一段：复用器处理一个数据包时写出的字节，到 avio 中的位置 end 为止。
+ * 文件头和文件尾（写 trailer 时写出的字节）各是一段，stream_index 分别为 MANIFEST_HEADER 和 MANIFEST_TRAILER
+ */
+typedef struct ManifestSegment {
+    int stream_index;
+    int64_t pts, dts;
+    int size;
+    int64_t end;
+} ManifestSegment;
+
+#define MANIFEST_HEADER  -1
+#define MANIFEST_TRAILER -2
+
+/**
+ * @brief 自定义输出层。复用器通过 avio_alloc_context 创建的 AVIOContext 把数据交给这里。
+ * 流式输出（stream 为 1）时，数据先进入一个有界的环形缓冲区，再由独立的 writer 线程写入 stdout、
+ * FIFO 或 socket，缓冲区写满时复用器线程会阻塞等待（反压），阻塞的时间计入 stall_time；
+ * 普通文件输出时，avio 每次刷新的数据被拷贝到一个 chunk 中，攒够一批后用一次 writev 写出
+ */
+typedef struct OutputIO {
+    // 输出的文件描述符
+    int fd;
+    // 1: 流式输出（环形缓冲区 + writer 线程）；0: 普通文件（writev 批量写入，可 seek）
+    int stream;
+
+    // 普通文件：待写出的 iovec 批次，每个 iovec 指向一个大小为 chunk_size 的 chunk
+    struct iovec *iov;
+    uint8_t **chunks;
+    int nb_iov;
+    int max_iov;
+    int chunk_size;
+    // 普通文件：预分配的大小，以及 lseek 系统调用次数
+    int64_t preallocated;
+    int64_t nb_seeks;
+    // 普通文件：AVIOContext 中的位置 0 对应的文件偏移，从检查点恢复时不为 0
+    int64_t base_offset;
+
+    // 有界环形缓冲区：起始读位置和当前数据量
+    uint8_t *ring;
+    int ring_size;
+    int ring_head;
+    int ring_len;
+
+    // writer 线程，以及保护上面环形缓冲区状态的锁和条件变量（两个方向共用一个条件变量）
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // 复用器已经写完全部数据，writer 线程写完剩余数据后退出
+    int closing;
+    // writer 线程遇到的写错误（errno），非 0 时复用器的写入会失败
+    int error;
+
+    // 刷新策略：OUTPUT_FLUSH_PACKET 每个数据包都尽快写出；OUTPUT_FLUSH_FULL 缓冲区半满时才写出；
+    // 大于 0 时表示每隔多少毫秒写出一次（缓冲区半满时也会提前写出）
+    int flush_policy;
+
+    // 统计信息：写出的字节数、write/writev 系统调用次数、复用器因缓冲区满而阻塞的次数和总时间（微秒）
+    int64_t bytes;
+    int64_t nb_writes;
+    int64_t nb_stalls;
+    int64_t stall_time;
+    int64_t t_open;
+
+    // 整个文件的哈希，在写入路径上顺序计算，不需要再读一遍文件。hashed 是已经计入哈希的字节数；
+    // 如果复用器 seek 回去改写已经写过的数据（例如 mp4 的 mdat 大小），顺序计算的哈希就不再等于
+    // 文件内容的哈希，此时 hash_broken 置 1
+    struct AVHashContext *file_hash;
+    int64_t pos;
+    int64_t hashed;
+    int hash_broken;
+    char file_hash_hex[2 * AV_HASH_MAX_SIZE + 1];
+
+    // 完整性清单：segs 是已经知道边界、但字节还没有全部写出的段。seg_pos 是已经顺序写出的字节数，
+    // seg_start 和 seg_crc 是当前段的起始位置和已经写出部分的 CRC32C
+    ManifestSegment *segs;
+    int nb_segs, segs_size;
+    int64_t seg_start;
+    int64_t seg_pos;
+    uint32_t seg_crc;
+} OutputIO;
+
+#define OUTPUT_FLUSH_PACKET  0
+#define OUTPUT_FLUSH_FULL   -1
+
+/* 自定义输出层相关的运行选项 */
+static int output_buffer_size  = 1 << 20;        /* 流式输出环形缓冲区的大小（字节） */
+static int output_flush_policy = OUTPUT_FLUSH_PACKET;
+static int output_avio_buffer_size = 32768;      /* avio 内部缓冲区大小，与 avio_open 的默认值相同 */
+static int output_writev_batch = 0;              /* 普通文件：每次 writev 合并的 avio 缓冲区个数，0 表示使用 avio_open */
+static int output_preallocate  = 0;              /* 普通文件：1 表示按预计码率 × 时长预分配文件空间 */
+static int output_file_hash    = 0;              /* 1: 在写入路径上计算整个文件的 SHA-256 */
+static int64_t output_append_offset = 0;         /* 普通文件：大于 0 时保留文件的前这么多字节，从这里继续写 */
+static OutputIO *manifest_io = NULL;             /* 完整性清单：计算各段 CRC32C 的输出 */
+static int io_engine_mode      = -1;             /* 普通文件：所有输出共享的 I/O 引擎，-1 不使用，0 pwritev，1 io_uring */
+static int io_engine_buffers   = 64;             /* 共享 I/O 引擎的缓冲池大小（缓冲区个数） */
+static int io_engine_batch     = 16;             /* 共享 I/O 引擎每次提交的写入个数 */
+
+
+
+
+/**
+ * @brief 判断输出目标是否是不可 seek 的流：stdout（"-" 或 "pipe:"）、tcp://、unix: 或者已存在的 FIFO
+ */
+static int is_stream_output(const char *url)
+{
+    struct stat st;
+
+    if (!strcmp(url, "-") || av_strstart(url, "pipe:", NULL) ||
+        av_strstart(url, "tcp://", NULL) || av_strstart(url, "unix:", NULL))
+    {
+        return 1;
+    }
+
+    return !stat(url, &st) && S_ISFIFO(st.st_mode);
+}
+
+
+
+
+/**
+ * @brief 连接到 tcp://host:port 或 unix:path 形式的地址
+ * @return 成功时返回 socket 描述符，失败时返回负数的错误码
+ */
+static int connect_socket(const char *url)
+{
+    const char *p;
+    int fd = AVERROR(EINVAL);
+    int err;
+
+    if (av_strstart(url, "unix:", &p))
+    {
+        struct sockaddr_un addr = { 0 };
+
+        // 同时接受 unix:path 和 unix://path 两种写法
+        av_strstart(p, "//", &p);
+        addr.sun_family = AF_UNIX;
+        av_strlcpy(addr.sun_path, p, sizeof(addr.sun_path));
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            return AVERROR(errno);
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            err = AVERROR(errno);
+            close(fd);
+            fd = err;
+        }
+    }
+    else if (av_strstart(url, "tcp://", &p))
+    {
+        struct addrinfo hints = { 0 }, *ai, *cur;
+        char host[256];
+        const char *port = strrchr(p, ':');
+
+        if (!port)
+        {
+            return AVERROR(EINVAL);
+        }
+        av_strlcpy(host, p, FFMIN(sizeof(host), port - p + 1));
+        port++;
+
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        // getaddrinfo 的错误不经过 errno
+        if ((err = getaddrinfo(host, port, &hints, &ai)))
+        {
+            fprintf(stderr, "Could not resolve '%s': %s\n", host, gai_strerror(err));
+            return err == EAI_SYSTEM ? AVERROR(errno) : AVERROR(EHOSTUNREACH);
+        }
+        fd = AVERROR(EHOSTUNREACH);
+        for (cur = ai; cur; cur = cur->ai_next)
+        {
+            fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+            if (fd < 0)
+            {
+                fd = AVERROR(errno);
+                continue;
+            }
+            if (!connect(fd, cur->ai_addr, cur->ai_addrlen))
+            {
+                break;
+            }
+            err = AVERROR(errno);
+            close(fd);
+            fd = err;
+        }
+        freeaddrinfo(ai);
+    }
+
+    return fd;
+}
+
+
+
+
+/**
+ * @brief 把完整性清单中一段的一行写入清单。start 和 end 换算成文件中的偏移（从检查点恢复时包含保留的字节）
+ * @param crc_valid 为 0 时这一段没有被顺序写出，CRC32C 写成 "-"
+ */
+static void manifest_print_segment(const OutputIO *io, const ManifestSegment *seg, int64_t start, int crc_valid)
+{
+    if (seg->stream_index < 0)
+    {
+        fprintf(manifest, "%s\t-\t-\t-\t", seg->stream_index == MANIFEST_HEADER ? "header" : "trailer");
+    }
+    else
+    {
+        fprintf(manifest, "%d\t%"PRId64"\t%"PRId64"\t%d\t", seg->stream_index, seg->pts, seg->dts, seg->size);
+    }
+    fprintf(manifest, "%"PRId64"\t%"PRId64"\t", io->base_offset + start, io->base_offset + seg->end);
+    if (crc_valid)
+    {
+        fprintf(manifest, "%08"PRIx32"\n", io->seg_crc);
+    }
+    else
+    {
+        fprintf(manifest, "-\n");
+    }
+}
+
+
+
+
+/**
+ * @brief 输出已经全部写出的段，下一段从它的末尾开始
+ */
+static void manifest_flush_segments(OutputIO *io)
+{
+    while (io->nb_segs && io->segs[0].end <= io->seg_pos)
+    {
+        manifest_print_segment(io, &io->segs[0], io->seg_start, 1);
+        io->seg_start = io->segs[0].end;
+        io->seg_crc   = 0;
+        io->nb_segs--;
+        memmove(io->segs, io->segs + 1, io->nb_segs * sizeof(*io->segs));
+    }
+}
+
+
+
+
+/**
+ * @brief 记录一段的边界。数据还在 avio 缓冲区里时先排队，写入路径上写到 end 之后再输出这一行；
+ * 在 write_packet 中调用，出错时直接退出
+ * @param end 复用器处理完这一段之后 avio 中的位置
+ */
+static void manifest_add_segment(int stream_index, int64_t pts, int64_t dts, int size, int64_t end)
+{
+    OutputIO *io = manifest_io;
+    ManifestSegment *segs;
+
+    if (io->nb_segs == io->segs_size)
+    {
+        segs = av_realloc_array(io->segs, FFMAX(2 * io->segs_size, 64), sizeof(*segs));
+        if (!segs)
+        {
+            fprintf(stderr, "Could not allocate the manifest segments\n");
+            exit(1);
+        }
+        io->segs      = segs;
+        io->segs_size = FFMAX(2 * io->segs_size, 64);
+    }
+
+    // 复用器 seek 回去改写时 avio 的位置会小于已经写出的位置，段的边界不能后退
+    end = FFMAX(end, io->nb_segs ? io->segs[io->nb_segs - 1].end : io->seg_pos);
+    io->segs[io->nb_segs++] = (ManifestSegment){ stream_index, pts, dts, size, end };
+    manifest_flush_segments(io);
+}
+
+
+
+
+/**
+ * @brief 把即将写入位置 io->pos 的数据按段的边界切开，计入各段的 CRC32C。只计入顺序写出的字节，
+ * seek 回去改写的数据（例如 mp4 的 mdat 大小）不计入，与整个文件的哈希相同
+ */
+static void output_io_manifest(OutputIO *io, const uint8_t *buf, int size)
+{
+    int n;
+
+    if (io != manifest_io || io->pos != io->seg_pos)
+    {
+        return;
+    }
+    while (size > 0)
+    {
+        // manifest_flush_segments 之后第一段的 end 一定大于 seg_pos
+        n = io->nb_segs ? FFMIN(size, io->segs[0].end - io->seg_pos) : size;
+        io->seg_crc  = ~crc32c_update(~io->seg_crc, buf, n);
+        io->seg_pos += n;
+        buf         += n;
+        size        -= n;
+        manifest_flush_segments(io);
+    }
+}
+
+
+
+
+/**
+ * @brief 输出关闭之后调用：输出剩下的段和文件尾（写 trailer 时写出的字节），并释放段队列。
+ * 复用器跳过一部分位置、没有顺序写出的段无法计算 CRC32C
+ */
+static void manifest_finish(OutputIO *io)
+{
+    ManifestSegment trailer = { .stream_index = MANIFEST_TRAILER, .end = io->seg_pos };
+    int i;
+
+    manifest_flush_segments(io);
+    if (!io->nb_segs && io->seg_pos > io->seg_start)
+    {
+        manifest_print_segment(io, &trailer, io->seg_start, 1);
+    }
+    for (i = 0; i < io->nb_segs; i++)
+    {
+        manifest_print_segment(io, &io->segs[i], io->seg_start, 0);
+        io->seg_start = io->segs[i].end;
+    }
+    av_freep(&io->segs);
+    io->nb_segs = io->segs_size = 0;
+}
+
+
+
+
+/**
+ * @brief 把即将写入位置 io->pos 的数据加入整个文件的哈希和完整性清单中的段，并推进 io->pos
+ */
+static void output_io_hash(OutputIO *io, const uint8_t *buf, int size)
+{
+    output_io_manifest(io, buf, size);
+    if (io->file_hash && !io->hash_broken)
+    {
+        if (io->pos == io->hashed)
+        {
+            av_hash_update(io->file_hash, buf, size);
+            io->hashed += size;
+        }
+        else if (io->pos < io->hashed)
+        {
+            // 改写了已经计入哈希的数据
+            io->hash_broken = 1;
+        }
+    }
+    io->pos += size;
+}
+
+
+
+
+/**
+ * @brief 判断 writer 线程现在是否应该写出数据。调用者需要持有 io->lock
+ */
+static int output_io_should_write(const OutputIO *io)
+{
+    if (!io->ring_len)
+    {
+        return 0;
+    }
+    if (io->closing || io->flush_policy == OUTPUT_FLUSH_PACKET)
+    {
+        return 1;
+    }
+
+    return io->ring_len >= io->ring_size / 2;
+}
+
+
+
+
+/**
+ * @brief writer 线程：把环形缓冲区中的数据写入 fd。write 阻塞（消费者跟不上）时缓冲区会逐渐填满，
+ * 从而让复用器线程在 output_io_write 中等待
+ */
+static void *output_io_writer_main(void *arg)
+{
+    OutputIO *io = arg;
+    struct timespec deadline;
+    ssize_t n;
+    int chunk;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;)
+    {
+        if (io->flush_policy > 0)
+        {
+            // 定时刷新：最多等待 flush_policy 毫秒，超时后写出已有的全部数据
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)(io->flush_policy % 1000) * 1000000;
+            deadline.tv_sec  += io->flush_policy / 1000 + deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (!output_io_should_write(io) && !(io->closing && !io->ring_len))
+            {
+                if (pthread_cond_timedwait(&io->cond, &io->lock, &deadline) == ETIMEDOUT)
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            while (!output_io_should_write(io) && !(io->closing && !io->ring_len))
+            {
+                pthread_cond_wait(&io->cond, &io->lock);
+            }
+        }
+
+        if (io->closing && !io->ring_len)
+        {
+            break;
+        }
+        if (!io->ring_len)
+        {
+            continue;
+        }
+
+        // 只写出从读位置开始的连续部分，环绕的部分在下一轮写出
+        chunk = FFMIN(io->ring_len, io->ring_size - io->ring_head);
+        pthread_mutex_unlock(&io->lock);
+        n = write(io->fd, io->ring + io->ring_head, chunk);
+        pthread_mutex_lock(&io->lock);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            io->error = errno;
+            pthread_cond_broadcast(&io->cond);
+            break;
+        }
+
+        io->ring_head  = (io->ring_head + n) % io->ring_size;
+        io->ring_len  -= n;
+        io->bytes     += n;
+        io->nb_writes++;
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief AVIOContext 的 write_packet 回调：把复用器写出的数据拷贝进环形缓冲区，缓冲区满时阻塞等待
+ */
+static int output_io_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    OutputIO *io = opaque;
+    int size = buf_size;
+    int tail, n;
+    int64_t t0;
+
+    // 流式输出不能 seek，数据总是顺序写出的
+    output_io_hash(io, buf, buf_size);
+
+    pthread_mutex_lock(&io->lock);
+    while (buf_size > 0)
+    {
+        if (io->error)
+        {
+            pthread_mutex_unlock(&io->lock);
+            return AVERROR(io->error);
+        }
+
+        if (io->ring_len == io->ring_size)
+        {
+            // 缓冲区已满：唤醒 writer 线程，并等待它腾出空间
+            t0 = av_gettime_relative();
+            pthread_cond_broadcast(&io->cond);
+            while (io->ring_len == io->ring_size && !io->error)
+            {
+                pthread_cond_wait(&io->cond, &io->lock);
+            }
+            io->stall_time += av_gettime_relative() - t0;
+            io_time        += av_gettime_relative() - t0;
+            io->nb_stalls++;
+            continue;
+        }
+
+        tail = (io->ring_head + io->ring_len) % io->ring_size;
+        n    = FFMIN(buf_size, io->ring_size - io->ring_len);
+        n    = FFMIN(n, io->ring_size - tail);
+        memcpy(io->ring + tail, buf, n);
+        io->ring_len += n;
+        buf          += n;
+        buf_size     -= n;
+    }
+    if (output_io_should_write(io))
+    {
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return size;
+}
+
+
+
+
+/**
+ * @brief 普通文件：用一次 writev 写出当前批次中的全部 chunk，处理部分写入的情况
+ */
+static int output_file_flush(OutputIO *io)
+{
+    struct iovec *iov = io->iov;
+    int cnt = io->nb_iov;
+    int64_t t0 = av_gettime_relative();
+    ssize_t n;
+
+    while (cnt > 0)
+    {
+        n = writev(io->fd, iov, cnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            io_time += av_gettime_relative() - t0;
+            return AVERROR(errno);
+        }
+        io->nb_writes++;
+        io->bytes += n;
+
+        // 跳过已经完整写出的 iovec，并调整部分写出的那一个
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    io->nb_iov = 0;
+    io_time += av_gettime_relative() - t0;
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 普通文件的 write_packet 回调：avio 的缓冲区在回调返回后会被复用，因此把数据拷贝到
+ * 批次中的下一个 chunk，攒够 max_iov 个之后再一起写出
+ */
+static int output_file_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    OutputIO *io = opaque;
+    int ret;
+
+    output_io_hash(io, buf, buf_size);
+
+    if (buf_size > io->chunk_size)
+    {
+        // 不会发生（avio 每次交出的数据不超过它的缓冲区大小），为了安全仍然直接写出
+        if ((ret = output_file_flush(io)) < 0)
+        {
+            return ret;
+        }
+        io->iov[0].iov_base = buf;
+        io->iov[0].iov_len  = buf_size;
+        io->nb_iov = 1;
+        return (ret = output_file_flush(io)) < 0 ? ret : buf_size;
+    }
+
+    memcpy(io->chunks[io->nb_iov], buf, buf_size);
+    io->iov[io->nb_iov].iov_base = io->chunks[io->nb_iov];
+    io->iov[io->nb_iov].iov_len  = buf_size;
+    io->nb_iov++;
+
+    if (io->nb_iov == io->max_iov && (ret = output_file_flush(io)) < 0)
+    {
+        return ret;
+    }
+
+    return buf_size;
+}
+
+
+
+
+/**
+ * @brief 普通文件的 seek 回调：seek 之前必须先写出批次中的数据，保证写入顺序
+ */
+static int64_t output_file_seek(void *opaque, int64_t offset, int whence)
+{
+    OutputIO *io = opaque;
+    struct stat st;
+    int64_t pos, t0;
+    int ret;
+
+    if ((ret = output_file_flush(io)) < 0)
+    {
+        return ret;
+    }
+
+    if (whence & AVSEEK_SIZE)
+    {
+        return fstat(io->fd, &st) < 0 ? AVERROR(errno) : st.st_size - io->base_offset;
+    }
+
+    io->nb_seeks++;
+    whence &= ~AVSEEK_FORCE;
+    t0  = av_gettime_relative();
+    pos = lseek(io->fd, whence == SEEK_SET ? offset + io->base_offset : offset, whence);
+    io_time += av_gettime_relative() - t0;
+    if (pos < 0)
+    {
+        return AVERROR(errno);
+    }
+    pos -= io->base_offset;
+    // seek 到已哈希部分之后（留下空洞）也无法再顺序计算哈希
+    if (pos > io->hashed)
+    {
+        io->hash_broken = 1;
+    }
+    io->pos = pos;
+
+    return pos;
+}
+
+
+
+
+/**
+ * @brief 普通文件：预分配 size 字节的磁盘空间，但不改变文件大小，减少写入过程中的块分配和碎片
+ * @return 实际预分配的字节数，不支持时返回 0
+ */
+static int64_t output_file_preallocate(int fd, int64_t size)
+{
+#if defined(__linux__)
+    if (!fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size))
+    {
+        return size;
+    }
+#elif defined(__APPLE__)
+    fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, size, 0 };
+
+    if (fcntl(fd, F_PREALLOCATE, &store) != -1)
+    {
+        return size;
+    }
+#endif
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 打开输出目标，并创建写入它的 AVIOContext
+ * @param io 输出层状态
+ * @param url 输出目标：流式输出时 "-"/"pipe:" 表示 stdout，tcp://host:port，unix:path，或者 FIFO 的路径；
+ * 否则为普通文件的路径
+ * @param stream 是否为流式输出
+ * @param prealloc_size 普通文件需要预分配的字节数，0 表示不预分配
+ * @param pb 用于返回创建的 AVIOContext
+ * @return 0 表示成功，负数表示错误码
+ */
+static int output_io_open(OutputIO *io, const char *url, int stream, int64_t prealloc_size,
+                          AVIOContext **pb)
+{
+    uint8_t *avio_buffer = NULL;
+    int i, ret = 0, threads = 0;
+
+    io->stream = stream;
+    io->fd     = -1;
+    *pb        = NULL;
+    if (output_file_hash)
+    {
+        if (av_hash_alloc(&io->file_hash, "SHA256") < 0)
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        av_hash_init(io->file_hash);
+    }
+
+    if (!stream)
+    {
+        io->fd = open(url, O_WRONLY | O_CREAT | (output_append_offset > 0 ? 0 : O_TRUNC), 0644);
+        if (io->fd < 0)
+        {
+            ret = AVERROR(errno);
+            goto end;
+        }
+        if (output_append_offset > 0)
+        {
+            // 从检查点恢复：丢弃最后一个检查点之后写出的不完整数据，从那里继续写。
+            // 前面的数据没有经过写入路径，无法计算整个文件的哈希
+            if (ftruncate(io->fd, output_append_offset) < 0 ||
+                lseek(io->fd, output_append_offset, SEEK_SET) < 0)
+            {
+                ret = AVERROR(errno);
+                goto end;
+            }
+            io->base_offset = output_append_offset;
+            io->hash_broken = 1;
+        }
+
+        io->chunk_size = output_avio_buffer_size;
+        io->max_iov    = FFMIN(FFMAX(output_writev_batch, 1), IOV_MAX);
+        io->iov        = av_calloc(io->max_iov, sizeof(*io->iov));
+        io->chunks     = av_calloc(io->max_iov, sizeof(*io->chunks));
+        if (!io->iov || !io->chunks)
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        for (i = 0; i < io->max_iov; i++)
+        {
+            io->chunks[i] = av_malloc(io->chunk_size);
+            if (!io->chunks[i])
+            {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+        }
+        if (prealloc_size > 0)
+        {
+            io->preallocated = output_file_preallocate(io->fd, prealloc_size);
+        }
+
+        avio_buffer = av_malloc(output_avio_buffer_size);
+        *pb = avio_buffer ? avio_alloc_context(avio_buffer, output_avio_buffer_size, 1, io,
+                                               NULL, output_file_write, output_file_seek) : NULL;
+        if (!*pb)
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        io->t_open = av_gettime_relative();
+        goto end;
+    }
+
+    if (!strcmp(url, "-") || av_strstart(url, "pipe:", NULL))
+    {
+        io->fd = STDOUT_FILENO;
+    }
+    else if (av_strstart(url, "tcp://", NULL) || av_strstart(url, "unix:", NULL))
+    {
+        io->fd = connect_socket(url);
+        if (io->fd < 0)
+        {
+            ret    = io->fd;
+            io->fd = -1;
+            goto end;
+        }
+    }
+    else
+    {
+        // 打开 FIFO 时会阻塞，直到有读者打开了另一端
+        io->fd = open(url, O_WRONLY);
+        if (io->fd < 0)
+        {
+            ret = AVERROR(errno);
+            goto end;
+        }
+    }
+
+    // 消费者提前退出时 write 返回 EPIPE，而不是让进程被 SIGPIPE 杀死
+    signal(SIGPIPE, SIG_IGN);
+
+    io->ring_size    = output_buffer_size;
+    io->flush_policy = output_flush_policy;
+    io->ring         = av_malloc(io->ring_size);
+    avio_buffer      = av_malloc(output_avio_buffer_size);
+    // 没有 seek 回调，复用器会把输出当作不可 seek 的流
+    *pb = io->ring && avio_buffer ?
+          avio_alloc_context(avio_buffer, output_avio_buffer_size, 1, io, NULL, output_io_write, NULL) : NULL;
+    if (!*pb)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    threads    = 1;
+    io->t_open = av_gettime_relative();
+    ret = pthread_create(&io->writer, NULL, output_io_writer_main, io);
+    if (ret)
+    {
+        ret = AVERROR(ret);
+        goto end;
+    }
+
+end:
+    // 失败时释放已经打开和分配的一切，io 回到未打开的状态
+    if (ret < 0)
+    {
+        avio_context_free(pb);
+        av_free(avio_buffer);
+        if (threads)
+        {
+            pthread_mutex_destroy(&io->lock);
+            pthread_cond_destroy(&io->cond);
+        }
+        if (io->fd >= 0 && io->fd != STDOUT_FILENO)
+        {
+            close(io->fd);
+        }
+        io->fd = -1;
+        for (i = 0; io->chunks && i < io->max_iov; i++)
+        {
+            av_freep(&io->chunks[i]);
+        }
+        av_freep(&io->chunks);
+        av_freep(&io->iov);
+        av_freep(&io->ring);
+        av_hash_freep(&io->file_hash);
+    }
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 写出剩余数据，结束 writer 线程，关闭输出并释放 AVIOContext，最后打印系统调用次数、
+ * 每次系统调用写出的字节数、吞吐量和阻塞时间
+ */
+static void output_io_close(OutputIO *io, AVIOContext **pb)
+{
+    struct stat st;
+    int64_t elapsed;
+    int i, ret;
+
+    avio_flush(*pb);
+
+    if (io->stream)
+    {
+        pthread_mutex_lock(&io->lock);
+        io->closing = 1;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->writer, NULL);
+    }
+    else
+    {
+        if ((ret = output_file_flush(io)) < 0)
+        {
+            fprintf(stderr, "Error writing the output file: %s\n", av_err2str(ret));
+        }
+        // 释放超出文件末尾的预分配空间
+        if (io->preallocated && !fstat(io->fd, &st) && ftruncate(io->fd, st.st_size) < 0)
+        {
+            fprintf(stderr, "Could not release the preallocated space: %s\n", strerror(errno));
+        }
+    }
+
+    elapsed = FFMAX(av_gettime_relative() - io->t_open, 1);
+    fprintf(stderr, "output: %"PRId64" bytes in %"PRId64" write syscalls (%.0f bytes/syscall), "
+            "%"PRId64" seeks, %.2f MB/s",
+            io->bytes, io->nb_writes, io->bytes / (double)FFMAX(io->nb_writes, 1),
+            io->nb_seeks, io->bytes / (double)elapsed);
+    if (io->stream)
+    {
+        fprintf(stderr, ", stalled %"PRId64" times for %.3f s%s%s",
+                io->nb_stalls, io->stall_time / 1000000.0,
+                io->error ? ", error: " : "", io->error ? strerror(io->error) : "");
+    }
+    else if (io->preallocated)
+    {
+        fprintf(stderr, ", preallocated %"PRId64" bytes", io->preallocated);
+    }
+    fprintf(stderr, "\n");
+
+    if (io->file_hash)
+    {
+        if (io->hash_broken)
+        {
+            snprintf(io->file_hash_hex, sizeof(io->file_hash_hex), "unavailable");
+            fprintf(stderr, "file hash unavailable: the muxer rewrote data in place "
+                    "(use a streaming format such as mpegts or fragmented mp4)\n");
+        }
+        else
+        {
+            av_hash_final_hex(io->file_hash, (uint8_t *)io->file_hash_hex, sizeof(io->file_hash_hex));
+            fprintf(stderr, "file hash: SHA256:%s\n", io->file_hash_hex);
+        }
+        av_hash_freep(&io->file_hash);
+    }
+
+    if (io->fd != STDOUT_FILENO)
+    {
+        close(io->fd);
+    }
+    if (io->stream)
+    {
+        pthread_mutex_destroy(&io->lock);
+        pthread_cond_destroy(&io->cond);
+    }
+    for (i = 0; io->chunks && i < io->max_iov; i++)
+    {
+        av_freep(&io->chunks[i]);
+    }
+    av_freep(&io->chunks);
+    av_freep(&io->iov);
+    av_freep(&io->ring);
+    // avio 可能替换过内部缓冲区，因此释放 (*pb)->buffer 而不是最初分配的指针
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+
+
+
+
+/**
+ * @brief 共享 I/O 引擎中的一个写缓冲区，来自引擎的缓冲池。复用器写出的数据拷贝进来后，
+ * 连同目标文件和偏移一起排队，写完成后回到缓冲池
+ */
+typedef struct IOBuffer {
+    struct IOBuffer *next;
+    struct IOFile *file;
+    uint8_t *data;
+    // 在缓冲池中的序号，也是 io_uring 固定缓冲区的下标
+    int index;
+    int size;
+    int64_t offset;
+    // 交给内核（或 writer 线程）的时刻，用于统计写延迟；以及写出时遇到的错误（errno）
+    int64_t t_submit;
+    int error;
+} IOBuffer;
+
+/**
+ * @brief 通过共享 I/O 引擎写出的一个输出文件。每次写入都带着自己的偏移（pwrite 语义），
+ * 不依赖文件描述符的当前位置，因此不同文件的写入可以任意交错、乱序完成
+ */
+typedef struct IOFile {
+    struct IOEngine *engine;
+    int fd;
+    // AVIOContext 中的当前位置和写到过的最大位置
+    int64_t pos;
+    int64_t size;
+    // 已经排队但还没有完成的写入个数
+    int inflight;
+} IOFile;
+
+/**
+ * @brief 所有输出共享的 I/O 引擎：固定大小的缓冲池，加上一个 io_uring 提交队列（没有 liburing 时
+ * 改用一个 writer 线程，把同一个文件中相邻的缓冲区合并成一次 pwritev）。复用器线程只拷贝数据和排队，
+ * 攒够一批才提交，写完成后由收割线程（或 writer 线程）把缓冲区还给缓冲池
+ */
+typedef struct IOEngine {
+    // 1: io_uring；0: pwritev writer 线程
+    int uring;
+#if HAVE_LIBURING
+    struct io_uring ring;
+    // 缓冲池是否注册成了 io_uring 的固定缓冲区（受 RLIMIT_MEMLOCK 限制，可能失败）
+    int fixed;
+    pthread_t reaper;
+#endif
+    // 缓冲池：nb_buffers 个大小为 buffer_size 的缓冲区，切自同一块内存
+    uint8_t *arena;
+    IOBuffer *buffers;
+    IOBuffer *free_list;
+    int nb_buffers;
+    int buffer_size;
+    // 攒够多少个写入才提交一次
+    int batch;
+
+    // 已经排队、还没有交给内核（io_uring）或 writer 线程（pwritev）的缓冲区
+    IOBuffer *queue_head, *queue_tail;
+    int nb_queued;
+    // 正在等待写完成的线程个数（缓冲池用完、seek 回头改写或关闭文件），此时不再攒批
+    int nb_waiters;
+    pthread_t writer;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int closing;
+    // 第一个写错误（errno），非 0 时之后的写入都会失败
+    int error;
+    // io_uring 的收割线程因错误退出，已经提交的写入再也不会完成；提交失败，留在提交队列中的写入再也不会完成
+    int reaper_failed;
+    int submit_failed;
+    // 已经交给内核、还没有收割的 SQE 个数
+    int nb_submitted;
+
+    // 统计信息：打开过的文件数、写出的字节数、写入次数、系统调用次数（io_uring_enter 或 pwritev），
+    // 以及每次写入从提交到完成的延迟（微秒）
+    int nb_files;
+    int64_t bytes;
+    int64_t nb_writes;
+    int64_t nb_syscalls;
+    int64_t *latency;
+    int nb_latency;
+    int latency_size;
+    int64_t t_start;
+} IOEngine;
+
+static IOEngine io_engine = { 0 };
+
+
+
+
+/**
+ * @brief 一个写入完成（调用时持有 e->lock）：记录延迟和错误，把缓冲区还给缓冲池
+ */
+static void io_engine_complete(IOEngine *e, IOBuffer *b, int64_t now)
+{
+    int64_t *latency;
+
+    if (b->error && !e->error)
+    {
+        e->error = b->error;
+    }
+    if (!b->error)
+    {
+        e->bytes += b->size;
+    }
+    e->nb_writes++;
+
+    if (e->nb_latency == e->latency_size)
+    {
+        latency = av_realloc_array(e->latency, FFMAX(2 * e->latency_size, 1024), sizeof(*latency));
+        if (latency)
+        {
+            e->latency      = latency;
+            e->latency_size = FFMAX(2 * e->latency_size, 1024);
+        }
+    }
+    if (e->nb_latency < e->latency_size)
+    {
+        e->latency[e->nb_latency++] = now - b->t_submit;
+    }
+
+    b->file->inflight--;
+    b->next      = e->free_list;
+    e->free_list = b;
+}
+
+
+
+
+#if HAVE_LIBURING
+/**
+ * @brief 把提交队列中的 SQE 全部交给内核（调用时持有 e->lock）。内核暂时不接受（EAGAIN、完成队列满时的 EBUSY）时
+ * 先等收割线程取走完成事件，没有在途的写入时稍后重试；其他错误记录在 e->error 中，之后不再提交
+ * @return 0 表示成功，负数表示错误码
+ */
+static int io_engine_submit_ring(IOEngine *e)
+{
+    int ret;
+
+    while (io_uring_sq_ready(&e->ring) && !e->submit_failed)
+    {
+        ret = io_uring_submit(&e->ring);
+        e->nb_syscalls++;
+        if (ret > 0)
+        {
+            e->nb_submitted += ret;
+        }
+        else if (ret == 0 || ret == -EAGAIN || ret == -EBUSY)
+        {
+            if (e->nb_submitted && !e->reaper_failed)
+            {
+                pthread_cond_wait(&e->cond, &e->lock);
+            }
+            else
+            {
+                av_usleep(1000);
+            }
+        }
+        else if (ret != -EINTR)
+        {
+            e->submit_failed = 1;
+            if (!e->error)
+            {
+                e->error = -ret;
+            }
+            pthread_cond_broadcast(&e->cond);
+            return AVERROR(-ret);
+        }
+    }
+    return e->submit_failed ? AVERROR(e->error) : 0;
+}
+
+
+
+
+/**
+ * @brief 取一个空闲的 SQE（调用时持有 e->lock）。提交队列满了（之前的 SQE 还没有全部交给内核）时先提交再重试
+ * @return SQE，提交失败时返回 NULL
+ */
+static struct io_uring_sqe *io_engine_get_sqe(IOEngine *e)
+{
+    struct io_uring_sqe *sqe;
+
+    while (!(sqe = io_uring_get_sqe(&e->ring)))
+    {
+        if (io_engine_submit_ring(e) < 0)
+        {
+            return NULL;
+        }
+    }
+    return sqe;
+}
+#endif
+
+
+
+
+/**
+ * @brief 把排队的缓冲区交出去（调用时持有 e->lock）：io_uring 时一次 io_uring_submit 提交整批，
+ * pwritev 时唤醒 writer 线程
+ */
+static void io_engine_submit(IOEngine *e)
+{
+    if (!e->nb_queued)
+    {
+        return;
+    }
+    if (!e->uring)
+    {
+        pthread_cond_broadcast(&e->cond);
+        return;
+    }
+
+#if HAVE_LIBURING
+    {
+        int64_t now = av_gettime_relative();
+        IOBuffer *b;
+
+        for (b = e->queue_head; b; b = b->next)
+        {
+            b->t_submit = now;
+        }
+        io_engine_submit_ring(e);
+    }
+#endif
+    e->queue_head = e->queue_tail = NULL;
+    e->nb_queued  = 0;
+}
+
+
+
+
+/**
+ * @brief 排队一次写入（调用时持有 e->lock），攒够一批时提交。io_uring 的提交队列满了时先提交再取 SQE，
+ * 提交失败时这次写入直接带着错误完成
+ */
+static void io_engine_queue(IOEngine *e, IOBuffer *b)
+{
+#if HAVE_LIBURING
+    if (e->uring)
+    {
+        struct io_uring_sqe *sqe = io_engine_get_sqe(e);
+
+        if (!sqe)
+        {
+            b->error = e->error;
+            io_engine_complete(e, b, av_gettime_relative());
+            pthread_cond_broadcast(&e->cond);
+            return;
+        }
+        if (e->fixed)
+        {
+            io_uring_prep_write_fixed(sqe, b->file->fd, b->data, b->size, b->offset, b->index);
+        }
+        else
+        {
+            io_uring_prep_write(sqe, b->file->fd, b->data, b->size, b->offset);
+        }
+        io_uring_sqe_set_data(sqe, b);
+    }
+#endif
+
+    b->next = NULL;
+    if (e->queue_tail)
+        e->queue_tail->next = b;
+    else
+        e->queue_head = b;
+    e->queue_tail = b;
+    e->nb_queued++;
+
+    if (e->nb_queued >= e->batch || e->nb_waiters)
+    {
+        io_engine_submit(e);
+    }
+}
+
+
+
+
+/**
+ * @brief 等待条件满足之前先提交已经排队的写入，否则可能永远等不到写完成（调用时持有 e->lock）
+ */
+static void io_engine_wait(IOEngine *e)
+{
+    e->nb_waiters++;
+    io_engine_submit(e);
+    pthread_cond_wait(&e->cond, &e->lock);
+    e->nb_waiters--;
+}
+
+
+
+
+#if HAVE_LIBURING
+/**
+ * @brief io_uring 收割线程：等待完成事件，一次取走所有已经完成的写入，把缓冲区还给缓冲池。
+ * 提交和收割分别只在一个线程中进行，SQ 和 CQ 两个环可以并发使用
+ */
+static void *io_engine_reaper_main(void *arg)
+{
+    IOEngine *e = arg;
+    struct io_uring_cqe *cqe;
+    unsigned head, n;
+    int waited, stop = 0, ret;
+
+    while (!stop)
+    {
+        // 完成队列为空时 io_uring_wait_cqe 才会进入内核
+        waited = 0;
+        if (io_uring_peek_cqe(&e->ring, &cqe))
+        {
+            waited = 1;
+            ret    = io_uring_wait_cqe(&e->ring, &cqe);
+            if (ret == -EINTR)
+            {
+                continue;
+            }
+            if (ret < 0)
+            {
+                // 之后不会再有写完成，唤醒所有等待空闲缓冲区或写完成的线程，让它们带着错误返回
+                fprintf(stderr, "io_uring_wait_cqe failed: %s\n", strerror(-ret));
+                pthread_mutex_lock(&e->lock);
+                if (!e->error)
+                {
+                    e->error = -ret;
+                }
+                e->reaper_failed = 1;
+                pthread_cond_broadcast(&e->cond);
+                pthread_mutex_unlock(&e->lock);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&e->lock);
+        e->nb_syscalls += waited;
+        n = 0;
+        io_uring_for_each_cqe(&e->ring, head, cqe)
+        {
+            IOBuffer *b = io_uring_cqe_get_data(cqe);
+
+            n++;
+            e->nb_submitted--;
+            // 关闭引擎时提交的 NOP，之前的写入都已经完成
+            if (!b)
+            {
+                stop = 1;
+                continue;
+            }
+            // 普通文件上的短写只会发生在磁盘写满等情况下，按错误处理
+            b->error = cqe->res < 0 ? -cqe->res : cqe->res < b->size ? ENOSPC : 0;
+            io_engine_complete(e, b, av_gettime_relative());
+        }
+        io_uring_cq_advance(&e->ring, n);
+        pthread_cond_broadcast(&e->cond);
+        pthread_mutex_unlock(&e->lock);
+    }
+
+    return NULL;
+}
+#endif
+
+
+
+
+/**
+ * @brief pwritev 写出一组在文件中相邻的缓冲区，处理部分写入的情况
+ * @param nb_syscalls 累加 pwritev 调用的次数
+ * @return 0 表示成功，否则为 errno
+ */
+static int io_engine_pwritev(int fd, struct iovec *iov, int cnt, int64_t offset, int64_t *nb_syscalls)
+{
+    ssize_t n;
+
+    while (cnt > 0)
+    {
+        n = pwritev(fd, iov, cnt, offset);
+        (*nb_syscalls)++;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        if (n == 0)
+        {
+            return ENOSPC;
+        }
+        offset += n;
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 没有 io_uring 时的 writer 线程：攒够一批（或者有人在等）时取走整个队列，同一个文件中
+ * 首尾相接的缓冲区合并成一次 pwritev。队列按排队顺序写出，同一位置先后写入的数据不会乱序
+ */
+static void *io_engine_writer_main(void *arg)
+{
+    IOEngine *e = arg;
+    struct iovec iov[64];
+    IOBuffer *list, *first, *last, *b;
+    int64_t nb_syscalls, now;
+    int n, err;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;)
+    {
+        while (!e->closing && (!e->nb_queued || (e->nb_queued < e->batch && !e->nb_waiters)))
+        {
+            pthread_cond_wait(&e->cond, &e->lock);
+        }
+        if (!e->nb_queued)
+        {
+            break;
+        }
+        list = e->queue_head;
+        e->queue_head = e->queue_tail = NULL;
+        e->nb_queued  = 0;
+        pthread_mutex_unlock(&e->lock);
+
+        now         = av_gettime_relative();
+        nb_syscalls = 0;
+        for (first = list; first; first = last->next)
+        {
+            first->t_submit = now;
+            iov[0].iov_base = first->data;
+            iov[0].iov_len  = first->size;
+            n    = 1;
+            last = first;
+            while (last->next && n < FF_ARRAY_ELEMS(iov) && last->next->file == first->file &&
+                   last->next->offset == last->offset + last->size)
+            {
+                last = last->next;
+                last->t_submit  = now;
+                iov[n].iov_base = last->data;
+                iov[n].iov_len  = last->size;
+                n++;
+            }
+            err = io_engine_pwritev(first->file->fd, iov, n, first->offset, &nb_syscalls);
+            for (b = first; ; b = b->next)
+            {
+                b->error = err;
+                if (b == last)
+                {
+                    break;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&e->lock);
+        e->nb_syscalls += nb_syscalls;
+        now = av_gettime_relative();
+        while (list)
+        {
+            b    = list;
+            list = list->next;
+            io_engine_complete(e, b, now);
+        }
+        pthread_cond_broadcast(&e->cond);
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief 初始化共享 I/O 引擎
+ * @param uring 1 使用 io_uring（编译时没有 liburing 则退回 pwritev），0 使用 pwritev writer 线程
+ * @param nb_buffers 缓冲池中的缓冲区个数，也是同时在写的最大个数
+ * @param buffer_size 每个缓冲区的大小，与各个输出的 avio 缓冲区大小相同
+ * @param batch 每次提交的写入个数
+ * @return 0 表示成功，负数表示错误码
+ */
+static int io_engine_init(IOEngine *e, int uring, int nb_buffers, int buffer_size, int batch)
+{
+#if HAVE_LIBURING
+    struct iovec *iov = NULL;
+    int ring = 0;
+#endif
+    int i, ret;
+
+    e->uring       = uring;
+    e->nb_buffers  = FFMAX(nb_buffers, 2);
+    e->buffer_size = buffer_size;
+    e->batch       = av_clip(batch, 1, e->nb_buffers);
+
+    e->arena   = av_malloc((size_t)e->nb_buffers * buffer_size);
+    e->buffers = av_calloc(e->nb_buffers, sizeof(*e->buffers));
+    if (!e->arena || !e->buffers)
+    {
+        av_freep(&e->buffers);
+        av_freep(&e->arena);
+        return AVERROR(ENOMEM);
+    }
+    for (i = e->nb_buffers - 1; i >= 0; i--)
+    {
+        e->buffers[i].index = i;
+        e->buffers[i].data  = e->arena + (size_t)i * buffer_size;
+        e->buffers[i].next  = e->free_list;
+        e->free_list        = &e->buffers[i];
+    }
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+
+    if (e->uring)
+    {
+#if HAVE_LIBURING
+        iov = av_malloc_array(e->nb_buffers, sizeof(*iov));
+        if (!iov)
+        {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        if ((ret = io_uring_queue_init(e->nb_buffers, &e->ring, 0)) < 0)
+        {
+            fprintf(stderr, "Could not set up io_uring: %s\n", strerror(-ret));
+            ret = AVERROR(-ret);
+            goto fail;
+        }
+        ring = 1;
+        // 固定缓冲区：内核只在注册时映射一次这些页，之后每次写入不再逐页 pin 住用户内存
+        for (i = 0; i < e->nb_buffers; i++)
+        {
+            iov[i].iov_base = e->buffers[i].data;
+            iov[i].iov_len  = buffer_size;
+        }
+        ret      = io_uring_register_buffers(&e->ring, iov, e->nb_buffers);
+        e->fixed = ret == 0;
+        av_freep(&iov);
+        if (!e->fixed)
+        {
+            fprintf(stderr, "Could not register the io_uring buffers (%s), using plain writes\n", strerror(-ret));
+        }
+        if ((ret = pthread_create(&e->reaper, NULL, io_engine_reaper_main, e)))
+        {
+            ret = AVERROR(ret);
+            goto fail;
+        }
+#else
+        fprintf(stderr, "Built without liburing, using the pwritev engine\n");
+        e->uring = 0;
+#endif
+    }
+    if (!e->uring && (ret = pthread_create(&e->writer, NULL, io_engine_writer_main, e)))
+    {
+        ret = AVERROR(ret);
+        goto fail;
+    }
+
+    e->t_start = av_gettime_relative();
+    return 0;
+
+fail:
+#if HAVE_LIBURING
+    av_freep(&iov);
+    if (ring)
+    {
+        if (e->fixed)
+        {
+            io_uring_unregister_buffers(&e->ring);
+        }
+        io_uring_queue_exit(&e->ring);
+    }
+#endif
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->cond);
+    av_freep(&e->buffers);
+    av_freep(&e->arena);
+    e->free_list  = NULL;
+    e->nb_buffers = 0;
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 共享 I/O 引擎的 write_packet 回调：从缓冲池取一个缓冲区（用完时等待写完成），在锁外拷贝数据，
+ * 然后带着当前偏移排队。avio 的缓冲区大小与引擎的缓冲区相同，一次回调通常只占用一个缓冲区
+ */
+static int io_file_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    IOFile *f = opaque;
+    IOEngine *e = f->engine;
+    int64_t t0 = av_gettime_relative();
+    IOBuffer *b;
+    int done = 0, ret = buf_size;
+
+    pthread_mutex_lock(&e->lock);
+    while (done < buf_size)
+    {
+        while (!e->free_list && !e->error)
+        {
+            io_engine_wait(e);
+        }
+        if (e->error)
+        {
+            ret = AVERROR(e->error);
+            break;
+        }
+        b            = e->free_list;
+        e->free_list = b->next;
+        pthread_mutex_unlock(&e->lock);
+
+        b->file   = f;
+        b->size   = FFMIN(buf_size - done, e->buffer_size);
+        b->offset = f->pos;
+        b->error  = 0;
+        memcpy(b->data, buf + done, b->size);
+        done   += b->size;
+        f->pos += b->size;
+        f->size = FFMAX(f->size, f->pos);
+
+        pthread_mutex_lock(&e->lock);
+        f->inflight++;
+        io_engine_queue(e, b);
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    io_time += av_gettime_relative() - t0;
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 等待文件 f 已经排队的写入全部完成
+ * @return 0 表示成功，负数表示引擎遇到过的写错误
+ */
+static int io_file_drain(IOFile *f)
+{
+    IOEngine *e = f->engine;
+    int ret;
+
+    pthread_mutex_lock(&f->engine->lock);
+    while (f->inflight && !e->reaper_failed && !e->submit_failed)
+    {
+        io_engine_wait(e);
+    }
+    ret = e->error ? AVERROR(e->error) : 0;
+    pthread_mutex_unlock(&e->lock);
+
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 共享 I/O 引擎的 seek 回调：写入带着各自的偏移，seek 只改变之后写入的位置；
+ * 回头改写已经写过的区域（例如 mp4 的 mdat 大小）之前，先等这个文件排队的写入全部完成，新旧数据才不会乱序落盘
+ */
+static int64_t io_file_seek(void *opaque, int64_t offset, int whence)
+{
+    IOFile *f = opaque;
+    int64_t t0;
+    int ret;
+
+    if (whence & AVSEEK_SIZE)
+    {
+        return f->size;
+    }
+    whence &= ~AVSEEK_FORCE;
+    if (whence == SEEK_CUR)
+        offset += f->pos;
+    else if (whence == SEEK_END)
+        offset += f->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+    if (offset < 0)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    if (offset < f->size)
+    {
+        t0       = av_gettime_relative();
+        ret      = io_file_drain(f);
+        io_time += av_gettime_relative() - t0;
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    f->pos = offset;
+
+    return offset;
+}
+
+
+
+
+/**
+ * @brief 打开一个通过共享 I/O 引擎写出的普通文件，并创建对应的 AVIOContext
+ * @return 0 表示成功，负数表示错误码
+ */
+static int io_engine_open(IOEngine *e, const char *filename, AVIOContext **pb)
+{
+    IOFile *f;
+    uint8_t *avio_buffer;
+    int ret;
+
+    av_strstart(filename, "file:", &filename);
+
+    f = av_mallocz(sizeof(*f));
+    if (!f)
+    {
+        return AVERROR(ENOMEM);
+    }
+    f->engine = e;
+    f->fd     = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (f->fd < 0)
+    {
+        ret = AVERROR(errno);
+        av_free(f);
+        return ret;
+    }
+
+    avio_buffer = av_malloc(e->buffer_size);
+    *pb = avio_buffer ? avio_alloc_context(avio_buffer, e->buffer_size, 1, f, NULL, io_file_write, io_file_seek) : NULL;
+    if (!*pb)
+    {
+        av_free(avio_buffer);
+        close(f->fd);
+        av_free(f);
+        return AVERROR(ENOMEM);
+    }
+    e->nb_files++;
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 写出 AVIOContext 中剩余的数据，等这个文件的写入全部完成后关闭它
+ * @return 0 表示成功，负数表示写错误
+ */
+static int io_engine_close(AVIOContext **pb)
+{
+    IOFile *f = (*pb)->opaque;
+    int ret;
+
+    avio_flush(*pb);
+    ret = io_file_drain(f);
+    if (close(f->fd) < 0 && ret >= 0)
+    {
+        ret = AVERROR(errno);
+    }
+    av_free(f);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+
+    return ret;
+}
+
+
+
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+
+
+/**
+ * @brief 关闭共享 I/O 引擎（所有文件都已经关闭），打印系统调用次数、每 GB 的系统调用次数和写延迟的分布
+ */
+static void io_engine_uninit(IOEngine *e)
+{
+    int64_t elapsed, p50 = 0, p99 = 0, p999 = 0, max = 0;
+#if HAVE_LIBURING
+    int detach = 0;
+#endif
+
+    pthread_mutex_lock(&e->lock);
+    e->closing = 1;
+#if HAVE_LIBURING
+    if (e->uring)
+    {
+        // 用一个 NOP 唤醒收割线程，它之前的写入都已经完成
+        struct io_uring_sqe *sqe = io_engine_get_sqe(e);
+
+        if (sqe)
+        {
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, NULL);
+            io_engine_submit_ring(e);
+        }
+        // NOP 没能交给内核：等已经提交的写入收割完，收割线程之后会一直阻塞在等待中，不再等它退出，环也不释放
+        if (e->submit_failed && !e->reaper_failed)
+        {
+            while (e->nb_submitted && !e->reaper_failed)
+            {
+                pthread_cond_wait(&e->cond, &e->lock);
+            }
+            detach = !e->reaper_failed;
+        }
+    }
+#endif
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+
+#if HAVE_LIBURING
+    if (e->uring && detach)
+    {
+        fprintf(stderr, "io_uring submission failed, the ring is not released\n");
+        pthread_detach(e->reaper);
+    }
+    else if (e->uring)
+    {
+        pthread_join(e->reaper, NULL);
+        if (e->fixed)
+        {
+            io_uring_unregister_buffers(&e->ring);
+        }
+        io_uring_queue_exit(&e->ring);
+    }
+#endif
+    if (!e->uring)
+    {
+        pthread_join(e->writer, NULL);
+    }
+
+    elapsed = FFMAX(av_gettime_relative() - e->t_start, 1);
+    if (e->nb_latency)
+    {
+        qsort(e->latency, e->nb_latency, sizeof(*e->latency), compare_int64);
+        p50  = e->latency[e->nb_latency / 2];
+        p99  = e->latency[(int64_t)e->nb_latency * 99 / 100];
+        p999 = e->latency[(int64_t)e->nb_latency * 999 / 1000];
+        max  = e->latency[e->nb_latency - 1];
+    }
+    fprintf(stderr, "io engine: %s%s, %d files, %"PRId64" bytes in %"PRId64" writes, %"PRId64" syscalls "
+            "(%.0f syscalls/GB), %.2f MB/s\n",
+            e->uring ? "io_uring" : "pwritev",
+#if HAVE_LIBURING
+            e->fixed ? " (registered buffers)" : "",
+#else
+            "",
+#endif
+            e->nb_files, e->bytes, e->nb_writes, e->nb_syscalls,
+            e->nb_syscalls * 1073741824.0 / FFMAX(e->bytes, 1), e->bytes / (double)elapsed);
+    fprintf(stderr, "io engine write latency: p50 %"PRId64" us, p99 %"PRId64" us, p99.9 %"PRId64" us, "
+            "max %"PRId64" us%s%s\n",
+            p50, p99, p999, max, e->error ? ", error: " : "", e->error ? strerror(e->error) : "");
+
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->cond);
+    av_freep(&e->latency);
+    av_freep(&e->buffers);
+    av_freep(&e->arena);
+}
+
+
+
+
+
+/**
+ * @brief count/null 输出：复用器照常工作，写出的数据只统计字节数，不保存也不产生系统调用
+ */
+typedef struct CountSink {
+    int64_t bytes, nb_writes, nb_seeks;
+    // 当前位置和最大位置，用于支持 mp4 这类结束时需要回头改写的复用器
+    int64_t pos, size;
+} CountSink;
+
+static CountSink count_sink = { 0 };
+
+
+
+
+static int count_sink_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    CountSink *sink = opaque;
+
+    sink->bytes += buf_size;
+    sink->nb_writes++;
+    sink->pos  += buf_size;
+    sink->size  = FFMAX(sink->size, sink->pos);
+
+    return buf_size;
+}
+
+
+
+
+static int64_t count_sink_seek(void *opaque, int64_t offset, int whence)
+{
+    CountSink *sink = opaque;
+
+    if (whence & AVSEEK_SIZE)
+    {
+        return sink->size;
+    }
+    whence &= ~AVSEEK_FORCE;
+    if (whence == SEEK_CUR)
+        offset += sink->pos;
+    else if (whence == SEEK_END)
+        offset += sink->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+    if (offset < 0)
+    {
+        return AVERROR(EINVAL);
+    }
+    sink->nb_seeks++;
+    sink->pos = offset;
+
+    return offset;
+}
+
+
+
+
+
+/**
+ * @brief 在视频关键帧 key_pts 之前保存一个检查点：先把已经交给复用器的数据包全部写到文件，
+ * 再把恢复所需的状态写入检查点文件（先写临时文件再 rename，保证检查点文件总是完整的）
+ * @param oc 输出媒体文件的格式上下文
+ * @param key_pts 即将写入的视频关键帧的 pts（编码器时间基准），恢复时视频从这一帧重新开始编码
+ * @return 0 表示成功，负数表示错误码
+ */
+static int write_checkpoint(AVFormatContext *oc, int64_t key_pts)
+{
+    OutputStream *video = checkpoint.video, *audio = checkpoint.audio;
+    const GeneratorState *state = NULL;
+    char tmp_name[1024];
+    int64_t bytes;
+    FILE *f;
+    int i, ret;
+
+    // 找到已写出的音频之后第一帧的生成器状态。编码器内部缓冲的音频帧还没有写出，恢复时重新生成
+    if (audio && !audio->eof)
+    {
+        for (i = 0; i < FFMIN(audio->nb_history, GENERATOR_HISTORY); i++)
+        {
+            if (audio->history[i].pts == audio->written_end)
+            {
+                state = &audio->history[i];
+                break;
+            }
+        }
+        if (!state)
+        {
+            fprintf(stderr, "checkpoint skipped: no generator state for audio pts %"PRId64"\n",
+                    audio->written_end);
+            return 0;
+        }
+    }
+
+    // 清空交错队列，再让复用器写出它内部缓冲的数据（例如 mpegts 尚未写出的 PES）
+    if ((ret = av_interleaved_write_frame(oc, NULL)) < 0 ||
+        (ret = av_write_frame(oc, NULL)) < 0)
+    {
+        fprintf(stderr, "Error flushing the muxer for a checkpoint: %s\n", av_err2str(ret));
+        return ret;
+    }
+    avio_flush(oc->pb);
+    if ((ret = output_file_flush(checkpoint.io)) < 0)
+    {
+        return ret;
+    }
+    // 输出数据先落盘，检查点文件再落盘，断电时检查点也不会指向不存在的数据
+    if (fsync(checkpoint.io->fd) < 0)
+    {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not sync the output for a checkpoint: %s\n", av_err2str(ret));
+        return ret;
+    }
+    bytes = checkpoint.base_offset + avio_tell(oc->pb);
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", checkpoint.filename);
+    f = fopen(tmp_name, "w");
+    if (!f)
+    {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not open '%s': %s\n", tmp_name, av_err2str(ret));
+        return ret;
+    }
+    fprintf(f, "bytes=%"PRId64"\n", bytes);
+    fprintf(f, "video_next_pts=%"PRId64"\n", key_pts);
+    if (audio)
+    {
+        fprintf(f, "audio_eof=%d\n", audio->eof);
+    }
+    if (state)
+    {
+        // 浮点数以十六进制形式保存，恢复后的相位与不中断时完全相同
+        fprintf(f, "audio_next_pts=%"PRId64"\n", state->next_pts);
+        fprintf(f, "audio_samples_count=%d\n", state->samples_count);
+        fprintf(f, "audio_t=%a\n", state->t);
+        fprintf(f, "audio_tincr=%a\n", state->tincr);
+    }
+    // 任何一步失败都不替换原来的检查点文件
+    ret = fflush(f) || fsync(fileno(f)) < 0 ? AVERROR(errno) : 0;
+    if (fclose(f) && ret >= 0)
+    {
+        ret = AVERROR(errno);
+    }
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not write '%s': %s\n", tmp_name, av_err2str(ret));
+        unlink(tmp_name);
+        return ret;
+    }
+    if (rename(tmp_name, checkpoint.filename) < 0)
+    {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not rename '%s': %s\n", tmp_name, av_err2str(ret));
+        return ret;
+    }
+
+    checkpoint.next_pts = key_pts + (int64_t)checkpoint.gops * video->enc->gop_size;
+    checkpoint.nb_saved++;
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 读取检查点文件，恢复视频和音频的生成状态
+ * @param bytes 用于返回检查点时文件中已经完整写出的字节数
+ * @return 1 表示已从检查点恢复，0 表示没有检查点文件，负数表示检查点文件损坏
+ */
+static int load_checkpoint(OutputStream *video, OutputStream *audio, int64_t *bytes)
+{
+    char line[256], *value;
+    int nb_keys = 0;
+    FILE *f;
+
+    f = fopen(checkpoint.filename, "r");
+    if (!f)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        value = strchr(line, '=');
+        if (!value)
+        {
+            continue;
+        }
+        *value++ = 0;
+        nb_keys++;
+
+        if (!strcmp(line, "bytes"))
+            *bytes = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "video_next_pts") && video)
+            video->next_pts = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "audio_eof") && audio)
+            audio->eof = atoi(value);
+        else if (!strcmp(line, "audio_next_pts") && audio)
+            audio->next_pts = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "audio_samples_count") && audio)
+            audio->samples_count = atoi(value);
+        else if (!strcmp(line, "audio_t") && audio)
+            audio->t = strtod(value, NULL);
+        else if (!strcmp(line, "audio_tincr") && audio)
+            audio->tincr = strtod(value, NULL);
+        else
+            nb_keys--;
+    }
+    fclose(f);
+
+    if (nb_keys < 2 || *bytes <= 0)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+    if (video)
+    {
+        checkpoint.next_pts = video->next_pts + (int64_t)checkpoint.gops * video->enc->gop_size;
+    }
+
+    return 1;
+}
+
+
+
+
+
+/**
+ * @brief 为回放打开一个额外的输出：格式、流参数和时间基准都与 src 相同
+ * @param opt 写文件头时使用的选项（与 src 写文件头时相同），函数内部使用它的副本
+ * @return 0 表示成功，负数表示错误码
+ */
+static int open_replay_output(AVFormatContext **out, const char *filename, const AVFormatContext *src,
+                              const AVDictionary *opt)
+{
+    AVDictionary *header_opt = NULL;
+    unsigned int i;
+    int ret;
+
+    ret = avformat_alloc_output_context2(out, src->oformat, NULL, filename);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    (*out)->flags |= src->flags & AVFMT_FLAG_BITEXACT;
+
+    for (i = 0; i < src->nb_streams; i++)
+    {
+        AVStream *st = avformat_new_stream(*out, NULL);
+
+        if (!st)
+        {
+            return AVERROR(ENOMEM);
+        }
+        if ((ret = avcodec_parameters_copy(st->codecpar, src->streams[i]->codecpar)) < 0)
+        {
+            return ret;
+        }
+        st->time_base = src->streams[i]->time_base;
+    }
+
+    if (!((*out)->oformat->flags & AVFMT_NOFILE) && io_engine.nb_buffers)
+    {
+        // 所有输出共享同一个 I/O 引擎
+        if ((ret = io_engine_open(&io_engine, filename, &(*out)->pb)) < 0)
+        {
+            return ret;
+        }
+        (*out)->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    else if (!((*out)->oformat->flags & AVFMT_NOFILE) &&
+             (ret = avio_open(&(*out)->pb, filename, AVIO_FLAG_WRITE)) < 0)
+    {
+        return ret;
+    }
+
+    if ((ret = av_dict_copy(&header_opt, opt, 0)) < 0)
+    {
+        return ret;
+    }
+    ret = avformat_write_header(*out, &header_opt);
+    av_dict_free(&header_opt);
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 把数据包仓库中的数据包回放 loops 轮，交错写入所有输出。第 k 轮的时间戳加上 k 倍的一轮时长，
+ * 一轮时长取所有流中最长的那个，并向上取整到在每个流的时间基准下都是整数，各个流的偏移完全相同，不会逐轮漂移
+ * @param outputs 输出的格式上下文，outputs[0] 是编码时使用的那一个，数据包的时间戳以它的流时间基准为准
+ * @param nb_outputs 输出个数
+ * @param ps 数据包仓库
+ * @param loops 回放轮数
+ * @param bytes 用于返回写给复用器的负载字节数
+ * @return 0 表示成功，负数表示错误码
+ */
+static int replay_packets(AVFormatContext **outputs, int nb_outputs, PacketStore *ps, int loops, int64_t *bytes)
+{
+    AVFormatContext *src = outputs[0];
+    int64_t den = 1, unit = 1, span = 0, scale[MAX_STORE_STREAMS], step[MAX_STORE_STREAMS];
+    AVPacket *pkt;
+    unsigned int i;
+    int k, n, j, ret = 0;
+
+    // 公共时间基准 1/den，den 为各流时间基准分母的最小公倍数；流 i 的一个时间单位等于 scale[i] 个公共单位
+    for (i = 0; i < src->nb_streams; i++)
+    {
+        den = den / av_gcd(den, src->streams[i]->time_base.den) * src->streams[i]->time_base.den;
+    }
+    for (i = 0; i < src->nb_streams; i++)
+    {
+        AVRational tb = src->streams[i]->time_base;
+
+        scale[i] = tb.num * (den / tb.den);
+        unit     = unit / av_gcd(unit, scale[i]) * scale[i];
+        span     = FFMAX(span, (ps->end[i] - ps->start[i]) * scale[i]);
+    }
+    span = (span + unit - 1) / unit * unit;
+    for (i = 0; i < src->nb_streams; i++)
+    {
+        step[i] = span / scale[i];
+    }
+
+    pkt = av_packet_alloc();
+    if (!pkt)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    *bytes = 0;
+    for (k = 0; k < loops && ret >= 0; k++)
+    {
+        for (n = 0; n < ps->nb_packets && ret >= 0; n++)
+        {
+            const StoredPacket *sp = &ps->packets[n];
+            int64_t offset = k * step[sp->stream_index];
+
+            for (j = 0; j < nb_outputs; j++)
+            {
+                AVStream *st = outputs[j]->streams[sp->stream_index];
+
+                pkt->buf = av_buffer_ref(ps->buf);
+                if (!pkt->buf)
+                {
+                    ret = AVERROR(ENOMEM);
+                    break;
+                }
+                pkt->data         = ps->arena + sp->offset;
+                pkt->size         = sp->size;
+                pkt->pts          = sp->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : sp->pts + offset;
+                pkt->dts          = sp->dts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : sp->dts + offset;
+                pkt->duration     = sp->duration;
+                pkt->flags        = sp->flags;
+                pkt->stream_index = sp->stream_index;
+                // 额外输出的复用器在写文件头时可能改变了时间基准
+                if (av_cmp_q(st->time_base, src->streams[sp->stream_index]->time_base))
+                {
+                    av_packet_rescale_ts(pkt, src->streams[sp->stream_index]->time_base, st->time_base);
+                }
+
+                *bytes += sp->size;
+                if ((ret = av_interleaved_write_frame(outputs[j], pkt)) < 0)
+                {
+                    fprintf(stderr, "Error while replaying a packet: %s\n", av_err2str(ret));
+                    break;
+                }
+            }
+        }
+    }
+
+    av_packet_free(&pkt);
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 回放模式：编码已经结束，把仓库中的数据包回放给 oc 以及另外 replay_outputs - 1 个输出，
+ * 只测量复用和写文件的吞吐量
+ * @param oc 编码时使用的输出
+ * @param pattern 输出文件名模板，replay_outputs 大于 1 时其中的 %d 替换为输出序号
+ * @param opt 其他输出写文件头时使用的选项
+ * @return 0 表示成功，负数表示错误码
+ */
+static int run_replay(AVFormatContext *oc, const char *pattern, const AVDictionary *opt)
+{
+    AVFormatContext **outputs;
+    char name[1024];
+    int64_t t0, elapsed, bytes = 0;
+    int i, ret = 0, nb_packets = packet_store.nb_packets;
+
+    if (packet_store.arena_size > INT_MAX)
+    {
+        fprintf(stderr, "The packet store is too large to replay\n");
+        return AVERROR(EINVAL);
+    }
+    // arena 交给 AVBufferRef 管理，之后回放的数据包都引用它
+    packet_store.buf = av_buffer_create(packet_store.arena, packet_store.arena_size,
+                                        av_buffer_default_free, NULL, AV_BUFFER_FLAG_READONLY);
+    if (!packet_store.buf)
+    {
+        return AVERROR(ENOMEM);
+    }
+    fprintf(stderr, "replay: %d packets, %.1f MB stored\n", nb_packets, packet_store.arena_len / 1048576.0);
+
+    outputs = av_calloc(replay_outputs, sizeof(*outputs));
+    if (!outputs)
+    {
+        return AVERROR(ENOMEM);
+    }
+    outputs[0] = oc;
+    for (i = 1; i < replay_outputs && ret >= 0; i++)
+    {
+        av_get_frame_filename(name, sizeof(name), pattern, i);
+        if ((ret = open_replay_output(&outputs[i], name, oc, opt)) < 0)
+        {
+            fprintf(stderr, "Could not open replay output '%s': %s\n", name, av_err2str(ret));
+        }
+    }
+
+    t0 = av_gettime_relative();
+    if (ret >= 0)
+    {
+        ret = replay_packets(outputs, replay_outputs, &packet_store, replay_loops, &bytes);
+    }
+    for (i = 1; i < replay_outputs && outputs[i]; i++)
+    {
+        if (ret >= 0)
+        {
+            ret = av_write_trailer(outputs[i]);
+        }
+        if (!(outputs[i]->oformat->flags & AVFMT_NOFILE) && outputs[i]->pb && io_engine.nb_buffers)
+        {
+            int close_ret = io_engine_close(&outputs[i]->pb);
+
+            ret = ret < 0 ? ret : close_ret;
+        }
+        else if (!(outputs[i]->oformat->flags & AVFMT_NOFILE))
+        {
+            avio_closep(&outputs[i]->pb);
+        }
+        avformat_free_context(outputs[i]);
+    }
+    elapsed = FFMAX(av_gettime_relative() - t0, 1);
+    av_free(outputs);
+
+    // oc 的文件尾由 main 写出，这里的耗时不包括它
+    fprintf(stderr, "replay: %d loops x %d outputs, %"PRId64" packets, %.1f MB in %.3f s "
+            "(%.0f packets/s, %.1f MB/s)\n",
+            replay_loops, replay_outputs, (int64_t)nb_packets * replay_loops * replay_outputs,
+            bytes / 1048576.0, elapsed / 1000000.0,
+            (double)nb_packets * replay_loops * replay_outputs * 1000000.0 / elapsed,
+            bytes / (double)elapsed);
+
+    av_buffer_unref(&packet_store.buf);
+    av_freep(&packet_store.packets);
+
+    return ret;
+}
+
+
+
+
+
+/**
+ * @brief 多会话模式下排队等待写出的一块数据，由复用器的 write_packet 回调产生，I/O 线程写出后释放
+ */
+typedef struct OutChunk {
+    struct OutChunk *next;
+    int size;
+    // 已经写出的字节数，只由 I/O 线程访问
+    int done;
+    uint8_t data[];
+} OutChunk;
+
+enum {
+    SESSION_READY,                               /* 在运行队列中等待工作线程 */
+    SESSION_RUNNING,                             /* 正在由某个工作线程执行一步 */
+    SESSION_BLOCKED,                             /* 排队的输出超过了配额，等待 I/O 线程写出 */
+    SESSION_FINISHED,                            /* 编码和复用已结束，等待剩余的输出写完 */
+    SESSION_CLOSED,                              /* 所有输出都已写出，描述符已关闭 */
+};
+
+/**
+ * @brief 一个轻量的复用会话：一组输出流、一个输出格式上下文，以及尚未写出的输出数据。
+ * 会话没有自己的线程，工作线程每次为它执行一步（编码并复用一帧）后把它放回运行队列的末尾
+ */
+typedef struct Session {
+    int index;
+    struct Scheduler *sched;
+    AVFormatContext *oc;
+    OutputStream video, audio;
+    int have_video, have_audio, encode_video, encode_audio;
+    int state;
+    int fd;
+
+    // 尚未写出的输出数据（链表），以及其中的字节数；由 sched_lock 保护
+    OutChunk *out_head, *out_tail;
+    int64_t pending;
+
+    // 统计：已执行的步数、写出的字节数、因输出积压被阻塞的次数、编码结束的时刻
+    int64_t steps, bytes, nb_blocked, t_finish;
+    // 会话因为自身或其他会话出错而被放弃，输出不完整
+    int failed;
+} Session;
+
+/**
+ * @brief 多会话调度器的共享状态。所有字段由 lock 保护
+ */
+typedef struct Scheduler {
+    Session *sessions;
+    int nb_sessions;
+
+    // 运行队列：保存处于 READY 状态的会话，先进先出，保证每个会话轮流前进一步
+    Session **run_queue;
+    int run_head, run_len;
+
+    pthread_mutex_t lock;
+    // work_cond：运行队列不空或者全部结束；io_cond：有新的输出数据或者有会话结束
+    pthread_cond_t work_cond, io_cond;
+
+    // 所有会话排队中的输出字节数、峰值，以及单个会话允许积压的字节数
+    int64_t pending, peak_pending, session_cap;
+    int nb_finished, nb_closed;
+    int error;
+
+    // 第一个会话结束时，所有会话已执行步数的最小值和最大值，用于衡量公平性
+    int64_t first_finish_min, first_finish_max;
+    // I/O 线程统计：写系统调用次数、poll 次数
+    int64_t nb_writes, nb_polls;
+} Scheduler;
+
+
+
+
+/**
+ * @brief 会话的 AVIOContext write_packet 回调，在工作线程中调用：只把数据挂到会话的输出链表上，
+ * 真正的写出由 I/O 线程完成，工作线程不会阻塞在慢速的输出上
+ */
+static int session_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    Session *sess = opaque;
+    Scheduler *sched = sess->sched;
+    OutChunk *chunk = av_malloc(sizeof(*chunk) + buf_size);
+
+    if (!chunk)
+    {
+        return AVERROR(ENOMEM);
+    }
+    chunk->next = NULL;
+    chunk->size = buf_size;
+    chunk->done = 0;
+    memcpy(chunk->data, buf, buf_size);
+
+    pthread_mutex_lock(&sched->lock);
+    if (sess->out_tail)
+        sess->out_tail->next = chunk;
+    else
+        sess->out_head = chunk;
+    sess->out_tail = chunk;
+    sess->pending  += buf_size;
+    sched->pending += buf_size;
+    sched->peak_pending = FFMAX(sched->peak_pending, sched->pending);
+    pthread_cond_signal(&sched->io_cond);
+    pthread_mutex_unlock(&sched->lock);
+
+    return buf_size;
+}
+
+
+
+
+/**
+ * @brief 创建一个会话：输出文件名为 pattern 中的 %d 替换为会话序号，打开输出描述符（设置为非阻塞）、
+ * 编码器，写入文件头。会话的编码器只用一个线程，并行度来自工作线程池
+ * @return 0 表示成功，负数表示错误码
+ */
+static int session_open(Scheduler *sched, Session *sess, const char *pattern, const char *format_name,
+                        AVDictionary *opt_arg)
+{
+    const AVCodec *video_codec, *audio_codec;
+    AVDictionary *opt = NULL;
+    uint8_t *avio_buffer;
+    char name[1024];
+    int ret;
+
+    av_get_frame_filename(name, sizeof(name), pattern, sess->index);
+    sess->sched = sched;
+    sess->fd    = -1;
+
+    avformat_alloc_output_context2(&sess->oc, NULL, format_name, name);
+    if (!sess->oc)
+    {
+        avformat_alloc_output_context2(&sess->oc, NULL, "mpegts", name);
+    }
+    if (!sess->oc)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    if (sess->oc->oformat->video_codec != AV_CODEC_ID_NONE)
+    {
+        add_stream(&sess->video, sess->oc, &video_codec, sess->oc->oformat->video_codec);
+        sess->video.enc->thread_count = 1;
+        sess->have_video = sess->encode_video = 1;
+    }
+    if (sess->oc->oformat->audio_codec != AV_CODEC_ID_NONE)
+    {
+        add_stream(&sess->audio, sess->oc, &audio_codec, sess->oc->oformat->audio_codec);
+        sess->audio.enc->thread_count = 1;
+        sess->have_audio = sess->encode_audio = 1;
+    }
+    if (sess->have_video)
+    {
+        open_video(sess->oc, video_codec, &sess->video, opt_arg);
+    }
+    if (sess->have_audio)
+    {
+        open_audio(sess->oc, audio_codec, &sess->audio, opt_arg);
+    }
+    if (sess->have_video && frame_cache > 0)
+    {
+        init_frame_cache(&sess->video, (int)FFMIN(frame_cache, sess->video.end_pts + 1));
+    }
+    if (sess->have_video && sess->have_audio)
+    {
+        OutputStream *streams[] = { &sess->video, &sess->audio };
+        init_scheduler_clock(streams, FF_ARRAY_ELEMS(streams));
+    }
+
+    // 输出数据只在 I/O 线程中顺序写出，无法 seek；MP4/MOV 改为 fragmented MP4
+    av_dict_copy(&opt, opt_arg, 0);
+    if (av_match_name(sess->oc->oformat->name, "mov,mp4,m4a,3gp,3g2,ipod,psp,ismv,f4v"))
+    {
+        av_dict_set(&opt, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
+    if (!(sess->oc->oformat->flags & AVFMT_NOFILE))
+    {
+        // FIFO 以非阻塞方式打开时如果还没有读者会失败，因此先阻塞地打开，再设置为非阻塞
+        if (av_strstart(name, "tcp://", NULL) || av_strstart(name, "unix:", NULL))
+            ret = connect_socket(name);
+        else if ((ret = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            ret = AVERROR(errno);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Could not open '%s': %s\n", name, av_err2str(ret));
+            av_dict_free(&opt);
+            return ret;
+        }
+        sess->fd = ret;
+        fcntl(sess->fd, F_SETFL, fcntl(sess->fd, F_GETFL) | O_NONBLOCK);
+
+        avio_buffer = av_malloc(output_avio_buffer_size);
+        sess->oc->pb = avio_buffer ? avio_alloc_context(avio_buffer, output_avio_buffer_size, 1, sess,
+                                                        NULL, session_write, NULL) : NULL;
+        if (!sess->oc->pb)
+        {
+            av_free(avio_buffer);
+            av_dict_free(&opt);
+            return AVERROR(ENOMEM);
+        }
+        sess->oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    ret = avformat_write_header(sess->oc, &opt);
+    av_dict_free(&opt);
+
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 为会话执行一步：编码并复用一帧（选择下一帧时间较早的那个流），两个流都结束时写文件尾
+ * @return 1 表示会话已经结束，0 表示还有工作，负数表示错误码
+ */
+static int session_step(Session *sess)
+{
+    int ret;
+
+    if (sess->encode_video && (!sess->encode_audio || stream_before(&sess->video, &sess->audio)))
+    {
+        sess->encode_video = !write_video_frame(sess->oc, &sess->video);
+    }
+    else if (sess->encode_audio)
+    {
+        sess->encode_audio = !write_audio_frame(sess->oc, &sess->audio);
+    }
+    sess->steps++;
+
+    if (sess->encode_video || sess->encode_audio)
+    {
+        return 0;
+    }
+
+    if ((ret = av_write_trailer(sess->oc)) < 0)
+    {
+        return ret;
+    }
+    if (sess->oc->pb)
+    {
+        avio_flush(sess->oc->pb);
+    }
+
+    return 1;
+}
+
+
+
+
+/**
+ * @brief 判断会话的输出积压是否允许它继续执行：单个会话不超过它的配额，所有会话之和不超过内存上限。
+ * 调用时必须持有 sched->lock
+ */
+static int session_may_run(const Scheduler *sched, const Session *sess)
+{
+    return sess->pending < sched->session_cap && sched->pending < session_mem_budget;
+}
+
+
+
+
+/**
+ * @brief 丢弃会话尚未写出的全部输出数据，不计入写出的字节数。调用时必须持有 sched->lock
+ * @return 丢弃的字节数
+ */
+static int64_t session_discard_output(Scheduler *sched, Session *sess)
+{
+    int64_t discarded = sess->pending;
+    OutChunk *chunk;
+
+    while ((chunk = sess->out_head))
+    {
+        sess->out_head = chunk->next;
+        av_free(chunk);
+    }
+    sess->out_tail  = NULL;
+    sched->pending -= sess->pending;
+    sess->pending   = 0;
+    return discarded;
+}
+
+
+
+
+/**
+ * @brief 把会话放到运行队列的末尾并唤醒一个工作线程。调用时必须持有 sched->lock
+ */
+static void session_enqueue(Scheduler *sched, Session *sess)
+{
+    sess->state = SESSION_READY;
+    sched->run_queue[(sched->run_head + sched->run_len) % sched->nb_sessions] = sess;
+    sched->run_len++;
+    pthread_cond_signal(&sched->work_cond);
+}
+
+
+
+
+/**
+ * @brief 工作线程：反复从运行队列头部取出一个会话执行一步，再根据它的输出积压放回队列末尾或者阻塞它。
+ * 每一步的工作量相近（一帧），轮转调度使所有会话以相同的速度前进
+ */
+static void *session_worker_main(void *arg)
+{
+    Scheduler *sched = arg;
+    Session *sess;
+    int ret, i;
+
+    pthread_mutex_lock(&sched->lock);
+    for (;;)
+    {
+        while (!sched->run_len && sched->nb_finished < sched->nb_sessions && !sched->error)
+        {
+            pthread_cond_wait(&sched->work_cond, &sched->lock);
+        }
+        if (!sched->run_len)
+        {
+            break;
+        }
+        sess = sched->run_queue[sched->run_head];
+        sched->run_head = (sched->run_head + 1) % sched->nb_sessions;
+        sched->run_len--;
+        if (sched->error)
+        {
+            // 出错之后不再编码：放弃排队中的会话，交给 I/O 线程关闭
+            sess->failed = 1;
+            sess->state  = SESSION_FINISHED;
+            sched->nb_finished++;
+            pthread_cond_signal(&sched->io_cond);
+            continue;
+        }
+        sess->state = SESSION_RUNNING;
+        pthread_mutex_unlock(&sched->lock);
+
+        ret = session_step(sess);
+
+        pthread_mutex_lock(&sched->lock);
+        if (ret < 0)
+        {
+            fprintf(stderr, "session %d failed: %s\n", sess->index, av_err2str(ret));
+            sched->error = ret;
+            sess->failed = 1;
+        }
+        if (sess->state == SESSION_CLOSED)
+        {
+            // I/O 线程已经关闭了这个会话，不能再改回其他状态
+        }
+        else if (ret == 0 && sched->error)
+        {
+            // 其他会话出错：这个会话不再继续，交给 I/O 线程关闭
+            sess->failed = 1;
+            sess->state  = SESSION_FINISHED;
+            sched->nb_finished++;
+            pthread_cond_signal(&sched->io_cond);
+        }
+        else if (ret != 0)
+        {
+            sess->state    = SESSION_FINISHED;
+            sess->t_finish = av_gettime_relative();
+            // 第一个会话结束时记录所有会话的进度差距，轮转调度下它们应当接近
+            if (!sched->nb_finished++)
+            {
+                sched->first_finish_min = INT64_MAX;
+                for (i = 0; i < sched->nb_sessions; i++)
+                {
+                    sched->first_finish_min = FFMIN(sched->first_finish_min, sched->sessions[i].steps);
+                    sched->first_finish_max = FFMAX(sched->first_finish_max, sched->sessions[i].steps);
+                }
+            }
+            pthread_cond_broadcast(&sched->work_cond);
+            pthread_cond_signal(&sched->io_cond);
+        }
+        else if (session_may_run(sched, sess))
+        {
+            session_enqueue(sched, sess);
+        }
+        else
+        {
+            sess->state = SESSION_BLOCKED;
+            sess->nb_blocked++;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief I/O 线程：用 poll 等待有积压数据的会话的描述符变为可写，以非阻塞方式写出每个会话链表头部的数据块。
+ * 写出后积压减少，被阻塞的会话重新放回运行队列；会话结束且数据全部写出后关闭它的描述符
+ */
+static void *session_io_main(void *arg)
+{
+    Scheduler *sched = arg;
+    struct pollfd *fds;
+    Session **polled;
+    int nb_fds, i, n;
+    ssize_t written;
+
+    fds    = av_calloc(sched->nb_sessions, sizeof(*fds));
+    polled = av_calloc(sched->nb_sessions, sizeof(*polled));
+    if (!fds || !polled)
+    {
+        pthread_mutex_lock(&sched->lock);
+        sched->error = AVERROR(ENOMEM);
+        pthread_cond_broadcast(&sched->work_cond);
+        pthread_mutex_unlock(&sched->lock);
+        av_free(fds);
+        av_free(polled);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    while (sched->nb_closed < sched->nb_sessions)
+    {
+        nb_fds = 0;
+        for (i = 0; i < sched->nb_sessions; i++)
+        {
+            Session *sess = &sched->sessions[i];
+
+            if (sess->state == SESSION_CLOSED)
+            {
+                continue;
+            }
+            if (sched->error)
+            {
+                // 出错后不再写出：阻塞或已结束的会话丢弃积压的输出后关闭；正在运行或排在运行队列中的会话
+                // 属于工作线程，工作线程看到错误后把它们标记为结束
+                if (sess->state == SESSION_BLOCKED || sess->state == SESSION_FINISHED)
+                {
+                    if (session_discard_output(sched, sess) > 0 || sess->state == SESSION_BLOCKED)
+                    {
+                        sess->failed = 1;
+                    }
+                    if (sess->fd >= 0)
+                    {
+                        close(sess->fd);
+                        sess->fd = -1;
+                    }
+                    sess->state = SESSION_CLOSED;
+                    sched->nb_closed++;
+                }
+                continue;
+            }
+            if (sess->out_head)
+            {
+                fds[nb_fds].fd      = sess->fd;
+                fds[nb_fds].events  = POLLOUT;
+                fds[nb_fds].revents = 0;
+                polled[nb_fds++]    = sess;
+            }
+            else if (sess->state == SESSION_FINISHED)
+            {
+                // 输出已经全部写出，关闭会话的描述符
+                if (sess->fd >= 0)
+                {
+                    close(sess->fd);
+                    sess->fd = -1;
+                }
+                sess->state = SESSION_CLOSED;
+                sched->nb_closed++;
+            }
+        }
+        if (!nb_fds)
+        {
+            if (sched->nb_closed < sched->nb_sessions)
+            {
+                pthread_cond_wait(&sched->io_cond, &sched->lock);
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&sched->lock);
+
+        // 普通文件总是可写；FIFO 和 socket 在下游读得慢时不可写，此时不影响其他会话
+        n = poll(fds, nb_fds, 100);
+        sched->nb_polls++;
+
+        for (i = 0; n > 0 && i < nb_fds; i++)
+        {
+            Session *sess = polled[i];
+            OutChunk *chunk = sess->out_head;
+
+            if (!(fds[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+            {
+                continue;
+            }
+            // 工作线程只会修改链表尾部，头部的数据块在 I/O 线程中可以不加锁地读取
+            written = write(sess->fd, chunk->data + chunk->done, chunk->size - chunk->done);
+            if (written < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                continue;
+            }
+            sched->nb_writes++;
+
+            pthread_mutex_lock(&sched->lock);
+            if (written < 0)
+            {
+                // 写不出去的数据直接丢弃，不计入写出的字节数
+                fprintf(stderr, "session %d: write error: %s\n", sess->index, strerror(errno));
+                sched->error = AVERROR(errno);
+                sess->failed = 1;
+                session_discard_output(sched, sess);
+                pthread_cond_broadcast(&sched->work_cond);
+                pthread_mutex_unlock(&sched->lock);
+                continue;
+            }
+            chunk->done    += written;
+            sess->bytes    += written;
+            sess->pending  -= written;
+            sched->pending -= written;
+            if (chunk->done == chunk->size)
+            {
+                sess->out_head = chunk->next;
+                if (!sess->out_head)
+                {
+                    sess->out_tail = NULL;
+                }
+                av_free(chunk);
+            }
+            pthread_mutex_unlock(&sched->lock);
+        }
+
+        // 积压减少后，重新调度被阻塞的会话；出错后不再调度，阻塞的会话在下一轮中被关闭
+        pthread_mutex_lock(&sched->lock);
+        for (i = 0; i < sched->nb_sessions && !sched->error; i++)
+        {
+            Session *sess = &sched->sessions[i];
+
+            if (sess->state == SESSION_BLOCKED && session_may_run(sched, sess))
+            {
+                session_enqueue(sched, sess);
+            }
+        }
+    }
+    pthread_cond_broadcast(&sched->work_cond);
+    pthread_mutex_unlock(&sched->lock);
+
+    av_free(fds);
+    av_free(polled);
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief 多会话模式：nb_sessions 个会话在 nb_workers 个工作线程上协作式地运行，一个 I/O 线程负责所有的写出
+ * @param pattern 输出文件名模板，其中的 %d 替换为会话序号
+ * @param format_name 强制指定的输出格式，NULL 表示根据文件名推断
+ * @param opt 传给编码器和复用器的选项
+ * @return 0 表示成功，负数表示错误码
+ */
+static int run_sessions(const char *pattern, const char *format_name, AVDictionary *opt)
+{
+    Scheduler sched = { 0 };
+    pthread_t *workers = NULL, io_thread;
+    int64_t t_start, elapsed, frames = 0, bytes = 0, blocked = 0, finish_min = INT64_MAX, finish_max = 0;
+    int i, ret = 0, nb_started = 0, nb_failed = 0;
+
+    if (nb_workers <= 0)
+    {
+        nb_workers = FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+    // 消费者提前退出时 write 返回 EPIPE，而不是让进程被 SIGPIPE 杀死
+    signal(SIGPIPE, SIG_IGN);
+
+    sched.nb_sessions = nb_sessions;
+    sched.sessions    = av_calloc(nb_sessions, sizeof(*sched.sessions));
+    sched.run_queue   = av_calloc(nb_sessions, sizeof(*sched.run_queue));
+    workers           = av_calloc(nb_workers, sizeof(*workers));
+    if (!sched.sessions || !sched.run_queue || !workers)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    // 每个会话最多积压平均份额的两倍，至少能放下两个 avio 缓冲区，一个慢速的输出不会占满全部内存
+    sched.session_cap = FFMAX(session_mem_budget / nb_sessions * 2, 2 * output_avio_buffer_size);
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.work_cond, NULL);
+    pthread_cond_init(&sched.io_cond, NULL);
+
+    for (i = 0; i < nb_sessions; i++)
+    {
+        sched.sessions[i].index = i;
+        if ((ret = session_open(&sched, &sched.sessions[i], pattern, format_name, opt)) < 0)
+        {
+            fprintf(stderr, "Could not start session %d: %s\n", i, av_err2str(ret));
+            nb_sessions = i + 1;
+            goto end;
+        }
+        session_enqueue(&sched, &sched.sessions[i]);
+    }
+    fprintf(stderr, "sessions: %d sessions on %d workers, memory budget %.1f MB (%.1f MB per session)\n",
+            nb_sessions, nb_workers, session_mem_budget / 1048576.0, sched.session_cap / 1048576.0);
+
+    t_start = av_gettime_relative();
+    if ((ret = AVERROR(pthread_create(&io_thread, NULL, session_io_main, &sched))) < 0)
+    {
+        goto end;
+    }
+    for (i = 0; i < nb_workers; i++)
+    {
+        if ((ret = AVERROR(pthread_create(&workers[i], NULL, session_worker_main, &sched))) < 0)
+        {
+            break;
+        }
+        nb_started++;
+    }
+    if (!nb_started)
+    {
+        // 没有工作线程时所有会话都无法结束，通知 I/O 线程放弃
+        pthread_mutex_lock(&sched.lock);
+        sched.error = ret;
+        sched.nb_finished = sched.nb_sessions;
+        sched.run_len = 0;
+        for (i = 0; i < nb_sessions; i++)
+        {
+            sched.sessions[i].failed = 1;
+            sched.sessions[i].state  = SESSION_FINISHED;
+        }
+        pthread_cond_signal(&sched.io_cond);
+        pthread_mutex_unlock(&sched.lock);
+    }
+    for (i = 0; i < nb_started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_join(io_thread, NULL);
+    elapsed = FFMAX(av_gettime_relative() - t_start, 1);
+    if (sched.error < 0)
+    {
+        ret = sched.error;
+    }
+
+    for (i = 0; i < nb_sessions; i++)
+    {
+        Session *sess = &sched.sessions[i];
+
+        frames += sess->video.nb_frames + sess->audio.nb_frames;
+        bytes  += sess->bytes;
+        blocked += sess->nb_blocked;
+        nb_failed += sess->failed;
+        if (sess->t_finish)
+        {
+            finish_min = FFMIN(finish_min, sess->t_finish - t_start);
+            finish_max = FFMAX(finish_max, sess->t_finish - t_start);
+        }
+    }
+    fprintf(stderr, "sessions: %"PRId64" frames in %.3f s (%.1f frames/s), %.1f MB written in %"PRId64" writes, "
+            "%"PRId64" polls\n",
+            frames, elapsed / 1000000.0, frames * 1000000.0 / elapsed,
+            bytes / 1048576.0, sched.nb_writes, sched.nb_polls);
+    fprintf(stderr, "fairness: sessions finished between %.3f s and %.3f s, "
+            "steps %"PRId64"..%"PRId64" when the first one finished\n",
+            finish_min == INT64_MAX ? 0 : finish_min / 1000000.0, finish_max / 1000000.0,
+            sched.first_finish_min, sched.first_finish_max);
+    fprintf(stderr, "memory: peak queued output %.1f MB, sessions blocked on their quota %"PRId64" times\n",
+            sched.peak_pending / 1048576.0, blocked);
+    if (nb_failed)
+    {
+        fprintf(stderr, "sessions: %d of %d sessions failed, their output is incomplete\n", nb_failed, nb_sessions);
+    }
+
+end:
+    for (i = 0; sched.sessions && i < nb_sessions; i++)
+    {
+        Session *sess = &sched.sessions[i];
+        OutChunk *chunk;
+
+        while ((chunk = sess->out_head))
+        {
+            sess->out_head = chunk->next;
+            av_free(chunk);
+        }
+        if (sess->have_video)
+            close_stream(sess->oc, &sess->video);
+        if (sess->have_audio)
+            close_stream(sess->oc, &sess->audio);
+        if (sess->oc && sess->oc->pb)
+        {
+            av_freep(&sess->oc->pb->buffer);
+            avio_context_free(&sess->oc->pb);
+        }
+        if (sess->fd >= 0)
+        {
+            close(sess->fd);
+        }
+        avformat_free_context(sess->oc);
+    }
+    av_free(sched.sessions);
+    av_free(sched.run_queue);
+    av_free(workers);
+
+    return ret;
+}
+
+
+
+
+
+/**
+ * @brief 图像序列模式的共享状态：工作线程从 next_frame 领取帧号，各自编码并写出一个文件
+ */
+typedef struct ImageSequence {
+    const char *pattern;
+    const AVCodec *codec;
+    enum AVPixelFormat pix_fmt;
+    AVDictionary *opt;
+    int nb_frames;
+
+    // 保护下面的字段
+    pthread_mutex_t lock;
+    int next_frame;
+    int error;
+    // 已经写完的最大帧号，以及在某个更晚的帧之后才写完的文件个数
+    int64_t max_done;
+    int nb_out_of_order;
+} ImageSequence;
+
+/**
+ * @brief 图像序列模式的一个工作线程，拥有自己的编码器上下文、帧和转换上下文，线程之间不共享任何编码状态
+ */
+typedef struct ImageWorker {
+    ImageSequence *seq;
+    int index;
+    pthread_t thread;
+    // 复用 OutputStream 的 enc、frame、tmp_frame、sws_ctx 和 tmp_pkt，以便直接调用 render_video_frame
+    OutputStream ost;
+
+    // 统计信息：编码的帧数、写出的字节数、编码和写文件的耗时（微秒）
+    int nb_frames;
+    int64_t bytes;
+    int64_t encode_time;
+    int64_t write_time;
+} ImageWorker;
+
+
+
+
+/**
+ * @brief 把一个数据包写成一个图像文件：先写到同一目录下的临时文件，写完后 rename 成最终的文件名。
+ * rename 是原子的，读取目录的程序要么看不到这个文件，要么看到完整的文件，因此各帧可以按任意顺序完成
+ * @return 0 表示成功，负数表示错误码
+ */
+static int write_image_file(ImageWorker *w, const AVPacket *pkt)
+{
+    char name[1024], tmp_name[1100];
+    const uint8_t *p = pkt->data;
+    int size = pkt->size, fd, ret = 0;
+    ssize_t n;
+
+    if (av_get_frame_filename(name, sizeof(name), w->seq->pattern, pkt->pts) < 0)
+    {
+        return AVERROR(EINVAL);
+    }
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp%d", name, w->index);
+
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        return AVERROR(errno);
+    }
+    while (size > 0)
+    {
+        n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            ret = AVERROR(errno);
+            break;
+        }
+        p    += n;
+        size -= n;
+    }
+    if (close(fd) < 0 && ret >= 0)
+    {
+        ret = AVERROR(errno);
+    }
+    if (ret >= 0 && rename(tmp_name, name) < 0)
+    {
+        ret = AVERROR(errno);
+    }
+    if (ret < 0)
+    {
+        unlink(tmp_name);
+        return ret;
+    }
+
+    w->bytes += pkt->size;
+    pthread_mutex_lock(&w->seq->lock);
+    if (pkt->pts < w->seq->max_done)
+    {
+        w->seq->nb_out_of_order++;
+    }
+    w->seq->max_done = FFMAX(w->seq->max_done, pkt->pts);
+    pthread_mutex_unlock(&w->seq->lock);
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 取出编码器中所有可用的数据包并逐个写成文件。文件名取自数据包的 pts（即帧号），
+ * 不依赖领取帧号的顺序
+ * @return 0 表示成功，负数表示错误码
+ */
+static int write_image_packets(ImageWorker *w)
+{
+    AVPacket *pkt = w->ost.tmp_pkt;
+    int64_t t0;
+    int ret;
+
+    for (;;)
+    {
+        t0  = av_gettime_relative();
+        ret = avcodec_receive_packet(w->ost.enc, pkt);
+        w->encode_time += av_gettime_relative() - t0;
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        {
+            return 0;
+        }
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        t0  = av_gettime_relative();
+        ret = write_image_file(w, pkt);
+        w->write_time += av_gettime_relative() - t0;
+        av_packet_unref(pkt);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief 图像序列模式的工作线程：不断领取下一个帧号，渲染、编码并写出，直到所有帧都领取完
+ */
+static void *image_worker_main(void *arg)
+{
+    ImageWorker *w = arg;
+    ImageSequence *seq = w->seq;
+    OutputStream *ost = &w->ost;
+    int64_t t0;
+    int frame_index, ret = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&seq->lock);
+        frame_index = seq->error ? seq->nb_frames : seq->next_frame++;
+        pthread_mutex_unlock(&seq->lock);
+        if (frame_index >= seq->nb_frames)
+        {
+            break;
+        }
+
+        // 编码器可能仍然持有上一帧的引用
+        if (av_frame_make_writable(ost->frame) < 0)
+        {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        render_video_frame(ost, ost->frame, frame_index);
+        ost->frame->pts = frame_index;
+
+        t0  = av_gettime_relative();
+        ret = avcodec_send_frame(ost->enc, ost->frame);
+        w->encode_time += av_gettime_relative() - t0;
+        if (ret < 0 || (ret = write_image_packets(w)) < 0)
+        {
+            break;
+        }
+        w->nb_frames++;
+    }
+
+    // 帧内编码器通常没有延迟，为了安全仍然冲刷一次
+    if (ret >= 0 && (ret = avcodec_send_frame(ost->enc, NULL)) >= 0)
+    {
+        ret = write_image_packets(w);
+    }
+
+    if (ret < 0)
+    {
+        pthread_mutex_lock(&seq->lock);
+        if (!seq->error)
+        {
+            fprintf(stderr, "image worker %d failed: %s\n", w->index, av_err2str(ret));
+            seq->error = ret;
+        }
+        pthread_mutex_unlock(&seq->lock);
+    }
+
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief 为一个工作线程创建并打开编码器上下文。并行发生在帧之间，每个编码器只用一个线程，避免线程数超过 CPU 个数
+ * @return 0 表示成功，负数表示错误码
+ */
+static int open_image_worker(ImageWorker *w)
+{
+    ImageSequence *seq = w->seq;
+    OutputStream *ost = &w->ost;
+    AVDictionary *opt = NULL;
+    AVCodecContext *c;
+    int ret;
+
+    c = avcodec_alloc_context3(seq->codec);
+    ost->tmp_pkt = av_packet_alloc();
+    if (!c || !ost->tmp_pkt)
+    {
+        avcodec_free_context(&c);
+        return AVERROR(ENOMEM);
+    }
+    ost->enc = c;
+
+    c->codec_id     = seq->codec->id;
+    c->width        = 352;
+    c->height       = 288;
+    c->time_base    = (AVRational){ 1, STREAM_FRAME_RATE };
+    c->pix_fmt      = seq->pix_fmt;
+    c->thread_count = 1;
+    if (deterministic)
+    {
+        c->flags |= AV_CODEC_FLAG_BITEXACT;
+    }
+
+    av_dict_copy(&opt, seq->opt, 0);
+    ret = avcodec_open2(c, seq->codec, &opt);
+    av_dict_free(&opt);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ost->frame = alloc_picture(c->pix_fmt, c->width, c->height);
+    if (c->pix_fmt != AV_PIX_FMT_YUV420P)
+    {
+        ost->tmp_frame = alloc_picture(AV_PIX_FMT_YUV420P, c->width, c->height);
+    }
+    return ost->frame ? 0 : AVERROR(ENOMEM);
+}
+
+
+
+
+/**
+ * @brief 图像序列模式：STREAM_DURATION 秒的视频帧由 nb_workers 个线程并行地用帧内编码器（PNG、MJPEG、WebP 等）
+ * 编码，每帧写成一个文件，文件按完成的先后顺序写出。帧之间没有依赖，吞吐量随 CPU 个数线性增长
+ * @param pattern 输出文件名模板，其中的 %d 替换为帧号
+ * @param fmt 输出格式（image2），只用于根据文件扩展名选择编码器
+ * @param opt 传给编码器的选项
+ * @return 0 表示成功，负数表示错误码
+ */
+static int run_image_sequence(const char *pattern, const AVOutputFormat *fmt, AVDictionary *opt)
+{
+    ImageSequence seq = { 0 };
+    ImageWorker *workers;
+    const AVCodecDescriptor *desc;
+    enum AVCodecID codec_id;
+    int64_t t_start, elapsed, bytes = 0, busy = 0, encode = 0;
+    int i, ret = 0, nb_started = 0, min_frames = INT_MAX, max_frames = 0;
+
+    // image2 的默认编码器是 MJPEG，这里按文件扩展名选择编码器（.png 为 PNG，.webp 为 WebP）
+    codec_id = av_guess_codec(fmt, NULL, pattern, NULL, AVMEDIA_TYPE_VIDEO);
+    desc     = avcodec_descriptor_get(codec_id);
+    if (!desc || !(desc->props & AV_CODEC_PROP_INTRA_ONLY))
+    {
+        fprintf(stderr, "-image_seq needs an intra-only image encoder (png, jpg, webp ...), got '%s'\n",
+                avcodec_get_name(codec_id));
+        return AVERROR(EINVAL);
+    }
+    // libwebp_anim 编码器输出动画，单张图像使用 libwebp
+    if (codec_id == AV_CODEC_ID_WEBP)
+    {
+        seq.codec = avcodec_find_encoder_by_name("libwebp");
+    }
+    if (!seq.codec)
+    {
+        seq.codec = avcodec_find_encoder(codec_id);
+    }
+    if (!seq.codec)
+    {
+        fprintf(stderr, "Could not find encoder for '%s'\n", avcodec_get_name(codec_id));
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    // 使用编码器首选的像素格式：PNG 为 RGB24，MJPEG 为全范围的 YUVJ420P
+    seq.pix_fmt   = seq.codec->pix_fmts ? seq.codec->pix_fmts[0] : STREAM_PIX_FMT;
+    seq.pattern   = pattern;
+    seq.opt       = opt;
+    // 与 write_video_frame 的结束条件相同：编码 pts 为 0 到 end_pts（含）的帧
+    seq.nb_frames = (int)av_rescale_q_rnd(STREAM_DURATION, (AVRational){ 1, 1 }, (AVRational){ 1, STREAM_FRAME_RATE },
+                                          AV_ROUND_DOWN) + 1;
+    seq.max_done  = -1;
+    pthread_mutex_init(&seq.lock, NULL);
+
+    if (nb_workers <= 0)
+    {
+        nb_workers = FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+    workers = av_calloc(nb_workers, sizeof(*workers));
+    if (!workers)
+    {
+        pthread_mutex_destroy(&seq.lock);
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < nb_workers && ret >= 0; i++)
+    {
+        workers[i].seq   = &seq;
+        workers[i].index = i;
+        if ((ret = open_image_worker(&workers[i])) < 0)
+        {
+            fprintf(stderr, "Could not open the %s encoder: %s\n", seq.codec->name, av_err2str(ret));
+        }
+    }
+
+    t_start = av_gettime_relative();
+    for (i = 0; i < nb_workers && ret >= 0; i++)
+    {
+        if ((ret = pthread_create(&workers[i].thread, NULL, image_worker_main, &workers[i])))
+        {
+            fprintf(stderr, "Could not start an image worker: %s\n", strerror(ret));
+            ret = AVERROR(ret);
+            break;
+        }
+        nb_started++;
+    }
+    // 线程没能全部启动时，已经启动的线程仍会把剩下的帧做完
+    for (i = 0; i < nb_started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    elapsed = FFMAX(av_gettime_relative() - t_start, 1);
+    ret     = ret < 0 ? ret : seq.error;
+
+    for (i = 0; i < nb_workers; i++)
+    {
+        bytes      += workers[i].bytes;
+        encode     += workers[i].encode_time;
+        busy       += workers[i].encode_time + workers[i].write_time;
+        min_frames  = FFMIN(min_frames, workers[i].nb_frames);
+        max_frames  = FFMAX(max_frames, workers[i].nb_frames);
+        close_stream(NULL, &workers[i].ost);
+    }
+    av_free(workers);
+    pthread_mutex_destroy(&seq.lock);
+    if (!nb_started)
+    {
+        return ret;
+    }
+
+    // parallelism 是各线程编码和写文件的总耗时除以墙钟时间，接近线程数说明吞吐量随线程数线性增长
+    fprintf(stderr, "image sequence: %d %s frames (%s) on %d workers, %.1f MB in %.3f s (%.1f frames/s)\n",
+            seq.nb_frames, seq.codec->name, av_get_pix_fmt_name(seq.pix_fmt), nb_workers,
+            bytes / 1048576.0, elapsed / 1000000.0, seq.nb_frames * 1000000.0 / elapsed);
+    fprintf(stderr, "image sequence: encode %.3f s, write %.3f s, parallelism %.2f, "
+            "%d..%d frames per worker, %d files finished after a later frame\n",
+            encode / 1000000.0, (busy - encode) / 1000000.0, busy / (double)elapsed,
+            min_frames, max_frames, seq.nb_out_of_order);
+
+    return ret;
+}
+
+
+
+
+
+/**
+ * @brief 剪辑模式中缓存的一个 GOP：从关键帧开始按解码顺序的数据包，alloc 是已经分配的 AVPacket 个数；
+ * key 和 end 是 GOP 拥有的显示时间范围 [key, end)（主视频流时间基准）
+ */
+typedef struct ClipGop {
+    AVPacket **pkts;
+    int nb;
+    int alloc;
+    int64_t key, end;
+} ClipGop;
+
+/**
+ * @brief 剪辑模式（-clip_input）的状态。主视频流的数据包按 GOP 缓存：完全落在剪辑范围内的 GOP 原样拷贝，
+ * 只有跨越起点或终点的 GOP 解码后用参数相同的编码器重新编码，经过 write_frame 写出。
+ * 重新编码的帧最多是两个 GOP（加上相邻 GOP 的开放 GOP 前导帧），解码最多涉及六个 GOP，与剪辑的长度无关
+ */
+typedef struct ClipState {
+    AVFormatContext *ic;
+    AVFormatContext *oc;
+    // 主视频流在输入中的索引，以及每个输入流对应的输出流索引（-1 表示丢弃或者已经越过终点）
+    int video_index;
+    int *stream_map;
+    // 剪辑范围（AV_TIME_BASE），起点也是输出时间戳的零点
+    int64_t start_us, end_us;
+    // 主视频流时间基准下的起点和终点
+    int64_t start, end;
+
+    // 主视频流的解码器；重新编码时使用的输出流，其中的编码器只在重新编码一个 GOP 期间存在
+    AVCodecContext *dec;
+    OutputStream video;
+    AVFrame *frame;
+    AVDictionary *opt;
+
+    // 正在读的 GOP；等待重新编码的 GOP（要等下一个 GOP 读完才能解码出显示在下一个关键帧之前的前导帧）；
+    // 上一个处理完的 GOP（重新编码下一个 GOP 时用来解码它的前导帧）
+    ClipGop gop, pending, prev;
+    int has_pending;
+    // 重新编码 pending 时从上一个 GOP 的关键帧开始解码
+    int pending_prime;
+    // 上一个 GOP 的结束时间，关键帧没有时间戳时代替；已经处理了终点之后的 GOP
+    int64_t last_end;
+    int past_end;
+    // 拷贝时使用的数据包引用
+    AVPacket *copy_pkt;
+    // 关键帧的 pts - dts（B 帧重排序延迟），AV_NOPTS_VALUE 表示还没有读到关键帧
+    int64_t delay;
+    // 上一个 GOP 是重新编码的；上一个 GOP 是原样拷贝的（开放 GOP 的前导帧只有这时才能解码）
+    int prev_encoded;
+    int prev_copied;
+    // 源码流的参数集，按源码流的格式存放：avcC/hvcC 时是长度前缀的 VPS/SPS/PPS，否则是 extradata 本身
+    uint8_t *param_sets;
+    int param_sets_size;
+
+    // 统计信息
+    int nb_gops_copied;
+    int nb_gops_encoded;
+    int64_t nb_packets_copied;
+    int64_t nb_packets_dropped;
+    int nb_gops_skipped;
+    int64_t nb_frames_decoded;
+    int64_t nb_frames_encoded;
+} ClipState;
+
+
+
+
+
+/**
+ * @brief 把输入文件中的一个数据包原样写入剪辑的输出，时间戳减去剪辑起点后换算到输出流的时间基准
+ * @param cs 剪辑状态
+ * @param pkt 输入的数据包，写入后被清空
+ */
+static void clip_copy_packet(ClipState *cs, AVPacket *pkt)
+{
+    AVStream *ist = cs->ic->streams[pkt->stream_index];
+    AVStream *st  = cs->oc->streams[cs->stream_map[pkt->stream_index]];
+    int64_t offset = av_rescale_q(cs->start_us, AV_TIME_BASE_Q, ist->time_base);
+
+    if (pkt->pts != AV_NOPTS_VALUE)
+    {
+        pkt->pts -= offset;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE)
+    {
+        pkt->dts -= offset;
+    }
+    // 与 write_frame 相同，换算到输出流的时间基准并设置流索引
+    av_packet_rescale_ts(pkt, ist->time_base, st->time_base);
+    pkt->stream_index = st->index;
+    pkt->pos          = -1;
+
+    write_packet(cs->oc, pkt);
+}
+
+
+
+
+
+/**
+ * @brief 把一个 NAL 追加到 cs->param_sets，前面写上 length_size 字节的长度
+ * @return 0 表示成功，负数表示错误码
+ */
+static int clip_append_nal(ClipState *cs, const uint8_t *nal, int size, int length_size)
+{
+    uint8_t *buf = av_realloc(cs->param_sets, cs->param_sets_size + length_size + size);
+
+    if (!buf)
+    {
+        return AVERROR(ENOMEM);
+    }
+    cs->param_sets = buf;
+    buf += cs->param_sets_size;
+    switch (length_size)
+    {
+    case 1:  buf[0] = size;         break;
+    case 2:  AV_WB16(buf, size);    break;
+    default: AV_WB32(buf, size);    break;
+    }
+    memcpy(buf + length_size, nal, size);
+    cs->param_sets_size += length_size + size;
+    return 0;
+}
+
+
+
+
+
+/**
+ * @brief 检查主视频流的码流格式，决定重新编码的数据包如何与拷贝的数据包衔接。
+ * 编码器不设置 AV_CODEC_FLAG_GLOBAL_HEADER，每个重新编码的 GOP 在码流中带有自己的参数集（Annex B）：
+ * 源 extradata 是 avcC/hvcC 时，编码器的数据包改写成与源相同的长度前缀格式，否则保持 Annex B，
+ * 复用器对两种数据包的处理方式相同；同时保存源码流的参数集，在重新编码的 GOP 之后插入到下一个拷贝的关键帧前面。
+ * 只支持这里检查过的编码格式
+ * @param cs 剪辑状态
+ * @return 0 表示成功，负数表示错误码
+ */
+static int clip_probe_bitstream(ClipState *cs)
+{
+    AVCodecParameters *par = cs->ic->streams[cs->video_index]->codecpar;
+    const uint8_t *d = par->extradata, *end = par->extradata + par->extradata_size, *p;
+    int length_size, nb, type, size, i, j, ret;
+
+    cs->video.nal_length_size = 0;
+    switch (par->codec_id)
+    {
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_HEVC:
+        if (par->extradata_size < 4 || (!d[0] && !d[1] && (d[2] == 1 || (!d[2] && d[3] == 1))))
+        {
+            // Annex B：extradata 本身就是起始码分隔的参数集，或者参数集只在码流中
+            break;
+        }
+        if (par->codec_id == AV_CODEC_ID_H264)
+        {
+            // avcC：version、profile、兼容性、level、lengthSizeMinusOne、SPS 个数、SPS、PPS 个数、PPS
+            if (par->extradata_size < 7 || d[0] != 1)
+            {
+                break;
+            }
+            length_size = (d[4] & 3) + 1;
+            p = d + 5;
+            for (i = 0; i < 2 && p < end; i++)
+            {
+                nb = i ? *p++ : *p++ & 0x1f;
+                for (j = 0; j < nb; j++)
+                {
+                    if (end - p < 2 || end - p - 2 < AV_RB16(p))
+                    {
+                        goto invalid;
+                    }
+                    size = AV_RB16(p);
+                    if ((ret = clip_append_nal(cs, p + 2, size, length_size)) < 0)
+                    {
+                        return ret;
+                    }
+                    p += 2 + size;
+                }
+            }
+        }
+        else
+        {
+            // hvcC：22 字节的头（lengthSizeMinusOne 在第 21 字节），然后是若干 NAL 数组（VPS/SPS/PPS/SEI）
+            if (par->extradata_size < 23)
+            {
+                goto invalid;
+            }
+            length_size = (d[21] & 3) + 1;
+            p = d + 23;
+            for (i = 0; i < d[22]; i++)
+            {
+                if (end - p < 3)
+                {
+                    goto invalid;
+                }
+                type = p[0] & 0x3f;
+                nb   = AV_RB16(p + 1);
+                p   += 3;
+                for (j = 0; j < nb; j++)
+                {
+                    if (end - p < 2 || end - p - 2 < AV_RB16(p))
+                    {
+                        goto invalid;
+                    }
+                    size = AV_RB16(p);
+                    // 只插入 VPS/SPS/PPS（32/33/34），SEI 与具体的帧有关
+                    if (type >= 32 && type <= 34 && (ret = clip_append_nal(cs, p + 2, size, length_size)) < 0)
+                    {
+                        return ret;
+                    }
+                    p += 2 + size;
+                }
+            }
+        }
+        if (length_size == 3)
+        {
+            goto invalid;
+        }
+        cs->video.nal_length_size = length_size;
+        return 0;
+    case AV_CODEC_ID_MPEG2VIDEO:
+    case AV_CODEC_ID_MPEG4:
+        // 序列头/VOL 头写在码流中，extradata 就是源码流的头
+        break;
+    default:
+        fprintf(stderr, "Boundary GOPs of '%s' cannot be spliced with copied GOPs; "
+                "-clip_input supports H.264, HEVC, MPEG-2 and MPEG-4 video\n", avcodec_get_name(par->codec_id));
+        return AVERROR_PATCHWELCOME;
+    }
+
+    if (par->extradata_size > 0)
+    {
+        if (!(cs->param_sets = av_memdup(par->extradata, par->extradata_size)))
+        {
+            return AVERROR(ENOMEM);
+        }
+        cs->param_sets_size = par->extradata_size;
+    }
+    return 0;
+
+invalid:
+    fprintf(stderr, "Invalid %s extradata in '%s'\n", avcodec_get_name(par->codec_id), clip_input);
+    return AVERROR_INVALIDDATA;
+}
+
+
+
+
+
+/**
+ * @brief 在重新编码的 GOP 之后第一个拷贝的关键帧前面插入源码流的参数集，
+ * 覆盖重新编码的 GOP 在码流中留下的同 id 的参数集
+ * @param cs 剪辑状态
+ * @param pkt 拷贝的关键帧
+ * @return 0 表示成功，负数表示错误码
+ */
+static int clip_prepend_param_sets(ClipState *cs, AVPacket *pkt)
+{
+    AVPacket *out = av_packet_alloc();
+    int ret;
+
+    if (!out)
+    {
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = av_new_packet(out, cs->param_sets_size + pkt->size)) < 0 ||
+        (ret = av_packet_copy_props(out, pkt)) < 0)
+    {
+        av_packet_free(&out);
+        return ret;
+    }
+    memcpy(out->data, cs->param_sets, cs->param_sets_size);
+    memcpy(out->data + cs->param_sets_size, pkt->data, pkt->size);
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, out);
+    av_packet_free(&out);
+    return 0;
+}
+
+
+
+
+
+/**
+ * @brief 剪辑的解码回读检查（-clip_verify）：重新打开写好的输出，解码其中的视频流，
+ * 检查解码出的帧数是否等于拷贝的数据包个数加上重新编码的帧数，以及是否有解码错误
+ * @param filename 剪辑的输出文件名
+ * @param expected 期望的视频帧数
+ * @return 0 表示检查通过，负数表示错误码
+ */
+static int clip_verify_output(const char *filename, int64_t expected)
+{
+    AVFormatContext *ic = NULL;
+    AVCodecContext *dec = NULL;
+    const AVCodec *decoder;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int64_t nb_frames = 0, nb_errors = 0;
+    int index, ret;
+
+    if (!pkt || !frame)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avformat_open_input(&ic, filename, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(ic, NULL)) < 0 ||
+        (ret = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0)) < 0)
+    {
+        fprintf(stderr, "clip verify: could not open the video stream of '%s': %s\n", filename, av_err2str(ret));
+        goto end;
+    }
+    index = ret;
+    if (!(dec = avcodec_alloc_context3(decoder)))
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    avcodec_parameters_to_context(dec, ic->streams[index]->codecpar);
+    // 码流错误作为返回值报告，而不是被解码器隐藏
+    dec->err_recognition = AV_EF_EXPLODE;
+    if ((ret = avcodec_open2(dec, decoder, NULL)) < 0)
+    {
+        fprintf(stderr, "clip verify: could not open the '%s' decoder: %s\n", decoder->name, av_err2str(ret));
+        goto end;
+    }
+
+    for (;;)
+    {
+        ret = av_read_frame(ic, pkt);
+        if (ret < 0 && ret != AVERROR_EOF)
+        {
+            fprintf(stderr, "clip verify: error reading '%s': %s\n", filename, av_err2str(ret));
+            goto end;
+        }
+        if (ret >= 0 && pkt->stream_index != index)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (avcodec_send_packet(dec, ret >= 0 ? pkt : NULL) < 0)
+        {
+            nb_errors++;
+        }
+        av_packet_unref(pkt);
+        while (avcodec_receive_frame(dec, frame) >= 0)
+        {
+            nb_frames++;
+            if (frame->decode_error_flags || (frame->flags & AV_FRAME_FLAG_CORRUPT))
+            {
+                nb_errors++;
+            }
+            av_frame_unref(frame);
+        }
+        if (ret == AVERROR_EOF)
+        {
+            break;
+        }
+    }
+
+    fprintf(stderr, "clip verify: %"PRId64" video frames decoded (%"PRId64" expected), %"PRId64" decode errors\n",
+            nb_frames, expected, nb_errors);
+    ret = nb_frames == expected && !nb_errors ? 0 : AVERROR_INVALIDDATA;
+
+end:
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&dec);
+    avformat_close_input(&ic);
+    return ret;
+}
+
+
+
+
+
+/**
+ * @brief 为一个需要重新编码的 GOP 打开编码器。编码器与源码流使用相同的编码格式、尺寸、像素格式、
+ * 宽高比、色彩参数、profile/level 和码率，重新编码的帧与拷贝的 GOP 可以被同一个解码器连续解码
+ * @param cs 剪辑状态
+ * @return 0 表示成功，负数表示错误码
+ */
+static int clip_open_encoder(ClipState *cs, int gop_size)
+{
+    AVStream *ist = cs->ic->streams[cs->video_index];
+    AVCodecParameters *par = ist->codecpar;
+    AVDictionary *opt = NULL;
+    const AVCodec *codec;
+    AVCodecContext *c;
+    int ret;
+
+    codec = avcodec_find_encoder(par->codec_id);
+    if (!codec)
+    {
+        fprintf(stderr, "No '%s' encoder, the boundary GOPs cannot be re-encoded\n",
+                avcodec_get_name(par->codec_id));
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    c = avcodec_alloc_context3(codec);
+    if (!c)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    c->width                  = par->width;
+    c->height                 = par->height;
+    c->pix_fmt                = cs->dec->pix_fmt;
+    c->sample_aspect_ratio    = par->sample_aspect_ratio;
+    c->color_range            = par->color_range;
+    c->color_primaries        = par->color_primaries;
+    c->color_trc              = par->color_trc;
+    c->colorspace             = par->color_space;
+    c->chroma_sample_location = par->chroma_location;
+    c->profile                = par->profile;
+    c->level                  = par->level;
+    c->bit_rate               = par->bit_rate > 0 ? par->bit_rate : cs->ic->bit_rate;
+    // 一次编码的帧中只有第一帧是关键帧，不使用 B 帧，dts 等于 pts
+    c->gop_size     = gop_size;
+    c->max_b_frames = 0;
+    // 帧率已知时时间基准取 1/帧率（有的编码器不支持 1/90000 这样的时间基准），否则沿用输入流的时间基准
+    if (ist->avg_frame_rate.num && ist->avg_frame_rate.den)
+    {
+        c->framerate = ist->avg_frame_rate;
+        c->time_base = av_inv_q(ist->avg_frame_rate);
+    }
+    else
+    {
+        c->time_base = ist->time_base;
+    }
+    // 不设置 AV_CODEC_FLAG_GLOBAL_HEADER：参数集随关键帧写在码流中，输出流的 extradata 沿用源文件的，
+    // 数据包在 write_frame 中转换成源码流的格式（见 clip_probe_bitstream）
+
+    av_dict_copy(&opt, cs->opt, 0);
+    ret = avcodec_open2(c, codec, &opt);
+    av_dict_free(&opt);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not open the '%s' encoder: %s\n", codec->name, av_err2str(ret));
+        avcodec_free_context(&c);
+        return ret;
+    }
+
+    cs->video.enc       = c;
+    cs->video.eof       = 0;
+    cs->video.dts_shift = cs->delay == AV_NOPTS_VALUE ? 0 :
+                          av_rescale_q(cs->delay, ist->time_base, c->time_base);
+    return 0;
+}
+
+
+
+
+
+/**
+ * @brief 数据包的显示时间：没有 pts 时用 dts 加上关键帧的重排序延迟估计，都没有时返回 AV_NOPTS_VALUE
+ */
+static int64_t clip_packet_ts(const ClipState *cs, const AVPacket *pkt)
+{
+    if (pkt->pts != AV_NOPTS_VALUE)
+    {
+        return pkt->pts;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE)
+    {
+        return pkt->dts + (cs->delay != AV_NOPTS_VALUE ? cs->delay : 0);
+    }
+    return AV_NOPTS_VALUE;
+}
+
+
+
+
+
+/**
+ * @brief 把一个数据包追加到 GOP 中，pkt 的引用被移走
+ * @return 0 表示成功，负数表示错误码
+ */
+static int clip_gop_append(ClipGop *gop, AVPacket *pkt)
+{
+    AVPacket **pkts;
+
+    if (gop->nb == gop->alloc)
+    {
+        pkts = av_realloc_array(gop->pkts, gop->alloc + 1, sizeof(*pkts));
+        if (!pkts)
+        {
+            return AVERROR(ENOMEM);
+        }
+        gop->pkts = pkts;
+        if (!(gop->pkts[gop->alloc] = av_packet_alloc()))
+        {
+            return AVERROR(ENOMEM);
+        }
+        gop->alloc++;
+    }
+    av_packet_move_ref(gop->pkts[gop->nb++], pkt);
+    return 0;
+}
+
+/* 清空 GOP 中的数据包，保留已经分配的 AVPacket */
+static void clip_gop_clear(ClipGop *gop)
+{
+    int i;
+
+    for (i = 0; i < gop->nb; i++)
+    {
+        av_packet_unref(gop->pkts[i]);
+    }
+    gop->nb = 0;
+}
+
+/* 交换两个 GOP 的内容 */
+static void clip_gop_swap(ClipGop *a, ClipGop *b)
+{
+    ClipGop tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+/* 释放 GOP */
+static void clip_gop_free(ClipGop *gop)
+{
+    int i;
+
+    for (i = 0; i < gop->alloc; i++)
+    {
+        av_packet_free(&gop->pkts[i]);
+    }
+    av_freep(&gop->pkts);
+    gop->nb = gop->alloc = 0;
+}
+
+
+
+
+
+/**
+ * @brief 重新编码等待中的 GOP（cs->pending）。GOP 拥有从它的关键帧到下一个关键帧之间的显示时间，
+ * 其中包括下一个 GOP 的开放 GOP 前导帧，因此把 lookahead（下一个 GOP）的数据包也送进解码器；
+ * cs->pending_prime 为 1 时（上一个 GOP 是拷贝的，或者时间戳是估计的认不出前导帧）这个 GOP 自己的前导帧参考了上一个 GOP，
+ * 从上一个关键帧开始解码，前导帧也一起重新编码。
+ * 所有数据包都在下一个拷贝的 GOP 之前交给复用器
+ * @param cs 剪辑状态
+ * @param lookahead 下一个 GOP，NULL 表示文件结尾
+ * @return 0 表示成功，负数表示错误码
+ */
+static int clip_encode_gop(ClipState *cs, const ClipGop *lookahead)
+{
+    AVStream *ist = cs->ic->streams[cs->video_index];
+    const ClipGop *parts[3];
+    int64_t ts, lower, upper;
+    int nb_parts = 0, p, i, ret;
+
+    // 输出的帧：前导帧从它们中最早的一个开始（只有从上一个关键帧开始解码时），否则从关键帧开始，到下一个关键帧为止
+    lower = cs->pending.key;
+    if (cs->pending_prime)
+    {
+        for (i = 1; i < cs->pending.nb; i++)
+        {
+            ts = clip_packet_ts(cs, cs->pending.pkts[i]);
+            if (ts != AV_NOPTS_VALUE)
+            {
+                lower = FFMIN(lower, ts);
+            }
+        }
+        parts[nb_parts++] = &cs->prev;
+    }
+    upper = cs->pending.end;
+    parts[nb_parts++] = &cs->pending;
+    if (lookahead)
+    {
+        parts[nb_parts++] = lookahead;
+    }
+
+    // 一次编码的帧中只有第一帧是关键帧
+    if ((ret = clip_open_encoder(cs, cs->prev.nb + cs->pending.nb + (lookahead ? lookahead->nb : 0) + 1)) < 0)
+    {
+        return ret;
+    }
+
+    avcodec_flush_buffers(cs->dec);
+    for (p = 0; p <= nb_parts; p++)
+    {
+        for (i = 0; i < (p < nb_parts ? parts[p]->nb : 1); i++)
+        {
+            ret = avcodec_send_packet(cs->dec, p < nb_parts ? parts[p]->pkts[i] : NULL);
+            if (ret < 0)
+            {
+                fprintf(stderr, "Error decoding a boundary GOP: %s\n", av_err2str(ret));
+                return ret;
+            }
+            while ((ret = avcodec_receive_frame(cs->dec, cs->frame)) >= 0)
+            {
+                cs->nb_frames_decoded++;
+                ts = cs->frame->best_effort_timestamp;
+                if (ts != AV_NOPTS_VALUE && ts >= FFMAX(cs->start, lower) && ts < FFMIN(cs->end, upper))
+                {
+                    cs->frame->pts       = av_rescale_q(ts - cs->start, ist->time_base, cs->video.enc->time_base);
+                    cs->frame->pict_type = AV_PICTURE_TYPE_NONE;
+                    write_frame(cs->oc, &cs->video, cs->frame);
+                    cs->nb_frames_encoded++;
+                }
+                av_frame_unref(cs->frame);
+            }
+            if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            {
+                fprintf(stderr, "Error decoding a boundary GOP: %s\n", av_err2str(ret));
+                return ret;
+            }
+        }
+    }
+
+    write_frame(cs->oc, &cs->video, NULL);
+    avcodec_free_context(&cs->video.enc);
+    cs->nb_gops_encoded++;
+    return 0;
+}
+
+
+
+
+
+/**
+ * @brief 当前 GOP 已经完整（读到了下一个关键帧或者文件结尾）：先重新编码等待中的 GOP（当前 GOP 作为它的 lookahead），
+ * 再决定当前 GOP 丢弃、拷贝还是等待重新编码
+ * @param cs 剪辑状态
+ * @param next 下一个 GOP 的关键帧，NULL 表示文件结尾
+ * @return 0 表示成功，负数表示错误码
+ */
+static int clip_flush_gop(ClipState *cs, const AVPacket *next)
+{
+    ClipGop *gop = &cs->gop;
+    int64_t ts, lead = AV_NOPTS_VALUE;
+    int i, guessed = 0, ret;
+
+    if (cs->has_pending)
+    {
+        if ((ret = clip_encode_gop(cs, gop->nb ? gop : NULL)) < 0)
+        {
+            return ret;
+        }
+        cs->has_pending  = 0;
+        cs->prev_encoded = 1;
+        cs->prev_copied  = 0;
+        clip_gop_swap(&cs->prev, &cs->pending);
+        clip_gop_clear(&cs->pending);
+    }
+    if (!gop->nb)
+    {
+        return 0;
+    }
+
+    // GOP 的时间范围：从关键帧到下一个关键帧；文件结尾处到最后一帧结束。关键帧没有时间戳时从上一个 GOP 的结束处开始，
+    // 下一个关键帧没有时间戳时到这个 GOP 最后一帧结束
+    gop->key = clip_packet_ts(cs, gop->pkts[0]);
+    if (gop->key == AV_NOPTS_VALUE)
+    {
+        gop->key = cs->last_end;
+    }
+    gop->end = next ? clip_packet_ts(cs, next) : AV_NOPTS_VALUE;
+    if (gop->end == AV_NOPTS_VALUE)
+    {
+        for (i = 0; i < gop->nb; i++)
+        {
+            ts = clip_packet_ts(cs, gop->pkts[i]);
+            if (ts != AV_NOPTS_VALUE && (gop->end == AV_NOPTS_VALUE || ts + gop->pkts[i]->duration > gop->end))
+            {
+                gop->end = ts + gop->pkts[i]->duration;
+            }
+        }
+    }
+    if (gop->key == AV_NOPTS_VALUE || gop->end == AV_NOPTS_VALUE)
+    {
+        // 无法确定这个 GOP 在剪辑中的位置
+        fprintf(stderr, "clip: skipping a GOP of %d packets without timestamps\n", gop->nb);
+        cs->nb_gops_skipped++;
+        cs->prev_encoded = cs->prev_copied = 0;
+        clip_gop_clear(gop);
+        return 0;
+    }
+    cs->last_end = gop->end;
+    // 开放 GOP：排在关键帧后面、显示在关键帧之前的前导帧参考了上一个 GOP，lead 是其中最早的显示时间。
+    // 有帧重排序时用 dts 估计的时间戳认不出前导帧，guessed 表示这个 GOP 可能是开放的
+    for (i = 0; i < gop->nb; i++)
+    {
+        guessed |= gop->pkts[i]->pts == AV_NOPTS_VALUE && cs->ic->streams[cs->video_index]->codecpar->video_delay > 0;
+        ts = i ? clip_packet_ts(cs, gop->pkts[i]) : AV_NOPTS_VALUE;
+        if (ts != AV_NOPTS_VALUE && ts < gop->key && (lead == AV_NOPTS_VALUE || ts < lead))
+        {
+            lead = ts;
+        }
+    }
+
+    // 终点上的 GOP 的前导帧还在剪辑范围内时，这个 GOP 也要处理：上一个 GOP 是拷贝的，前导帧只能在这里重新编码
+    if (gop->end <= cs->start ||
+        (gop->key >= cs->end && !(cs->prev_copied && lead != AV_NOPTS_VALUE && lead < cs->end)))
+    {
+        // 完全在剪辑范围之外：seek 落在起点之前更早的关键帧上，或者是终点之后用作 lookahead 的 GOP
+        cs->past_end     = gop->key >= cs->end;
+        cs->prev_encoded = cs->prev_copied = 0;
+    }
+    else if (gop->key >= cs->start && gop->end <= cs->end && (cs->prev_copied || !guessed))
+    {
+        // 重新编码的 GOP 在码流中留下了自己的参数集，拷贝的 GOP 需要源码流的参数集
+        if (cs->prev_encoded && cs->param_sets_size && (ret = clip_prepend_param_sets(cs, gop->pkts[0])) < 0)
+        {
+            return ret;
+        }
+        for (i = 0; i < gop->nb; i++)
+        {
+            // 前导帧的显示时间属于上一个 GOP：上一个 GOP 重新编码时它们已经一起重新编码，上一个 GOP 不在剪辑范围内时它们也不在
+            ts = clip_packet_ts(cs, gop->pkts[i]);
+            if (!cs->prev_copied && ts != AV_NOPTS_VALUE && ts < gop->key)
+            {
+                cs->nb_packets_dropped++;
+                continue;
+            }
+            // 拷贝一个引用，原数据包留给下一个 GOP 重新编码时解码前导帧
+            if ((ret = av_packet_ref(cs->copy_pkt, gop->pkts[i])) < 0)
+            {
+                return ret;
+            }
+            clip_copy_packet(cs, cs->copy_pkt);
+            av_packet_unref(cs->copy_pkt);
+            cs->nb_packets_copied++;
+        }
+        cs->nb_gops_copied++;
+        cs->prev_encoded = 0;
+        cs->prev_copied  = 1;
+    }
+    else
+    {
+        // 跨越起点或终点，或者认不出前导帧又不能随上一个 GOP 一起拷贝：等下一个 GOP 读完后再重新编码，
+        // 上一个 GOP 保留在 cs->prev 中。
+        // 只剩前导帧在范围内时不需要下一个 GOP，立即编码
+        cs->pending_prime = (lead != AV_NOPTS_VALUE && cs->prev_copied) || (guessed && cs->prev.nb);
+        cs->has_pending   = 1;
+        cs->past_end      = gop->key >= cs->end;
+        clip_gop_swap(&cs->pending, gop);
+        if (!next || cs->past_end)
+        {
+            return clip_flush_gop(cs, NULL);
+        }
+        return 0;
+    }
+
+    clip_gop_swap(&cs->prev, gop);
+    clip_gop_clear(gop);
+    return 0;
+}
+
+
+
+
+
+/**
+ * @brief 剪辑模式：从 clip_input 中截取 [clip_start, clip_end) 写入 filename。主视频流中完整的 GOP 直接拷贝，
+ * 跨越起点或终点的 GOP 解码后重新编码，得到帧精确的剪辑；音频流直接拷贝，在数据包边界上切分
+ * @param filename 输出文件名
+ * @param format_name 强制指定的输出格式，NULL 表示按扩展名推断
+ * @param opt 传给重新编码的编码器的选项
+ * @return 0 表示成功，负数表示错误码
+ */
+static int run_clip(const char *filename, const char *format_name, AVDictionary *opt)
+{
+    ClipState cs = { .video_index = -1, .delay = AV_NOPTS_VALUE, .last_end = AV_NOPTS_VALUE, .opt = opt };
+    AVPacket *pkt = NULL;
+    AVStream *ist, *st;
+    const AVCodec *decoder;
+    int64_t base, t_start, elapsed, start, end;
+    int i, ret, video_done = 0, nb_open = 0;
+
+    if ((ret = avformat_open_input(&cs.ic, clip_input, NULL, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", clip_input, av_err2str(ret));
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(cs.ic, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not find stream information: %s\n", av_err2str(ret));
+        goto end;
+    }
+    if ((ret = av_find_best_stream(cs.ic, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0)) < 0)
+    {
+        fprintf(stderr, "No video stream in '%s'\n", clip_input);
+        goto end;
+    }
+    cs.video_index = ret;
+
+    if ((ret = clip_probe_bitstream(&cs)) < 0)
+    {
+        goto end;
+    }
+
+    avformat_alloc_output_context2(&cs.oc, NULL, format_name, filename);
+    cs.stream_map = av_malloc_array(cs.ic->nb_streams, sizeof(*cs.stream_map));
+    if (!cs.oc || !cs.stream_map)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    // 只支持检查过的容器：它们对长度前缀和 Annex B 的数据包都按 extradata 的格式统一处理，并且允许码流中的参数集变化
+    if (!av_match_name(cs.oc->oformat->name, "mp4,mov,matroska,mpegts"))
+    {
+        fprintf(stderr, "-clip_input supports mp4, mov, mkv and mpegts outputs, not '%s'\n", cs.oc->oformat->name);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
+
+    // 主视频流和所有音频流按原样建立输出流，其他流丢弃
+    for (i = 0; i < cs.ic->nb_streams; i++)
+    {
+        ist = cs.ic->streams[i];
+        cs.stream_map[i] = -1;
+        if (i != cs.video_index && ist->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+        {
+            ist->discard = AVDISCARD_ALL;
+            continue;
+        }
+        st = avformat_new_stream(cs.oc, NULL);
+        if (!st || (ret = avcodec_parameters_copy(st->codecpar, ist->codecpar)) < 0)
+        {
+            ret = st ? ret : AVERROR(ENOMEM);
+            goto end;
+        }
+        st->codecpar->codec_tag = 0;
+        st->time_base           = ist->time_base;
+        cs.stream_map[i]        = st->index;
+        if (i != cs.video_index)
+        {
+            nb_open++;
+        }
+    }
+
+    ist    = cs.ic->streams[cs.video_index];
+    cs.dec = avcodec_alloc_context3(decoder);
+    if (!cs.dec)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    avcodec_parameters_to_context(cs.dec, ist->codecpar);
+    cs.dec->pkt_timebase = ist->time_base;
+    if ((ret = avcodec_open2(cs.dec, decoder, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open the '%s' decoder: %s\n", decoder->name, av_err2str(ret));
+        goto end;
+    }
+
+    cs.video.st      = cs.oc->streams[cs.stream_map[cs.video_index]];
+    cs.video.tmp_pkt = av_packet_alloc();
+    cs.frame         = av_frame_alloc();
+    cs.copy_pkt      = av_packet_alloc();
+    pkt              = av_packet_alloc();
+    if (!cs.video.tmp_pkt || !cs.frame || !cs.copy_pkt || !pkt)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    // 剪辑范围相对文件开头
+    base        = cs.ic->start_time != AV_NOPTS_VALUE ? cs.ic->start_time : 0;
+    cs.start_us = base + llrint(clip_start * AV_TIME_BASE);
+    cs.end_us   = clip_end >= 0 ? base + llrint(clip_end * AV_TIME_BASE) : INT64_MAX;
+    cs.start    = av_rescale_q(cs.start_us, AV_TIME_BASE_Q, ist->time_base);
+    cs.end      = cs.end_us == INT64_MAX ? INT64_MAX : av_rescale_q(cs.end_us, AV_TIME_BASE_Q, ist->time_base);
+
+    if (!(cs.oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&cs.oc->pb, filename, AVIO_FLAG_WRITE)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, av_err2str(ret));
+        goto end;
+    }
+    if ((ret = avformat_write_header(cs.oc, NULL)) < 0)
+    {
+        fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    t_start = av_gettime_relative();
+
+    // 从起点之前最近的关键帧开始读，起点之前的部分只解码不输出
+    if (av_seek_frame(cs.ic, cs.video_index, cs.start, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        fprintf(stderr, "Seeking to %.3f s failed, reading from the start of the file\n", clip_start);
+    }
+
+    while (!video_done || nb_open > 0)
+    {
+        ret = av_read_frame(cs.ic, pkt);
+        if (ret == AVERROR_EOF)
+        {
+            break;
+        }
+        else if (ret < 0)
+        {
+            fprintf(stderr, "Error reading '%s': %s\n", clip_input, av_err2str(ret));
+            goto end;
+        }
+        ist = cs.ic->streams[pkt->stream_index];
+
+        // 音频的每个数据包都可以独立解码，直接拷贝落在范围内的数据包，越过终点后不再需要这个流
+        if (pkt->stream_index != cs.video_index)
+        {
+            start = av_rescale_q(cs.start_us, AV_TIME_BASE_Q, ist->time_base);
+            end   = cs.end_us == INT64_MAX ? INT64_MAX : av_rescale_q(cs.end_us, AV_TIME_BASE_Q, ist->time_base);
+            if (cs.stream_map[pkt->stream_index] >= 0 && pkt->pts != AV_NOPTS_VALUE && pkt->pts >= end)
+            {
+                cs.stream_map[pkt->stream_index] = -1;
+                nb_open--;
+            }
+            if (cs.stream_map[pkt->stream_index] >= 0 && pkt->pts != AV_NOPTS_VALUE && pkt->pts >= start)
+            {
+                clip_copy_packet(&cs, pkt);
+            }
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        if (video_done || (!cs.gop.nb && !(pkt->flags & AV_PKT_FLAG_KEY)))
+        {
+            // 视频已经越过终点，或者 seek 没有落在关键帧上：丢弃到下一个关键帧
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (pkt->flags & AV_PKT_FLAG_KEY)
+        {
+            if (cs.delay == AV_NOPTS_VALUE && pkt->pts != AV_NOPTS_VALUE && pkt->dts != AV_NOPTS_VALUE)
+            {
+                cs.delay = pkt->pts - pkt->dts;
+            }
+            if ((ret = clip_flush_gop(&cs, pkt)) < 0)
+            {
+                goto end;
+            }
+            // 终点之后的第一个 GOP 也要读完，作为终点所在 GOP 重新编码时的 lookahead
+            if (cs.past_end)
+            {
+                video_done = 1;
+                av_packet_unref(pkt);
+                continue;
+            }
+        }
+
+        if ((ret = clip_gop_append(&cs.gop, pkt)) < 0)
+        {
+            goto end;
+        }
+    }
+
+    // 文件结尾：最后一个 GOP 没有下一个关键帧
+    if ((ret = clip_flush_gop(&cs, NULL)) < 0)
+    {
+        goto end;
+    }
+    if ((ret = av_write_trailer(cs.oc)) < 0)
+    {
+        fprintf(stderr, "Error writing the trailer: %s\n", av_err2str(ret));
+        goto end;
+    }
+    elapsed = FFMAX(av_gettime_relative() - t_start, 1);
+
+    // 重新编码的帧数只与起点和终点所在 GOP 的长度有关，与剪辑的长度无关
+    end = cs.end_us == INT64_MAX ? base + cs.ic->duration : cs.end_us;
+    fprintf(stderr, "clip: %.3f s .. %.3f s of '%s': %d GOPs copied (%"PRId64" packets), "
+            "%d boundary GOPs re-encoded (%"PRId64" frames decoded, %"PRId64" encoded) in %.3f s\n",
+            (cs.start_us - base) / 1000000.0, (end - base) / 1000000.0, clip_input,
+            cs.nb_gops_copied, cs.nb_packets_copied, cs.nb_gops_encoded,
+            cs.nb_frames_decoded, cs.nb_frames_encoded, elapsed / 1000000.0);
+    if (cs.nb_packets_dropped)
+    {
+        fprintf(stderr, "clip: %"PRId64" open-GOP leading frames not copied (re-encoded with the previous GOP "
+                "or before the clip start)\n", cs.nb_packets_dropped);
+    }
+    if (cs.nb_gops_skipped)
+    {
+        fprintf(stderr, "clip: skipped %d GOPs without timestamps\n", cs.nb_gops_skipped);
+    }
+    ret = 0;
+
+    if (clip_verify)
+    {
+        // 先关闭输出，确保内容都已经写到文件中
+        if (!(cs.oc->oformat->flags & AVFMT_NOFILE))
+        {
+            avio_closep(&cs.oc->pb);
+        }
+        ret = clip_verify_output(filename, cs.nb_packets_copied + cs.nb_frames_encoded);
+    }
+
+end:
+    clip_gop_free(&cs.gop);
+    clip_gop_free(&cs.pending);
+    clip_gop_free(&cs.prev);
+    av_packet_free(&cs.copy_pkt);
+    av_packet_free(&pkt);
+    av_packet_free(&cs.video.tmp_pkt);
+    av_frame_free(&cs.frame);
+    avcodec_free_context(&cs.video.enc);
+    avcodec_free_context(&cs.dec);
+    if (cs.oc && !(cs.oc->oformat->flags & AVFMT_NOFILE))
+    {
+        avio_closep(&cs.oc->pb);
+    }
+    avformat_free_context(cs.oc);
+    av_free(cs.stream_map);
+    av_free(cs.param_sets);
+    avformat_close_input(&cs.ic);
+    return ret;
+}
+
+
+
+
+
+/**
+ * @brief 拼接模式（-concat）。输入列表中的文件依次原样复用到同一个输出，每个输入的时间戳加上
+ * 之前所有输入的累计时长；预读线程提前打开后面的 concat_prefetch 个输入（读文件头、探测流信息），
+ * 主线程读完一个输入时下一个输入通常已经就绪，文件边界处不需要等待
+ */
+typedef struct ConcatState {
+    // 输入文件列表
+    char **names;
+    int nb_names;
+
+    // 预读线程打开的输入和结果，ready[i] 为 1 时 inputs[i]/errors[i] 有效；consumed 是主线程已经用完的输入个数
+    AVFormatContext **inputs;
+    int *errors;
+    int *ready;
+    int consumed;
+    int depth;
+    int abort;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    AVFormatContext *oc;
+    // 当前输入的时间戳偏移，以及已经写出的内容的结束时间（AV_TIME_BASE），下一个输入从这里开始
+    int64_t offset;
+    int64_t next_offset;
+    // 每个输出流最后写出的 dts（输出流时间基准），输入之间的舍入误差不能让 dts 倒退
+    int64_t *last_dts;
+    // 第一个输入每个流的 codec_tag（输出流的 codec_tag 清零后由复用器选择）
+    uint32_t *codec_tags;
+
+    // 统计信息：预读线程打开输入的总耗时，主线程在文件边界等待的总时间和最长时间（微秒）
+    int64_t open_time;
+    int64_t wait_time;
+    int64_t max_wait;
+    int64_t nb_packets;
+    int64_t bytes;
+    int64_t nb_adjusted;
+} ConcatState;
+
+
+
+
+/**
+ * @brief 读取输入列表：每行一个文件名，忽略空行和以 # 开头的行
+ * @param cs 拼接状态，结果保存在 names/nb_names 中
+ * @param list 列表文件名
+ * @return 0 表示成功，负数表示错误码
+ */
+static int concat_read_list(ConcatState *cs, const char *list)
+{
+    char line[4096];
+    char **names;
+    size_t len;
+    FILE *f;
+
+    f = fopen(list, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", list, strerror(errno));
+        return AVERROR(errno);
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        len = strcspn(line, "\r\n");
+        line[len] = 0;
+        if (!len || line[0] == '#')
+        {
+            continue;
+        }
+        names = av_realloc_array(cs->names, cs->nb_names + 1, sizeof(*names));
+        if (!names)
+        {
+            fclose(f);
+            return AVERROR(ENOMEM);
+        }
+        cs->names = names;
+        if (!(cs->names[cs->nb_names] = av_strdup(line)))
+        {
+            fclose(f);
+            return AVERROR(ENOMEM);
+        }
+        cs->nb_names++;
+    }
+    fclose(f);
+
+    if (!cs->nb_names)
+    {
+        fprintf(stderr, "No inputs in '%s'\n", list);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 预读线程的入口函数。按顺序打开输入，最多领先主线程 depth 个输入
+ * @param arg 指向 ConcatState
+ */
+static void *concat_prefetch_main(void *arg)
+{
+    ConcatState *cs = arg;
+    AVFormatContext *ic;
+    int64_t t0;
+    int i, stop, ret;
+
+    for (i = 0; i < cs->nb_names; i++)
+    {
+        // abort 由主线程在锁内设置，也只在锁内读取
+        pthread_mutex_lock(&cs->lock);
+        while (i >= cs->consumed + cs->depth && !cs->abort)
+        {
+            pthread_cond_wait(&cs->cond, &cs->lock);
+        }
+        stop = cs->abort;
+        pthread_mutex_unlock(&cs->lock);
+        if (stop)
+        {
+            break;
+        }
+
+        ic  = NULL;
+        t0  = av_gettime_relative();
+        ret = avformat_open_input(&ic, cs->names[i], NULL, NULL);
+        if (ret >= 0 && (ret = avformat_find_stream_info(ic, NULL)) < 0)
+        {
+            avformat_close_input(&ic);
+        }
+
+        pthread_mutex_lock(&cs->lock);
+        cs->open_time += av_gettime_relative() - t0;
+        cs->inputs[i]  = ic;
+        cs->errors[i]  = ret;
+        cs->ready[i]   = 1;
+        pthread_cond_broadcast(&cs->cond);
+        pthread_mutex_unlock(&cs->lock);
+    }
+
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief 取出第 index 个输入，预读线程还没有打开它时等待，等待的时间计入边界停顿
+ * @param cs 拼接状态
+ * @param index 输入序号
+ * @param ic 打开的输入
+ * @return 0 表示成功，负数表示打开输入时的错误码
+ */
+static int concat_get_input(ConcatState *cs, int index, AVFormatContext **ic)
+{
+    int64_t t0 = av_gettime_relative(), wait;
+    int ret;
+
+    pthread_mutex_lock(&cs->lock);
+    while (!cs->ready[index])
+    {
+        pthread_cond_wait(&cs->cond, &cs->lock);
+    }
+    *ic = cs->inputs[index];
+    ret = cs->errors[index];
+    cs->inputs[index] = NULL;
+    pthread_mutex_unlock(&cs->lock);
+
+    wait = av_gettime_relative() - t0;
+    cs->wait_time += wait;
+    cs->max_wait   = FFMAX(cs->max_wait, wait);
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", cs->names[index], av_err2str(ret));
+    }
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 检查输入与输出（由第一个输入建立）是否兼容：流的个数、类型和编码格式一致，
+ * 视频的尺寸和音频的采样率、声道数一致，像素/采样格式、profile、codec_tag 和 extradata 一致。
+ * 输出流的 extradata 来自第一个输入，参数集不同的输入拷贝过去无法解码
+ * @param cs 拼接状态
+ * @param ic 输入
+ * @param name 输入文件名
+ * @return 1 表示兼容
+ */
+static int concat_compatible(ConcatState *cs, AVFormatContext *ic, const char *name)
+{
+    AVCodecParameters *a, *b;
+    const char *what;
+    int i;
+
+    if (ic->nb_streams != cs->oc->nb_streams)
+    {
+        fprintf(stderr, "'%s' has %d streams, expected %d\n", name, ic->nb_streams, cs->oc->nb_streams);
+        return 0;
+    }
+    for (i = 0; i < ic->nb_streams; i++)
+    {
+        a    = cs->oc->streams[i]->codecpar;
+        b    = ic->streams[i]->codecpar;
+        what = NULL;
+        if (a->codec_type != b->codec_type || a->codec_id != b->codec_id)
+        {
+            what = "codec";
+        }
+        else if (a->codec_type == AVMEDIA_TYPE_VIDEO && (a->width != b->width || a->height != b->height))
+        {
+            what = "frame size";
+        }
+        else if (a->codec_type == AVMEDIA_TYPE_AUDIO && (a->sample_rate != b->sample_rate || a->channels != b->channels))
+        {
+            what = "sample rate or channel count";
+        }
+        else if (a->format != b->format)
+        {
+            what = a->codec_type == AVMEDIA_TYPE_VIDEO ? "pixel format" : "sample format";
+        }
+        else if (a->profile != b->profile)
+        {
+            what = "profile";
+        }
+        // codec_tag 为 0 表示输入格式没有记录，只比较两边都有的（例如 avc1 与 avc3、hvc1 与 hev1）
+        else if (cs->codec_tags[i] && b->codec_tag && cs->codec_tags[i] != b->codec_tag)
+        {
+            what = "codec tag";
+        }
+        else if (a->extradata_size != b->extradata_size ||
+                 (a->extradata_size && memcmp(a->extradata, b->extradata, a->extradata_size)))
+        {
+            what = "extradata (codec parameter sets)";
+        }
+        if (what)
+        {
+            fprintf(stderr, "Stream #%d of '%s' (%s) does not match the first input: different %s\n",
+                    i, name, avcodec_get_name(b->codec_id), what);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+
+/**
+ * @brief 把一个输入的所有数据包写入输出：时间戳先减去输入的起始时间、加上累计偏移，
+ * 再像 write_frame 一样用 av_packet_rescale_ts 换算到输出流的时间基准
+ * @param cs 拼接状态
+ * @param ic 输入
+ * @param pkt 用于读取数据包
+ * @return 0 表示成功，负数表示错误码
+ */
+static int concat_copy_input(ConcatState *cs, AVFormatContext *ic, AVPacket *pkt)
+{
+    AVStream *ist, *st;
+    int64_t start = ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+    int64_t offset, end;
+    int ret;
+
+    for (;;)
+    {
+        ret = av_read_frame(ic, pkt);
+        if (ret == AVERROR_EOF)
+        {
+            break;
+        }
+        else if (ret < 0)
+        {
+            return ret;
+        }
+        ist = ic->streams[pkt->stream_index];
+        st  = cs->oc->streams[pkt->stream_index];
+
+        // 偏移量在 AV_TIME_BASE 下相减后只换算一次，避免每个输入累积舍入误差
+        offset = av_rescale_q(cs->offset - start, AV_TIME_BASE_Q, ist->time_base);
+        if (pkt->pts != AV_NOPTS_VALUE)
+        {
+            pkt->pts += offset;
+            end = av_rescale_q(pkt->pts + pkt->duration, ist->time_base, AV_TIME_BASE_Q);
+            cs->next_offset = FFMAX(cs->next_offset, end);
+        }
+        if (pkt->dts != AV_NOPTS_VALUE)
+        {
+            pkt->dts += offset;
+        }
+        av_packet_rescale_ts(pkt, ist->time_base, st->time_base);
+
+        // 输入的时长和起始时间不精确时，边界处的 dts 可能与上一个输入的最后一个数据包重叠
+        if (pkt->dts != AV_NOPTS_VALUE)
+        {
+            if (cs->last_dts[st->index] != AV_NOPTS_VALUE && pkt->dts <= cs->last_dts[st->index])
+            {
+                pkt->dts = cs->last_dts[st->index] + 1;
+                if (pkt->pts != AV_NOPTS_VALUE && pkt->pts < pkt->dts)
+                {
+                    pkt->pts = pkt->dts;
+                }
+                cs->nb_adjusted++;
+            }
+            cs->last_dts[st->index] = pkt->dts;
+        }
+        pkt->pos = -1;
+
+        cs->nb_packets++;
+        cs->bytes += pkt->size;
+        write_packet(cs->oc, pkt);
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 拼接模式：把 list 中列出的兼容输入（流的类型、编码格式、参数都相同）不经重新编码依次写入 filename，
+ * 只读一遍输入，预读线程在后台打开后面的输入
+ * @param list 输入列表文件，每行一个文件名
+ * @param filename 输出文件名
+ * @param format_name 强制指定的输出格式，NULL 表示按扩展名推断
+ * @return 0 表示成功，负数表示错误码
+ */
+static int run_concat(const char *list, const char *filename, const char *format_name)
+{
+    ConcatState cs = { 0 };
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = NULL;
+    AVStream *st;
+    int64_t t_start, elapsed;
+    int i, ret, started = 0;
+
+    if ((ret = concat_read_list(&cs, list)) < 0)
+    {
+        goto end;
+    }
+    cs.depth  = FFMAX(concat_prefetch, 1);
+    cs.inputs = av_calloc(cs.nb_names, sizeof(*cs.inputs));
+    cs.errors = av_calloc(cs.nb_names, sizeof(*cs.errors));
+    cs.ready  = av_calloc(cs.nb_names, sizeof(*cs.ready));
+    pkt       = av_packet_alloc();
+    if (!cs.inputs || !cs.errors || !cs.ready || !pkt)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    pthread_mutex_init(&cs.lock, NULL);
+    pthread_cond_init(&cs.cond, NULL);
+    if ((ret = pthread_create(&cs.thread, NULL, concat_prefetch_main, &cs)))
+    {
+        ret = AVERROR(ret);
+        goto end;
+    }
+    started = 1;
+
+    t_start = av_gettime_relative();
+
+    // 第一个输入决定输出的流和编码参数
+    if ((ret = concat_get_input(&cs, 0, &ic)) < 0)
+    {
+        goto end;
+    }
+    avformat_alloc_output_context2(&cs.oc, NULL, format_name, filename);
+    if (!cs.oc || !(cs.last_dts = av_malloc_array(ic->nb_streams, sizeof(*cs.last_dts))) ||
+        !(cs.codec_tags = av_malloc_array(ic->nb_streams, sizeof(*cs.codec_tags))))
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < ic->nb_streams; i++)
+    {
+        st = avformat_new_stream(cs.oc, NULL);
+        if (!st || (ret = avcodec_parameters_copy(st->codecpar, ic->streams[i]->codecpar)) < 0)
+        {
+            ret = st ? ret : AVERROR(ENOMEM);
+            goto end;
+        }
+        cs.codec_tags[i]        = st->codecpar->codec_tag;
+        st->codecpar->codec_tag = 0;
+        st->time_base           = ic->streams[i]->time_base;
+        cs.last_dts[i]          = AV_NOPTS_VALUE;
+    }
+    if (!(cs.oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&cs.oc->pb, filename, AVIO_FLAG_WRITE)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, av_err2str(ret));
+        goto end;
+    }
+    if ((ret = avformat_write_header(cs.oc, NULL)) < 0)
+    {
+        fprintf(stderr, "Error occurred when opening output file: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    for (i = 0; i < cs.nb_names; i++)
+    {
+        if (i > 0 && (ret = concat_get_input(&cs, i, &ic)) < 0)
+        {
+            goto end;
+        }
+        if (!concat_compatible(&cs, ic, cs.names[i]))
+        {
+            ret = AVERROR(EINVAL);
+            goto end;
+        }
+        if ((ret = concat_copy_input(&cs, ic, pkt)) < 0)
+        {
+            fprintf(stderr, "Error reading '%s': %s\n", cs.names[i], av_err2str(ret));
+            goto end;
+        }
+        // 下一个输入从这个输入写出的内容结束处开始
+        cs.offset = cs.next_offset;
+        avformat_close_input(&ic);
+
+        pthread_mutex_lock(&cs.lock);
+        cs.consumed = i + 1;
+        pthread_cond_broadcast(&cs.cond);
+        pthread_mutex_unlock(&cs.lock);
+    }
+
+    if ((ret = av_write_trailer(cs.oc)) < 0)
+    {
+        fprintf(stderr, "Error writing the trailer: %s\n", av_err2str(ret));
+        goto end;
+    }
+    elapsed = FFMAX(av_gettime_relative() - t_start, 1);
+
+    // 边界停顿接近 0 说明预读线程跟得上，整个过程的速度取决于读写的吞吐量
+    fprintf(stderr, "concat: %d inputs, %.3f s of output, %"PRId64" packets, %.1f MB in %.3f s (%.1f MB/s)\n",
+            cs.nb_names, cs.offset / (double)AV_TIME_BASE, cs.nb_packets, cs.bytes / 1048576.0,
+            elapsed / 1000000.0, cs.bytes / 1048576.0 / (elapsed / 1000000.0));
+    fprintf(stderr, "concat: opening inputs took %.3f s on the prefetch thread, boundary stalls %.3f s "
+            "(max %.3f ms), %"PRId64" timestamps adjusted\n",
+            cs.open_time / 1000000.0, cs.wait_time / 1000000.0, cs.max_wait / 1000.0, cs.nb_adjusted);
+    ret = 0;
+
+end:
+    if (started)
+    {
+        pthread_mutex_lock(&cs.lock);
+        cs.abort = 1;
+        pthread_cond_broadcast(&cs.cond);
+        pthread_mutex_unlock(&cs.lock);
+        pthread_join(cs.thread, NULL);
+        pthread_mutex_destroy(&cs.lock);
+        pthread_cond_destroy(&cs.cond);
+    }
+    avformat_close_input(&ic);
+    for (i = 0; i < cs.nb_names; i++)
+    {
+        if (cs.inputs)
+        {
+            avformat_close_input(&cs.inputs[i]);
+        }
+        av_free(cs.names[i]);
+    }
+    av_free(cs.names);
+    av_free(cs.inputs);
+    av_free(cs.errors);
+    av_free(cs.ready);
+    av_free(cs.last_dts);
+    av_free(cs.codec_tags);
+    av_packet_free(&pkt);
+    if (cs.oc && !(cs.oc->oformat->flags & AVFMT_NOFILE))
+    {
+        avio_closep(&cs.oc->pb);
+    }
+    avformat_free_context(cs.oc);
+    return ret;
+}
+
+
+
+
+
+int main(int argc, char **argv)
+{
+    // 视频、音频输出流
+    OutputStream video_st = { 0 }, audio_st = { 0 };
+    // 指向输出格式的指针
+    const AVOutputFormat *fmt;
+    // 保存通过命令行传入的输出文件的文件名
+    const char *filename;
+    // 指向输出媒体上下文的指针，包含有关正在创建的媒体文件的信息
+    AVFormatContext *oc;
+    // 分别存储音频、视频编解码器的指针
+    const AVCodec *audio_codec, *video_codec;
+    // 用于存储各种调用的返回值
+    int ret;
+    int have_video = 0, have_audio = 0;
+    int encode_video = 0, encode_audio = 0;
+    AVDictionary *opt = NULL;
+    int i;
+    // 计时：写完文件头的时刻、第一个流结束（进入尾部阶段）的时刻、写完文件尾的时刻；
+    // 第一个流结束时已经编码的帧数，稳态吞吐量只统计这些帧
+    int64_t t_start, t_first_eof = 0, t_end;
+    int64_t steady_frames = 0;
+    int trailer_ret;
+    // 强制指定的输出格式（-f），以及输出是否为 stdout/FIFO/socket 这类不可 seek 的流
+    const char *format_name = NULL;
+    int stream_output;
+    // 普通文件是否通过自定义输出层（可配置的 avio 缓冲区、writev 批量写入、预分配）写出
+    int custom_file_io = 0;
+    int64_t prealloc_size = 0;
+    OutputIO out_io = { .fd = -1 };
+    // 确定性模式下期望的数据包哈希，以及本次运行得到的哈希（十六进制字符串）
+    const char *golden_hash = NULL;
+    uint8_t hash_hex[2 * AV_HASH_MAX_SIZE + 1];
+    int hash_mismatch = 0;
+    // 完整性清单的文件名
+    const char *manifest_name = NULL;
+    // 从检查点恢复时，文件中已经完整写出的字节数
+    int64_t resume_bytes = 0;
+    // 回放模式：多个输出时的文件名模板和第 0 个输出的文件名、回放的耗时和结果
+    const char *replay_pattern = NULL;
+    char first_name[1024];
+    int64_t replay_time = 0;
+    int replay_ret = 0;
+    // 写文件头之前的选项副本（avformat_write_header 会取走用掉的选项），回放的其他输出使用相同的选项
+    AVDictionary *replay_opt = NULL;
+    int loudness_ret = 0;
+    // 内存输出（-sink mem）结束时得到的数据
+    uint8_t *sink_buf = NULL;
+    int sink_size;
+    int64_t wall, mux_only, t_trailer;
+
+    if (argc < 2)
+    {
+        printf("usage: %s output_file\n"
+               "API example program to output a media file with libavformat.\n"
+               "This program generates a synthetic audio and video stream, encodes and\n"
+               "muxes them into a file named output_file.\n"
+               "The output format is automatically guessed according to the file extension.\n"
+               "Raw images can also be output by using '%%d' in the filename.\n"
+               "\n"
+               "options:\n"
+               "  -flags/-fflags <flags>  codec/format flags passed to the encoders\n"
+               "  -async_drain <0|1>      drain each encoder on its own thread at end of stream\n"
+               "  -reserve_moov <0|1>     (mp4/mov) reserve the index space up front, fill it in place at the end\n"
+               "  -f <format>             force the output format (default for streams: mpegts)\n"
+               "  -out_buffer_size <n>    bounded buffer size in bytes for stream outputs\n"
+               "  -flush_policy <p>       stream output flush policy: packet, full or an interval in ms\n"
+               "  -avio_buffer_size <n>   avio buffer size in bytes (default 32768)\n"
+               "  -writev_batch <n>       coalesce n avio buffers into one writev (regular files)\n"
+               "  -preallocate <0|1>      preallocate the file from the expected bitrate x duration\n"
+               "  -deterministic <0|1>    reproducible output: single-threaded, bitexact, prints a packet hash\n"
+               "  -golden <hash>          with -deterministic, fail if the packet hash differs from <hash>\n"
+               "  -manifest <file>        write per-packet byte ranges and CRC32C of the muxed output and a whole-file SHA-256 to <file>\n"
+               "  -checkpoint <file>      (mpegts) save resumable state at GOP boundaries, resume if <file> exists\n"
+               "  -checkpoint_gops <n>    save a checkpoint every n GOPs (default 1)\n"
+               "  -frame_cache <n>        pre-render n video frames and encode references to them\n"
+               "                          (%d = one full period of the test pattern, output unchanged)\n"
+               "  -replay_loops <n>       encode once into memory, then replay the packets n times (mux/IO only)\n"
+               "  -replay_outputs <n>     replay into n outputs at once; '%%d' in output_file is the output index\n"
+               "  -sink <s>               file (default), null (drop packets after encoding), mem (mux into a\n"
+               "                          dynamic buffer) or count (mux and count bytes); output_file picks the format\n"
+               "  -sessions <n>           run n independent muxing sessions; '%%d' in output_file is the session index\n"
+               "  -workers <n>            worker threads shared by all sessions (default: number of CPUs)\n"
+               "  -mem_budget <bytes>     limit on output queued by all sessions (default 64MB)\n"
+               "  -image_seq <0|1>        with '%%d' and an image format (png, jpg, webp): encode the frames on\n"
+               "                          -workers threads, one encoder each, one file per frame\n"
+               "  -barcode <0|1>          stamp next_pts and the wall-clock send time into a luma barcode\n"
+               "                          in the top-left corner of every frame (read it back with barcode_detect)\n"
+               "  -sync_test <seconds>    A/V sync test: every <seconds> a white video frame and a one-frame\n"
+               "                          1 kHz tone burst start at the same pts (measure with avsync_detect)\n"
+               "  -qc <file>              detect black, frozen and silent intervals in the frames sent to the\n"
+               "                          encoders and write them to <file> as JSON lines ('-' for stderr)\n"
+               "  -qc_min_duration <s>    shortest interval reported by -qc (default 2)\n"
+               "  -loudness <0|1|2>       measure EBU R128 loudness and true peak of the encoded audio on a side\n"
+               "                          thread; 2 also prints momentary/short-term loudness every second\n"
+               "  -io_engine <e>          write regular files through one shared I/O engine: uring or pwritev\n"
+               "  -io_buffers <n>         buffers in the shared I/O engine pool (default 64)\n"
+               "  -io_batch <n>           writes per submission in the shared I/O engine (default 16)\n"
+               "  -clip_input <file>      cut [-clip_start, -clip_end) out of <file> instead of encoding test signals:\n"
+               "                          complete GOPs are copied, only the boundary GOPs are re-encoded\n"
+               "  -clip_start <seconds>   clip start, relative to the start of the input (default 0)\n"
+               "  -clip_end <seconds>     clip end (default: end of the input)\n"
+               "  -clip_verify 1          decode the clip back and check the frame count and decode errors\n"
+               "  -concat <list>          copy the inputs listed in <list> (one per line) into output_file\n"
+               "                          back to back, without re-encoding\n"
+               "  -concat_prefetch <n>    inputs opened ahead on the prefetch thread (default 2)\n"
+               "\n"
+               "output_file may also be '-' (stdout), a FIFO, tcp://host:port or unix:path.\n"
+               "\n", argv[0], FRAME_CACHE_PERIOD);
+        return 1;
+    }
+
+    filename = argv[1];
+    for (i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-flags") || !strcmp(argv[i], "-fflags"))
+        {
+            av_dict_set(&opt, argv[i] + 1, argv[i + 1], 0);
+        }
+        else if (!strcmp(argv[i], "-async_drain"))
+        {
+            async_drain = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-reserve_moov"))
+        {
+            reserve_moov = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-f"))
+        {
+            format_name = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-out_buffer_size"))
+        {
+            output_buffer_size = FFMAX(atoi(argv[i + 1]), 4096);
+        }
+        else if (!strcmp(argv[i], "-flush_policy"))
+        {
+            if (!strcmp(argv[i + 1], "packet"))
+                output_flush_policy = OUTPUT_FLUSH_PACKET;
+            else if (!strcmp(argv[i + 1], "full"))
+                output_flush_policy = OUTPUT_FLUSH_FULL;
+            else
+                output_flush_policy = FFMAX(atoi(argv[i + 1]), 1);
+        }
+        else if (!strcmp(argv[i], "-avio_buffer_size"))
+        {
+            output_avio_buffer_size = FFMAX(atoi(argv[i + 1]), 4096);
+            custom_file_io = 1;
+        }
+        else if (!strcmp(argv[i], "-writev_batch"))
+        {
+            output_writev_batch = FFMAX(atoi(argv[i + 1]), 1);
+            custom_file_io = 1;
+        }
+        else if (!strcmp(argv[i], "-preallocate"))
+        {
+            // 自定义输出层要等算出预分配的大小之后才决定是否启用
+            output_preallocate = atoi(argv[i + 1]) > 0;
+        }
+        else if (!strcmp(argv[i], "-deterministic"))
+        {
+            deterministic = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-golden"))
+        {
+            golden_hash = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-manifest"))
+        {
+            manifest_name = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-checkpoint"))
+        {
+            checkpoint.filename = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-checkpoint_gops"))
+        {
+            checkpoint.gops = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-frame_cache"))
+        {
+            frame_cache = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-replay_loops"))
+        {
+            replay_loops = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-replay_outputs"))
+        {
+            replay_outputs = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-sessions"))
+        {
+            nb_sessions = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-workers"))
+        {
+            nb_workers = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-mem_budget"))
+        {
+            session_mem_budget = FFMAX(strtoll(argv[i + 1], NULL, 10), 1);
+        }
+        else if (!strcmp(argv[i], "-image_seq"))
+        {
+            image_seq = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-clip_input"))
+        {
+            clip_input = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-clip_start"))
+        {
+            clip_start = FFMAX(atof(argv[i + 1]), 0);
+        }
+        else if (!strcmp(argv[i], "-clip_end"))
+        {
+            clip_end = atof(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-clip_verify"))
+        {
+            clip_verify = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-concat"))
+        {
+            concat_list = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-concat_prefetch"))
+        {
+            concat_prefetch = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-barcode"))
+        {
+            barcode = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-sync_test"))
+        {
+            sync_period = atof(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-qc"))
+        {
+            qc_name = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-qc_min_duration"))
+        {
+            qc_min_duration = atof(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-loudness"))
+        {
+            loudness = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-io_engine"))
+        {
+            if (!strcmp(argv[i + 1], "uring"))
+                io_engine_mode = 1;
+            else if (!strcmp(argv[i + 1], "pwritev"))
+                io_engine_mode = 0;
+            else
+            {
+                fprintf(stderr, "Unknown I/O engine '%s'\n", argv[i + 1]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-io_buffers"))
+        {
+            io_engine_buffers = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-io_batch"))
+        {
+            io_engine_batch = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-sink"))
+        {
+            if (!strcmp(argv[i + 1], "file"))
+                output_sink = SINK_FILE;
+            else if (!strcmp(argv[i + 1], "null"))
+                output_sink = SINK_NULL;
+            else if (!strcmp(argv[i + 1], "mem"))
+                output_sink = SINK_MEM;
+            else if (!strcmp(argv[i + 1], "count"))
+                output_sink = SINK_COUNT;
+            else
+            {
+                fprintf(stderr, "Unknown sink '%s'\n", argv[i + 1]);
+                return 1;
+            }
+        }
+    }
+
+    // 不落盘的输出没有文件可以校验或者续写
+    if (output_sink != SINK_FILE && (manifest_name || checkpoint.filename))
+    {
+        fprintf(stderr, "-sink %s cannot be combined with -manifest or -checkpoint\n",
+                output_sink == SINK_NULL ? "null" : output_sink == SINK_MEM ? "mem" : "count");
+        return 1;
+    }
+
+    // 条码记录的是渲染时的墙钟时间：预先渲染的帧缓存里的时间没有意义，可复现模式的输出也不再固定
+    if (barcode && (frame_cache > 0 || deterministic))
+    {
+        fprintf(stderr, "-barcode cannot be combined with -frame_cache or -deterministic\n");
+        return 1;
+    }
+
+    // 帧缓存以 FRAME_CACHE_PERIOD 帧为周期重复，闪白的帧不一定落在事件上
+    if (sync_period > 0 && frame_cache > 0)
+    {
+        fprintf(stderr, "-sync_test cannot be combined with -frame_cache\n");
+        return 1;
+    }
+
+    // 响度表只有一个，挂在主编码循环的音频流上
+    if (loudness && (nb_sessions > 0 || image_seq || clip_input || concat_list))
+    {
+        fprintf(stderr, "-loudness cannot be combined with -sessions, -image_seq, -clip_input or -concat\n");
+        return 1;
+    }
+
+    // 质量检查的状态同样只有一份，而且需要覆盖整个输出，剪辑模式只重新编码边界上的帧
+    if (qc_name && (nb_sessions > 0 || image_seq || clip_input || concat_list))
+    {
+        fprintf(stderr, "-qc cannot be combined with -sessions, -image_seq, -clip_input or -concat\n");
+        return 1;
+    }
+
+    // 图像序列模式不经过复用器，没有数据包哈希、清单、检查点或回放可言
+    if (image_seq && (manifest_name || checkpoint.filename || replay_loops > 0 || deterministic || nb_sessions > 0 ||
+                      output_sink != SINK_FILE || io_engine_mode >= 0))
+    {
+        fprintf(stderr, "-image_seq cannot be combined with -manifest, -checkpoint, -replay_loops, -deterministic, "
+                "-sessions, -sink or -io_engine\n");
+        return 1;
+    }
+
+    // 剪辑模式：输出的流来自输入文件而不是测试信号，与编码测试信号的各种模式互斥
+    if (clip_input)
+    {
+        if (manifest_name || checkpoint.filename || replay_loops > 0 || deterministic || nb_sessions > 0 ||
+            image_seq || output_sink != SINK_FILE || io_engine_mode >= 0 || is_stream_output(filename))
+        {
+            fprintf(stderr, "-clip_input cannot be combined with -manifest, -checkpoint, -replay_loops, -deterministic, "
+                    "-sessions, -image_seq, -sink, -io_engine or a stream output\n");
+            return 1;
+        }
+        if (clip_end >= 0 && clip_end <= clip_start)
+        {
+            fprintf(stderr, "-clip_end must be after -clip_start\n");
+            return 1;
+        }
+        ret = run_clip(filename, format_name, opt);
+        av_dict_free(&opt);
+        return ret < 0;
+    }
+
+    // 拼接模式：与剪辑模式一样直接复制输入的数据包
+    if (concat_list)
+    {
+        if (clip_input || manifest_name || checkpoint.filename || replay_loops > 0 || deterministic ||
+            nb_sessions > 0 || image_seq || output_sink != SINK_FILE || io_engine_mode >= 0 ||
+            is_stream_output(filename))
+        {
+            fprintf(stderr, "-concat cannot be combined with -clip_input, -manifest, -checkpoint, -replay_loops, "
+                    "-deterministic, -sessions, -image_seq, -sink, -io_engine or a stream output\n");
+            return 1;
+        }
+        ret = run_concat(concat_list, filename, format_name);
+        av_dict_free(&opt);
+        return ret < 0;
+    }
+
+    // 多会话模式：所有会话共享工作线程池，各自的输出由一个 I/O 线程写出；
+    // 依赖全局状态（数据包哈希、清单、检查点、回放仓库）的功能不能用于多个会话
+    if (nb_sessions > 0)
+    {
+        if (manifest_name || checkpoint.filename || replay_loops > 0 || deterministic || output_sink != SINK_FILE ||
+            io_engine_mode >= 0)
+        {
+            fprintf(stderr, "-sessions cannot be combined with -manifest, -checkpoint, -replay_loops, "
+                    "-deterministic, -sink or -io_engine\n");
+            return 1;
+        }
+        if (av_get_frame_filename(first_name, sizeof(first_name), filename, 0) < 0)
+        {
+            fprintf(stderr, "-sessions needs a '%%d' in the output file name\n");
+            return 1;
+        }
+        // 数据包信息会从多个线程交错打印，编码器冲刷也由工作线程按步完成
+        log_packets = 0;
+        async_drain = 0;
+        ret = run_sessions(filename, format_name, opt);
+        av_dict_free(&opt);
+        return ret < 0;
+    }
+
+    // 回放模式：清单和检查点描述的是编码出的数据包与输出文件一一对应的关系，回放时不成立
+    if (replay_loops > 0)
+    {
+        if (manifest_name || checkpoint.filename)
+        {
+            fprintf(stderr, "-replay_loops cannot be combined with -manifest or -checkpoint\n");
+            return 1;
+        }
+        replay_outputs = FFMAX(replay_outputs, 1);
+        if (replay_outputs > 1)
+        {
+            if (av_get_frame_filename(first_name, sizeof(first_name), filename, 0) < 0)
+            {
+                fprintf(stderr, "-replay_outputs needs a '%%d' in the output file name\n");
+                return 1;
+            }
+            replay_pattern = filename;
+            filename       = first_name;
+        }
+    }
+
+    // 确定性模式：异步冲刷时数据包到达复用器的顺序依赖线程调度，因此关闭它
+    if (deterministic)
+    {
+        if (async_drain)
+        {
+            fprintf(stderr, "-async_drain is disabled in deterministic mode\n");
+            async_drain = 0;
+        }
+        if (av_hash_alloc(&packet_hash, "MD5") < 0)
+        {
+            fprintf(stderr, "Could not allocate the packet hash\n");
+            return 1;
+        }
+        av_hash_init(packet_hash);
+    }
 
+    // 完整性清单：整个文件的哈希在自定义输出层的写入路径上计算，因此普通文件也改用自定义输出层
+    if (manifest_name)
+    {
+        manifest = fopen(manifest_name, "w");
+        if (!manifest)
+        {
+            fprintf(stderr, "Could not open '%s': %s\n", manifest_name, strerror(errno));
+            return 1;
+        }
+        fprintf(manifest, "# stream\tpts\tdts\tsize\tstart\tend\tcrc32c\n");
+        crc32c_init();
+        output_file_hash = 1;
+        custom_file_io   = 1;
+    }
 
+    // 不落盘时输出文件名只用来推断格式
+    stream_output = output_sink == SINK_FILE && is_stream_output(filename);
+    if (stream_output && (!strcmp(filename, "-") || av_strstart(filename, "pipe:", NULL)))
+    {
+        // 数据写到 stdout，数据包信息不能再打印到 stdout
+        log_packets = 0;
+    }
 
+    // 根据输出文件扩展名分配和初始化输出媒体上下文，如果无法推断，则使用 mpeg 格式；
+    // 对于 stdout 和 socket 这类没有扩展名的流式输出，默认使用适合不可 seek 输出的 MPEG-TS
+    if (format_name)
+    {
+        avformat_alloc_output_context2(&oc, NULL, format_name, filename);
+    }
+    else
+    {
+        avformat_alloc_output_context2(&oc, NULL, NULL, filename);
+        if (!oc && stream_output)
+        {
+            avformat_alloc_output_context2(&oc, NULL, "mpegts", filename);
+        }
+        else if (!oc)
+        {
+            printf("Could not deduce output format from file extension: using MPEG.\n");
+            avformat_alloc_output_context2(&oc, NULL, "mpeg", filename);
+        }
+    }
 
+    if (!oc)
+    {
+        return 1;
+    }
 
-int main(int argc, char **argv)
-{
-    // 视频、音频输出流
-    OutputStream video_st = { 0 }, audio_st = { 0 };
-    // 指向输出格式的指针
-    const AVOutputFormat *fmt;
-    // 保存通过命令行传入的输出文件的文件名
-    const char *filename;
-    // 指向输出媒体上下文的指针，包含有关正在创建的媒体文件的信息
-    AVFormatContext *oc;
-    // 分别存储音频、视频编解码器的指针
-    const AVCodec *audio_codec, *video_codec;
-    // 用于存储各种调用的返回值
-    int ret;
-    int have_video = 0, have_audio = 0;
-    int encode_video = 0, encode_audio = 0;
-    AVDictionary *opt = NULL;
-    int i;
+    fmt = oc->oformat;
 
-    if (argc < 2)
+    // 确定性模式：复用器不写入版本号、创建时间等随运行变化的信息
+    if (deterministic)
     {
-        printf("usage: %s output_file\n"
-               "API example program to output a media file with libavformat.\n"
-               "This program generates a synthetic audio and video stream, encodes and\n"
-               "muxes them into a file named output_file.\n"
-               "The output format is automatically guessed according to the file extension.\n"
-               "Raw images can also be output by using '%%d' in the filename.\n"
-               "\n", argv[0]);
-        return 1;
+        oc->flags |= AVFMT_FLAG_BITEXACT;
     }
 
-    filename = argv[1];
-    for (i = 2; i + 1 < argc; i += 2)
+    // 图像序列模式：每帧一个文件，由工作线程池并行编码和写出，之后的流和复用器都用不到
+    if (image_seq)
     {
-        if (!strcmp(argv[i], "-flags") || !strcmp(argv[i], "-fflags"))
+        if (strcmp(fmt->name, "image2") || av_get_frame_filename(first_name, sizeof(first_name), filename, 0) < 0)
         {
-            av_dict_set(&opt, argv[i] + 1, argv[i + 1], 0);
+            fprintf(stderr, "-image_seq needs an image file name with '%%d', e.g. frame%%03d.png\n");
+            return 1;
         }
+        ret = run_image_sequence(filename, fmt, opt);
+        avformat_free_context(oc);
+        av_dict_free(&opt);
+        return ret < 0;
     }
 
-    // 根据输出文件扩展名分配和初始化输出媒体上下文，如果无法推断，则使用 mpeg 格式
-    avformat_alloc_output_context2(&oc, NULL, NULL, filename);
-    if (!oc)
+    // 检查点：恢复时要在已有文件的末尾直接续写，需要可以追加的容器（mpegts）和普通文件；
+    // fragmented MP4 续写时需要重写初始化段，libavformat 不支持
+    if (checkpoint.filename)
     {
-        printf("Could not deduce output format from file extension: using MPEG.\n");
-        avformat_alloc_output_context2(&oc, NULL, "mpeg", filename);
+        if (strcmp(fmt->name, "mpegts") || stream_output || fmt->video_codec == AV_CODEC_ID_NONE)
+        {
+            fprintf(stderr, "-checkpoint needs a regular mpegts output file with video\n");
+            return 1;
+        }
+        checkpoint.gops = FFMAX(checkpoint.gops, 1);
+        custom_file_io  = 1;
+        if (async_drain)
+        {
+            fprintf(stderr, "-async_drain is disabled when checkpointing\n");
+            async_drain = 0;
+        }
     }
 
-    if (!oc)
+    // 共享 I/O 引擎：只用于普通文件，与同样接管写文件路径的功能（writev 批量写入、预分配、清单、检查点）互斥；
+    // -avio_buffer_size 同时决定引擎中缓冲区的大小
+    if (io_engine_mode >= 0)
     {
-        return 1;
+        if (stream_output || output_sink != SINK_FILE || output_writev_batch || output_preallocate ||
+            manifest_name || checkpoint.filename || (fmt->flags & AVFMT_NOFILE))
+        {
+            fprintf(stderr, "-io_engine needs a regular output file and cannot be combined with -sink, "
+                    "-writev_batch, -preallocate, -manifest or -checkpoint\n");
+            return 1;
+        }
+        if ((ret = io_engine_init(&io_engine, io_engine_mode, io_engine_buffers, output_avio_buffer_size,
+                                  io_engine_batch)) < 0)
+        {
+            fprintf(stderr, "Could not start the I/O engine: %s\n", av_err2str(ret));
+            return 1;
+        }
+        custom_file_io = 0;
     }
 
-    fmt = oc->oformat;
-
     // 检查输出格式支持的视频和音频编解码器，并将相应的流添加到输出媒体上下文。
     // 如果存在编解码器，则调用 add_stream 来设置流
     if (fmt->video_codec != AV_CODEC_ID_NONE)
@@ -945,6 +8284,12 @@ int main(int argc, char **argv)
         encode_audio = 1;
     }
 
+    // 检查点：使用封闭 GOP，关键帧之前显示的帧都在关键帧之前解码，从关键帧处切分时不会丢帧
+    if (have_video && checkpoint.filename)
+    {
+        video_st.enc->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    }
+
     // 如果存在视频和音频流，则打开相应的编解码器，并分配必要的编码缓冲区
     if (have_video)
     {
@@ -954,13 +8299,153 @@ int main(int argc, char **argv)
     if (have_audio)
     {
         open_audio(oc, audio_codec, &audio_st, opt);
+        if (loudness && loudness_start(&loudness_meter, audio_st.enc, loudness) < 0)
+        {
+            exit(1);
+        }
+    }
+
+    if (qc_name && qc_start(qc_name, qc_min_duration, have_video ? video_st.enc->pix_fmt : AV_PIX_FMT_NONE) < 0)
+    {
+        exit(1);
+    }
+
+    // 帧缓存：编码开始前一次性渲染好，编码循环中只测量编码器本身；帧数不超过整个视频的长度
+    if (have_video && frame_cache > 0)
+    {
+        init_frame_cache(&video_st, (int)FFMIN(frame_cache, video_st.end_pts + 1));
+    }
+
+    // 选择下一个要编码的流时使用公共时间基准下的整数时钟
+    if (have_video && have_audio)
+    {
+        OutputStream *streams[] = { &video_st, &audio_st };
+        init_scheduler_clock(streams, FF_ARRAY_ELEMS(streams));
+    }
+
+    // 检查点：存在检查点文件时恢复生成状态，输出文件截断到最后一个检查点并从那里续写
+    if (checkpoint.filename)
+    {
+        checkpoint.video = &video_st;
+        checkpoint.audio = have_audio ? &audio_st : NULL;
+        ret = load_checkpoint(checkpoint.video, checkpoint.audio, &resume_bytes);
+        if (ret < 0)
+        {
+            fprintf(stderr, "Invalid checkpoint file '%s'\n", checkpoint.filename);
+            return 1;
+        }
+        if (ret > 0)
+        {
+            fprintf(stderr, "resuming from checkpoint: %"PRId64" bytes, video pts %"PRId64"\n",
+                    resume_bytes, video_st.next_pts);
+            output_append_offset   = resume_bytes;
+            checkpoint.base_offset = resume_bytes;
+            encode_audio = have_audio && !audio_st.eof;
+        }
+        else
+        {
+            checkpoint.next_pts = (int64_t)checkpoint.gops * video_st.enc->gop_size;
+        }
+    }
+
+    // 编码器打开之后才能得到音频帧大小和全局头大小，此时估算需要为 moov 预留的空间
+    if (reserve_moov && stream_output)
+    {
+        fprintf(stderr, "-reserve_moov needs a seekable output, ignored\n");
+    }
+    else if (reserve_moov)
+    {
+        if (av_match_name(fmt->name, "mov,mp4,m4a,3gp,3g2,ipod,psp,ismv,f4v"))
+        {
+            int64_t moov_size = estimate_moov_size(&video_st, have_video, &audio_st, have_audio);
+            av_dict_set_int(&opt, "moov_size", moov_size, 0);
+            fprintf(stderr, "reserving %"PRId64" bytes for the moov atom\n", moov_size);
+        }
+        else
+        {
+            fprintf(stderr, "-reserve_moov is only supported by the mov/mp4 muxers, ignored\n");
+        }
     }
 
     // 打印输出格式及其流的信息
     av_dump_format(oc, 0, filename, 1);
 
+    // 不可 seek 的输出上 MP4/MOV 不能回头改写 moov，改为写 fragmented MP4
+    if (stream_output && av_match_name(fmt->name, "mov,mp4,m4a,3gp,3g2,ipod,psp,ismv,f4v"))
+    {
+        av_dict_set(&opt, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
+    // 预计的文件大小：所有编码器的码率之和 × 时长，再加 5% 的容器开销
+    if (output_preallocate)
+    {
+        if (have_video)
+            prealloc_size += video_st.enc->bit_rate;
+        if (have_audio)
+            prealloc_size += audio_st.enc->bit_rate;
+        prealloc_size = (int64_t)(prealloc_size / 8 * STREAM_DURATION * 1.05);
+        // 码率未知时没有可预分配的大小，不为此启用自定义输出层
+        custom_file_io |= prealloc_size > 0;
+    }
+
     /* open the output file, if needed */
-    if (!(fmt->flags & AVFMT_NOFILE))
+    if (!(fmt->flags & AVFMT_NOFILE) && output_sink == SINK_MEM)
+    {
+        // 内存输出：动态缓冲区支持 seek，标记为可 seek，mp4 等复用器才能在结束时回头改写
+        if ((ret = avio_open_dyn_buf(&oc->pb)) < 0)
+        {
+            fprintf(stderr, "Could not open the memory sink: %s\n", av_err2str(ret));
+            return 1;
+        }
+        oc->pb->seekable = AVIO_SEEKABLE_NORMAL;
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE) && output_sink != SINK_FILE)
+    {
+        // count/null 输出：复用器的输出只计数；null 输出只有文件头和文件尾会写到这里
+        uint8_t *avio_buffer = av_malloc(output_avio_buffer_size);
+
+        oc->pb = avio_buffer ? avio_alloc_context(avio_buffer, output_avio_buffer_size, 1, &count_sink,
+                                                  NULL, count_sink_write, count_sink_seek) : NULL;
+        if (!oc->pb)
+        {
+            av_free(avio_buffer);
+            fprintf(stderr, "Could not open the count sink\n");
+            return 1;
+        }
+        oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE) && io_engine.nb_buffers)
+    {
+        ret = io_engine_open(&io_engine, filename, &oc->pb);
+        if (ret < 0)
+        {
+            fprintf(stderr,
+                    "Could not open '%s': %s\n",
+                    filename,
+                    av_err2str(ret));
+            return 1;
+        }
+        oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE) && (stream_output || custom_file_io))
+    {
+        // 流式输出：通过有界缓冲区和 writer 线程写出；普通文件：通过 writev 批量写出
+        ret = output_io_open(&out_io, filename, stream_output, prealloc_size, &oc->pb);
+        checkpoint.io = &out_io;
+        manifest_io   = &out_io;
+        if (ret < 0)
+        {
+            fprintf(stderr,
+                    "Could not open '%s': %s\n",
+                    filename,
+                    av_err2str(ret));
+            return 1;
+        }
+        oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+        // packet 策略下每个数据包写完都刷新 avio 缓冲区，尽快交给 writer 线程
+        oc->flush_packets = stream_output && output_flush_policy == OUTPUT_FLUSH_PACKET;
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE))
     {
         // 打开输出文件
         ret = avio_open(&oc->pb, filename, AVIO_FLAG_WRITE);
@@ -975,7 +8460,13 @@ int main(int argc, char **argv)
     }
 
     // 写入流头信息
+    if (replay_loops > 0 && av_dict_copy(&replay_opt, opt, 0) < 0)
+    {
+        fprintf(stderr, "Could not copy the muxer options\n");
+        return 1;
+    }
     ret = avformat_write_header(oc, &opt);
+    av_dict_free(&opt);
     if (ret < 0)
     {
         fprintf(stderr,
@@ -983,6 +8474,12 @@ int main(int argc, char **argv)
                 av_err2str(ret));
         return 1;
     }
+    if (manifest)
+    {
+        manifest_add_segment(MANIFEST_HEADER, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0, avio_tell(oc->pb));
+    }
+
+    t_start = av_gettime_relative();
 
     // 程序进入循环，直到视频和音频流都被完全编码和写入
     // 在循环中，根据视频和音频的时间戳选择要编码的流
@@ -991,15 +8488,51 @@ int main(int argc, char **argv)
     {
         /* select the stream to encode */
         if (encode_video &&
-            (!encode_audio || av_compare_ts(video_st.next_pts,
-                                            video_st.enc->time_base,
-                                            audio_st.next_pts,
-                                            audio_st.enc->time_base) <= 0))
+            (!encode_audio || stream_before(&video_st, &audio_st)))
         {
             encode_video = !write_video_frame(oc, &video_st);
         } else {
             encode_audio = !write_audio_frame(oc, &audio_st);
         }
+
+        // 记录第一个流结束的时刻，之后的时间都计入尾部耗时
+        if (!t_first_eof && ((have_video && !encode_video) || (have_audio && !encode_audio)))
+        {
+            t_first_eof   = av_gettime_relative();
+            steady_frames = video_st.nb_frames + audio_st.nb_frames;
+        }
+
+        // 异步冲刷时，另一个流仍在编码，顺便把冲刷线程已经产出的数据包写入文件
+        if (async_drain)
+        {
+            write_drained_packets(oc, &video_st);
+            write_drained_packets(oc, &audio_st);
+        }
+    }
+
+    // 等待所有冲刷线程结束，并写入它们产出的剩余数据包
+    while (async_drain &&
+           ((video_st.draining && !video_st.drain_joined) ||
+            (audio_st.draining && !audio_st.drain_joined)))
+    {
+        pthread_mutex_lock(&drain_lock);
+        while (!drain_ready(&video_st) && !drain_ready(&audio_st))
+        {
+            pthread_cond_wait(&drain_cond, &drain_lock);
+        }
+        pthread_mutex_unlock(&drain_lock);
+
+        write_drained_packets(oc, &video_st);
+        write_drained_packets(oc, &audio_st);
+    }
+
+    // 回放模式：编码结束后把内存中的数据包回放给复用器，这段时间不计入尾部耗时
+    if (replay_loops > 0)
+    {
+        replay_time = av_gettime_relative();
+        replay_ret  = run_replay(oc, replay_pattern ? replay_pattern : filename, replay_opt);
+        replay_time = av_gettime_relative() - replay_time;
+        av_dict_free(&replay_opt);
     }
 
     /* Write the trailer, if any. The trailer must be written before you
@@ -1008,7 +8541,75 @@ int main(int argc, char **argv)
      * av_codec_close(). 
      * 写入媒体文件尾部
      * */
-    av_write_trailer(oc);
+    t_trailer   = av_gettime_relative();
+    trailer_ret = av_write_trailer(oc);
+    mux_time   += av_gettime_relative() - t_trailer;
+    if (trailer_ret < 0)
+    {
+        // 使用 -reserve_moov 时，如果预留的空间放不下 moov，mov 复用器会在这里报错
+        fprintf(stderr, "Error writing the trailer: %s\n", av_err2str(trailer_ret));
+    }
+    t_end = av_gettime_relative();
+
+    // 分别报告稳态吞吐量（写完文件头到第一个流结束）和尾部耗时（第一个流结束到写完文件尾）
+    if (!t_first_eof)
+    {
+        t_first_eof   = t_end;
+        steady_frames = video_st.nb_frames + audio_st.nb_frames;
+    }
+    loudness_ret = loudness_finish(&loudness_meter);
+    qc_finish();
+    fprintf(stderr, "steady state: %"PRId64" frames in %.3f s (%.1f frames/s)\n",
+            steady_frames,
+            (t_first_eof - t_start) / 1000000.0,
+            steady_frames * 1000000.0 / FFMAX(t_first_eof - t_start, 1));
+    fprintf(stderr, "tail latency: %.3f s", (t_end - t_first_eof - replay_time) / 1000000.0);
+    if (video_st.draining)
+    {
+        fprintf(stderr, ", video drain %.3f s", (video_st.drain_end - video_st.drain_start) / 1000000.0);
+    }
+    if (audio_st.draining)
+    {
+        fprintf(stderr, ", audio drain %.3f s", (audio_st.drain_end - audio_st.drain_start) / 1000000.0);
+    }
+    fprintf(stderr, "\n");
+
+    // 分层耗时：I/O 回调在复用器内部被调用，复用器本身的耗时需要减去 I/O；其余时间用于生成和转换音视频帧、
+    // 选择要编码的流以及等待冲刷线程。直接用 avio_open 写文件时无法单独统计 I/O
+    wall     = FFMAX(t_end - t_start - replay_time, 1);
+    mux_only = FFMAX(mux_time - io_time, 0);
+    if (output_sink != SINK_FILE || stream_output || custom_file_io || io_engine.nb_buffers)
+    {
+        fprintf(stderr, "layers: encode %.3f s (%.0f%%), mux %.3f s (%.0f%%), io %.3f s (%.0f%%), "
+                "other %.3f s (%.0f%%)\n",
+                encode_time / 1000000.0, encode_time * 100.0 / wall,
+                mux_only / 1000000.0, mux_only * 100.0 / wall,
+                io_time / 1000000.0, io_time * 100.0 / wall,
+                FFMAX(wall - encode_time - mux_time, 0) / 1000000.0,
+                FFMAX(wall - encode_time - mux_time, 0) * 100.0 / wall);
+    }
+    else
+    {
+        fprintf(stderr, "layers: encode %.3f s (%.0f%%), mux+io %.3f s (%.0f%%), other %.3f s (%.0f%%)\n",
+                encode_time / 1000000.0, encode_time * 100.0 / wall,
+                mux_time / 1000000.0, mux_time * 100.0 / wall,
+                FFMAX(wall - encode_time - mux_time, 0) / 1000000.0,
+                FFMAX(wall - encode_time - mux_time, 0) * 100.0 / wall);
+    }
+
+    // 打印数据包哈希，并与基准运行的哈希比较，用于确认优化前后的输出完全一致
+    if (packet_hash)
+    {
+        av_hash_final_hex(packet_hash, hash_hex, sizeof(hash_hex));
+        fprintf(stderr, "packet hash: %s:%s\n", av_hash_get_name(packet_hash), hash_hex);
+        if (golden_hash)
+        {
+            av_strstart(golden_hash, "MD5:", &golden_hash);
+            hash_mismatch = av_strcasecmp(golden_hash, (const char *)hash_hex) != 0;
+            fprintf(stderr, "bit-exact with golden run: %s\n", hash_mismatch ? "NO" : "yes");
+        }
+        av_hash_freep(&packet_hash);
+    }
 
     // 关闭编解码器
     if (have_video)
@@ -1020,7 +8621,40 @@ int main(int argc, char **argv)
         close_stream(oc, &audio_st);
     }
 
-    if (!(fmt->flags & AVFMT_NOFILE))
+    if (!(fmt->flags & AVFMT_NOFILE) && output_sink == SINK_MEM)
+    {
+        sink_size = avio_close_dyn_buf(oc->pb, &sink_buf);
+        oc->pb    = NULL;
+        fprintf(stderr, "mem sink: %d bytes\n", sink_size);
+        av_free(sink_buf);
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE) && output_sink != SINK_FILE)
+    {
+        avio_flush(oc->pb);
+        fprintf(stderr, "%s sink: %"PRId64" bytes in %"PRId64" writes, %"PRId64" seeks\n",
+                output_sink == SINK_NULL ? "null" : "count",
+                count_sink.bytes, count_sink.nb_writes, count_sink.nb_seeks);
+        av_freep(&oc->pb->buffer);
+        avio_context_free(&oc->pb);
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE) && io_engine.nb_buffers)
+    {
+        if ((ret = io_engine_close(&oc->pb)) < 0)
+        {
+            fprintf(stderr, "Error writing '%s': %s\n", filename, av_err2str(ret));
+            trailer_ret = ret;
+        }
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE) && (stream_output || custom_file_io))
+    {
+        output_io_close(&out_io, &oc->pb);
+        if (manifest)
+        {
+            manifest_finish(&out_io);
+            fprintf(manifest, "# file\tsha256\t%s\n", out_io.file_hash_hex);
+        }
+    }
+    else if (!(fmt->flags & AVFMT_NOFILE))
     {
         /* Close the output file. */
         avio_closep(&oc->pb);
@@ -1029,5 +8663,23 @@ int main(int argc, char **argv)
     /* free the stream */
     avformat_free_context(oc);
 
-    return 0;
+    // 所有输出都已经关闭，打印共享 I/O 引擎的统计信息
+    if (io_engine.nb_buffers)
+    {
+        io_engine_uninit(&io_engine);
+    }
+
+    if (manifest)
+    {
+        fclose(manifest);
+    }
+
+    // 编码正常完成，删除检查点，下次运行从头开始
+    if (checkpoint.filename && trailer_ret >= 0)
+    {
+        fprintf(stderr, "%"PRId64" checkpoints saved\n", checkpoint.nb_saved);
+        unlink(checkpoint.filename);
+    }
+
+    return trailer_ret < 0 || hash_mismatch || replay_ret < 0 || loudness_ret < 0;
 }
\ No newline at end of file
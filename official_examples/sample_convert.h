@@ -0,0 +1,57 @@
+/**
+ * @file
+ * 把解码器或编码器使用的各种采样格式的样本转换成 float，muxing_demo 的响度表、静音检测和
+ * avsync_detect 的短音检测共用。只有头文件，不需要单独编译。
+ */
+
+#ifndef SAMPLE_CONVERT_H
+#define SAMPLE_CONVERT_H
+
+#include <stdint.h>
+
+#include <libavutil/samplefmt.h>
+
+/**
+ * @brief 判断 sample_to_float 能否转换这种采样格式（平面或交错的 u8、s16、s32、flt、dbl）
+ */
+static inline int sample_fmt_to_float_supported(enum AVSampleFormat fmt)
+{
+    switch (av_get_packed_sample_fmt(fmt))
+    {
+    case AV_SAMPLE_FMT_U8:
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_FLT:
+    case AV_SAMPLE_FMT_DBL:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief 把一个样本转换成 float，满幅对应 [-1.0, 1.0)
+ * @param src 一个平面（交错格式时是唯一的平面）的起始地址
+ * @param fmt 交错形式的采样格式，即 av_get_packed_sample_fmt 的返回值；不支持的格式返回 0
+ * @param i 样本在平面中的下标，交错格式时为 样本序号 × 声道数 + 声道
+ */
+static inline float sample_to_float(const uint8_t *src, enum AVSampleFormat fmt, int i)
+{
+    switch (fmt)
+    {
+    case AV_SAMPLE_FMT_U8:
+        return (src[i] - 128) / 128.0f;
+    case AV_SAMPLE_FMT_S16:
+        return ((const int16_t *)src)[i] / 32768.0f;
+    case AV_SAMPLE_FMT_S32:
+        return ((const int32_t *)src)[i] / 2147483648.0f;
+    case AV_SAMPLE_FMT_FLT:
+        return ((const float *)src)[i];
+    case AV_SAMPLE_FMT_DBL:
+        return ((const double *)src)[i];
+    default:
+        return 0;
+    }
+}
+
+#endif /* SAMPLE_CONVERT_H */
@@ -0,0 +1,646 @@
+/**
+ * @file
+ * 关键帧 / seek 索引的生成和使用。
+ *
+ * 第一次运行时只解复用、不解码，扫描输入文件中一个流的所有数据包，记录每个数据包的 pts、在文件中的字节偏移
+ * 和是否是关键帧，按 pts 排序后写成一个紧凑的二进制旁路索引文件（sidecar，默认是输入文件名加 .idx）。
+ * 之后的运行直接加载索引（输入文件的大小或修改时间变化时重新生成），用二分查找找到目标时间之前最近的关键帧，
+ * 用 avformat_seek_file seek 到这个关键帧（mpegts/ps 直接按字节偏移 seek），最后从关键帧解码到目标帧。
+ * 只有打开时没有自带索引的流才把关键帧交给 av_add_index_entry：mov、matroska 等格式的解复用器直接按自己的索引
+ * 读取数据，加入 pts 为键、大小为 0 的条目会破坏它们。长录像中的逐帧精确 seek 因此只需要 O(log n) 次查找，不需要在文件中反复探测。
+ * @example seek_index.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavutil/intreadwrite.h>
+#include <libavutil/time.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+
+#define INDEX_MAGIC       "FFSIDX1"              /* 索引文件的魔数（含结尾的 0 共 8 字节） */
+#define INDEX_HEADER_SIZE 48                     /* 文件头：魔数、流序号、时间基准、输入文件大小和修改时间、条目数 */
+#define INDEX_ENTRY_SIZE  16                     /* 每个条目：pts（8 字节）+ 字节偏移 << 1 | 关键帧标志（8 字节） */
+
+/**
+ * @brief 索引中的一个条目，对应流中的一个数据包
+ */
+typedef struct IndexEntry {
+    int64_t pts;
+    int64_t pos;
+    int key;
+} IndexEntry;
+
+/**
+ * @brief 一个流的 seek 索引。entries 按 pts 排序，keyframes 是其中关键帧的下标（同样按 pts 排序），用于二分查找
+ */
+typedef struct SeekIndex {
+    int stream_index;
+    AVRational time_base;
+    // 生成索引时输入文件的大小和修改时间，任意一个变化都说明索引已经过期
+    int64_t file_size;
+    int64_t mtime;
+
+    IndexEntry *entries;
+    int nb_entries;
+    int *keyframes;
+    int nb_keyframes;
+} SeekIndex;
+
+
+
+
+static int compare_entry(const void *a, const void *b)
+{
+    const IndexEntry *x = a, *y = b;
+
+    if (x->pts != y->pts)
+    {
+        return x->pts > y->pts ? 1 : -1;
+    }
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+
+
+
+/**
+ * @brief 建立关键帧下标数组；sort 为 1 时先按 pts 排序条目（有 B 帧时数据包的顺序不是 pts 顺序）
+ * @return 0 表示成功，负数表示错误码
+ */
+static int index_finalize(SeekIndex *idx, int sort)
+{
+    int i;
+
+    if (sort)
+    {
+        qsort(idx->entries, idx->nb_entries, sizeof(*idx->entries), compare_entry);
+    }
+
+    idx->keyframes    = av_malloc_array(FFMAX(idx->nb_entries, 1), sizeof(*idx->keyframes));
+    idx->nb_keyframes = 0;
+    if (!idx->keyframes)
+    {
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < idx->nb_entries; i++)
+    {
+        if (idx->entries[i].key)
+        {
+            idx->keyframes[idx->nb_keyframes++] = i;
+        }
+    }
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief 扫描输入文件，为 stream_index 这个流生成索引。只调用 av_read_frame 读取数据包的时间戳、偏移和标志，
+ * 不解码；其他流在解复用层丢弃，支持的格式会直接跳过它们的负载
+ * @return 0 表示成功，负数表示错误码
+ */
+static int index_build(AVFormatContext *fmt_ctx, int stream_index, SeekIndex *idx)
+{
+    AVPacket *pkt = av_packet_alloc();
+    IndexEntry *entries;
+    int64_t nb_skipped = 0;
+    unsigned int s;
+    int size = 0, ret;
+
+    if (!pkt)
+    {
+        return AVERROR(ENOMEM);
+    }
+    for (s = 0; s < fmt_ctx->nb_streams; s++)
+    {
+        fmt_ctx->streams[s]->discard = (int)s == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    idx->stream_index = stream_index;
+    idx->time_base    = fmt_ctx->streams[stream_index]->time_base;
+    while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0)
+    {
+        int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+        // 没有时间戳或字节偏移的数据包无法用于 seek
+        if (pkt->stream_index != stream_index || pts == AV_NOPTS_VALUE || pkt->pos < 0)
+        {
+            nb_skipped += pkt->stream_index == stream_index;
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (idx->nb_entries == size)
+        {
+            size    = FFMAX(2 * size, 4096);
+            entries = av_realloc_array(idx->entries, size, sizeof(*entries));
+            if (!entries)
+            {
+                av_packet_free(&pkt);
+                return AVERROR(ENOMEM);
+            }
+            idx->entries = entries;
+        }
+        idx->entries[idx->nb_entries].pts = pts;
+        idx->entries[idx->nb_entries].pos = pkt->pos;
+        idx->entries[idx->nb_entries].key = !!(pkt->flags & AV_PKT_FLAG_KEY);
+        idx->nb_entries++;
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    for (s = 0; s < fmt_ctx->nb_streams; s++)
+    {
+        fmt_ctx->streams[s]->discard = AVDISCARD_DEFAULT;
+    }
+    if (ret != AVERROR_EOF)
+    {
+        return ret;
+    }
+    if (nb_skipped)
+    {
+        fprintf(stderr, "%"PRId64" packets without a timestamp or byte offset were not indexed\n", nb_skipped);
+    }
+
+    return index_finalize(idx, 1);
+}
+
+
+
+
+/**
+ * @brief 把索引写入 path：先写临时文件再 rename，读取的一方不会看到写了一半的索引。所有整数按小端序存储
+ * @return 0 表示成功，负数表示错误码
+ */
+static int index_write(const SeekIndex *idx, const char *path)
+{
+    char tmp_path[1100];
+    uint8_t header[INDEX_HEADER_SIZE] = { 0 }, *buf;
+    FILE *f;
+    int i, ret = 0;
+
+    buf = av_malloc_array(FFMAX(idx->nb_entries, 1), INDEX_ENTRY_SIZE);
+    if (!buf)
+    {
+        return AVERROR(ENOMEM);
+    }
+    memcpy(header, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    AV_WL32(header +  8, idx->stream_index);
+    AV_WL32(header + 12, idx->time_base.num);
+    AV_WL32(header + 16, idx->time_base.den);
+    AV_WL64(header + 24, idx->file_size);
+    AV_WL64(header + 32, idx->mtime);
+    AV_WL64(header + 40, idx->nb_entries);
+    for (i = 0; i < idx->nb_entries; i++)
+    {
+        AV_WL64(buf + i * INDEX_ENTRY_SIZE,     idx->entries[i].pts);
+        AV_WL64(buf + i * INDEX_ENTRY_SIZE + 8, (uint64_t)idx->entries[i].pos << 1 | idx->entries[i].key);
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    f = fopen(tmp_path, "wb");
+    if (!f)
+    {
+        av_free(buf);
+        return AVERROR(errno);
+    }
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header) ||
+        fwrite(buf, INDEX_ENTRY_SIZE, idx->nb_entries, f) != (size_t)idx->nb_entries)
+    {
+        ret = AVERROR(EIO);
+    }
+    if (fclose(f) && ret >= 0)
+    {
+        ret = AVERROR(errno);
+    }
+    if (ret >= 0 && rename(tmp_path, path) < 0)
+    {
+        ret = AVERROR(errno);
+    }
+    if (ret < 0)
+    {
+        unlink(tmp_path);
+    }
+    av_free(buf);
+
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 从 path 读取索引。文件不存在、格式不对或者与输入文件的大小、修改时间不一致时返回错误，调用者重新生成
+ * @return 0 表示成功，负数表示错误码
+ */
+static int index_read(SeekIndex *idx, const char *path, int64_t file_size, int64_t mtime)
+{
+    uint8_t header[INDEX_HEADER_SIZE], *buf;
+    int64_t nb_entries;
+    FILE *f;
+    int i, ret = 0;
+
+    f = fopen(path, "rb");
+    if (!f)
+    {
+        return AVERROR(errno);
+    }
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, INDEX_MAGIC, sizeof(INDEX_MAGIC)))
+    {
+        fclose(f);
+        return AVERROR_INVALIDDATA;
+    }
+    nb_entries = AV_RL64(header + 40);
+    if ((int64_t)AV_RL64(header + 24) != file_size || (int64_t)AV_RL64(header + 32) != mtime)
+    {
+        fclose(f);
+        return AVERROR(ESTALE);
+    }
+    if (nb_entries < 0 || nb_entries > INT_MAX / INDEX_ENTRY_SIZE)
+    {
+        fclose(f);
+        return AVERROR_INVALIDDATA;
+    }
+
+    idx->stream_index   = AV_RL32(header + 8);
+    idx->time_base.num  = AV_RL32(header + 12);
+    idx->time_base.den  = AV_RL32(header + 16);
+    idx->file_size      = file_size;
+    idx->mtime          = mtime;
+    idx->nb_entries     = nb_entries;
+    idx->entries        = av_malloc_array(FFMAX(nb_entries, 1), sizeof(*idx->entries));
+    buf                 = av_malloc_array(FFMAX(nb_entries, 1), INDEX_ENTRY_SIZE);
+    if (!idx->entries || !buf)
+    {
+        ret = AVERROR(ENOMEM);
+    }
+    else if (fread(buf, INDEX_ENTRY_SIZE, nb_entries, f) != (size_t)nb_entries)
+    {
+        ret = AVERROR_INVALIDDATA;
+    }
+    fclose(f);
+    for (i = 0; ret >= 0 && i < idx->nb_entries; i++)
+    {
+        uint64_t v = AV_RL64(buf + i * INDEX_ENTRY_SIZE + 8);
+
+        idx->entries[i].pts = AV_RL64(buf + i * INDEX_ENTRY_SIZE);
+        idx->entries[i].pos = v >> 1;
+        idx->entries[i].key = v & 1;
+    }
+    av_free(buf);
+
+    // 文件中的条目已经按 pts 排好序，只需要重新建立关键帧数组
+    return ret < 0 ? ret : index_finalize(idx, 0);
+}
+
+
+
+
+/**
+ * @brief 二分查找 pts 小于等于 target 的最后一个关键帧
+ * @return 关键帧在 entries 中的下标，target 在第一个关键帧之前时返回 -1
+ */
+static int index_lookup(const SeekIndex *idx, int64_t target)
+{
+    int lo = 0, hi = idx->nb_keyframes;
+
+    // 循环不变量：keyframes[0, lo) 的 pts 都不大于 target，keyframes[hi, n) 的 pts 都大于 target
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (idx->entries[idx->keyframes[mid]].pts <= target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 ? idx->keyframes[lo - 1] : -1;
+}
+
+
+
+
+/**
+ * @brief 把索引中的关键帧交给解复用器（av_add_index_entry），之后按时间戳 seek 时解复用器直接使用这些条目。
+ * 只能用于打开后没有任何索引条目的流
+ */
+static void index_feed(const SeekIndex *idx, AVStream *st)
+{
+    int i;
+
+    for (i = 0; i < idx->nb_keyframes; i++)
+    {
+        const IndexEntry *e = &idx->entries[idx->keyframes[i]];
+
+        av_add_index_entry(st, e->pos, e->pts, 0, 0, AVINDEX_KEYFRAME);
+    }
+}
+
+
+
+
+/**
+ * @brief 逐帧精确地 seek 到 target（流的时间基准）：查找之前最近的关键帧，seek 过去，然后解码到第一个 pts 不小于 target 的帧。
+ * mpegts 和 ps 中数据包的字节偏移就是可以重新同步的位置，直接跳到关键帧的字节偏移；其他格式用关键帧的 pts 调用
+ * avformat_seek_file，max 等于它：解复用器的索引以 dts 为键时可能落在更早的关键帧上，多解码几帧而已
+ * @return 解码出的帧数，负数表示错误码
+ */
+static int seek_exact(AVFormatContext *fmt_ctx, AVCodecContext *dec, AVFrame *frame, AVPacket *pkt,
+                      const SeekIndex *idx, int64_t target, int64_t *found_pts)
+{
+    const IndexEntry *key;
+    int k, ret, nb_decoded = 0;
+
+    k = index_lookup(idx, target);
+    if (k < 0)
+    {
+        k = idx->nb_keyframes ? idx->keyframes[0] : -1;
+    }
+    if (k < 0)
+    {
+        return AVERROR(ENOENT);
+    }
+    key = &idx->entries[k];
+
+    if (av_match_name(fmt_ctx->iformat->name, "mpegts,mpeg"))
+        ret = avformat_seek_file(fmt_ctx, idx->stream_index, key->pos, key->pos, key->pos, AVSEEK_FLAG_BYTE);
+    else
+        ret = avformat_seek_file(fmt_ctx, idx->stream_index, INT64_MIN, key->pts, key->pts, 0);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    avcodec_flush_buffers(dec);
+
+    while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0 || ret == AVERROR_EOF)
+    {
+        if (ret >= 0 && pkt->stream_index != idx->stream_index)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        ret = avcodec_send_packet(dec, ret >= 0 ? pkt : NULL);
+        av_packet_unref(pkt);
+        if (ret < 0 && ret != AVERROR_EOF)
+        {
+            return ret;
+        }
+        while ((ret = avcodec_receive_frame(dec, frame)) >= 0)
+        {
+            nb_decoded++;
+            *found_pts = frame->best_effort_timestamp;
+            av_frame_unref(frame);
+            if (*found_pts != AV_NOPTS_VALUE && *found_pts >= target)
+            {
+                return nb_decoded;
+            }
+        }
+        if (ret == AVERROR_EOF)
+        {
+            return nb_decoded;
+        }
+        if (ret != AVERROR(EAGAIN))
+        {
+            return ret;
+        }
+    }
+
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 为索引的流打开解码器，只在需要逐帧精确 seek 时使用
+ * @return 0 表示成功，负数表示错误码
+ */
+static int open_decoder(AVCodecContext **dec, AVStream *st)
+{
+    const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+    int ret;
+
+    if (!codec)
+    {
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+    *dec = avcodec_alloc_context3(codec);
+    if (!*dec)
+    {
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = avcodec_parameters_to_context(*dec, st->codecpar)) < 0)
+    {
+        return ret;
+    }
+    (*dec)->pkt_timebase = st->time_base;
+
+    return avcodec_open2(*dec, codec, NULL);
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *dec = NULL;
+    AVFrame *frame = NULL;
+    AVPacket *pkt = NULL;
+    SeekIndex idx = { 0 };
+    struct stat st;
+    char default_path[1024];
+    const char *input, *index_path = NULL, *seek_list = NULL, *p;
+    int64_t t0, target, found_pts = AV_NOPTS_VALUE;
+    int *own_index = NULL;
+    int i, ret, rebuild = 0, built = 0, stream_index;
+
+    if (argc < 2)
+    {
+        printf("usage: %s input_file [-index file] [-rebuild 1] [-seek t1,t2,...]\n"
+               "build (or load) a sidecar index of the packet timestamps, byte offsets and\n"
+               "keyframe flags of the main stream of input_file, then seek frame-accurately\n"
+               "to each time in seconds given with -seek using a binary search in the index.\n"
+               "the default index file is input_file.idx.\n"
+               "\n", argv[0]);
+        return 1;
+    }
+
+    input = argv[1];
+    for (i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-index"))
+        {
+            index_path = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-rebuild"))
+        {
+            rebuild = atoi(argv[i + 1]);
+        }
+        else if (!strcmp(argv[i], "-seek"))
+        {
+            seek_list = argv[i + 1];
+        }
+    }
+    if (!index_path)
+    {
+        snprintf(default_path, sizeof(default_path), "%s.idx", input);
+        index_path = default_path;
+    }
+    if (stat(input, &st) < 0)
+    {
+        fprintf(stderr, "Could not stat '%s': %s\n", input, strerror(errno));
+        return 1;
+    }
+
+    if ((ret = avformat_open_input(&fmt_ctx, input, NULL, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", input, av_err2str(ret));
+        return 1;
+    }
+    // 记下打开时就带有索引（例如 mov 的样本表、matroska 的 Cues）的流，这些流不能再加入索引条目；
+    // 之后读取数据包时 libavformat 为其他格式生成的通用索引不算
+    own_index = av_malloc_array(FFMAX(fmt_ctx->nb_streams, 1), sizeof(*own_index));
+    if (!own_index)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < (int)fmt_ctx->nb_streams; i++)
+    {
+        own_index[i] = avformat_index_get_entries_count(fmt_ctx->streams[i]) > 0;
+    }
+
+    // 索引有效时不再调用 avformat_find_stream_info：索引已经给出了 seek 需要的一切，
+    // 只有文件头里没有编解码参数的格式才需要探测
+    t0  = av_gettime_relative();
+    ret = rebuild ? AVERROR(ESTALE) : index_read(&idx, index_path, st.st_size, st.st_mtime);
+    if (ret >= 0 && (idx.stream_index < 0 || idx.stream_index >= (int)fmt_ctx->nb_streams ||
+                     av_cmp_q(idx.time_base, fmt_ctx->streams[idx.stream_index]->time_base)))
+    {
+        ret = AVERROR_INVALIDDATA;
+    }
+    if (ret >= 0)
+    {
+        printf("loaded %s: %d entries, %d keyframes in %.3f ms\n", index_path, idx.nb_entries, idx.nb_keyframes,
+               (av_gettime_relative() - t0) / 1000.0);
+    }
+    else
+    {
+        if (ret != AVERROR(ENOENT))
+        {
+            fprintf(stderr, "Rebuilding %s: %s\n", index_path, av_err2str(ret));
+        }
+        av_freep(&idx.entries);
+        av_freep(&idx.keyframes);
+        memset(&idx, 0, sizeof(idx));
+
+        if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+        {
+            fprintf(stderr, "Cannot find stream information\n");
+            goto end;
+        }
+        stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (stream_index < 0)
+        {
+            stream_index = 0;
+        }
+
+        t0 = av_gettime_relative();
+        idx.file_size = st.st_size;
+        idx.mtime     = st.st_mtime;
+        if ((ret = index_build(fmt_ctx, stream_index, &idx)) < 0 ||
+            (ret = index_write(&idx, index_path)) < 0)
+        {
+            fprintf(stderr, "Could not build the index: %s\n", av_err2str(ret));
+            goto end;
+        }
+        built = 1;
+        printf("indexed stream #%d: %d entries, %d keyframes in %.3f s, %s is %"PRId64" bytes\n",
+               stream_index, idx.nb_entries, idx.nb_keyframes, (av_gettime_relative() - t0) / 1000000.0,
+               index_path, (int64_t)INDEX_HEADER_SIZE + (int64_t)idx.nb_entries * INDEX_ENTRY_SIZE);
+    }
+    // find_stream_info 可能新增了流，它们打开时没有索引
+    if (idx.stream_index >= (int)fmt_ctx->nb_streams || !own_index[idx.stream_index])
+    {
+        index_feed(&idx, fmt_ctx->streams[idx.stream_index]);
+    }
+
+    if (!seek_list)
+    {
+        ret = 0;
+        goto end;
+    }
+    if (!built && !fmt_ctx->streams[idx.stream_index]->codecpar->width &&
+        fmt_ctx->streams[idx.stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0)
+    {
+        fprintf(stderr, "Cannot find stream information\n");
+        goto end;
+    }
+
+    frame = av_frame_alloc();
+    pkt   = av_packet_alloc();
+    if (!frame || !pkt)
+    {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = open_decoder(&dec, fmt_ctx->streams[idx.stream_index])) < 0)
+    {
+        fprintf(stderr, "Could not open the decoder: %s\n", av_err2str(ret));
+        goto end;
+    }
+
+    for (p = seek_list; *p; p += *p == ',')
+    {
+        char *end;
+        double seconds = strtod(p, &end);
+        int k;
+
+        if (end == p)
+        {
+            break;
+        }
+        p      = end;
+        target = av_rescale_q((int64_t)(seconds * AV_TIME_BASE), AV_TIME_BASE_Q, idx.time_base);
+        if (fmt_ctx->streams[idx.stream_index]->start_time != AV_NOPTS_VALUE)
+        {
+            target += fmt_ctx->streams[idx.stream_index]->start_time;
+        }
+
+        t0  = av_gettime_relative();
+        k   = index_lookup(&idx, target);
+        ret = seek_exact(fmt_ctx, dec, frame, pkt, &idx, target, &found_pts);
+        if (ret < 0)
+        {
+            fprintf(stderr, "seek to %.3f s failed: %s\n", seconds, av_err2str(ret));
+            goto end;
+        }
+        printf("seek %.3f s: keyframe pts %"PRId64" at byte %"PRId64", decoded %d frames to pts %"PRId64", %.3f ms\n",
+               seconds, k >= 0 ? idx.entries[k].pts : AV_NOPTS_VALUE, k >= 0 ? idx.entries[k].pos : -1,
+               ret, found_pts, (av_gettime_relative() - t0) / 1000.0);
+    }
+    ret = 0;
+
+end:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fmt_ctx);
+    av_freep(&idx.entries);
+    av_freep(&idx.keyframes);
+    av_freep(&own_index);
+
+    return ret < 0;
+}
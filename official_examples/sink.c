@@ -0,0 +1,224 @@
+/**
+ * @file
+ * 流式输出的本地消费者（stand-in consumer）。
+ *
+ * 从 stdin、FIFO、tcp 或 unix socket 读取 muxing_demo 的流式输出并丢弃，可以用 -rate 限制
+ * 读取速度来模拟慢速的下游，配合 muxing_demo 打印的 stall 时间观察反压效果。
+ * @example sink.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/**
+ * @brief 返回单调时钟的当前时间（微秒）
+ */
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+
+/**
+ * @brief 在 tcp://host:port 或 unix:path 上监听，并接受一个连接
+ * @return 成功时返回已连接的 socket 描述符，失败时返回 -1
+ */
+static int accept_one(const char *url)
+{
+    int listen_fd = -1, fd, one = 1;
+
+    if (!strncmp(url, "unix:", 5))
+    {
+        struct sockaddr_un addr = { 0 };
+        const char *path = url + 5;
+
+        if (!strncmp(path, "//", 2))
+        {
+            path += 2;
+        }
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+        unlink(path);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            goto fail;
+        }
+    }
+    else
+    {
+        struct addrinfo hints = { 0 }, *ai;
+        char host[256];
+        const char *p    = url + 6;
+        const char *port = strrchr(p, ':');
+
+        if (!port)
+        {
+            return -1;
+        }
+        snprintf(host, sizeof(host), "%.*s", (int)(port - p), p);
+        port++;
+
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        if (getaddrinfo(host, port, &hints, &ai))
+        {
+            return -1;
+        }
+        listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (listen_fd >= 0)
+        {
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (listen_fd < 0 || bind(listen_fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        {
+            freeaddrinfo(ai);
+            goto fail;
+        }
+        freeaddrinfo(ai);
+    }
+
+    if (listen(listen_fd, 1) < 0)
+    {
+        goto fail;
+    }
+    fprintf(stderr, "waiting for a connection on %s\n", url);
+    fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    return fd;
+
+fail:
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+    }
+    return -1;
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+    // 读取速度上限（字节/秒），0 表示不限速
+    int64_t rate = 0;
+    // 每次 read 的最大字节数
+    int chunk = 65536;
+    int64_t bytes = 0, nb_reads = 0, t_start, t_first = 0, elapsed, ahead;
+    const char *source;
+    char *buf;
+    ssize_t n;
+    int fd, i;
+
+    if (argc < 2)
+    {
+        printf("usage: %s source [-rate bytes_per_second] [-chunk bytes]\n"
+               "stand-in consumer for the streaming output of muxing_demo.\n"
+               "source is '-' (stdin), a FIFO path, tcp://host:port or unix:path;\n"
+               "for sockets this program listens and accepts one connection.\n"
+               "\n", argv[0]);
+        return 1;
+    }
+
+    source = argv[1];
+    for (i = 2; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-rate"))
+        {
+            rate = strtoll(argv[i + 1], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-chunk"))
+        {
+            chunk = atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : chunk;
+        }
+    }
+
+    if (!strcmp(source, "-"))
+    {
+        fd = STDIN_FILENO;
+    }
+    else if (!strncmp(source, "tcp://", 6) || !strncmp(source, "unix:", 5))
+    {
+        fd = accept_one(source);
+    }
+    else
+    {
+        // FIFO 不存在时先创建它，这样可以先启动消费者再启动 muxing_demo
+        if (mkfifo(source, 0644) < 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Could not create FIFO '%s': %s\n", source, strerror(errno));
+            return 1;
+        }
+        fd = open(source, O_RDONLY);
+    }
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", source, strerror(errno));
+        return 1;
+    }
+
+    buf = malloc(chunk);
+    if (!buf)
+    {
+        return 1;
+    }
+
+    t_start = now_us();
+    for (;;)
+    {
+        n = read(fd, buf, chunk);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        if (!t_first)
+        {
+            t_first = now_us();
+        }
+        bytes += n;
+        nb_reads++;
+
+        // 限速：读得比 rate 快时睡眠，让生产者的缓冲区逐渐填满
+        if (rate > 0)
+        {
+            ahead = bytes * 1000000 / rate - (now_us() - t_first);
+            if (ahead > 0)
+            {
+                usleep(ahead);
+            }
+        }
+    }
+
+    elapsed = now_us() - (t_first ? t_first : t_start);
+    fprintf(stderr, "received %"PRId64" bytes in %"PRId64" reads, %.3f s, %.2f MB/s\n",
+            bytes, nb_reads, elapsed / 1000000.0, bytes / (double)(elapsed > 0 ? elapsed : 1));
+
+    free(buf);
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+    return n < 0;
+}
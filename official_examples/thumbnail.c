@@ -0,0 +1,527 @@
+/**
+ * @file
+ * 基于关键帧的快速缩略图提取。
+ *
+ * 在输入文件的时长上均匀地取 N 个位置，每个位置用 AVSEEK_FLAG_BACKWARD seek 到它之前最近的关键帧，
+ * 解码器设置 skip_frame = AVDISCARD_NONKEY，只解码这一个关键帧，再用一次 sws_scale 直接缩小并转换成
+ * 图像编码器需要的像素格式，编码后写成一个文件。多个位置由多个线程并行处理，每个线程打开自己的
+ * 解复用器和解码器实例，互不共享读位置。生成缩略图的开销从解码整个文件降到只解码几个关键帧。
+ * @example thumbnail.c
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+
+/**
+ * @brief 所有线程共享的任务：输入、输出文件名模板、缩略图的个数和尺寸，以及下一个要处理的位置
+ */
+typedef struct ThumbnailJob {
+    const char *input;
+    const char *pattern;
+    int nb_thumbs;
+    int width;
+
+    // 输入的起始时间和时长（AV_TIME_BASE），由主线程探测一次
+    int64_t start_time;
+    int64_t duration;
+    // 缩略图的编码器（由输出文件的扩展名决定）
+    const AVCodec *codec;
+
+    // 保护 next 和 error
+    pthread_mutex_t lock;
+    int next;
+    int error;
+} ThumbnailJob;
+
+/**
+ * @brief 一个工作线程：拥有自己的解复用器、解码器、缩放上下文和编码器
+ */
+typedef struct ThumbnailWorker {
+    ThumbnailJob *job;
+    int index;
+    pthread_t thread;
+
+    AVFormatContext *fmt_ctx;
+    int video_index;
+    AVCodecContext *dec;
+    AVCodecContext *enc;
+    struct SwsContext *sws_ctx;
+    AVFrame *frame;
+    AVFrame *thumb;
+    AVPacket *pkt;
+
+    // 统计信息：读取的数据包数、其中被跳过的非关键帧数、送入解码器的关键帧数、读取的字节数
+    int64_t nb_packets;
+    int64_t nb_skipped;
+    int64_t nb_decoded;
+    int64_t bytes_read;
+} ThumbnailWorker;
+
+static int nb_threads = 0;                       /* 工作线程数，0 表示使用 CPU 个数 */
+
+
+
+
+/**
+ * @brief 打开输入文件和其中最合适的视频流的解码器。解码器只解码关键帧，并且只用一个线程：
+ * 并行发生在不同的 seek 位置之间
+ * @return 0 表示成功，负数表示错误码
+ */
+static int open_input(ThumbnailWorker *w)
+{
+    const AVCodec *codec;
+    AVStream *st;
+    unsigned int s;
+    int ret;
+
+    if ((ret = avformat_open_input(&w->fmt_ctx, w->job->input, NULL, NULL)) < 0)
+    {
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(w->fmt_ctx, NULL)) < 0)
+    {
+        return ret;
+    }
+    ret = av_find_best_stream(w->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    w->video_index = ret;
+    st = w->fmt_ctx->streams[ret];
+
+    // 其他流的数据包在解复用层就丢弃
+    for (s = 0; s < w->fmt_ctx->nb_streams; s++)
+    {
+        w->fmt_ctx->streams[s]->discard = s == (unsigned int)w->video_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    w->dec = avcodec_alloc_context3(codec);
+    if (!w->dec)
+    {
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = avcodec_parameters_to_context(w->dec, st->codecpar)) < 0)
+    {
+        return ret;
+    }
+    w->dec->pkt_timebase = st->time_base;
+    w->dec->thread_count = 1;
+    w->dec->skip_frame   = AVDISCARD_NONKEY;
+
+    return avcodec_open2(w->dec, codec, NULL);
+}
+
+
+
+
+/**
+ * @brief 打开缩略图的编码器：尺寸按宽度和视频的显示宽高比计算，像素格式使用编码器首选的格式
+ * （PNG 为 RGB24，MJPEG 为 YUVJ420P），缩放和像素格式转换在同一次 sws_scale 中完成
+ * @return 0 表示成功，负数表示错误码
+ */
+static int open_encoder(ThumbnailWorker *w)
+{
+    AVCodecParameters *par = w->fmt_ctx->streams[w->video_index]->codecpar;
+    AVRational sar = par->sample_aspect_ratio;
+    AVCodecContext *c;
+    int ret;
+
+    if (sar.num <= 0 || sar.den <= 0)
+    {
+        sar = (AVRational){ 1, 1 };
+    }
+
+    c = avcodec_alloc_context3(w->job->codec);
+    if (!c)
+    {
+        return AVERROR(ENOMEM);
+    }
+    w->enc = c;
+
+    c->width     = FFMAX(w->job->width & ~1, 2);
+    c->height    = FFMAX((int)av_rescale(c->width, (int64_t)par->height * sar.den, (int64_t)par->width * sar.num) & ~1, 2);
+    c->pix_fmt   = w->job->codec->pix_fmts ? w->job->codec->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+    c->time_base = (AVRational){ 1, 25 };
+    if ((ret = avcodec_open2(c, w->job->codec, NULL)) < 0)
+    {
+        return ret;
+    }
+
+    w->thumb = av_frame_alloc();
+    if (!w->thumb)
+    {
+        return AVERROR(ENOMEM);
+    }
+    w->thumb->format = c->pix_fmt;
+    w->thumb->width  = c->width;
+    w->thumb->height = c->height;
+
+    return av_frame_get_buffer(w->thumb, 0);
+}
+
+
+
+
+/**
+ * @brief seek 到 target（AV_TIME_BASE）之前最近的关键帧并解码它。非关键帧的数据包直接丢弃，
+ * 送入解码器的只有关键帧，送入后立即冲刷解码器取出这一帧
+ * @return 0 表示 w->frame 中是解码出的关键帧，负数表示错误码
+ */
+static int decode_keyframe(ThumbnailWorker *w, int64_t target)
+{
+    AVStream *st = w->fmt_ctx->streams[w->video_index];
+    int64_t ts = av_rescale_q(target, AV_TIME_BASE_Q, st->time_base);
+    int ret;
+
+    if ((ret = av_seek_frame(w->fmt_ctx, w->video_index, ts, AVSEEK_FLAG_BACKWARD)) < 0)
+    {
+        return ret;
+    }
+    avcodec_flush_buffers(w->dec);
+
+    while ((ret = av_read_frame(w->fmt_ctx, w->pkt)) >= 0)
+    {
+        if (w->pkt->stream_index != w->video_index)
+        {
+            av_packet_unref(w->pkt);
+            continue;
+        }
+        w->nb_packets++;
+        if (!(w->pkt->flags & AV_PKT_FLAG_KEY))
+        {
+            w->nb_skipped++;
+            av_packet_unref(w->pkt);
+            continue;
+        }
+
+        w->nb_decoded++;
+        ret = avcodec_send_packet(w->dec, w->pkt);
+        av_packet_unref(w->pkt);
+        if (ret < 0 || (ret = avcodec_send_packet(w->dec, NULL)) < 0)
+        {
+            return ret;
+        }
+        ret = avcodec_receive_frame(w->dec, w->frame);
+        // 解码器开始冲刷后要先重置才能继续送入数据
+        avcodec_flush_buffers(w->dec);
+        if (ret >= 0)
+        {
+            return 0;
+        }
+        // 这个关键帧没能单独解码出图像（例如开放 GOP 的头部），换下一个关键帧
+        if (ret != AVERROR_EOF)
+        {
+            return ret;
+        }
+    }
+
+    return ret;
+}
+
+
+
+
+/**
+ * @brief 把解码出的帧缩小并编码，写成 pattern 中序号为 index 的文件
+ * @return 写出的字节数，负数表示错误码
+ */
+static int write_thumbnail(ThumbnailWorker *w, int index)
+{
+    char name[1024];
+    FILE *f;
+    int ret, size = 0;
+
+    w->sws_ctx = sws_getCachedContext(w->sws_ctx, w->frame->width, w->frame->height, w->frame->format,
+                                      w->enc->width, w->enc->height, w->enc->pix_fmt,
+                                      SWS_AREA, NULL, NULL, NULL);
+    if (!w->sws_ctx)
+    {
+        return AVERROR(EINVAL);
+    }
+    if ((ret = av_frame_make_writable(w->thumb)) < 0)
+    {
+        return ret;
+    }
+    sws_scale(w->sws_ctx, (const uint8_t * const *)w->frame->data, w->frame->linesize, 0, w->frame->height,
+              w->thumb->data, w->thumb->linesize);
+    w->thumb->pts = index;
+
+    if ((ret = avcodec_send_frame(w->enc, w->thumb)) < 0 ||
+        (ret = avcodec_receive_packet(w->enc, w->pkt)) < 0)
+    {
+        return ret;
+    }
+
+    if (av_get_frame_filename(name, sizeof(name), w->job->pattern, index) < 0)
+    {
+        av_strlcpy(name, w->job->pattern, sizeof(name));
+    }
+    f = fopen(name, "wb");
+    if (!f)
+    {
+        ret = AVERROR(errno);
+    }
+    else
+    {
+        if (fwrite(w->pkt->data, 1, w->pkt->size, f) != (size_t)w->pkt->size)
+        {
+            ret = AVERROR(EIO);
+        }
+        if (fclose(f) && ret >= 0)
+        {
+            ret = AVERROR(errno);
+        }
+        size = w->pkt->size;
+    }
+    av_packet_unref(w->pkt);
+
+    return ret < 0 ? ret : size;
+}
+
+
+
+
+/**
+ * @brief 工作线程：不断领取下一个位置，seek、解码关键帧、缩小并写出
+ */
+static void *thumbnail_worker_main(void *arg)
+{
+    ThumbnailWorker *w = arg;
+    ThumbnailJob *job = w->job;
+    int64_t target, t0;
+    int k, ret = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        k = job->error ? job->nb_thumbs : job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (k >= job->nb_thumbs)
+        {
+            break;
+        }
+
+        // 第 k 个位置取在第 k 段的中点，避开文件开头的黑场和结尾
+        target = job->start_time + av_rescale(job->duration, 2 * k + 1, 2 * job->nb_thumbs);
+        t0     = av_gettime_relative();
+        if ((ret = decode_keyframe(w, target)) < 0)
+        {
+            fprintf(stderr, "thumbnail %d: no keyframe at %.3f s: %s\n", k, target / 1000000.0, av_err2str(ret));
+            break;
+        }
+        if ((ret = write_thumbnail(w, k)) < 0)
+        {
+            fprintf(stderr, "thumbnail %d: %s\n", k, av_err2str(ret));
+            break;
+        }
+        printf("thumbnail %d: target %.3f s, keyframe %.3f s, %d bytes, %.1f ms\n", k, target / 1000000.0,
+               w->frame->best_effort_timestamp == AV_NOPTS_VALUE ? NAN :
+               w->frame->best_effort_timestamp * av_q2d(w->fmt_ctx->streams[w->video_index]->time_base),
+               ret, (av_gettime_relative() - t0) / 1000.0);
+        av_frame_unref(w->frame);
+        ret = 0;
+    }
+
+    if (ret < 0)
+    {
+        pthread_mutex_lock(&job->lock);
+        job->error = ret;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief 打开一个工作线程的输入、解码器和编码器
+ * @return 0 表示成功，负数表示错误码
+ */
+static int open_worker(ThumbnailWorker *w)
+{
+    int ret;
+
+    w->frame = av_frame_alloc();
+    w->pkt   = av_packet_alloc();
+    if (!w->frame || !w->pkt)
+    {
+        return AVERROR(ENOMEM);
+    }
+    if ((ret = open_input(w)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", w->job->input, av_err2str(ret));
+        return ret;
+    }
+    if ((ret = open_encoder(w)) < 0)
+    {
+        fprintf(stderr, "Could not open the %s encoder: %s\n", w->job->codec->name, av_err2str(ret));
+        return ret;
+    }
+    // 打开输入时读取的数据不计入统计
+    w->bytes_read = w->fmt_ctx->pb ? -w->fmt_ctx->pb->bytes_read : 0;
+
+    return 0;
+}
+
+
+
+
+static void close_worker(ThumbnailWorker *w)
+{
+    if (w->fmt_ctx && w->fmt_ctx->pb)
+    {
+        w->bytes_read += w->fmt_ctx->pb->bytes_read;
+    }
+    avformat_close_input(&w->fmt_ctx);
+    avcodec_free_context(&w->dec);
+    avcodec_free_context(&w->enc);
+    sws_freeContext(w->sws_ctx);
+    av_frame_free(&w->frame);
+    av_frame_free(&w->thumb);
+    av_packet_free(&w->pkt);
+}
+
+
+
+
+int main(int argc, char **argv)
+{
+    ThumbnailJob job = { 0 };
+    ThumbnailWorker *workers = NULL;
+    AVFormatContext *probe = NULL;
+    const AVOutputFormat *image2;
+    enum AVCodecID codec_id;
+    int64_t t_start, elapsed, nb_packets = 0, nb_skipped = 0, nb_decoded = 0, bytes_read = 0;
+    int i, ret, nb_started = 0;
+
+    if (argc < 3)
+    {
+        printf("usage: %s input_file output_pattern [-count n] [-width pixels] [-threads n]\n"
+               "write n thumbnails evenly spaced over input_file, decoding only the keyframe\n"
+               "nearest before each position. '%%d' in output_pattern is the thumbnail index and\n"
+               "its extension picks the image encoder (png, jpg, ...).\n"
+               "\n", argv[0]);
+        return 1;
+    }
+
+    job.input     = argv[1];
+    job.pattern   = argv[2];
+    job.nb_thumbs = 10;
+    job.width     = 320;
+    for (i = 3; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "-count"))
+        {
+            job.nb_thumbs = FFMAX(atoi(argv[i + 1]), 1);
+        }
+        else if (!strcmp(argv[i], "-width"))
+        {
+            job.width = FFMAX(atoi(argv[i + 1]), 2);
+        }
+        else if (!strcmp(argv[i], "-threads"))
+        {
+            nb_threads = atoi(argv[i + 1]);
+        }
+    }
+
+    // 图像的编码器由输出文件的扩展名决定
+    image2   = av_guess_format("image2", NULL, NULL);
+    codec_id = image2 ? av_guess_codec(image2, NULL, job.pattern, NULL, AVMEDIA_TYPE_VIDEO) : AV_CODEC_ID_NONE;
+    job.codec = avcodec_find_encoder(codec_id);
+    if (!job.codec)
+    {
+        fprintf(stderr, "No image encoder for '%s'\n", job.pattern);
+        return 1;
+    }
+
+    // 时长只需要探测一次；每个线程仍然打开自己的解复用器
+    if ((ret = avformat_open_input(&probe, job.input, NULL, NULL)) < 0 ||
+        (ret = avformat_find_stream_info(probe, NULL)) < 0)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", job.input, av_err2str(ret));
+        avformat_close_input(&probe);
+        return 1;
+    }
+    job.start_time = probe->start_time == AV_NOPTS_VALUE ? 0 : probe->start_time;
+    job.duration   = probe->duration;
+    avformat_close_input(&probe);
+    if (job.duration <= 0)
+    {
+        fprintf(stderr, "'%s' has no known duration\n", job.input);
+        return 1;
+    }
+
+    if (nb_threads <= 0)
+    {
+        nb_threads = FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+    nb_threads = FFMIN(nb_threads, job.nb_thumbs);
+    pthread_mutex_init(&job.lock, NULL);
+
+    workers = av_calloc(nb_threads, sizeof(*workers));
+    if (!workers)
+    {
+        return 1;
+    }
+    ret = 0;
+    for (i = 0; i < nb_threads && ret >= 0; i++)
+    {
+        workers[i].job   = &job;
+        workers[i].index = i;
+        ret = open_worker(&workers[i]);
+    }
+
+    t_start = av_gettime_relative();
+    for (i = 0; i < nb_threads && ret >= 0; i++)
+    {
+        if ((ret = pthread_create(&workers[i].thread, NULL, thumbnail_worker_main, &workers[i])))
+        {
+            fprintf(stderr, "Could not start a worker thread: %s\n", strerror(ret));
+            ret = AVERROR(ret);
+            break;
+        }
+        nb_started++;
+    }
+    for (i = 0; i < nb_started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    elapsed = FFMAX(av_gettime_relative() - t_start, 1);
+    ret     = ret < 0 ? ret : job.error;
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        close_worker(&workers[i]);
+        nb_packets += workers[i].nb_packets;
+        nb_skipped += workers[i].nb_skipped;
+        nb_decoded += workers[i].nb_decoded;
+        bytes_read += workers[i].bytes_read;
+    }
+    av_free(workers);
+    pthread_mutex_destroy(&job.lock);
+
+    if (nb_started)
+    {
+        printf("total: %d thumbnails on %d threads in %.3f s, %"PRId64" keyframes decoded, "
+               "%"PRId64" of %"PRId64" video packets skipped, %.1f MB read\n",
+               job.nb_thumbs, nb_threads, elapsed / 1000000.0, nb_decoded,
+               nb_skipped, nb_packets, bytes_read / 1048576.0);
+    }
+
+    return ret < 0;
+}